@@ -14,38 +14,67 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <glob.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DEFAULT_READ_INTERVAL 60
 #define DEFAULT_PROCS_TO_SAMPLE 5
 #define DEFAULT_WARMUP_SECONDS 600
 
-#define DEFAULT_PROC_GLOB_PATH "/proc/[0-9]*/stat"
+#define DEFAULT_PROC_PATH "/proc"
 
 #define CMD_LEN 15
-#define STR(X) #X
-#define XSTR(X) STR(X)
+
+/* Leave this many fds for everything other than cached stat files. */
+#define RESERVED_FDS 16
+
+#define PID_EMPTY 0
+#define PID_DELETED -1
 
 struct proc {
   pid_t pid;
+  int fd;             /* open <proc_path>/<pid>/stat, or -1 */
+  bool has_baseline;  /* msec holds a previous sample */
   char cmd[CMD_LEN + 1];
   unsigned long msec;
 };
 
-struct proc_list {
-  struct proc *procs;
-  int count;
+/*
+ * Processes we know about, hashed by pid with linear probing. Entries
+ * persist across intervals so their stat files only need to be opened
+ * once.
+ */
+struct proc_table {
+  struct proc *slots;
+  int capacity;  /* always a power of two */
+  int count;     /* live entries */
+  int used;      /* live + deleted entries */
 };
 
 static long ticks_per_sec;
+static const char *proc_path = DEFAULT_PROC_PATH;
+static struct proc_table procs;
+static int cached_fds;
+static int max_cached_fds;
+
+/* Set when we may have missed processes, and must scan proc_path. */
+static bool need_scan = true;
 
 void die(const char *msg)
 {
@@ -58,112 +87,409 @@ unsigned long ticks_to_ms(unsigned long ticks)
   return (1000.0 / ticks_per_sec) * ticks;
 }
 
-void read_stat(struct proc *proc, const char *stat_path)
+static unsigned pid_hash(pid_t pid, int capacity)
+{
+  return ((unsigned)pid * 2654435761u) & (capacity - 1);
+}
+
+/* Returns the slot holding pid, or the free slot where it would go. */
+struct proc *find_slot(pid_t pid)
+{
+  struct proc *deleted = NULL;
+  unsigned n = pid_hash(pid, procs.capacity);
+
+  for (;;) {
+    struct proc *p = &procs.slots[n];
+    if (p->pid == pid)
+      return p;
+    if (p->pid == PID_EMPTY)
+      return deleted ? deleted : p;
+    if (p->pid == PID_DELETED && !deleted)
+      deleted = p;
+    n = (n + 1) & (procs.capacity - 1);
+  }
+}
+
+void resize_procs(int capacity)
+{
+  struct proc_table old = procs;
+  int i;
+
+  procs.slots = calloc(capacity, sizeof(*procs.slots));
+  if (!procs.slots)
+    die("out of memory");
+  procs.capacity = capacity;
+  procs.used = procs.count;
+
+  for (i = 0; i < old.capacity; i++) {
+    if (old.slots[i].pid > 0)
+      *find_slot(old.slots[i].pid) = old.slots[i];
+  }
+  free(old.slots);
+}
+
+struct proc *add_proc(pid_t pid)
+{
+  struct proc *p;
+
+  /* Keep a quarter of the slots empty. Rehashing also drops deleted
+     entries, so only grow if the live ones need the room. */
+  if ((procs.used + 1) * 4 > procs.capacity * 3) {
+    int capacity = procs.capacity ? procs.capacity : 256;
+    if ((procs.count + 1) * 2 > capacity)
+      capacity *= 2;
+    resize_procs(capacity);
+  }
+
+  p = find_slot(pid);
+  if (p->pid == pid)
+    return p;
+
+  if (p->pid == PID_EMPTY)
+    procs.used++;
+  procs.count++;
+  memset(p, 0, sizeof(*p));
+  p->pid = pid;
+  p->fd = -1;
+  return p;
+}
+
+void remove_proc(struct proc *p)
+{
+  if (p->fd >= 0) {
+    close(p->fd);
+    cached_fds--;
+  }
+  p->pid = PID_DELETED;
+  p->fd = -1;
+  procs.count--;
+}
+
+static const char *skip_field(const char *s, const char *end)
+{
+  while (s < end && *s != ' ')
+    s++;
+  while (s < end && *s == ' ')
+    s++;
+  return s;
+}
+
+static const char *parse_ulong(const char *s, const char *end,
+    unsigned long *val)
+{
+  unsigned long v = 0;
+
+  if (s >= end || !isdigit((unsigned char)*s))
+    return NULL;
+  while (s < end && isdigit((unsigned char)*s))
+    v = v * 10 + (*s++ - '0');
+  *val = v;
+  return s;
+}
+
+/*
+ * Parses "pid (comm) state ppid ... utime stime ..." from a stat file.
+ * comm may itself contain spaces and parentheses, so it runs up to the
+ * last ')'.
+ */
+bool parse_stat(const char *buf, int len, char *cmd, unsigned long *ticks)
 {
-  char buf[256];
-  int pid_int;
-  unsigned long utime;
-  unsigned long stime;
+  const char *end = buf + len;
+  const char *open = memchr(buf, '(', len);
+  const char *close = memrchr(buf, ')', len);
+  const char *s;
+  unsigned long utime, stime;
+  int i, cmd_len;
+
+  if (!open || !close || close < open)
+    return false;
+
+  cmd_len = MIN(close - open - 1, CMD_LEN);
+  memcpy(cmd, open + 1, cmd_len);
+  cmd[cmd_len] = '\0';
+
+  /* Skip ") ", then state and the 10 fields before utime. */
+  s = close + 2;
+  for (i = 0; i < 11; i++)
+    s = skip_field(s, end);
+
+  if (!(s = parse_ulong(s, end, &utime)))
+    return false;
+  s = skip_field(s, end);
+  if (!parse_ulong(s, end, &stime))
+    return false;
+
+  *ticks = utime + stime;
+  return true;
+}
+
+/*
+ * Reads the CPU time used so far by p. Returns false if the process has
+ * exited.
+ */
+bool read_proc(struct proc *p, unsigned long *msec)
+{
+  char buf[512];
+  unsigned long ticks;
+  int fd = p->fd;
   int rc;
-  int fd;
 
-  fd = open(stat_path, O_RDONLY);
-  /* This isn't an error. We have a list of files which existed the moment the
-     glob was run. If a process exits before we get around to reading it, its
-     /proc files will go away. */
-  if (fd == -1)
-    return;
+  if (fd < 0) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%d/stat", proc_path, p->pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return false;
+    if (cached_fds < max_cached_fds) {
+      p->fd = fd;
+      cached_fds++;
+    }
+  }
 
-  rc = read(fd, buf, sizeof(buf) - 1);
+  /* A stat file is regenerated on each read from offset 0. Once the
+     process is gone, reads through an old fd fail with ESRCH. */
+  rc = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (fd != p->fd)
+    close(fd);
   if (rc < 1)
-    die("read");
-  close(fd);
+    return false;
   buf[rc] = '\0';
 
-  rc = sscanf(buf,
-      "%d (%" XSTR(CMD_LEN) "[^)]) %*c %*d %*d %*d %*d %*d %*u %*u "
-      "%*u %*u %*u %lu %lu", &pid_int, proc->cmd, &utime, &stime);
-  if (rc != 4)
-    die("sscanf");
+  if (!parse_stat(buf, rc, p->cmd, &ticks))
+    die("parse_stat");
 
-  proc->pid = pid_int;
-  proc->msec = ticks_to_ms(utime + stime);
+  *msec = ticks_to_ms(ticks);
+  return true;
 }
 
-int proc_pid_cmp(const void *a, const void *b)
+/* Adds any processes in proc_path which we don't know about yet. */
+void scan_procs(void)
 {
-  const struct proc *_a = a;
-  const struct proc *_b = b;
-  return _a->pid - _b->pid;
+  DIR *dir;
+  struct dirent *ent;
+
+  if (!(dir = opendir(proc_path)))
+    die("opendir");
+
+  while ((ent = readdir(dir)) != NULL) {
+    char *end;
+    long pid = strtol(ent->d_name, &end, 10);
+    if (pid > 0 && *end == '\0')
+      add_proc(pid);
+  }
+
+  closedir(dir);
 }
 
-int proc_msec_cmp(const void *a, const void *b)
+/*
+ * Subscribes to the kernel's process events connector, so fork
+ * notifications tell us about new processes without scanning. Returns
+ * the socket, or -1 if not available (it needs CAP_NET_ADMIN).
+ */
+int open_proc_connector(void)
 {
-  const struct proc *_a = a;
-  const struct proc *_b = b;
-  return _a->msec - _b->msec;
+  struct sockaddr_nl addr;
+  struct {
+    struct nlmsghdr nlh;
+    struct cn_msg cn;
+    enum proc_cn_mcast_op op;
+  } __attribute__((packed)) req;
+  int sock;
+
+  sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+      NETLINK_CONNECTOR);
+  if (sock < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.nlh.nlmsg_len = sizeof(req);
+  req.nlh.nlmsg_type = NLMSG_DONE;
+  req.nlh.nlmsg_pid = getpid();
+  req.cn.id.idx = CN_IDX_PROC;
+  req.cn.id.val = CN_VAL_PROC;
+  req.cn.len = sizeof(req.op);
+  req.op = PROC_CN_MCAST_LISTEN;
+  if (send(sock, &req, sizeof(req), 0) < 0) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
 }
 
-void print_top(struct proc_list *new_procs, struct proc_list *old_procs,
-    int procs_to_sample, int interval)
+void handle_proc_event(const struct proc_event *ev)
 {
-  struct proc top[new_procs->count];
-  int top_count;
-  int i, lim;
+  struct proc *p;
+
+  if (ev->what == PROC_EVENT_FORK) {
+    pid_t pid = ev->event_data.fork.child_pid;
+    /* Threads show up in their process's stat file. */
+    if (pid != ev->event_data.fork.child_tgid)
+      return;
+    /* We don't act on exit events, since the kernel also sends those
+       when only the main thread exits; sampling drops processes once
+       they are reaped. So the pid may still be here from a previous
+       process, with its stat file open. */
+    if (procs.capacity) {
+      p = find_slot(pid);
+      if (p->pid == pid)
+        remove_proc(p);
+    }
+    p = add_proc(pid);
+    /* A new process starts out with no CPU time, so its first sample
+       is already a delta. */
+    p->has_baseline = true;
+    p->msec = 0;
+  }
+}
+
+void read_proc_events(int sock)
+{
+  char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
 
-  top_count = 0;
-  for (i = 0; i < new_procs->count; i++) {
-    struct proc *new_proc = &new_procs->procs[i];
-    struct proc *old_proc = bsearch(new_proc, old_procs->procs, old_procs->count,
-        sizeof(*old_procs->procs), proc_pid_cmp);
-    if (old_proc) {
-      top[top_count] = *new_proc;
-      top[top_count].msec = new_proc->msec - old_proc->msec;
-      top_count++;
+  for (;;) {
+    struct nlmsghdr *nlh;
+    int len = recv(sock, buf, sizeof(buf), 0);
+
+    if (len < 0) {
+      if (errno == EAGAIN)
+        return;
+      /* ENOBUFS means we fell behind and events were dropped. */
+      if (errno == ENOBUFS)
+        need_scan = true;
+      else if (errno != EINTR)
+        die("recv");
+      continue;
+    }
+
+    for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (unsigned)len);
+        nlh = NLMSG_NEXT(nlh, len)) {
+      struct cn_msg *cn;
+      if (nlh->nlmsg_type == NLMSG_NOOP || nlh->nlmsg_type == NLMSG_ERROR)
+        continue;
+      cn = NLMSG_DATA(nlh);
+      if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+        continue;
+      handle_proc_event((const struct proc_event *)cn->data);
     }
   }
+}
 
-  qsort(top, top_count, sizeof(*top), proc_msec_cmp);
+/* Sleeps for interval seconds, handling process events meanwhile. */
+void wait_interval(int sock, int interval)
+{
+  struct timespec now, deadline;
 
-  printf("%dsec:", interval);
-  lim = (top_count > procs_to_sample) ? (top_count - procs_to_sample) : 0;
-  for (i = top_count - 1; i >= lim; i--) {
-    printf(" %s(%.3f)", top[i].cmd, top[i].msec / 1000.0);
+  if (sock < 0) {
+    sleep(interval);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += interval;
+
+  for (;;) {
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+        (deadline.tv_nsec - now.tv_nsec) / 1000000;
+    if (ms <= 0)
+      return;
+
+    if (poll(&pfd, 1, ms) > 0)
+      read_proc_events(sock);
   }
-  printf("\n");
 }
 
-void read_procs(struct proc_list *new_procs, const char *proc_glob_path)
+/* Keeps top[] sorted by descending msec, at most n entries. */
+static void insert_top(struct proc *top, int *top_count, int n,
+    const struct proc *p)
 {
-  glob_t pglob;
-  unsigned i;
-  int rc;
+  int i = MIN(*top_count, n - 1);
 
-  rc = glob(proc_glob_path, GLOB_NOSORT, NULL, &pglob);
-  if (rc != 0)
-    die("glob");
+  if (*top_count == n && p->msec <= top[n - 1].msec)
+    return;
+  while (i > 0 && top[i - 1].msec < p->msec) {
+    top[i] = top[i - 1];
+    i--;
+  }
+  top[i] = *p;
+  if (*top_count < n)
+    (*top_count)++;
+}
 
-  new_procs->count = pglob.gl_pathc;
-  new_procs->procs = malloc(new_procs->count * sizeof(*new_procs->procs));
-  if (!new_procs->procs)
-    die("out of memory");
+/*
+ * Reads every known process, and prints the procs_to_sample which used
+ * the most CPU since the previous call.
+ */
+void sample_procs(int procs_to_sample, int interval, bool print)
+{
+  struct proc top[procs_to_sample];
+  int top_count = 0;
+  int i;
+
+  for (i = 0; i < procs.capacity; i++) {
+    struct proc *p = &procs.slots[i];
+    unsigned long msec;
+
+    if (p->pid <= 0)
+      continue;
+
+    if (!read_proc(p, &msec)) {
+      remove_proc(p);
+      continue;
+    }
+
+    /* Without a cached fd, a pid reused by a new process can appear to
+       have gone back in time. Start over from this sample. */
+    if (p->has_baseline && msec >= p->msec) {
+      struct proc delta = *p;
+      delta.msec = msec - p->msec;
+      insert_top(top, &top_count, procs_to_sample, &delta);
+    }
 
-  for (i = 0; i < pglob.gl_pathc; i++) {
-    read_stat(&new_procs->procs[i], pglob.gl_pathv[i]);
+    p->msec = msec;
+    p->has_baseline = true;
   }
 
-  globfree(&pglob);
+  if (!print)
+    return;
 
-  /* glob sorts alphanumerically, so we would need to use an alphanumeric
-     comparison to find elements using bsearch. here we sort numerically by pid*/
-  qsort(new_procs->procs, new_procs->count, sizeof(*new_procs->procs), proc_pid_cmp);
+  printf("%dsec:", interval);
+  for (i = 0; i < top_count; i++) {
+    printf(" %s(%.3f)", top[i].cmd, top[i].msec / 1000.0);
+  }
+  printf("\n");
 }
 
-void free_procs(struct proc_list *p)
+/* Raises the fd limit as far as allowed, and sets max_cached_fds. */
+void init_fd_cache(void)
 {
-  free(p->procs);
+  struct rlimit rlim;
+
+  if (getrlimit(RLIMIT_NOFILE, &rlim))
+    die("getrlimit");
+  if (rlim.rlim_cur < rlim.rlim_max) {
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+    getrlimit(RLIMIT_NOFILE, &rlim);
+  }
+
+  if (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > 65536)
+    rlim.rlim_cur = 65536;
+  max_cached_fds = MAX((long)rlim.rlim_cur - RESERVED_FDS, 0);
 }
 
+#ifndef UNIT_TESTS
 void usage_and_die(const char *argv0)
 {
   fprintf(stderr, "Usage: %s [options]\n"
@@ -171,23 +497,21 @@ void usage_and_die(const char *argv0)
       "      -i, --interval=<interval>  sampling interval in seconds (%d)\n"
       "      -n, --num=<num>            number of processes to sample (%d)\n"
       "      -o, --oneshot              one-shot mode, do not loop\n"
-      "      -p, --path=<path>          path for process stat files (%s)\n"
+      "      -p, --path=<path>          path of the proc filesystem (%s)\n"
       "      -w, --warmup=<warmup>      seconds to wait before sampling begins (%d)\n",
       argv0, DEFAULT_READ_INTERVAL, DEFAULT_PROCS_TO_SAMPLE,
-      DEFAULT_PROC_GLOB_PATH, DEFAULT_WARMUP_SECONDS);
+      DEFAULT_PROC_PATH, DEFAULT_WARMUP_SECONDS);
   exit(1);
 }
 
 int main(int argc, char **argv)
 {
-  struct proc_list old_procs = {0, 0};
-  struct proc_list new_procs = {0, 0};
   int read_interval = DEFAULT_READ_INTERVAL;
   int procs_to_sample = DEFAULT_PROCS_TO_SAMPLE;
   int warmup_seconds = DEFAULT_WARMUP_SECONDS;
+  int sock = -1;
 
   int one_shot_mode = false;
-  const char *proc_glob_path = DEFAULT_PROC_GLOB_PATH;
 
   struct option long_options[] = {
     {"interval", required_argument, 0, 'i'},
@@ -215,7 +539,7 @@ int main(int argc, char **argv)
       one_shot_mode = true;
       break;
     case 'p':
-      proc_glob_path = optarg;
+      proc_path = optarg;
       break;
     case 'w':
       warmup_seconds = atoi(optarg);
@@ -233,18 +557,28 @@ int main(int argc, char **argv)
   setlinebuf(stdout);
 
   ticks_per_sec = sysconf(_SC_CLK_TCK);
+  init_fd_cache();
 
   sleep(warmup_seconds);
 
-  read_procs(&old_procs, proc_glob_path);
+  /* Process events describe the real /proc, not some other path. Listen
+     before the first scan so no fork falls in between. */
+  if (strcmp(proc_path, DEFAULT_PROC_PATH) == 0)
+    sock = open_proc_connector();
+
+  scan_procs();
+  need_scan = false;
+  sample_procs(procs_to_sample, read_interval, false);
   for (;;) {
-    sleep(read_interval);
-    read_procs(&new_procs, proc_glob_path);
-    print_top(&new_procs, &old_procs, procs_to_sample, read_interval);
-    free_procs(&old_procs);
-    old_procs = new_procs;
+    wait_interval(sock, read_interval);
+    if (sock < 0 || need_scan) {
+      scan_procs();
+      need_scan = false;
+    }
+    sample_procs(procs_to_sample, read_interval, true);
 
     if (one_shot_mode)
       exit(0);
   }
 }
+#endif  /* UNIT_TESTS */
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Unit tests for cpulog.c */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define UNIT_TESTS
+#include "cpulog.c"
+
+
+static bool parse(const char *line, char *cmd, unsigned long *ticks)
+{
+  return parse_stat(line, strlen(line), cmd, ticks);
+}
+
+
+void test_parse_stat()
+{
+  char cmd[CMD_LEN + 1];
+  unsigned long ticks;
+
+  assert(parse("123 (init) S 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15\n",
+               cmd, &ticks));
+  assert(strcmp(cmd, "init") == 0);
+  assert(ticks == 11 + 12);
+
+  /* comm runs up to the last ')', whatever it contains. */
+  assert(parse("123 (a) S 1 2 (b) R 1 2 3 4 5 6 7 8 9 10 11 12 13\n",
+               cmd, &ticks));
+  assert(strcmp(cmd, "a) S 1 2 (b") == 0);
+  assert(ticks == 11 + 12);
+
+  /* Longer names are cut to CMD_LEN, as the kernel does. */
+  assert(parse("123 (0123456789abcdefgh) S 1 2 3 4 5 6 7 8 9 10 11 12\n",
+               cmd, &ticks));
+  assert(strcmp(cmd, "0123456789abcde") == 0);
+  assert(ticks == 11 + 12);
+
+  /* Truncated lines. */
+  assert(!parse("123 (init) S 1 2 3 4 5 6 7 8 9 10 11", cmd, &ticks));
+  assert(!parse("123 (init) S 1 2 3 4 5 6 7 8 9 10 ", cmd, &ticks));
+  assert(!parse("123 (init) S", cmd, &ticks));
+  assert(!parse("123 (init", cmd, &ticks));
+  assert(!parse("123", cmd, &ticks));
+  assert(!parse("", cmd, &ticks));
+}
+
+
+void test_fork_reuses_pid()
+{
+  struct proc_event ev;
+  struct proc *p;
+
+  p = add_proc(42);
+  p->fd = open("/dev/null", O_RDONLY);
+  assert(p->fd >= 0);
+  cached_fds++;
+  p->msec = 1234;
+
+  /* A new process with the same pid must not inherit the old one's stat
+     file or CPU time. */
+  memset(&ev, 0, sizeof(ev));
+  ev.what = PROC_EVENT_FORK;
+  ev.event_data.fork.child_pid = 42;
+  ev.event_data.fork.child_tgid = 42;
+  handle_proc_event(&ev);
+
+  p = find_slot(42);
+  assert(p->pid == 42);
+  assert(p->fd == -1);
+  assert(p->has_baseline);
+  assert(p->msec == 0);
+  assert(cached_fds == 0);
+  assert(procs.count == 1);
+}
+
+
+int main(int argc, char** argv)
+{
+  test_parse_stat();
+  test_fork_reuses_pid();
+  exit(0);
+}
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <regex.h>
@@ -251,6 +252,140 @@ static void no_mischief_strncpy(char *dst, const char *src, size_t n)
   dst[n - 1] = '\0';
 }
 
+/*
+ * Given p pointing at the '[' of a bracket expression, return a pointer to
+ * its closing ']', allowing for [:class:] and []...], or to the
+ * terminating NUL if there is none.
+ */
+static const char *skip_bracket(const char *p)
+{
+  ++p;
+  if (*p == '^') ++p;
+  if (*p == ']') ++p;
+  while (*p && *p != ']') {
+    if (*p == '[' && *(p + 1) == ':') {
+      const char *e = strstr(p + 2, ":]");
+      p = e ? e + 1 : p;
+    }
+    ++p;
+  }
+  return p;
+}
+
+
+/*
+ * Find the longest run of plain characters which any string matching the
+ * extended regex must contain, lowercased for use with REG_ICASE. Anything
+ * optional, repeated, bracketed or inside an alternation ends a run. Leaves
+ * literal empty if no such run can be determined.
+ */
+static void required_literal(const char *regex, char *literal, size_t len)
+{
+  const char *p, *run = NULL, *best = NULL;
+  size_t runlen = 0, bestlen = 0;
+  int depth = 0;
+
+  literal[0] = '\0';
+  for (p = regex; *p; ++p) {
+    if (*p == '\\' && *(p + 1)) ++p;
+    else if (*p == '[' && *(p = skip_bracket(p)) == '\0') break;
+    else if (*p == '(') depth++;
+    else if (*p == ')') depth--;
+    else if (*p == '|' && depth == 0) {
+      return;  /* top level alternation, nothing is required */
+    }
+  }
+
+  for (p = regex; *p; ++p) {
+    int is_plain = 0;
+    char q = *(p + 1);
+
+    if (*p == '(') {
+      const char *end;
+      int d = 1, alternation = 0;
+      for (end = p + 1; *end && d > 0; ++end) {
+        if (*end == '[' && *(end = skip_bracket(end)) == '\0') break;
+        if (*end == '(') d++;
+        if (*end == ')') d--;
+        if (*end == '|' && d == 1) alternation = 1;
+      }
+      if (alternation || *end == '*' || *end == '?' || *end == '{' ||
+          *end == '+') {
+        p = end - 1;  /* skip the whole group */
+      }
+    } else if (*p == '[') {
+      if (*(p = skip_bracket(p)) == '\0') break;
+    } else if (*p == '{') {
+      if ((p = strchr(p, '}')) == NULL) break;
+    } else if (*p == '\\') {
+      if (*++p == '\0') break;  /* escapes just end the run */
+    } else if (strchr(".^$*+?)|", *p) == NULL) {
+      is_plain = 1;
+    }
+
+    if (is_plain && !(q == '*' || q == '?' || q == '{')) {
+      if (run == NULL) run = p;
+      runlen = p - run + 1;
+      if (runlen > bestlen) {
+        best = run;
+        bestlen = runlen;
+      }
+      /* a '+' still requires one occurrence, but ends the run. */
+      if (q == '+') run = NULL;
+    } else {
+      run = NULL;
+    }
+  }
+
+  if (best) {
+    size_t i;
+    /* any prefix of a required run is also required. */
+    if (bestlen >= len) bestlen = len - 1;
+    for (i = 0; i < bestlen; ++i) {
+      literal[i] = tolower((unsigned char)best[i]);
+    }
+    literal[bestlen] = '\0';
+  }
+}
+
+
+#define NUM_REGEX_MATCHES (sizeof(regex_matches) / sizeof(regex_matches[0]))
+
+/* Filled in by compile_matchers(), indexed like regex_matches[]. */
+static regex_t compiled_rx[NUM_REGEX_MATCHES];
+/* Lowercased substring which every match must contain, or "". */
+static char required[NUM_REGEX_MATCHES][32];
+static regex_t r_vendor, r_type, r_model;
+
+
+/* Compile every regex once, rather than on each lookup. */
+static void compile_matchers(void)
+{
+  static int compiled = 0;
+  size_t i;
+
+  if (compiled) return;
+
+  for (i = 0; regex_matches[i].regex != NULL; ++i) {
+    const char *regex = regex_matches[i].regex;
+    if (regcomp(&compiled_rx[i], regex, REG_EXTENDED | REG_ICASE)) {
+      fprintf(stderr, "%s: regcomp failed!\n", regex);
+      exit(1);
+    }
+    required_literal(regex, required[i], sizeof(required[i]));
+  }
+
+  if (regcomp(&r_vendor, "mfg=([^;]+)", REG_EXTENDED | REG_ICASE) ||
+      regcomp(&r_type, "typ=([^;]+)", REG_EXTENDED | REG_ICASE) ||
+      regcomp(&r_model, "mod=([^;]+)", REG_EXTENDED | REG_ICASE)) {
+    fprintf(stderr, "%s: regcomp failed!\n", __FUNCTION__);
+    exit(1);
+  }
+
+  compiled = 1;
+}
+
+
 /*
  * Check for vendor options pattern populated by a number of
  * printer manufacturers:
@@ -259,21 +394,22 @@ static void no_mischief_strncpy(char *dst, const char *src, size_t n)
  *   Mfg=FujiXerox;Typ=AIO;Mod=WorkCentre 6027;Ser=P1A234567
  *   Mfg=Hewlett Packard;Typ=Printer;Mod=HP LaserJet 400 M401n;Ser=ABCDE01234;
  *   mfg=Xerox;typ=MFP;mod=WorkCentre 3220;ser=ABC012345;loc=
+ *
+ * lowered is vendor_class in lowercase, or NULL if not available.
  */
-int check_for_printer(const char *vendor_class,
+int check_for_printer(const char *vendor_class, const char *lowered,
     char *genus, size_t genus_len,
     char *species, size_t species_len)
 {
-  regex_t r_vendor, r_type, r_model;
   regmatch_t match[2];
   char *vendor = NULL, *type = NULL, *model = NULL;
   int rc = 1;
 
-  if (regcomp(&r_vendor, "mfg=([^;]+)", REG_EXTENDED | REG_ICASE) ||
-      regcomp(&r_type, "typ=([^;]+)", REG_EXTENDED | REG_ICASE) ||
-      regcomp(&r_model, "mod=([^;]+)", REG_EXTENDED | REG_ICASE)) {
-    fprintf(stderr, "%s: regcomp failed!\n", __FUNCTION__);
-    exit(1);
+  compile_matchers();
+
+  if (lowered && strstr(lowered, "mod=") == NULL &&
+      (strstr(lowered, "mfg=") == NULL || strstr(lowered, "typ=") == NULL)) {
+    return(rc);
   }
 
   if (regexec(&r_vendor, vendor_class, 2, match, 0) == 0) {
@@ -305,9 +441,6 @@ int check_for_printer(const char *vendor_class,
   if (vendor) free(vendor);
   if (type) free(type);
   if (model) free(model);
-  regfree(&r_vendor);
-  regfree(&r_type);
-  regfree(&r_model);
 
   return(rc);
 }
@@ -318,8 +451,10 @@ int lookup_vc(const char *vendor_class,
     char *species, size_t species_len)
 {
   const struct string_match *p;
-  const struct regex_match *r;
   int slen = strlen(vendor_class);
+  char lowered[512];
+  const char *lp = NULL;
+  int i;
 
   if ((p = exact_match(vendor_class, slen)) != NULL) {
     no_mischief_strncpy(genus, p->genus, genus_len);
@@ -327,26 +462,34 @@ int lookup_vc(const char *vendor_class,
     return(0);
   }
 
-  for (r = &regex_matches[0]; r->regex != NULL; ++r) {
-    regex_t rx;
+  compile_matchers();
+
+  /* An overlong string disables the prefilter. */
+  if ((size_t)slen < sizeof(lowered)) {
+    for (i = 0; i < slen; ++i) {
+      lowered[i] = tolower((unsigned char)vendor_class[i]);
+    }
+    lowered[slen] = '\0';
+    lp = lowered;
+  }
+
+  for (i = 0; regex_matches[i].regex != NULL; ++i) {
     regmatch_t match[2];
-    if (regcomp(&rx, r->regex, REG_EXTENDED | REG_ICASE)) {
-      fprintf(stderr, "%s: regcomp failed!\n", r->regex);
-      exit(1);
+    if (lp && required[i][0] && strstr(lp, required[i]) == NULL) {
+      continue;
     }
-    if (regexec(&rx, vendor_class, 2, match, 0) == 0) {
+    if (regexec(&compiled_rx[i], vendor_class, 2, match, 0) == 0) {
       int len = match[1].rm_eo - match[1].rm_so;
       char *model = strndup(vendor_class + match[1].rm_so, len);
       no_mischief_strncpy(species, model, species_len);
       free(model);
 
-      snprintf(genus, genus_len, "%s", r->genus);
+      snprintf(genus, genus_len, "%s", regex_matches[i].genus);
       return(0);
     }
-    regfree(&rx);
   }
 
-  if (check_for_printer(vendor_class,
+  if (check_for_printer(vendor_class, lp,
         genus, genus_len, species, species_len) == 0) {
     return(0);
   }
@@ -355,9 +498,43 @@ int lookup_vc(const char *vendor_class,
 }
 
 
+/*
+ * Classify "label vendor_class" lines from stdin, printing the same
+ * output as one invocation per line would.
+ */
+void batch_lookup(FILE *in)
+{
+  char *line = NULL;
+  size_t line_size = 0;
+  char genus[80];
+  char species[80];
+
+  /* getline() grows the buffer, so a long line is never split in two. */
+  while (getline(&line, &line_size, in) != -1) {
+    char *vendor;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if ((vendor = strchr(line, ' ')) == NULL) {
+      continue;
+    }
+    *vendor++ = '\0';
+
+    memset(genus, 0, sizeof(genus));
+    memset(species, 0, sizeof(species));
+    if (lookup_vc(vendor, genus, sizeof(genus),
+          species, sizeof(species)) == 0) {
+      printf("dhcpv %s %s;%s\n", line, genus, species);
+    }
+  }
+  free(line);
+}
+
+
 void usage(const char *progname)
 {
   fprintf(stderr, "usage: %s -v vendor_string -l label\n", progname);
+  fprintf(stderr, "       %s -b  (read \"label vendor_string\" lines "
+      "from stdin)\n", progname);
   exit(1);
 }
 
@@ -365,20 +542,23 @@ void usage(const char *progname)
 int main(int argc, char **argv)
 {
   struct option long_options[] = {
+    {"batch",   no_argument,       0, 'b'},
     {"label",   required_argument, 0, 'l'},
     {"vendor",  required_argument, 0, 'v'},
     {0,         0,                 0, 0},
   };
   int c;
+  int batch = 0;
   const char *label = NULL;
   const char *vendor = NULL;
   char genus[80];
   char species[80];
 
-  setlinebuf(stdout);
-  alarm(30);
-  while ((c = getopt_long(argc, argv, "l:v:", long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "bl:v:", long_options, NULL)) != -1) {
     switch (c) {
+    case 'b':
+      batch = 1;
+      break;
     case 'l':
       label = optarg;
       break;
@@ -390,9 +570,19 @@ int main(int argc, char **argv)
     }
   }
 
+  if (batch) {
+    if (optind < argc || vendor != NULL || label != NULL)
+      usage(argv[0]);
+    batch_lookup(stdin);
+    exit(0);
+  }
+
   if (optind < argc || vendor == NULL || label == NULL)
     usage(argv[0]);
 
+  setlinebuf(stdout);
+  alarm(30);
+
   memset(genus, 0, sizeof(genus));
   memset(species, 0, sizeof(species));
   if (lookup_vc(vendor, genus, sizeof(genus), species, sizeof(species)) == 0) {
@@ -29,6 +29,7 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <memory.h>
 #include <netdb.h>
@@ -39,8 +40,18 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <thread>
 #include <time.h>
 #include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 
 #ifndef CLOCK_MONOTONIC_RAW
 #define CLOCK_MONOTONIC_RAW 4
@@ -50,6 +61,24 @@
 #define SERVER_PORT 4948
 #define DEFAULT_PACKETS_PER_SEC 10.0
 #define DEFAULT_TTL 2
+// Handshakes accepted from each source prefix: enough for a /24 full of CPEs
+// to reconnect within a few seconds, without letting one prefix monopolize
+// the server.
+#define DEFAULT_HANDSHAKES_PER_SEC 100.0
+#define DEFAULT_HANDSHAKE_BURST 256
+// How often the server reports handshake counters, if they've changed.
+#define HANDSHAKE_STATS_USEC (10 * 1000 * 1000)
+// Longest time telemetry records are buffered before being written out.
+#define TELEMETRY_FLUSH_USEC (100 * 1000)
+// Receive buffer requested for server sockets, so that a burst of packets from
+// many clients doesn't overflow while we're busy sending.
+#define SERVER_RCVBUF (4 * 1024 * 1024)
+// Kernel timestamps further than this from the current time are assumed to come
+// from a hardware clock that isn't synced to the system clock, and ignored.
+#define MAX_TIMESTAMP_AGE_USEC 1000000
+// Upper bound on how long the main loop sleeps, so that worker threads notice
+// want_to_die even when the signal was delivered to a different thread.
+#define MAX_WAIT_USEC 1000000
 
 // A 'cycle' is the amount of time we can assume our calibration between
 // the local and remote monotonic clocks is reasonably valid.  It seems
@@ -77,20 +106,22 @@
 int quiet = 0;
 int ttl = DEFAULT_TTL;
 int want_timestamps = 0;
+int want_kernel_timestamps = 0;
 double packets_per_sec = DEFAULT_PACKETS_PER_SEC;
 double prints_per_sec = -1.0;
+double handshakes_per_sec = DEFAULT_HANDSHAKES_PER_SEC;
 
-int want_to_die;
+volatile int want_to_die;
 
 
 static void sighandler(int sig) {
   want_to_die = 1;
 }
 
-// Render the given sockaddr as a string.  (Uses a static internal buffer
+// Render the given sockaddr as a string.  (Uses a static per-thread buffer
 // which is overwritten each time.)
 static const char *sockaddr_to_str(struct sockaddr *sa) {
-  static char addrbuf[128];
+  static __thread char addrbuf[128];
   void *aptr;
 
   switch (sa->sa_family) {
@@ -121,6 +152,11 @@ static void debug_print_hex(unsigned char *data, size_t data_len) {
   DLOG("\n");
 }
 
+static inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+  h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
 Session::Session(uint64_t first_send, uint32_t usec_per_pkt,
                  const struct sockaddr_storage &raddr, size_t raddr_len)
     : usec_per_pkt(usec_per_pkt),
@@ -143,7 +179,9 @@ Session::Session(uint64_t first_send, uint32_t usec_per_pkt,
       lat_tx(0), lat_tx_min(0x7fffffff), lat_tx_max(0),
       lat_tx_count(0), lat_tx_sum(0), lat_tx_var_sum(0),
       lat_rx(0), lat_rx_min(0x7fffffff), lat_rx_max(0),
-      lat_rx_count(0), lat_rx_sum(0), lat_rx_var_sum(0) {
+      lat_rx_count(0), lat_rx_sum(0), lat_rx_var_sum(0),
+      telemetry(NULL),
+      tx_timestamps(NULL) {
   memcpy(&remoteaddr, &raddr, raddr_len);
   memset(&tx, 0, sizeof(tx));
   strcpy(last_ackinfo, "");
@@ -156,77 +194,195 @@ SessionMap::iterator Sessions::NewSession(uint64_t first_send,
                                           socklen_t addr_len) {
   std::pair<SessionMap::iterator, bool> p = session_map.insert(std::make_pair(
       *addr, Session(first_send, usec_per_pkt, *addr, addr_len)));
-  next_sends.push(p.first);
+  Session &session = p.first->second;
+  if (p.second) {
+    session.tx_timestamps = tx_timestamps;
+  }
+  if (p.second && telemetry) {
+    session.telemetry = telemetry;
+    TelemetryRecord *r = telemetry->Add(&session, TELEMETRY_SESSION_START,
+                                        first_send, 0);
+    r->values[0] = usec_per_pkt;
+  }
+  ScheduleSend(p.first);
   return p.first;
 }
 
+// SipHash-2-4, as described in "SipHash: a fast short-input PRF" by
+// Aumasson and Bernstein.  We only ever hash three 64-bit words, so the
+// message schedule is unrolled for that case.
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+  } while (0)
+
+static void make_cookie_key(const unsigned char *secret, size_t secret_len,
+                            CookieKey *key) {
+  unsigned char k[16];
+  memset(k, 0, sizeof(k));
+  memcpy(k, secret, std::min(secret_len, sizeof(k)));
+  uint64_t k0 = 0, k1 = 0;
+  for (int i = 7; i >= 0; i--) {
+    k0 = (k0 << 8) | k[i];
+    k1 = (k1 << 8) | k[i + 8];
+  }
+  key->v[0] = k0 ^ 0x736f6d6570736575ULL;
+  // The 0xee selects the 128-bit output variant.
+  key->v[1] = k1 ^ 0x646f72616e646f6dULL ^ 0xee;
+  key->v[2] = k0 ^ 0x6c7967656e657261ULL;
+  key->v[3] = k1 ^ 0x7465646279746573ULL;
+}
+
+// Computes the 128-bit SipHash-2-4 of the 24-byte message m.
+static void siphash128_24(const CookieKey &key, const uint64_t m[3],
+                          uint64_t out[2]) {
+  uint64_t v0 = key.v[0], v1 = key.v[1], v2 = key.v[2], v3 = key.v[3];
+  for (int i = 0; i < 3; i++) {
+    v3 ^= m[i];
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m[i];
+  }
+  uint64_t b = (uint64_t)24 << 56;  // message length, no tail bytes
+  v3 ^= b;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xee;
+  for (int i = 0; i < 4; i++) SIP_ROUND(v0, v1, v2, v3);
+  out[0] = v0 ^ v1 ^ v2 ^ v3;
+  v1 ^= 0xdd;
+  for (int i = 0; i < 4; i++) SIP_ROUND(v0, v1, v2, v3);
+  out[1] = v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Packs the fields a cookie vouches for into three words: the requested
+// packet rate, and the client's address family, port and IP address.  Other
+// sockaddr fields (like the IPv6 flow label) don't identify the client, so
+// they're left out.
+static void cookie_message(const Packet *p,
+                           const struct sockaddr_storage *addr,
+                           uint64_t m[3]) {
+  uint16_t port = 0;
+  m[1] = m[2] = 0;
+  if (addr->ss_family == AF_INET) {
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)addr;
+    port = a4->sin_port;
+    m[1] = a4->sin_addr.s_addr;
+  } else if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)addr;
+    port = a6->sin6_port;
+    memcpy(m + 1, &a6->sin6_addr, sizeof(a6->sin6_addr));
+  }
+  m[0] = (uint64_t)p->usec_per_pkt | ((uint64_t)addr->ss_family << 32) |
+      ((uint64_t)port << 48);
+}
+
+HandshakeLimiter::HandshakeLimiter()
+    : seed(((uint64_t)std::random_device()() << 32) |
+           std::random_device()()) {
+  memset(tat, 0, sizeof(tat));
+  SetRate(DEFAULT_HANDSHAKES_PER_SEC, DEFAULT_HANDSHAKE_BURST);
+}
+
+void HandshakeLimiter::SetRate(double per_sec, double burst) {
+  interval_usec = 1e6 / per_sec;
+  burst_usec = interval_usec * std::max(burst - 1, 0.0);
+}
+
+bool HandshakeLimiter::Allow(const struct sockaddr_storage &addr,
+                             uint64_t now) {
+  uint64_t prefix[2] = { 0, 0 };
+  if (addr.ss_family == AF_INET) {
+    const struct sockaddr_in &a4 = *(const struct sockaddr_in *)&addr;
+    prefix[0] = ntohl(a4.sin_addr.s_addr) & 0xffffff00;
+  } else if (addr.ss_family == AF_INET6) {
+    const struct sockaddr_in6 &a6 = *(const struct sockaddr_in6 *)&addr;
+    if (IN6_IS_ADDR_V4MAPPED(&a6.sin6_addr)) {
+      // IPv4 clients of our dual-stack socket.
+      uint32_t a;
+      memcpy(&a, &a6.sin6_addr.s6_addr[12], sizeof(a));
+      prefix[0] = ntohl(a) & 0xffffff00;
+    } else {
+      memcpy(&prefix[1], &a6.sin6_addr, 7);  // /56
+    }
+  }
+  uint64_t h = hash_mix(hash_mix(seed, prefix[0]), prefix[1]);
+  uint64_t &t = tat[(h >> 32) % HANDSHAKE_BUCKETS];
+  if (DIFF64(t, now) < 0) {
+    t = now;
+  }
+  if ((uint64_t)DIFF64(t, now) > burst_usec) {
+    return false;
+  }
+  t += interval_usec;
+  return true;
+}
+
 Sessions::Sessions()
-    : md(EVP_sha256()),
+    : telemetry(NULL),
+      tx_timestamps(NULL),
       rng(std::random_device()()),
       cookie_epoch(0),
-      last_secret_update_time(0) {
+      last_secret_update_time(0),
+      prev_cookie_epoch(0) {
+  memset(prev_cookie_secret, 0, sizeof(prev_cookie_secret));
   NewRandomCookieSecret();
-  EVP_MD_CTX_init(&digest_context);
 }
 
 Sessions::~Sessions() {
-  EVP_MD_CTX_cleanup(&digest_context);
 }
 
 bool Sessions::CalculateCookie(Packet *p, struct sockaddr_storage *remoteaddr,
                                size_t remoteaddr_len) {
-  return CalculateCookieWithSecret(p, remoteaddr, remoteaddr_len,
-                                   cookie_secret, sizeof(cookie_secret));
+  return CalculateCookieWithKey(p, remoteaddr, cookie_key);
 }
 
-bool Sessions::CalculateCookieWithSecret(Packet *p,
-                                         struct sockaddr_storage *remoteaddr,
-                                         size_t remoteaddr_len,
-                                         unsigned char *secret,
-                                         size_t secret_len) {
+bool Sessions::CalculateCookieWithKey(Packet *p,
+                                      struct sockaddr_storage *remoteaddr,
+                                      const CookieKey &key) {
   if (p->packet_type != PACKET_TYPE_HANDSHAKE) {
     fprintf(stderr, "Tried to create cookie for a non-handshake packet\n");
     return false;
   }
-  if (!EVP_DigestInit_ex(&digest_context, md, NULL)) {
-    fprintf(stderr, "Unable to initialize hash digest\n");
-    return false;
-  }
-
-  // Hash the data
-  EVP_DigestUpdate(&digest_context, secret, secret_len);
-  EVP_DigestUpdate(&digest_context, &p->usec_per_pkt, sizeof(p->usec_per_pkt));
-  EVP_DigestUpdate(&digest_context, remoteaddr, remoteaddr_len);
-
-  unsigned int digest_size = 0;
-  EVP_DigestFinal_ex(&digest_context, p->data.handshake.cookie, &digest_size);
-  if (digest_size != COOKIE_SIZE) {
-    fprintf(stderr, "Invalid digest size %d for cookie; expected %d\n",
-            digest_size, COOKIE_SIZE);
-    return false;
-  }
+  uint64_t m[3], mac[2];
+  cookie_message(p, remoteaddr, m);
+  siphash128_24(key, m, mac);
+  handshake_stats.macs++;
+  memset(p->data.handshake.cookie, 0, sizeof(p->data.handshake.cookie));
+  memcpy(p->data.handshake.cookie, mac, COOKIE_MAC_SIZE);
   p->data.handshake.cookie_epoch = cookie_epoch;
   return true;
 }
 
+bool Sessions::CalculateCookieWithSecret(Packet *p,
+                                         struct sockaddr_storage *remoteaddr,
+                                         size_t remoteaddr_len,
+                                         unsigned char *secret,
+                                         size_t secret_len) {
+  CookieKey key;
+  make_cookie_key(secret, secret_len, &key);
+  return CalculateCookieWithKey(p, remoteaddr, key);
+}
+
 bool Sessions::ValidateCookie(Packet *p, struct sockaddr_storage *addr,
                               socklen_t addr_len) {
   if (p->data.handshake.cookie_epoch != cookie_epoch &&
       p->data.handshake.cookie_epoch != prev_cookie_epoch) {
     fprintf(stderr, "Obsolete cookie epoch: %d\n",
             p->data.handshake.cookie_epoch);
+    handshake_stats.cookies_rejected++;
     return false;
   }
   Packet golden;
   golden.packet_type = PACKET_TYPE_HANDSHAKE;
   golden.usec_per_pkt = p->usec_per_pkt;
-  unsigned char *secret = cookie_secret;
-  size_t secret_len = sizeof(cookie_secret);
-  if (p->data.handshake.cookie_epoch == prev_cookie_epoch) {
-    secret = prev_cookie_secret;
-    secret_len = sizeof(prev_cookie_secret);
-  }
-  CalculateCookieWithSecret(&golden, addr, addr_len, secret, secret_len);
+  const CookieKey &key = p->data.handshake.cookie_epoch == cookie_epoch ?
+      cookie_key : prev_cookie_key;
+  CalculateCookieWithKey(&golden, addr, key);
   DLOG("Handshake: cookie epoch=%d, cookie=0x",
        p->data.handshake.cookie_epoch);
   debug_print_hex(p->data.handshake.cookie, sizeof(p->data.handshake.cookie));
@@ -234,10 +390,16 @@ bool Sessions::ValidateCookie(Packet *p, struct sockaddr_storage *addr,
        golden.data.handshake.cookie_epoch);
   debug_print_hex(golden.data.handshake.cookie,
                   sizeof(golden.data.handshake.cookie));
-  if (memcmp(golden.data.handshake.cookie, p->data.handshake.cookie,
-             COOKIE_SIZE)) {
+  // Compare in constant time, so response timing doesn't leak how much of a
+  // forged cookie was right.
+  unsigned char diff = 0;
+  for (size_t i = 0; i < COOKIE_SIZE; i++) {
+    diff |= golden.data.handshake.cookie[i] ^ p->data.handshake.cookie[i];
+  }
+  if (diff) {
     fprintf(stderr, "Invalid cookie in handshake packet from %s\n",
             sockaddr_to_str((struct sockaddr *)addr));
+    handshake_stats.cookies_rejected++;
     return false;
   }
   return true;
@@ -270,9 +432,16 @@ void Sessions::NewRandomCookieSecret() {
     memcpy(&cookie_secret[i], &random,
            std::min(sizeof(random), sizeof(cookie_secret) - i));
   }
+  UpdateCookieKeys();
   DLOG("Generated new cookie secret.\n");
 }
 
+void Sessions::UpdateCookieKeys() {
+  make_cookie_key(cookie_secret, sizeof(cookie_secret), &cookie_key);
+  make_cookie_key(prev_cookie_secret, sizeof(prev_cookie_secret),
+                  &prev_cookie_key);
+}
+
 // Returns the kernel monotonic timestamp in microseconds.  We provide 64 bits
 // of data here, though we truncate to 32 on the wire to save space in our
 // packets.  This function never returns the value 0; it returns 1 instead, so
@@ -320,9 +489,17 @@ static void usage_and_die(char *argv0) {
           "      -r <pps>        packets per second (default=%g)\n"
           "                      in server mode: the highest accepted rate.\n"
           "      -t <ttl>        packet ttl to use (default=2 for safety)\n"
+          "      -w <threads>    server worker threads sharing the port\n"
+          "                      using SO_REUSEPORT (default=1)\n"
+          "      -H <hps>        server: max handshakes per second from each\n"
+          "                      /24 or /56 source prefix (default=%g)\n"
+          "      -o <output>     write binary per-session telemetry to a file,\n"
+          "                      or to unix:<path> (a datagram socket)\n"
+          "      -K              use kernel (or NIC) rx/tx timestamps\n"
           "      -q              quiet mode (don't print packets)\n"
           "      -T              print timestamps\n",
-          argv0, argv0, (double)DEFAULT_PACKETS_PER_SEC);
+          argv0, argv0, (double)DEFAULT_PACKETS_PER_SEC,
+          (double)DEFAULT_HANDSHAKES_PER_SEC);
   exit(99);
 }
 
@@ -331,33 +508,497 @@ void set_packets_per_sec(double new_pps) {
   packets_per_sec = new_pps;
 }
 
-bool CompareSockaddr::operator()(const struct sockaddr_storage &lhs,
-                                 const struct sockaddr_storage &rhs) {
+#define EMPTY_SLOT 0xffffffffU
+#define NO_ENTRY 0xffffffffU
+#define UNSCHEDULED 0xff
+#define DUE_LEVEL WHEEL_LEVELS
+
+// Returns true if lhs and rhs have the same address family, IPv4/6 address
+// and port.
+static bool sockaddr_equal(const struct sockaddr_storage &lhs,
+                           const struct sockaddr_storage &rhs) {
   if (lhs.ss_family != rhs.ss_family) {
-    return lhs.ss_family < rhs.ss_family;
+    return false;
   }
   if (lhs.ss_family == AF_INET) {
     const struct sockaddr_in &lhs4 = *(const struct sockaddr_in*)&lhs;
     const struct sockaddr_in &rhs4 = *(const struct sockaddr_in*)&rhs;
-    long long c = (ntohl(lhs4.sin_addr.s_addr) - ntohl(rhs4.sin_addr.s_addr));
-    if (c == 0) {
-      return ntohs(lhs4.sin_port) < ntohs(rhs4.sin_port);
-    }
-    return c < 0;
+    return lhs4.sin_addr.s_addr == rhs4.sin_addr.s_addr &&
+        lhs4.sin_port == rhs4.sin_port;
   } else {
     const struct sockaddr_in6 &lhs6 = *(const struct sockaddr_in6*)&lhs;
     const struct sockaddr_in6 &rhs6 = *(const struct sockaddr_in6*)&rhs;
-    int c = memcmp(&lhs6.sin6_addr, &rhs6.sin6_addr, sizeof(struct in6_addr));
-    if (c == 0) {
-      return ntohs(lhs6.sin6_port) < ntohs(rhs6.sin6_port);
+    return !memcmp(&lhs6.sin6_addr, &rhs6.sin6_addr,
+                   sizeof(struct in6_addr)) &&
+        lhs6.sin6_port == rhs6.sin6_port;
+  }
+}
+
+SessionMap::SessionMap()
+    : slots(16),
+      count(0),
+      seed(((uint64_t)std::random_device()() << 32) |
+           std::random_device()()) {
+  for (size_t i = 0; i < slots.size(); i++) {
+    slots[i].index = EMPTY_SLOT;
+  }
+}
+
+SessionMap::~SessionMap() {
+  for (size_t i = 0; i < nodes.size(); i++) {
+    delete nodes[i];
+  }
+}
+
+// The seed is random so that clients can't pick source ports that all land
+// in the same chain.
+uint32_t SessionMap::Hash(const struct sockaddr_storage &addr) const {
+  uint64_t h = seed;
+  if (addr.ss_family == AF_INET) {
+    const struct sockaddr_in &a4 = *(const struct sockaddr_in*)&addr;
+    h = hash_mix(h, ((uint64_t)a4.sin_addr.s_addr << 16) | a4.sin_port);
+  } else {
+    const struct sockaddr_in6 &a6 = *(const struct sockaddr_in6*)&addr;
+    uint64_t words[2];
+    memcpy(words, &a6.sin6_addr, sizeof(words));
+    h = hash_mix(h, words[0]);
+    h = hash_mix(h, words[1]);
+    h = hash_mix(h, a6.sin6_port);
+  }
+  h = hash_mix(h, addr.ss_family);
+  return (uint32_t)(h >> 32);
+}
+
+uint32_t SessionMap::Probe(const struct sockaddr_storage &addr,
+                           uint32_t hash) const {
+  uint32_t mask = slots.size() - 1;
+  uint32_t i = hash & mask;
+  while (slots[i].index != EMPTY_SLOT &&
+         (slots[i].hash != hash ||
+          !sockaddr_equal(nodes[slots[i].index]->first, addr))) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+uint32_t SessionMap::NextUsed(uint32_t index) const {
+  while (index < nodes.size() && nodes[index] == NULL) {
+    index++;
+  }
+  return index;
+}
+
+void SessionMap::Grow() {
+  std::vector<Slot> old;
+  old.swap(slots);
+  slots.resize(old.size() * 2);
+  for (size_t i = 0; i < slots.size(); i++) {
+    slots[i].index = EMPTY_SLOT;
+  }
+  uint32_t mask = slots.size() - 1;
+  for (size_t i = 0; i < old.size(); i++) {
+    if (old[i].index == EMPTY_SLOT) continue;
+    uint32_t j = old[i].hash & mask;
+    while (slots[j].index != EMPTY_SLOT) {
+      j = (j + 1) & mask;
+    }
+    slots[j] = old[i];
+  }
+}
+
+SessionMap::iterator SessionMap::find(const struct sockaddr_storage &addr) {
+  uint32_t i = Probe(addr, Hash(addr));
+  if (slots[i].index == EMPTY_SLOT) {
+    return end();
+  }
+  return iterator(this, slots[i].index);
+}
+
+std::pair<SessionMap::iterator, bool> SessionMap::insert(
+    const value_type &value) {
+  uint32_t hash = Hash(value.first);
+  uint32_t i = Probe(value.first, hash);
+  if (slots[i].index != EMPTY_SLOT) {
+    return std::make_pair(iterator(this, slots[i].index), false);
+  }
+  // Keep the load factor at or below 1/2, so probe chains stay short.
+  if ((count + 1) * 2 > slots.size()) {
+    Grow();
+    i = Probe(value.first, hash);
+  }
+  uint32_t index;
+  if (!free_indexes.empty()) {
+    index = free_indexes.back();
+    free_indexes.pop_back();
+  } else {
+    index = nodes.size();
+    nodes.push_back(NULL);
+  }
+  nodes[index] = new value_type(value);
+  slots[i].hash = hash;
+  slots[i].index = index;
+  count++;
+  return std::make_pair(iterator(this, index), true);
+}
+
+size_t SessionMap::erase(const struct sockaddr_storage &addr) {
+  iterator it = find(addr);
+  if (it == end()) {
+    return 0;
+  }
+  erase(it);
+  return 1;
+}
+
+void SessionMap::erase(iterator it) {
+  uint32_t index = it.index();
+  uint32_t i = Probe(nodes[index]->first, Hash(nodes[index]->first));
+  assert(slots[i].index == index);
+  delete nodes[index];
+  nodes[index] = NULL;
+  free_indexes.push_back(index);
+  count--;
+
+  // Backward-shift deletion: pull later members of the probe chain into the
+  // hole, so lookups never need tombstones.
+  uint32_t mask = slots.size() - 1;
+  uint32_t j = i;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (slots[j].index == EMPTY_SLOT) break;
+    uint32_t home = slots[j].hash & mask;
+    // Entries whose home slot is cyclically in (i, j] can't move back to i.
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+    slots[i] = slots[j];
+    i = j;
+  }
+  slots[i].index = EMPTY_SLOT;
+}
+
+SendWheel::SendWheel()
+    : due_head(NO_ENTRY),
+      current_tick(0),
+      count(0) {
+  for (int l = 0; l < WHEEL_LEVELS; l++) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+      heads[l][i] = NO_ENTRY;
+    }
+    occupied[l] = 0;
+  }
+}
+
+void SendWheel::Link(uint32_t index, int level, int slot) {
+  uint32_t *head = level == DUE_LEVEL ? &due_head : &heads[level][slot];
+  prev[index] = NO_ENTRY;
+  next[index] = *head;
+  if (*head != NO_ENTRY) {
+    prev[*head] = index;
+  }
+  *head = index;
+  level_of[index] = level;
+  slot_of[index] = slot;
+  if (level != DUE_LEVEL) {
+    occupied[level] |= 1ULL << slot;
+  }
+}
+
+void SendWheel::Unlink(uint32_t index) {
+  int level = level_of[index];
+  int slot = slot_of[index];
+  uint32_t *head = level == DUE_LEVEL ? &due_head : &heads[level][slot];
+  if (prev[index] != NO_ENTRY) {
+    next[prev[index]] = next[index];
+  } else {
+    *head = next[index];
+  }
+  if (next[index] != NO_ENTRY) {
+    prev[next[index]] = prev[index];
+  }
+  if (level != DUE_LEVEL && *head == NO_ENTRY) {
+    occupied[level] &= ~(1ULL << slot);
+  }
+  level_of[index] = UNSCHEDULED;
+}
+
+// Puts index in the slot for tick, relative to current_tick.  Times in the
+// past go in the current level 0 slot, which PopDue() checks entry by entry.
+void SendWheel::Insert(uint32_t index, uint64_t tick) {
+  if (tick <= current_tick) {
+    Link(index, 0, current_tick & (WHEEL_SLOTS - 1));
+    return;
+  }
+  uint64_t delta = tick - current_tick;
+  for (int l = 0; l < WHEEL_LEVELS; l++) {
+    if (delta < (1ULL << (WHEEL_SLOT_BITS * (l + 1)))) {
+      Link(index, l, (tick >> (WHEEL_SLOT_BITS * l)) & (WHEEL_SLOTS - 1));
+      return;
     }
-    return c < 0;
   }
+  // Beyond the end of the wheel: park it in the furthest top level slot, and
+  // re-file it when that slot comes up.
+  int top = WHEEL_LEVELS - 1;
+  Link(index, top, ((current_tick >> (WHEEL_SLOT_BITS * top)) +
+                    WHEEL_SLOTS - 1) & (WHEEL_SLOTS - 1));
+}
+
+void SendWheel::Schedule(uint32_t index, uint64_t when_usec) {
+  if (index >= when.size()) {
+    size_t n = std::max((size_t)index + 1, when.size() * 2);
+    when.resize(n);
+    next.resize(n);
+    prev.resize(n);
+    level_of.resize(n, UNSCHEDULED);
+    slot_of.resize(n);
+  }
+  if (level_of[index] != UNSCHEDULED) {
+    Unlink(index);
+    count--;
+  }
+  if (count == 0) {
+    // Nothing else to keep in order, so start the wheel at this entry instead
+    // of cascading all the way from wherever it was last used.
+    current_tick = when_usec >> WHEEL_TICK_SHIFT;
+  }
+  when[index] = when_usec;
+  Insert(index, when_usec >> WHEEL_TICK_SHIFT);
+  count++;
 }
 
-bool CompareNextSend::operator()(const SessionMap::iterator &lhs,
-                                 const SessionMap::iterator &rhs) {
-  return lhs->second.next_send > rhs->second.next_send;
+void SendWheel::Cancel(uint32_t index) {
+  if (index < when.size() && level_of[index] != UNSCHEDULED) {
+    Unlink(index);
+    count--;
+  }
+}
+
+uint64_t SendWheel::NextSlotTick(int level) const {
+  if (!occupied[level]) {
+    return 0;
+  }
+  int shift = WHEEL_SLOT_BITS * level;
+  uint64_t pos = current_tick >> shift;
+  // Rotate so that bit 0 is the slot after the current one.
+  int start = (pos + 1) & (WHEEL_SLOTS - 1);
+  uint64_t bits = occupied[level];
+  uint64_t rotated = start ? (bits >> start) | (bits << (WHEEL_SLOTS - start))
+                           : bits;
+  return (pos + 1 + __builtin_ctzll(rotated)) << shift;
+}
+
+void SendWheel::Cascade(int level, int slot) {
+  uint32_t i = heads[level][slot];
+  while (i != NO_ENTRY) {
+    uint32_t n = next[i];
+    Unlink(i);
+    Insert(i, when[i] >> WHEEL_TICK_SHIFT);
+    i = n;
+  }
+}
+
+// Moves current_tick forward to now_tick, shifting every entry that becomes due
+// onto the due list, and cascading higher levels down as their slots come up.
+// Jumps straight over stretches where nothing is scheduled.
+void SendWheel::Advance(uint64_t now_tick) {
+  if (count == 0) {
+    current_tick = now_tick;
+    return;
+  }
+  while (current_tick < now_tick) {
+    // Everything in the current tick's slot is now in the past.
+    int slot = current_tick & (WHEEL_SLOTS - 1);
+    uint32_t i = heads[0][slot];
+    while (i != NO_ENTRY) {
+      uint32_t n = next[i];
+      Unlink(i);
+      Link(i, DUE_LEVEL, 0);
+      i = n;
+    }
+
+    uint64_t target = now_tick;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+      uint64_t t = NextSlotTick(l);
+      if (t && t < target) {
+        target = t;
+      }
+    }
+    current_tick = target;
+    // Cascade from the top down, so entries moving down several levels at
+    // once end up in the right level 0 slot.
+    for (int l = WHEEL_LEVELS - 1; l >= 1; l--) {
+      int shift = WHEEL_SLOT_BITS * l;
+      if ((current_tick & ((1ULL << shift) - 1)) == 0) {
+        Cascade(l, (current_tick >> shift) & (WHEEL_SLOTS - 1));
+      }
+    }
+  }
+}
+
+bool SendWheel::PopDue(uint64_t now, uint32_t *index) {
+  Advance(now >> WHEEL_TICK_SHIFT);
+  if (due_head != NO_ENTRY) {
+    *index = due_head;
+    Unlink(due_head);
+    count--;
+    return true;
+  }
+  // The current slot holds entries for this tick (or the past, if now went
+  // backwards), which may or may not be due yet.
+  uint32_t i = heads[0][current_tick & (WHEEL_SLOTS - 1)];
+  for (; i != NO_ENTRY; i = next[i]) {
+    if (DIFF64(now, when[i]) >= 0) {
+      *index = i;
+      Unlink(i);
+      count--;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t SendWheel::MinTimeInList(uint32_t head) const {
+  uint64_t best = UINT64_MAX;
+  for (uint32_t i = head; i != NO_ENTRY; i = next[i]) {
+    best = std::min(best, when[i]);
+  }
+  return best;
+}
+
+uint64_t SendWheel::NextTime() const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t best = MinTimeInList(due_head);
+  int slot = current_tick & (WHEEL_SLOTS - 1);
+  if (heads[0][slot] != NO_ENTRY) {
+    best = std::min(best, MinTimeInList(heads[0][slot]));
+  } else if (occupied[0]) {
+    uint64_t t = NextSlotTick(0);
+    best = std::min(best, MinTimeInList(heads[0][t & (WHEEL_SLOTS - 1)]));
+  }
+  // Levels aren't ordered relative to each other, but every entry in a slot is
+  // no earlier than the slot's first tick, so most slots can be skipped.
+  for (int l = 1; l < WHEEL_LEVELS; l++) {
+    uint64_t t = NextSlotTick(l);
+    if (t && (t << WHEEL_TICK_SHIFT) < best) {
+      int shift = WHEEL_SLOT_BITS * l;
+      best = std::min(best, MinTimeInList(
+          heads[l][(t >> shift) & (WHEEL_SLOTS - 1)]));
+    }
+  }
+  return best;
+}
+
+Telemetry::Telemetry(int fd)
+    : fd(fd),
+      count(0),
+      first_time(0),
+      dropped_records(0) {
+  assert(sizeof(TelemetryRecord) == TELEMETRY_RECORD_SIZE);
+}
+
+Telemetry::~Telemetry() {
+  Flush(0);
+}
+
+TelemetryRecord *Telemetry::Add(const Session *s, int type, uint64_t now,
+                                uint32_t id) {
+  if (count == TELEMETRY_BATCH) {
+    Flush(now);
+  }
+  if (count == 0) {
+    first_time = now;
+  }
+  TelemetryRecord *r = &records[1 + count++];
+  memset(r, 0, sizeof(*r));
+  r->version = TELEMETRY_VERSION;
+  r->type = type;
+  r->time = now;
+  r->id = id;
+  r->family = s->remoteaddr.ss_family;
+  if (r->family == AF_INET) {
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)&s->remoteaddr;
+    r->port = ntohs(a4->sin_port);
+    memcpy(r->addr, &a4->sin_addr, sizeof(a4->sin_addr));
+  } else if (r->family == AF_INET6) {
+    const struct sockaddr_in6 *a6 =
+        (const struct sockaddr_in6 *)&s->remoteaddr;
+    r->port = ntohs(a6->sin6_port);
+    memcpy(r->addr, &a6->sin6_addr, sizeof(a6->sin6_addr));
+  }
+  return r;
+}
+
+void Telemetry::Flush(uint64_t now) {
+  if (count == 0) {
+    return;
+  }
+  TelemetryRecord *sync = &records[0];
+  memset(sync, 0, sizeof(*sync));
+  sync->version = TELEMETRY_VERSION;
+  sync->type = TELEMETRY_SYNC;
+  sync->time = now ? now : ustime64();
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t realtime = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+  sync->values[0] = realtime >> 32;
+  sync->values[1] = (uint32_t)realtime;
+
+  // One write per batch, so records from several workers sharing the fd
+  // never interleave, whether it's an O_APPEND file or a datagram socket.
+  size_t len = (count + 1) * sizeof(records[0]);
+  ssize_t wrote = write(fd, records, len);
+  if (wrote != (ssize_t)len) {
+    if (wrote < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != ENOBUFS) {
+      perror("telemetry write");
+    }
+    dropped_records += count;
+  }
+  count = 0;
+}
+
+void Telemetry::MaybeFlush(uint64_t now, uint64_t max_age) {
+  if (count > 0 && DIFF64(now, first_time) >= (int64_t)max_age) {
+    Flush(now);
+  }
+}
+
+// Reports the end of a session, with its summary statistics.
+static void report_session_end(Session *s, uint64_t now) {
+  if (!s->telemetry) {
+    return;
+  }
+  TelemetryRecord *r = s->telemetry->Add(s, TELEMETRY_SESSION_END, now,
+                                         s->lat_rx_count);
+  r->values[0] = s->lat_tx_count ? s->lat_tx_min : 0;
+  r->values[1] = DIV(s->lat_tx_sum, s->lat_tx_count);
+  r->values[2] = s->lat_tx_max;
+  r->values[3] = s->lat_rx_count ? s->lat_rx_min : 0;
+  r->values[4] = DIV(s->lat_rx_sum, s->lat_rx_count);
+  r->values[5] = s->lat_rx_max;
+  r->values[6] = s->num_lost;
+}
+
+uint32_t TxTimestamps::SlotIndex(uint32_t id, uint32_t txtime) const {
+  return (hash_mix(id, txtime) >> 32) % TX_TIMESTAMP_SLOTS;
+}
+
+void TxTimestamps::Add(uint32_t id, uint32_t txtime, int32_t lag) {
+  Slot &slot = slots[SlotIndex(id, txtime)];
+  slot.id = id;
+  slot.txtime = txtime;
+  slot.lag = lag;
+  slot.valid = 1;
+  added++;
+}
+
+bool TxTimestamps::Find(uint32_t id, uint32_t txtime, int32_t *lag) const {
+  const Slot &slot = slots[SlotIndex(id, txtime)];
+  if (!slot.valid || slot.id != id || slot.txtime != txtime) {
+    return false;
+  }
+  *lag = slot.lag;
+  return true;
 }
 
 // Print the timestamp corresponding to the current time.
@@ -454,26 +1095,15 @@ void send_initial_handshake_reply(Sessions *s, Packet *rx, int sock,
   memset(&tx, 0, sizeof(tx));
   prepare_handshake_reply_packet(&tx, rx, now);
   s->CalculateCookie(&tx, remoteaddr, remoteaddr_len);
+  s->handshake_stats.cookies_sent++;
   sendto(sock, &tx, sizeof(tx), 0, (struct sockaddr *)remoteaddr,
          remoteaddr_len);
 }
 
 
-int send_packet(struct Session *s, int sock, int is_server) {
-  if (is_server) {
-    if (sendto(sock, &s->tx, sizeof(s->tx), 0,
-               (struct sockaddr *)&s->remoteaddr, s->remoteaddr_len) < 0) {
-      perror("sendto");
-    }
-  } else {
-    DLOG("Calling send on socket %d, size=%ld, is_server=%d\n", sock,
-         sizeof(s->tx), is_server);
-    if (send(sock, &s->tx, sizeof(s->tx), 0) < 0) {
-      int e = errno;
-      perror("send");
-      if (e == ECONNREFUSED) return 2;
-    }
-  }
+// Moves s->next_send forward after s->tx has been sent (or queued for
+// sending).
+static void schedule_next_send(struct Session *s, int is_server) {
   if (is_server ||
       s->handshake_state == Session::ESTABLISHED ||
       s->handshake_state == Session::COOKIE_GENERATED) {
@@ -503,9 +1133,81 @@ int send_packet(struct Session *s, int sock, int is_server) {
     // Don't count the handshake packet as part of the sequence.
     s->next_tx_id--;
   }
+}
+
+int send_packet(struct Session *s, int sock, int is_server) {
+  if (is_server) {
+    if (sendto(sock, &s->tx, sizeof(s->tx), 0,
+               (struct sockaddr *)&s->remoteaddr, s->remoteaddr_len) < 0) {
+      perror("sendto");
+    }
+  } else {
+    DLOG("Calling send on socket %d, size=%ld, is_server=%d\n", sock,
+         sizeof(s->tx), is_server);
+    if (send(sock, &s->tx, sizeof(s->tx), 0) < 0) {
+      int e = errno;
+      perror("send");
+      if (e == ECONNREFUSED) return 2;
+    }
+  }
+  schedule_next_send(s, is_server);
   return 0;
 }
 
+void queue_packet(Sessions *s, struct Session *session, int sock) {
+  PacketBatch &b = s->tx_batch;
+  if (b.count == MAX_BATCH_PACKETS) {
+    flush_packets(s, sock);
+  }
+  memcpy(&b.packets[b.count], &session->tx, sizeof(session->tx));
+  memcpy(&b.addrs[b.count], &session->remoteaddr, session->remoteaddr_len);
+  b.addr_lens[b.count] = session->remoteaddr_len;
+  b.count++;
+}
+
+int flush_packets(Sessions *s, int sock) {
+  PacketBatch &b = s->tx_batch;
+  int sent = 0;
+#ifdef __linux__
+  struct mmsghdr msgs[MAX_BATCH_PACKETS];
+  struct iovec iovs[MAX_BATCH_PACKETS];
+  memset(msgs, 0, sizeof(msgs[0]) * b.count);
+  for (int i = 0; i < b.count; i++) {
+    iovs[i].iov_base = &b.packets[i];
+    iovs[i].iov_len = sizeof(b.packets[i]);
+    msgs[i].msg_hdr.msg_name = &b.addrs[i];
+    msgs[i].msg_hdr.msg_namelen = b.addr_lens[i];
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int done = 0;
+  while (done < b.count) {
+    int n = sendmmsg(sock, &msgs[done], b.count - done, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      // sendmmsg stops at the first failing packet.  Like a failed sendto(),
+      // that packet is lost, but the rest of the batch still goes out.
+      perror("sendmmsg");
+      done++;
+      continue;
+    }
+    done += n;
+    sent += n;
+  }
+#else
+  for (int i = 0; i < b.count; i++) {
+    if (sendto(sock, &b.packets[i], sizeof(b.packets[i]), 0,
+               (struct sockaddr *)&b.addrs[i], b.addr_lens[i]) < 0) {
+      perror("sendto");
+    } else {
+      sent++;
+    }
+  }
+#endif
+  b.count = 0;
+  return sent;
+}
+
 int send_waiting_packets(Sessions *sessions, int sock, uint64_t now,
                          int is_server) {
   if (sessions == NULL) {
@@ -515,17 +1217,22 @@ int send_waiting_packets(Sessions *sessions, int sock, uint64_t now,
        "next send time=%ld, diff=%ld\n",
        sessions->next_sends.size(), now, now, sessions->next_send_time(),
        DIFF64(now, sessions->next_send_time()));
-  while (sessions->next_sends.size() > 0 &&
-         DIFF64(now, sessions->next_send_time()) >= 0) {
-    DLOG("%ld waiting packets, now=%ld, next send time=%ld\n",
-         sessions->next_sends.size(), now, sessions->next_send_time());
-    SessionMap::iterator it = sessions->next_sends.top();
-    sessions->next_sends.pop();
+  uint32_t index;
+  while (sessions->next_sends.PopDue(now, &index)) {
+    DLOG("%ld waiting packets, now=%ld\n", sessions->next_sends.size(), now);
+    SessionMap::iterator it = sessions->session_map.from_index(index);
     Session &s = it->second;
     prepare_tx_packet(&s);
-    int err = send_packet(&s, sock, is_server);
-    if (err != 0) {
-      return err;
+    if (is_server) {
+      // A busy server has many sessions due at once; hand their packets to
+      // the kernel in batches instead of one sendto() each.
+      queue_packet(sessions, &s, sock);
+      schedule_next_send(&s, is_server);
+    } else {
+      int err = send_packet(&s, sock, is_server);
+      if (err != 0) {
+        return err;
+      }
     }
     // TODO(pmccurdy): Detect connection refused on a per-client basis.  Use
     // recvmsg with the MSG_ERRQUEUE flag to get error and client address,
@@ -538,56 +1245,65 @@ int send_waiting_packets(Sessions *sessions, int sock, uint64_t now,
     if (is_server && DIFF(now, s.last_rxtime) > 60 * 1000 * 1000) {
       fprintf(stderr, "client %s disconnected.\n",
               sockaddr_to_str((struct sockaddr *)&s.remoteaddr));
-      sessions->session_map.erase(s.remoteaddr);
+      report_session_end(&s, now);
+      sessions->EraseSession(it);
     } else {
-      sessions->next_sends.push(it);
+      sessions->ScheduleSend(it);
     }
   }
+  if (is_server) {
+    flush_packets(sessions, sock);
+  }
   return 0;
 }
 
-int read_incoming_packet(Sessions *s, int sock, uint64_t now, int is_server) {
-  struct sockaddr_storage rxaddr;
-  socklen_t rxaddr_len = sizeof(rxaddr);
-
-  Packet rx;
-  ssize_t got = recvfrom(sock, &rx, sizeof(rx), 0,
-                         (struct sockaddr *)&rxaddr, &rxaddr_len);
-  if (got < 0) {
-    int e = errno;
-    perror("recvfrom");
-    return e;
-  }
-  if (got != sizeof(rx) || rx.magic != htonl(MAGIC)) {
+// Validates a packet of length got that was received from rxaddr, and passes
+// it on to the right Session.  Returns 0 on success, EINVAL for malformed
+// packets, or -1 if the packet was from an unknown client.
+static int process_incoming_packet(Sessions *s, Packet *rx, ssize_t got,
+                                   struct sockaddr_storage *rxaddr,
+                                   socklen_t rxaddr_len, int sock,
+                                   uint64_t now, int is_server) {
+  if (got != sizeof(*rx) || rx->magic != htonl(MAGIC)) {
     fprintf(stderr, "got invalid packet of length %ld, magic=%d from %s\n",
-            (long)got, ntohl(rx.magic),
-            sockaddr_to_str((struct sockaddr *)&rxaddr));
+            (long)got, ntohl(rx->magic),
+            sockaddr_to_str((struct sockaddr *)rxaddr));
     return EINVAL;
   }
-  switch (rx.packet_type) {
+  switch (rx->packet_type) {
     case PACKET_TYPE_HANDSHAKE:
     case PACKET_TYPE_ACK:
       break;
     default:
-      fprintf(stderr, "received unknown packet type %d\n", rx.packet_type);
+      fprintf(stderr, "received unknown packet type %d\n", rx->packet_type);
       return EINVAL;
   }
 
   Session *session = NULL;
   if (is_server) {
-    SessionMap::iterator it = s->session_map.find(rxaddr);
+    SessionMap::iterator it = s->session_map.find(*rxaddr);
+    // Anything that isn't an ack from an established session makes us compute
+    // a cookie, so charge it to the sender's handshake budget.
+    if ((it == s->session_map.end() ||
+         rx->packet_type == PACKET_TYPE_HANDSHAKE) &&
+        !s->handshake_limiter.Allow(*rxaddr, now)) {
+      DLOG("Rate limited handshake from %s\n",
+           sockaddr_to_str((struct sockaddr *)rxaddr));
+      s->handshake_stats.rate_limited++;
+      return -1;
+    }
     if (it != s->session_map.end()) {
       session = &it->second;
     } else {
       // Note: we don't want to allocate any memory here until the client has
       // completed the handshake.
-      if (rx.packet_type != PACKET_TYPE_HANDSHAKE) {
+      if (rx->packet_type != PACKET_TYPE_HANDSHAKE) {
         fprintf(stderr,
                 "Received non-handshake packet from unknown client %s\n",
-                sockaddr_to_str((struct sockaddr *)&rxaddr));
+                sockaddr_to_str((struct sockaddr *)rxaddr));
         // Reply with a new handshake packet, including a cookie; we may have
         // dropped a legit client and we need to tell them to renegotiate.
-        send_initial_handshake_reply(s, &rx, sock, &rxaddr, rxaddr_len, now);
+        send_initial_handshake_reply(s, rx, sock, rxaddr, rxaddr_len, now);
         return -1;
       }
     }
@@ -595,18 +1311,225 @@ int read_incoming_packet(Sessions *s, int sock, uint64_t now, int is_server) {
     SessionMap::iterator it = s->session_map.begin();
     if (it == s->session_map.end()) {
       fprintf(stderr, "No session configured for %s when receiving packet\n",
-              sockaddr_to_str((struct sockaddr *)&rxaddr));
+              sockaddr_to_str((struct sockaddr *)rxaddr));
       return EINVAL;
     }
     DLOG("read_incoming_packet: Client received %s packet from server\n",
-         rx.packet_type == PACKET_TYPE_ACK ? "ack" : "handshake");
+         rx->packet_type == PACKET_TYPE_ACK ? "ack" : "handshake");
     session = &it->second;
   }
-  handle_packet(s, session, &rx, sock, &rxaddr, rxaddr_len, now, is_server);
+  handle_packet(s, session, rx, sock, rxaddr, rxaddr_len, now, is_server);
+
+  return 0;
+}
+
+#ifdef __linux__
+// Converts a SCM_TIMESTAMPING control message to our ustime64() timebase.
+// The kernel reports software timestamps in CLOCK_REALTIME, so we use the
+// packet's age according to that clock.  A raw hardware timestamp is preferred
+// when there is one, but it's only comparable if something like phc2sys keeps
+// the NIC clock synced to the system clock, so it's ignored unless its age
+// looks plausible.  now and realtime must be sampled together, after the
+// timestamp was read.  Returns false if there was no usable timestamp.
+static bool kernel_timestamp_to_ustime(const struct scm_timestamping *tss,
+                                       uint64_t now, int64_t realtime,
+                                       uint64_t *result) {
+  // ts[2] is the raw hardware timestamp, ts[0] the software one.
+  static const int order[] = {2, 0};
+  for (size_t i = 0; i < ARRAY_LEN(order); i++) {
+    const struct timespec &t = tss->ts[order[i]];
+    if (!t.tv_sec && !t.tv_nsec) continue;
+    int64_t age = realtime - (t.tv_sec * 1000000LL + t.tv_nsec / 1000);
+    if (age < 0 || age > MAX_TIMESTAMP_AGE_USEC) continue;
+    *result = now - age;
+    return true;
+  }
+  return false;
+}
+
+static int64_t realtime64(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Returns the SCM_TIMESTAMPING data attached to msg, or NULL if there is none.
+static const struct scm_timestamping *find_timestamping(struct msghdr *msg) {
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL;
+       cm = CMSG_NXTHDR(msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+      return (const struct scm_timestamping *)CMSG_DATA(cm);
+    }
+  }
+  return NULL;
+}
 
+int enable_kernel_timestamps(int sock) {
+  // Without OPT_TSONLY, the kernel loops each sent packet back to us with its
+  // transmit timestamp, so we can tell which packet it belongs to.
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+              SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+              SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+    perror("setsockopt(SO_TIMESTAMPING)");
+    return 1;
+  }
   return 0;
 }
 
+int read_tx_timestamps(Sessions *s, int sock) {
+  int count = 0;
+  for (;;) {
+    // The looped back packet includes the link, IP and UDP headers, with our
+    // Packet at the end.
+    unsigned char buf[sizeof(Packet) + 256];
+    char control[512];
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("recvmsg(MSG_ERRQUEUE)");
+      }
+      break;
+    }
+    uint64_t now = ustime64();
+    int64_t realtime = realtime64();
+    const struct scm_timestamping *tss = find_timestamping(&msg);
+    uint64_t sent;
+    if (!tss || !s->tx_timestamps || (msg.msg_flags & MSG_TRUNC) ||
+        got < (ssize_t)sizeof(Packet) ||
+        !kernel_timestamp_to_ustime(tss, now, realtime, &sent)) {
+      continue;
+    }
+    Packet p;
+    memcpy(&p, buf + got - sizeof(p), sizeof(p));
+    if (p.magic != htonl(MAGIC)) {
+      continue;
+    }
+    uint32_t txtime = ntohl(p.txtime);
+    DLOG("tx timestamp: id=%u txtime=%u lag=%d\n", ntohl(p.id), txtime,
+         DIFF(sent, txtime));
+    s->tx_timestamps->Add(ntohl(p.id), txtime, DIFF(sent, txtime));
+    count++;
+  }
+  return count;
+}
+#else
+int enable_kernel_timestamps(int sock) {
+  fprintf(stderr, "kernel timestamps are not supported on this platform\n");
+  return 1;
+}
+
+int read_tx_timestamps(Sessions *s, int sock) {
+  return 0;
+}
+#endif
+
+int read_incoming_packet(Sessions *s, int sock, uint64_t now, int is_server) {
+  struct sockaddr_storage rxaddr;
+  socklen_t rxaddr_len = sizeof(rxaddr);
+
+  Packet rx;
+  ssize_t got = recvfrom(sock, &rx, sizeof(rx), 0,
+                         (struct sockaddr *)&rxaddr, &rxaddr_len);
+  if (got < 0) {
+    int e = errno;
+    perror("recvfrom");
+    return e;
+  }
+  return process_incoming_packet(s, &rx, got, &rxaddr, rxaddr_len, sock, now,
+                                 is_server);
+}
+
+int read_incoming_packets(Sessions *s, int sock, int is_server, int *npackets) {
+  Packet rx[MAX_BATCH_PACKETS];
+  struct sockaddr_storage rxaddrs[MAX_BATCH_PACKETS];
+  socklen_t rxaddr_lens[MAX_BATCH_PACKETS];
+  ssize_t got[MAX_BATCH_PACKETS];
+  uint64_t rxtimes[MAX_BATCH_PACKETS];
+  int n = 0;
+  int err = 0;
+
+  *npackets = 0;
+#ifdef __linux__
+  // Only needed when kernel timestamps are on, but small enough to always
+  // pass in.
+  union {
+    char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct cmsghdr align;
+  } controls[MAX_BATCH_PACKETS];
+  struct mmsghdr msgs[MAX_BATCH_PACKETS];
+  struct iovec iovs[MAX_BATCH_PACKETS];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < MAX_BATCH_PACKETS; i++) {
+    iovs[i].iov_base = &rx[i];
+    iovs[i].iov_len = sizeof(rx[i]);
+    msgs[i].msg_hdr.msg_name = &rxaddrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(rxaddrs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = controls[i].buf;
+    msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+  }
+  n = recvmmsg(sock, msgs, MAX_BATCH_PACKETS, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    int e = errno;
+    if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR) {
+      return 0;
+    }
+    perror("recvmmsg");
+    return e;
+  }
+  // The caller may have spent a while sending since it woke up, so take the
+  // time now that the packets are actually in hand.
+  uint64_t now = ustime64();
+  int64_t realtime = 0;
+  for (int i = 0; i < n; i++) {
+    got[i] = msgs[i].msg_len;
+    rxaddr_lens[i] = msgs[i].msg_hdr.msg_namelen;
+    // With kernel timestamps, each packet gets the time it actually arrived
+    // rather than the time we got around to reading it.
+    rxtimes[i] = now;
+    const struct scm_timestamping *tss = find_timestamping(&msgs[i].msg_hdr);
+    if (tss) {
+      if (!realtime) realtime = realtime64();
+      kernel_timestamp_to_ustime(tss, now, realtime, &rxtimes[i]);
+    }
+  }
+#else
+  for (; n < MAX_BATCH_PACKETS; n++) {
+    rxaddr_lens[n] = sizeof(rxaddrs[n]);
+    got[n] = recvfrom(sock, &rx[n], sizeof(rx[n]), MSG_DONTWAIT,
+                      (struct sockaddr *)&rxaddrs[n], &rxaddr_lens[n]);
+    if (got[n] < 0) {
+      int e = errno;
+      if (e != EAGAIN && e != EWOULDBLOCK && e != EINTR) {
+        perror("recvfrom");
+        err = e;
+      }
+      break;
+    }
+    rxtimes[n] = ustime64();
+  }
+#endif
+  // Without kernel timestamps, the packets in a recvmmsg() batch all get the
+  // time it returned.  That is no worse than reading them one by one, and is
+  // not skewed by the time spent processing earlier packets.
+  for (int i = 0; i < n; i++) {
+    process_incoming_packet(s, &rx[i], got[i], &rxaddrs[i], rxaddr_lens[i],
+                            sock, rxtimes[i], is_server);
+  }
+  *npackets = n;
+  return err;
+}
+
 // Checks what kind of packet we've received, and processes it appropriately.
 // Session may be null if we're dealing with a handshake packet for a new
 // connection.
@@ -656,7 +1579,10 @@ void handle_new_client_handshake_packet(Sessions *s, Packet *rx, int sock,
        rx->data.handshake.cookie_epoch);
   if (rx->data.handshake.cookie_epoch == 0) {
     // New connection with no cookie.  Return a cookie to validate the client.
-    s->session_map.erase(*remoteaddr);
+    SessionMap::iterator old = s->session_map.find(*remoteaddr);
+    if (old != s->session_map.end()) {
+      s->EraseSession(old);
+    }
     fprintf(stderr, "New connection from %s, sending cookie\n",
             sockaddr_to_str((struct sockaddr *)remoteaddr));
     send_initial_handshake_reply(s, rx, sock, remoteaddr, remoteaddr_len, now);
@@ -670,6 +1596,7 @@ void handle_new_client_handshake_packet(Sessions *s, Packet *rx, int sock,
     }
     fprintf(stderr, "New client connection: %s\n",
             sockaddr_to_str((struct sockaddr *)remoteaddr));
+    s->handshake_stats.cookies_accepted++;
     // Use the usec_per_pkt value provided by the server.
     SessionMap::iterator it = s->NewSession(
         now + 10 * 1000, ntohl(rx->usec_per_pkt), remoteaddr, remoteaddr_len);
@@ -694,8 +1621,6 @@ void handle_server_handshake_packet(Sessions *s, Packet *rx, uint64_t now) {
 
   SessionMap::iterator it = s->session_map.begin();
   Session &session = it->second;
-  // We don't need to resend the handshake packet any more.
-  s->next_sends.pop();
 
   session.next_tx_id = 1;
   session.next_rx_id = 0;
@@ -716,8 +1641,9 @@ void handle_server_handshake_packet(Sessions *s, Packet *rx, uint64_t now) {
        rx->data.handshake.cookie_epoch);
   debug_print_hex(rx->data.handshake.cookie, sizeof(rx->data.handshake.cookie));
   session.handshake_state = Session::COOKIE_GENERATED;
+  // Send the cookie back right away, instead of at the next handshake retry.
   session.next_send = now;
-  s->next_sends.push(it);
+  s->ScheduleSend(it);
 }
 
 void handle_ack_packet(struct Session *s, uint64_t now) {
@@ -763,8 +1689,14 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
     // packet losses using sequence numbers, and send that count back to us.  We
     // do the same here for incoming packets from the remote, and send the error
     // count back to them next time we're ready to transmit.
-    fprintf(stderr, "lost %ld  expected=%ld  got=%ld\n",
-            (long)tmpdiff, (long)s->next_rx_id, (long)id);
+    if (s->telemetry) {
+      TelemetryRecord *r = s->telemetry->Add(s, TELEMETRY_LOSS, now, id);
+      r->values[0] = tmpdiff;
+      r->values[1] = s->next_rx_id;
+    } else {
+      fprintf(stderr, "lost %ld  expected=%ld  got=%ld\n",
+              (long)tmpdiff, (long)s->next_rx_id, (long)id);
+    }
     s->num_lost += tmpdiff;
     s->next_rx_id += tmpdiff + 1;
   } else if (!tmpdiff) {
@@ -772,7 +1704,12 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
     s->next_rx_id++;
   } else if (tmpdiff < 0) {
     // packet before the expected one? weird.
-    fprintf(stderr, "out-of-order packets? %ld\n", (long)tmpdiff);
+    if (s->telemetry) {
+      s->telemetry->Add(s, TELEMETRY_OUT_OF_ORDER, now, id)->values[0] =
+          tmpdiff;
+    } else {
+      fprintf(stderr, "out-of-order packets? %ld\n", (long)tmpdiff);
+    }
   }
 
   // fix up the clock offset if there's any drift.
@@ -781,8 +1718,13 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
     // packet arrived before predicted time, so prediction was based on
     // a packet that was "slow" before, or else one of our clocks is
     // drifting. Use earliest legitimate start time.
-    fprintf(stderr, "time paradox: backsliding start by %ld usec\n",
-            (long)tmpdiff);
+    if (s->telemetry) {
+      s->telemetry->Add(s, TELEMETRY_TIME_PARADOX, now, id)->values[0] =
+          tmpdiff;
+    } else {
+      fprintf(stderr, "time paradox: backsliding start by %ld usec\n",
+              (long)tmpdiff);
+    }
     s->start_rxtime = rxtime - id * s->usec_per_pkt;
   }
   int32_t rxdiff = DIFF64(rxtime, s->start_rxtime + id * s->usec_per_pkt);
@@ -866,8 +1808,13 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
   if (rxdiff < s->min_cycle_rxdiff) s->min_cycle_rxdiff = rxdiff;
   if (DIFF(now, s->next_cycle) >= 0) {
     if (s->min_cycle_rxdiff > 0) {
-      fprintf(stderr, "clock skew: sliding start by %ld usec\n",
-              (long)s->min_cycle_rxdiff);
+      if (s->telemetry) {
+        s->telemetry->Add(s, TELEMETRY_CLOCK_SKEW, now, id)->values[0] =
+            s->min_cycle_rxdiff;
+      } else {
+        fprintf(stderr, "clock skew: sliding start by %ld usec\n",
+                (long)s->min_cycle_rxdiff);
+      }
       s->start_rxtime += s->min_cycle_rxdiff;
     }
     s->min_cycle_rxdiff = 0x7fffffff;
@@ -880,6 +1827,7 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
   s->next_txack_index = (s->next_txack_index + 1) % ARRAY_LEN(s->tx.data.acks);
 
   // see which of our own transmitted packets have been acked
+  int32_t newest_txdiff = INT32_MIN;
   uint32_t first_ack = s->rx.first_ack;
   for (uint32_t i = 0; i < ARRAY_LEN(s->rx.data.acks); i++) {
     uint32_t acki = (first_ack + i) % ARRAY_LEN(s->rx.data.acks);
@@ -889,6 +1837,12 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
       // an expected ack
       uint32_t start_txtime = s->next_send - s->next_tx_id * s->usec_per_pkt;
       uint32_t txtime = start_txtime + ackid * s->usec_per_pkt;
+      // With kernel timestamps, measure from when the packet really left,
+      // so our own scheduling delays don't count as network delay.
+      int32_t lag;
+      if (s->tx_timestamps && s->tx_timestamps->Find(ackid, txtime, &lag)) {
+        txtime += lag;
+      }
       uint32_t rrxtime = ntohl(s->rx.data.acks[acki].rxtime);
       uint32_t rxtime = rrxtime + offset;
       // note: already contains 1/2 rtt, unlike rxdiff
@@ -907,6 +1861,7 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
                  txdiff / 1000.0);
       }
       s->next_rxack_id = ackid + 1;
+      newest_txdiff = txdiff;
       s->lat_tx_count++;
       s->lat_tx = txdiff;
       s->lat_tx_min = s->lat_tx_min > s->lat_tx ? s->lat_tx : s->lat_tx_min;
@@ -916,19 +1871,361 @@ void handle_ack_packet(struct Session *s, uint64_t now) {
     }
   }
 
+  if (s->telemetry && ntohl(s->rx.clockdiff)) {
+    TelemetryRecord *r = s->telemetry->Add(s, TELEMETRY_ACK, now, id);
+    r->values[0] = rxdiff + rtt / 2;
+    r->values[1] = newest_txdiff;
+    r->values[2] = rtt;
+    r->values[3] = ntohl(s->rx.num_lost);
+    r->values[4] = s->num_lost;
+  }
+
   s->last_rxtime = rxtime;
 }
 
+// Waits for one or two sockets to become readable.  On Linux this uses epoll;
+// epoll_wait() only has millisecond resolution, which would make us send
+// packets up to 1ms late, so timeouts are armed on a timerfd in the same epoll
+// set instead.
+struct Poller {
+  int sock;
+  int extrasock;
+#ifdef __linux__
+  int epfd;
+  int timerfd;
+#endif
+};
+
+static int poller_init(Poller *p, int sock, int extrasock) {
+  p->sock = sock;
+  p->extrasock = extrasock;
+#ifdef __linux__
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (p->epfd < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+  p->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (p->timerfd < 0) {
+    perror("timerfd_create");
+    close(p->epfd);
+    return 1;
+  }
+  int fds[] = { p->timerfd, sock, extrasock };
+  for (size_t i = 0; i < ARRAY_LEN(fds); i++) {
+    if (fds[i] < 0) continue;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[i];
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fds[i], &ev) != 0) {
+      perror("epoll_ctl");
+      close(p->timerfd);
+      close(p->epfd);
+      return 1;
+    }
+  }
+#endif
+  return 0;
+}
+
+static void poller_close(Poller *p) {
+#ifdef __linux__
+  close(p->timerfd);
+  close(p->epfd);
+#endif
+}
+
+// Waits up to timeout_usec (forever if negative) for the sockets.  Sets
+// *sock_ready and *extrasock_ready, and returns the number of readable
+// sockets, or -1 on error.
+static int poller_wait(Poller *p, int64_t timeout_usec, int *sock_ready,
+                       int *extrasock_ready) {
+  *sock_ready = *extrasock_ready = 0;
+#ifdef __linux__
+  int timeout_ms = 0;
+  if (timeout_usec != 0) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (timeout_usec > 0) {
+      its.it_value.tv_sec = timeout_usec / 1000000;
+      its.it_value.tv_nsec = (timeout_usec % 1000000) * 1000;
+    }
+    // A zero it_value disarms the timer, for an infinite wait.
+    if (timerfd_settime(p->timerfd, 0, &its, NULL) != 0) {
+      perror("timerfd_settime");
+      return -1;
+    }
+    timeout_ms = -1;
+  }
+  struct epoll_event events[3];
+  int n = epoll_wait(p->epfd, events, ARRAY_LEN(events), timeout_ms);
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  int nfds = 0;
+  for (int i = 0; i < n; i++) {
+    int fd = events[i].data.fd;
+    if (fd == p->timerfd) {
+      uint64_t expirations;
+      if (read(p->timerfd, &expirations, sizeof(expirations)) < 0 &&
+          errno != EAGAIN) {
+        perror("read(timerfd)");
+      }
+    } else if (fd == p->sock) {
+      *sock_ready = 1;
+      nfds++;
+    } else if (fd == p->extrasock) {
+      *extrasock_ready = 1;
+      nfds++;
+    }
+  }
+  return nfds;
+#else
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(p->sock, &rfds);
+  if (p->extrasock > 0) {
+    FD_SET(p->extrasock, &rfds);
+  }
+  struct timeval tv;
+  struct timeval *tvp = NULL;
+  if (timeout_usec >= 0) {
+    tv.tv_sec = timeout_usec / 1000000;
+    tv.tv_usec = timeout_usec % 1000000;
+    tvp = &tv;
+  }
+  int nfds = select(std::max(p->sock, p->extrasock) + 1, &rfds, NULL, NULL,
+                    tvp);
+  if (nfds < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  *sock_ready = FD_ISSET(p->sock, &rfds);
+  *extrasock_ready = p->extrasock > 0 && FD_ISSET(p->extrasock, &rfds);
+  return nfds;
+#endif
+}
+
+// Sets the packet ttl on sock.  Returns 0 on success.
+static int set_ttl(int sock) {
+  // IPPROTO_IPV6 is the only one that works on MacOS, and is arguably the
+  // technically correct thing to do since it's an AF_INET6 socket.
+  if (setsockopt(sock, IPPROTO_IPV6, IP_TTL, &ttl, sizeof(ttl))) {
+    perror("setsockopt(TTLv6)");
+    return 1;
+  }
+  // ...but in Linux (at least 3.13), IPPROTO_IPV6 does not actually
+  // set the TTL if the IPv6 socket ends up going over IPv4.  We have to
+  // set that separately.  On MacOS, that always returns EINVAL, so ignore
+  // the error if that happens.
+  if (setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl))) {
+    if (errno != EINVAL) {
+      perror("setsockopt(TTLv4)");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Creates a server socket listening on SERVER_PORT.  If reuseport is set, the
+// port can be shared with other sockets, and the kernel spreads clients across
+// them by address, so each client always reaches the same socket.  Returns -1
+// on error.
+static int open_server_socket(int reuseport) {
+  int sock = socket(PF_INET6, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (reuseport) {
+#ifdef SO_REUSEPORT
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+      perror("setsockopt(SO_REUSEPORT)");
+      close(sock);
+      return -1;
+    }
+#else
+    fprintf(stderr, "SO_REUSEPORT is not supported on this platform\n");
+    close(sock);
+    return -1;
+#endif
+  }
+  int rcvbuf = SERVER_RCVBUF;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0) {
+    // Not fatal; we'll just drop packets sooner under load.
+    perror("setsockopt(SO_RCVBUF)");
+  }
+  struct sockaddr_in6 listenaddr;
+  memset(&listenaddr, 0, sizeof(listenaddr));
+  listenaddr.sin6_family = AF_INET6;
+  listenaddr.sin6_port = htons(SERVER_PORT);
+  if (bind(sock, (struct sockaddr *)&listenaddr, sizeof(listenaddr)) != 0) {
+    perror("bind");
+    close(sock);
+    return -1;
+  }
+  socklen_t addrlen = sizeof(listenaddr);
+  if (getsockname(sock, (struct sockaddr *)&listenaddr, &addrlen) != 0) {
+    perror("getsockname");
+    close(sock);
+    return -1;
+  }
+  fprintf(stderr, "server listening at [%s]:%d\n",
+         sockaddr_to_str((struct sockaddr *)&listenaddr),
+         ntohs(listenaddr.sin6_port));
+  return sock;
+}
+
+// Opens the telemetry output named by spec: either "unix:<path>" for a
+// datagram socket that a collector is listening on, or a file to append to.
+// Returns -1 on error.
+static int open_telemetry_output(const char *spec) {
+  const char *prefix = "unix:";
+  if (!strncmp(spec, prefix, strlen(prefix))) {
+    const char *path = spec + strlen(prefix);
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "telemetry socket path too long: %s\n", path);
+      return -1;
+    }
+    strcpy(sun.sun_path, path);
+    // Non-blocking, so a slow collector costs us records, not packets.
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror("telemetry socket");
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+  int fd = open(spec, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(spec);
+  }
+  return fd;
+}
+
+// Prints the handshake counters if they've changed since *last.
+static void print_handshake_stats(const HandshakeStats &stats,
+                                  HandshakeStats *last) {
+  if (!memcmp(&stats, last, sizeof(stats))) {
+    return;
+  }
+  fprintf(stderr, "handshakes: %llu cookies sent, %llu accepted, "
+          "%llu rejected, %llu rate limited, %llu MACs\n",
+          (unsigned long long)stats.cookies_sent,
+          (unsigned long long)stats.cookies_accepted,
+          (unsigned long long)stats.cookies_rejected,
+          (unsigned long long)stats.rate_limited,
+          (unsigned long long)stats.macs);
+  *last = stats;
+}
+
+// Sends and receives packets on sock until want_to_die is set or an error
+// occurs.  Returns 0 on a clean exit.
+static int run_loop(Sessions *sessions, int sock, int extrasock,
+                    int is_server) {
+  Poller poller;
+  if (poller_init(&poller, sock, extrasock) != 0) {
+    return 1;
+  }
+  sessions->handshake_limiter.SetRate(handshakes_per_sec,
+                                      DEFAULT_HANDSHAKE_BURST);
+  HandshakeStats last_stats;
+  uint64_t next_stats_time = ustime64() + HANDSHAKE_STATS_USEC;
+  int err = 0;
+  while (!want_to_die) {
+    uint64_t now = ustime64();
+    int64_t timeout_usec = MAX_WAIT_USEC;
+    if (extrasock > 0) {
+      timeout_usec = 0;
+    } else if (sessions->next_sends.size() > 0) {
+      int64_t wait = DIFF64(sessions->next_send_time(), now);
+      timeout_usec = std::min(std::max(wait, (int64_t)0),
+                              (int64_t)MAX_WAIT_USEC);
+    }
+    int sock_ready, extrasock_ready;
+    int nfds = poller_wait(&poller, timeout_usec, &sock_ready,
+                           &extrasock_ready);
+    now = ustime64();
+    if (nfds < 0) {
+      perror("poll");
+      err = 1;
+      break;
+    }
+    if (sessions->tx_timestamps) {
+      read_tx_timestamps(sessions, sock);
+    }
+
+    // Periodically check if the cookie secrets need updating.
+    sessions->MaybeRotateCookieSecrets(now, is_server);
+    if (is_server && DIFF64(now, next_stats_time) >= 0) {
+      print_handshake_stats(sessions->handshake_stats, &last_stats);
+      next_stats_time = now + HANDSHAKE_STATS_USEC;
+    }
+    if (sessions->telemetry) {
+      sessions->telemetry->MaybeFlush(now, TELEMETRY_FLUSH_USEC);
+    }
+
+    err = send_waiting_packets(sessions, sock, now, is_server);
+    if (err != 0) {
+      break;
+    }
+
+    // Read at most one batch from each socket per loop, so that sends that
+    // come due while we're busy receiving aren't delayed too long.
+    int npackets;
+    if (sock_ready) {
+      err = read_incoming_packets(sessions, sock, is_server, &npackets);
+      if (!is_server && err == ECONNREFUSED) {
+        err = 2;
+        break;
+      }
+    }
+    if (extrasock_ready) {
+      read_incoming_packets(sessions, extrasock, is_server, &npackets);
+    }
+    err = 0;
+
+    if (extrasock > 0 && nfds == 0) {
+      DLOG("read all data from extrasock, exiting\n");
+      exit(0);
+    }
+  }
+  poller_close(&poller);
+  if (sessions->telemetry) {
+    uint64_t now = ustime64();
+    for (SessionMap::iterator it = sessions->session_map.begin();
+         it != sessions->session_map.end(); ++it) {
+      report_session_end(&it->second, now);
+    }
+    sessions->telemetry->Flush(now);
+    if (sessions->telemetry->dropped()) {
+      fprintf(stderr, "telemetry: dropped %llu records\n",
+              (unsigned long long)sessions->telemetry->dropped());
+    }
+  }
+  return err;
+}
+
 int isoping_main(int argc, char **argv, Sessions *sessions, int extrasock) {
   assert(sessions != NULL);
 
-  struct sockaddr_in6 listenaddr;
   struct addrinfo *ai = NULL;
+  int workers = 1;
+  const char *telemetry_spec = NULL;
 
   setvbuf(stdout, NULL, _IOLBF, 0);
 
   int c;
-  while ((c = getopt(argc, argv, "f:r:t:qTh?")) >= 0) {
+  while ((c = getopt(argc, argv, "f:r:t:w:H:o:KqTh?")) >= 0) {
     switch (c) {
     case 'f':
       prints_per_sec = atof(optarg);
@@ -952,6 +2249,26 @@ int isoping_main(int argc, char **argv, Sessions *sessions, int extrasock) {
         return 99;
       }
       break;
+    case 'w':
+      workers = atoi(optarg);
+      if (workers < 1) {
+        fprintf(stderr, "%s: workers must be >= 1\n", argv[0]);
+        return 99;
+      }
+      break;
+    case 'H':
+      handshakes_per_sec = atof(optarg);
+      if (handshakes_per_sec <= 0) {
+        fprintf(stderr, "%s: handshakes per sec (-H) must be > 0\n", argv[0]);
+        return 99;
+      }
+      break;
+    case 'o':
+      telemetry_spec = optarg;
+      break;
+    case 'K':
+      want_kernel_timestamps = 1;
+      break;
     case 'q':
       quiet = 1;
       break;
@@ -966,35 +2283,36 @@ int isoping_main(int argc, char **argv, Sessions *sessions, int extrasock) {
     }
   }
 
-  int sock = socket(PF_INET6, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    perror("socket");
-    return 1;
+  int telemetry_fd = -1;
+  if (telemetry_spec) {
+    telemetry_fd = open_telemetry_output(telemetry_spec);
+    if (telemetry_fd < 0) {
+      return 1;
+    }
+    sessions->telemetry = new Telemetry(telemetry_fd);
+  }
+  if (want_kernel_timestamps) {
+    sessions->tx_timestamps = new TxTimestamps();
   }
 
+  int sock = -1;
   int is_server;
   uint64_t now = ustime64();     // current time
 
   if (argc - optind == 0) {
     is_server = 1;
-    memset(&listenaddr, 0, sizeof(listenaddr));
-    listenaddr.sin6_family = AF_INET6;
-    listenaddr.sin6_port = htons(SERVER_PORT);
-    if (bind(sock, (struct sockaddr *)&listenaddr, sizeof(listenaddr)) != 0) {
-      perror("bind");
+    sock = open_server_socket(workers > 1);
+    if (sock < 0) {
       return 1;
     }
-    socklen_t addrlen = sizeof(listenaddr);
-    if (getsockname(sock, (struct sockaddr *)&listenaddr, &addrlen) != 0) {
-      perror("getsockname");
-      return 1;
-    }
-    fprintf(stderr, "server listening at [%s]:%d\n",
-           sockaddr_to_str((struct sockaddr *)&listenaddr),
-           ntohs(listenaddr.sin6_port));
   } else if (argc - optind == 1) {
     const char *remotename = argv[optind];
     is_server = 0;
+    sock = socket(PF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) {
+      perror("socket");
+      return 1;
+    }
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
@@ -1018,21 +2336,11 @@ int isoping_main(int argc, char **argv, Sessions *sessions, int extrasock) {
   }
 
   fprintf(stderr, "using ttl=%d\n", ttl);
-  // IPPROTO_IPV6 is the only one that works on MacOS, and is arguably the
-  // technically correct thing to do since it's an AF_INET6 socket.
-  if (setsockopt(sock, IPPROTO_IPV6, IP_TTL, &ttl, sizeof(ttl))) {
-    perror("setsockopt(TTLv6)");
+  if (set_ttl(sock) != 0) {
     return 1;
   }
-  // ...but in Linux (at least 3.13), IPPROTO_IPV6 does not actually
-  // set the TTL if the IPv6 socket ends up going over IPv4.  We have to
-  // set that separately.  On MacOS, that always returns EINVAL, so ignore
-  // the error if that happens.
-  if (setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl))) {
-    if (errno != EINVAL) {
-      perror("setsockopt(TTLv4)");
-      return 1;
-    }
+  if (want_kernel_timestamps && enable_kernel_timestamps(sock) != 0) {
+    return 1;
   }
 
   struct sigaction act;
@@ -1041,57 +2349,70 @@ int isoping_main(int argc, char **argv, Sessions *sessions, int extrasock) {
   act.sa_flags = SA_RESETHAND;
   sigaction(SIGINT, &act, NULL);
 
-  while (!want_to_die) {
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(sock, &rfds);
-    if (extrasock > 0) {
-      FD_SET(extrasock, &rfds);
-    }
-    struct timeval tv;
-    tv.tv_sec = 0;
-
-    now = ustime64();
-    if (sessions->next_sends.size() == 0 ||
-        DIFF(sessions->next_send_time(), now) < 0 ||
-        extrasock > 0) {
-      tv.tv_usec = 0;
-    } else {
-      tv.tv_usec = DIFF(sessions->next_send_time(), now);
+  // Each extra worker gets its own socket on the same port and its own
+  // Sessions, so workers never share state.  SO_REUSEPORT always sends a given
+  // client to the same socket, so its cookie is validated by the worker that
+  // issued it.
+  //
+  // A worker whose loop fails closes its socket straight away, so the kernel
+  // stops steering clients to it, and sets want_to_die so the rest stop too.
+  int err = 0;
+  int nworkers = is_server ? workers - 1 : 0;
+  std::vector<Sessions *> worker_sessions;
+  std::vector<int> worker_socks(nworkers, -1);
+  std::vector<int> worker_errs(nworkers, 0);
+  std::vector<std::thread> worker_threads;
+  for (int i = 0; i < nworkers; i++) {
+    int wsock = open_server_socket(1);
+    if (wsock < 0 || set_ttl(wsock) != 0 ||
+        (want_kernel_timestamps && enable_kernel_timestamps(wsock) != 0)) {
+      fprintf(stderr, "worker %d: socket setup failed\n", i + 1);
+      if (wsock >= 0) close(wsock);
+      err = 1;
+      break;
     }
-    struct timeval *tvp = NULL;
-    if (sessions->next_sends.size() > 0 || extrasock > 0) {
-      tvp = &tv;
+    Sessions *ws = new Sessions();
+    if (telemetry_fd >= 0) {
+      ws->telemetry = new Telemetry(telemetry_fd);
     }
-    int nfds = select(std::max(sock, extrasock) + 1, &rfds, NULL, NULL, tvp);
-    now = ustime64();
-    if (nfds < 0 && errno != EINTR) {
-      perror("select");
-      return 1;
-    }
-
-    // Periodically check if the cookie secrets need updating.
-    sessions->MaybeRotateCookieSecrets(now, is_server);
-
-    int err = send_waiting_packets(sessions, sock, now, is_server);
-    if (err != 0) {
-      return err;
+    if (want_kernel_timestamps) {
+      ws->tx_timestamps = new TxTimestamps();
     }
-
-    if (nfds > 0) {
-      int s = FD_ISSET(sock, &rfds) ? sock : extrasock;
-      err = read_incoming_packet(sessions, s, now, is_server);
-      if (!is_server && err == ECONNREFUSED) return 2;
-      if (err != 0) {
-        continue;
+    worker_socks[i] = wsock;
+    worker_sessions.push_back(ws);
+    int *wsockp = &worker_socks[i];
+    int *werrp = &worker_errs[i];
+    worker_threads.push_back(std::thread([ws, wsockp, werrp, i]() {
+      *werrp = run_loop(ws, *wsockp, -1, 1);
+      if (*werrp != 0) {
+        fprintf(stderr, "worker %d: exiting with error %d\n", i + 1, *werrp);
+        close(*wsockp);
+        *wsockp = -1;
+        want_to_die = 1;
       }
-    }
+    }));
+  }
 
-    if (extrasock > 0 && nfds == 0) {
-      DLOG("read all data from extrasock, exiting\n");
-      exit(0);
+  if (err == 0) {
+    err = run_loop(sessions, sock, extrasock, is_server);
+  }
+
+  if (!worker_threads.empty()) {
+    want_to_die = 1;
+    for (size_t i = 0; i < worker_threads.size(); i++) {
+      worker_threads[i].join();
+      delete worker_sessions[i]->telemetry;
+      delete worker_sessions[i]->tx_timestamps;
+      delete worker_sessions[i];
+      if (worker_socks[i] >= 0) close(worker_socks[i]);
+      if (err == 0) err = worker_errs[i];
     }
   }
+  if (err != 0) {
+    if (ai) freeaddrinfo(ai);
+    close(sock);
+    return err;
+  }
 
   // TODO(pmccurdy): Separate out per-client and global stats, print stats for
   // the server when each client disconnects.
@@ -1115,5 +2436,12 @@ int isoping_main(int argc, char **argv, Sessions *sessions, int extrasock) {
 
   if (ai) freeaddrinfo(ai);
   if (sock >= 0) close(sock);
+  delete sessions->tx_timestamps;
+  sessions->tx_timestamps = NULL;
+  if (telemetry_fd >= 0) {
+    delete sessions->telemetry;
+    sessions->telemetry = NULL;
+    close(telemetry_fd);
+  }
   return 0;
 }
@@ -16,19 +16,28 @@
 #ifndef ISOPING_H
 #define ISOPING_H
 
-#include <map>
 #include <netinet/in.h>
-#include <openssl/evp.h>
-#include <queue>
 #include <random>
 #include <stdint.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <utility>
+#include <vector>
 
-// Number of bytes required to store the cookie, which is a SHA-256 hash.
+// Number of bytes reserved for the cookie in handshake packets.
 #define COOKIE_SIZE 32
-// Number of bytes used to store the random cookie secret.
+// Number of those bytes actually used, holding a 128-bit SipHash MAC.  The rest
+// are zero.
+#define COOKIE_MAC_SIZE 16
+// Number of bytes used to store the random cookie secret, which is the
+// SipHash key.
 #define COOKIE_SECRET_SIZE 16
+// Number of token buckets used to rate limit handshakes by source prefix.
+#define HANDSHAKE_BUCKETS 4096
+// Maximum number of packets moved by a single recvmmsg()/sendmmsg() call.
+#define MAX_BATCH_PACKETS 64
+// Number of recently sent packets whose kernel transmit timestamps we keep.
+#define TX_TIMESTAMP_SLOTS 4096
 
 enum {
   PACKET_TYPE_ACK = 0,
@@ -64,6 +73,9 @@ struct Packet {
 };
 
 
+class Telemetry;
+class TxTimestamps;
+
 // Data we track per session.
 struct Session {
   Session(uint64_t first_send, uint32_t usec_per_pkt,
@@ -109,29 +121,290 @@ struct Session {
       lat_tx_count, lat_tx_sum, lat_tx_var_sum;
   long long lat_rx, lat_rx_min, lat_rx_max,
       lat_rx_count, lat_rx_sum, lat_rx_var_sum;
+  // Where to report events for this session, or NULL to print them to stderr.
+  Telemetry *telemetry;
+  // When kernel timestamps are enabled, when our packets actually left.
+  const TxTimestamps *tx_timestamps;
+};
+
+// Records how late recently sent packets actually left, according to kernel
+// transmit timestamps.  Packets are identified by their id and (scheduled)
+// txtime, which is how the ack processing refers to them too, so this works
+// without knowing which session sent each packet.  Newer packets overwrite
+// older ones that hash to the same slot.
+class TxTimestamps {
+ public:
+  TxTimestamps() : added(0) { memset(slots, 0, sizeof(slots)); }
+
+  void Add(uint32_t id, uint32_t txtime, int32_t lag);
+
+  // Returns true, and sets *lag to how many microseconds after txtime the
+  // packet was sent, if that's known.
+  bool Find(uint32_t id, uint32_t txtime, int32_t *lag) const;
+
+  uint64_t count() const { return added; }
+
+ private:
+  struct Slot {
+    uint32_t id;
+    uint32_t txtime;
+    int32_t lag;
+    uint32_t valid;
+  };
+  uint32_t SlotIndex(uint32_t id, uint32_t txtime) const;
+
+  Slot slots[TX_TIMESTAMP_SLOTS];
+  uint64_t added;
+};
+
+// Binary telemetry records, written instead of text when isoping is given an
+// output with -o.  Each record is TELEMETRY_RECORD_SIZE bytes, and all
+// integers are in host byte order, except for addr which is exactly as it
+// appears in the sockaddr.  Delays and times are in microseconds.
+#define TELEMETRY_VERSION 1
+enum {
+  // Sent first in every flushed batch, to map monotonic times to wall clock
+  // time.  addr is empty; values[0..1] are the CLOCK_REALTIME microseconds
+  // (high, low 32 bits) at the record's time.
+  TELEMETRY_SYNC = 0,
+  // A session was created.  values[0] is usec_per_pkt.
+  TELEMETRY_SESSION_START,
+  // An ack packet arrived with sequence number id.  values[]: receive delay,
+  // transmit delay of the newest packet it acked (or INT32_MIN if none), round
+  // trip time, packets the remote side has lost, packets we've lost.
+  TELEMETRY_ACK,
+  // A run of packets was lost before id.  values[]: run length, expected id.
+  TELEMETRY_LOSS,
+  // Packet id arrived out of order.  values[0] is how far behind it was.
+  TELEMETRY_OUT_OF_ORDER,
+  // Packet id arrived earlier than predicted, so the receive clock estimate
+  // was moved back by -values[0].
+  TELEMETRY_TIME_PARADOX,
+  // The receive clock estimate was moved forward by values[0] to correct for
+  // clock skew.
+  TELEMETRY_CLOCK_SKEW,
+  // A session ended.  id is the number of packets received.  values[]:
+  // transmit delay min/avg/max, receive delay min/avg/max, packets lost.
+  TELEMETRY_SESSION_END,
 };
 
-// Comparator for use with sockaddr_in and sockaddr_in6 values.  Sorts by
-// address family first, then on the IPv4/6 address, then the port number.
-struct CompareSockaddr {
-  bool operator()(const struct sockaddr_storage &lhs,
-                  const struct sockaddr_storage &rhs);
+struct TelemetryRecord {
+  uint16_t version;
+  uint16_t type;
+  uint16_t family;   // AF_INET or AF_INET6
+  uint16_t port;
+  uint8_t addr[16];  // IPv4 addresses use the first 4 bytes
+  uint64_t time;     // local monotonic time
+  uint32_t id;
+  int32_t values[7];
 };
+#define TELEMETRY_RECORD_SIZE 64
+// Records buffered per worker before they're written out.
+#define TELEMETRY_BATCH 256
+
+// Buffers telemetry records for one thread and writes them out in batches.
+// Each worker has its own Telemetry, so appending never takes a lock; several
+// Telemetry objects may share one output fd.
+class Telemetry {
+ public:
+  explicit Telemetry(int fd);
+  ~Telemetry();
+
+  // Returns a zeroed record for session s, with the header filled in.  The
+  // record is written out by a later Flush().
+  TelemetryRecord *Add(const Session *s, int type, uint64_t now, uint32_t id);
+
+  // Writes out all buffered records, if any.  If the output can't keep up,
+  // the batch is dropped and counted, rather than stalling the caller.
+  void Flush(uint64_t now);
+
+  // Flushes if the buffer has been sitting for more than max_age usec.
+  void MaybeFlush(uint64_t now, uint64_t max_age);
+
+  uint64_t dropped() const { return dropped_records; }
 
-typedef std::map<struct sockaddr_storage, Session, CompareSockaddr>
-    SessionMap;
+ private:
+  int fd;
+  int count;
+  uint64_t first_time;  // time of the oldest buffered record
+  uint64_t dropped_records;
+  TelemetryRecord records[TELEMETRY_BATCH + 1];  // +1 for the sync record
 
-// Compares the next_send values of each referenced Session, sorting the earlier
-// timestamps first.
-struct CompareNextSend {
-  bool operator()(const SessionMap::iterator &lhs,
-                  const SessionMap::iterator &rhs);
+  Telemetry(const Telemetry &);
+  void operator=(const Telemetry &);
+};
+
+// Hash table of Sessions, keyed by the peer's address family, IPv4/6 address
+// and port.  The interface is the subset of std::map that isoping needs.
+// Lookups use open addressing over a compact array of (hash, index) pairs, so
+// probing never touches the Sessions themselves.  Each Session has its own
+// allocation, so references to it stay valid until it is erased.
+class SessionMap {
+ public:
+  typedef std::pair<struct sockaddr_storage, Session> value_type;
+
+  class iterator {
+   public:
+    iterator() : map(NULL), idx(0) {}
+    iterator(SessionMap *map, uint32_t idx) : map(map), idx(idx) {}
+    value_type &operator*() const { return *map->nodes[idx]; }
+    value_type *operator->() const { return map->nodes[idx]; }
+    iterator &operator++() {
+      idx = map->NextUsed(idx + 1);
+      return *this;
+    }
+    bool operator==(const iterator &other) const { return idx == other.idx; }
+    bool operator!=(const iterator &other) const { return idx != other.idx; }
+    // A small integer identifying this Session, stable for its lifetime.
+    uint32_t index() const { return idx; }
+
+   private:
+    SessionMap *map;
+    uint32_t idx;
+  };
+
+  SessionMap();
+  ~SessionMap();
+
+  size_t size() const { return count; }
+  iterator begin() { return iterator(this, NextUsed(0)); }
+  iterator end() { return iterator(this, nodes.size()); }
+  iterator from_index(uint32_t index) { return iterator(this, index); }
+  iterator find(const struct sockaddr_storage &addr);
+  // Like std::map::insert, does nothing if the key is already present.
+  std::pair<iterator, bool> insert(const value_type &value);
+  size_t erase(const struct sockaddr_storage &addr);
+  void erase(iterator it);
+
+ private:
+  struct Slot {
+    uint32_t hash;
+    uint32_t index;  // into nodes, or EMPTY_SLOT
+  };
+
+  uint32_t Hash(const struct sockaddr_storage &addr) const;
+  // Returns the position in slots holding addr, or of the empty slot where it
+  // would go.
+  uint32_t Probe(const struct sockaddr_storage &addr, uint32_t hash) const;
+  uint32_t NextUsed(uint32_t index) const;
+  void Grow();
+
+  std::vector<value_type *> nodes;  // NULL for unused indexes
+  std::vector<uint32_t> free_indexes;
+  std::vector<Slot> slots;          // size is a power of 2
+  size_t count;
+  uint64_t seed;
+
+  SessionMap(const SessionMap &);
+  void operator=(const SessionMap &);
+};
+
+// Hierarchical timing wheel of upcoming send times, holding Sessions by
+// SessionMap::iterator::index().  Scheduling, cancelling and popping a due
+// Session are O(1) no matter how many Sessions there are.  Each level has
+// WHEEL_SLOTS slots; a level 0 slot covers one tick, and each slot on the next
+// level up covers a whole turn of the level below.  Entries keep their exact
+// send time, so the tick size only affects bucketing, never when a packet is
+// sent.
+#define WHEEL_TICK_SHIFT 6  // 64us per tick
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_LEVELS 5      // 2^30 ticks, about 19 hours
+
+class SendWheel {
+ public:
+  SendWheel();
+
+  size_t size() const { return count; }
+  // Schedules index to be sent at time when, replacing any earlier schedule.
+  void Schedule(uint32_t index, uint64_t when);
+  // Removes index from the wheel, if it is there.
+  void Cancel(uint32_t index);
+  // Removes an entry whose send time is <= now and stores it in *index.
+  // Returns false if nothing is due yet.
+  bool PopDue(uint64_t now, uint32_t *index);
+  // Returns the earliest scheduled send time, or 0 if nothing is scheduled.
+  uint64_t NextTime() const;
+
+ private:
+  void Insert(uint32_t index, uint64_t tick);
+  void Link(uint32_t index, int level, int slot);
+  void Unlink(uint32_t index);
+  void Advance(uint64_t now_tick);
+  void Cascade(int level, int slot);
+  // Returns the first tick after current_tick at which a nonempty slot on
+  // level comes up, or 0 if the level is empty.
+  uint64_t NextSlotTick(int level) const;
+  uint64_t MinTimeInList(uint32_t head) const;
+
+  // Per-index state, grown on demand.
+  std::vector<uint64_t> when;
+  std::vector<uint32_t> next, prev;
+  std::vector<uint8_t> level_of, slot_of;
+
+  uint32_t heads[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_LEVELS];  // bitmap of nonempty slots per level
+  uint32_t due_head;                // entries already known to be due
+  uint64_t current_tick;
+  size_t count;
+};
+
+// Server packets that are due to be sent, waiting to be flushed to the socket
+// with as few syscalls as possible.  Each entry is a copy of a Session's tx
+// buffer, so the Session may be deleted before the batch is flushed.
+struct PacketBatch {
+  PacketBatch() : count(0) {}
+  int count;
+  Packet packets[MAX_BATCH_PACKETS];
+  struct sockaddr_storage addrs[MAX_BATCH_PACKETS];
+  socklen_t addr_lens[MAX_BATCH_PACKETS];
+};
+
+// SipHash-2-4 state after absorbing the key.  Computed once per cookie epoch,
+// so that each handshake only pays for the message rounds.
+struct CookieKey {
+  uint64_t v[4];
+};
+
+// Limits how often each source prefix (a /24 for IPv4, /56 for IPv6) can make
+// the server do handshake work, using one GCRA bucket per prefix.  Prefixes
+// are hashed into a fixed table, so spraying addresses can't make us allocate
+// memory; colliding prefixes just share a budget.  Established sessions never
+// go through the limiter.
+class HandshakeLimiter {
+ public:
+  HandshakeLimiter();
+
+  // Sets the sustained handshake rate allowed per prefix, and how many
+  // handshakes a prefix may send in a burst.
+  void SetRate(double per_sec, double burst);
+
+  // Returns true if a handshake from addr at time now is within its budget,
+  // and charges it for one.
+  bool Allow(const struct sockaddr_storage &addr, uint64_t now);
+
+ private:
+  uint64_t interval_usec;
+  uint64_t burst_usec;
+  uint64_t seed;
+  // Theoretical arrival time of the next conforming handshake, per bucket.
+  uint64_t tat[HANDSHAKE_BUCKETS];
+};
+
+// Counters describing how much handshake work the server has done.
+struct HandshakeStats {
+  HandshakeStats() { memset(this, 0, sizeof(*this)); }
+  uint64_t cookies_sent;      // handshake replies carrying a fresh cookie
+  uint64_t cookies_accepted;  // valid cookies that created a session
+  uint64_t cookies_rejected;  // invalid or expired cookies
+  uint64_t rate_limited;      // packets dropped by the handshake limiter
+  uint64_t macs;              // cookie MAC computations
 };
 
 class Sessions {
  public:
   Sessions();
-  ~Sessions();
+  virtual ~Sessions();
 
   // Rotates the cookie secrets if they haven't been changed in a while.
   virtual void MaybeRotateCookieSecrets(uint64_t now, int is_server);
@@ -155,35 +428,56 @@ class Sessions {
                                   struct sockaddr_storage *addr,
                                   socklen_t addr_len);
 
+  // (Re)schedules the session's next packet for its next_send time.
+  void ScheduleSend(SessionMap::iterator it) {
+    next_sends.Schedule(it.index(), it->second.next_send);
+  }
+
+  // Forgets the session entirely, including any pending send.
+  void EraseSession(SessionMap::iterator it) {
+    next_sends.Cancel(it.index());
+    session_map.erase(it);
+  }
+
   uint64_t next_send_time() {
-    if (next_sends.size() == 0) {
-      return 0;
-    }
-    return next_sends.top()->second.next_send;
+    return next_sends.NextTime();
   }
 
   // All active sessions, indexed by remote address/port.
   SessionMap session_map;
-  // A queue of upcoming send times, ordered most recent first, referencing
-  // entries in the session map.
-  std::priority_queue<SessionMap::iterator, std::vector<SessionMap::iterator>,
-      CompareNextSend> next_sends;
+  // Upcoming send times, referencing entries in the session map.
+  SendWheel next_sends;
+  // If not NULL, new sessions report events here.
+  Telemetry *telemetry;
+  // If not NULL, kernel timestamps are enabled on our socket, and transmit
+  // timestamps are recorded here.
+  TxTimestamps *tx_timestamps;
+  // Server-only: rate limits handshakes from unknown clients.
+  HandshakeLimiter handshake_limiter;
+  HandshakeStats handshake_stats;
+  // Outgoing server packets not yet handed to the kernel.
+  PacketBatch tx_batch;
 
  protected:
   void NewRandomCookieSecret();
+  // Recomputes cookie_key and prev_cookie_key.  Must be called whenever
+  // cookie_secret or prev_cookie_secret change.
+  void UpdateCookieKeys();
+  bool CalculateCookieWithKey(Packet *p, struct sockaddr_storage *remoteaddr,
+                              const CookieKey &key);
   bool CalculateCookieWithSecret(Packet *p, struct sockaddr_storage *remoteaddr,
                                  size_t remoteaddr_len, unsigned char *secret,
                                  size_t secret_len);
 
   // Fields required for calculating and verifying cookies.
-  EVP_MD_CTX digest_context;
-  const EVP_MD *md;
   std::mt19937_64 rng;
   uint32_t cookie_epoch;
   uint32_t last_secret_update_time;
   unsigned char cookie_secret[COOKIE_SECRET_SIZE];
   uint32_t prev_cookie_epoch;
   unsigned char prev_cookie_secret[COOKIE_SECRET_SIZE];
+  CookieKey cookie_key;
+  CookieKey prev_cookie_key;
 };
 
 // Process an incoming packet from the socket.
@@ -215,10 +509,33 @@ int send_waiting_packets(Sessions *s, int sock, uint64_t now, int is_server);
 // Sends a packet from the given session to the given socket immediately.
 int send_packet(struct Session *s, int sock, int is_server);
 
+// Server-only: appends a copy of session->tx to s->tx_batch, flushing the batch
+// first if it is full.
+void queue_packet(Sessions *s, struct Session *session, int sock);
+
+// Sends every packet in s->tx_batch to sock.  Returns the number of packets
+// handed to the kernel.
+int flush_packets(Sessions *s, int sock);
+
 // Reads a packet from sock and stores it in s->rx.  Assumes a packet is
 // currently readable.
 int read_incoming_packet(Sessions *s, int sock, uint64_t now, int is_server);
 
+// Reads up to MAX_BATCH_PACKETS packets already queued on sock, without
+// blocking, and processes each of them with the time they were read (or, with
+// kernel timestamps, the time they arrived).  Stores the number of packets
+// read in *npackets.  Returns 0 on success (including when nothing was
+// waiting), or the errno value if the socket itself reported an error.
+int read_incoming_packets(Sessions *s, int sock, int is_server, int *npackets);
+
+// Turns on kernel (and, if the NIC is configured for it, hardware) receive and
+// transmit timestamps for sock.  Returns 0 on success.
+int enable_kernel_timestamps(int sock);
+
+// Reads the transmit timestamps queued on sock's error queue, and records them
+// in s->tx_timestamps.  Returns the number of timestamps read.
+int read_tx_timestamps(Sessions *s, int sock);
+
 // Sets the global packets_per_sec value.  Used for test purposes only.
 void set_packets_per_sec(double new_pps);
 
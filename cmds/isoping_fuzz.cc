@@ -40,6 +40,7 @@ class DeterministicSessions : public Sessions {
     memset(&cookie_secret, 0, sizeof(cookie_secret));
     prev_cookie_secret[0] = 1;
     cookie_secret[0] = 2;
+    UpdateCookieKeys();
   }
   ~DeterministicSessions() {}
 
@@ -16,7 +16,9 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <map>
 #include <memory.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -702,9 +704,12 @@ WVTEST_MAIN("Send and receive on sockets") {
   WVPASSEQ(s.session_map.size(), 1);
   WVPASSEQ(s.next_sends.size(), 1);
   WVPASSEQ(s.next_send_time(), sbase + t + 10 * 1000);
-  WVPASSEQ(cSession.next_tx_id, sSession.next_rx_id);
+  // The old sSession was deleted when the client timed out; look up the new
+  // one.
+  Session &sSession2 = s.session_map.begin()->second;
+  WVPASSEQ(cSession.next_tx_id, sSession2.next_rx_id);
   WVPASSEQ(cSession.next_rx_id, 0);
-  WVPASSEQ(sSession.next_tx_id, 1);
+  WVPASSEQ(sSession2.next_tx_id, 1);
 
   // Cleanup
   close(ssock);
@@ -713,6 +718,114 @@ WVTEST_MAIN("Send and receive on sockets") {
   freeaddrinfo(res);
 }
 
+// Returns the same clock isoping uses internally.
+static uint64_t test_ustime64() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Returns how many packets are waiting on sock, consuming them.
+static int drain_socket(int sock) {
+  Packet p;
+  int count = 0;
+  while (recv(sock, &p, sizeof(p), MSG_DONTWAIT) == sizeof(p)) {
+    count++;
+  }
+  return count;
+}
+
+WVTEST_MAIN("Batched send and receive") {
+  int ssock, csock;
+  struct sockaddr_storage listenaddr;
+  socklen_t listenaddr_len = sizeof(listenaddr);
+  struct addrinfo *res;
+  if (!create_local_socketpair(&listenaddr, listenaddr_len, &csock, &ssock,
+                               &res)) {
+    return;
+  }
+  int c2sock = create_client_socket(&listenaddr, listenaddr_len, res);
+
+  // read_incoming_packets() reads the clock itself, so this test runs in real
+  // time.
+  int is_server = 1;
+  int is_client = 0;
+  uint32_t usec_per_pkt = 100 * 1000;
+  uint64_t now = test_ustime64();
+  Sessions s, c, c2;
+  s.MaybeRotateCookieSecrets(now, is_server);
+  c.NewSession(now, usec_per_pkt, &listenaddr, listenaddr_len);
+  c2.NewSession(now, usec_per_pkt, &listenaddr, listenaddr_len);
+  Session &cSession = c.session_map.begin()->second;
+  Session &c2Session = c2.session_map.begin()->second;
+
+  // Both handshakes are read in one batch, and each client gets a cookie.
+  int npackets;
+  WVPASS(!send_waiting_packets(&c, csock, now, is_client));
+  WVPASS(!send_waiting_packets(&c2, c2sock, now, is_client));
+  WVPASS(!read_incoming_packets(&s, ssock, is_server, &npackets));
+  WVPASSEQ(npackets, 2);
+  WVPASSEQ(s.session_map.size(), 0);
+  WVPASS(!read_incoming_packets(&c, csock, is_client, &npackets));
+  WVPASSEQ(npackets, 1);
+  WVPASS(!read_incoming_packets(&c2, c2sock, is_client, &npackets));
+  WVPASSEQ(npackets, 1);
+
+  // Nothing more to read.
+  WVPASS(!read_incoming_packets(&s, ssock, is_server, &npackets));
+  WVPASSEQ(npackets, 0);
+
+  // The first data packets establish both sessions on the server, stamped
+  // with the time they were read rather than a time passed in.
+  now = test_ustime64();
+  WVPASS(!send_waiting_packets(&c, csock, now, is_client));
+  WVPASS(!send_waiting_packets(&c2, c2sock, now, is_client));
+  uint64_t before = test_ustime64();
+  WVPASS(!read_incoming_packets(&s, ssock, is_server, &npackets));
+  uint64_t after = test_ustime64();
+  WVPASSEQ(npackets, 2);
+  WVPASSEQ(s.session_map.size(), 2);
+  for (SessionMap::iterator it = s.session_map.begin();
+       it != s.session_map.end(); ++it) {
+    WVPASS((int32_t)(it->second.last_rxtime - (uint32_t)before) >= 0);
+    WVPASS((int32_t)((uint32_t)after - it->second.last_rxtime) >= 0);
+  }
+
+  // Queued packets wait for flush_packets(), then all go out at once.
+  for (SessionMap::iterator it = s.session_map.begin();
+       it != s.session_map.end(); ++it) {
+    prepare_tx_packet(&it->second);
+    queue_packet(&s, &it->second, ssock);
+  }
+  WVPASSEQ(s.tx_batch.count, 2);
+  Packet p;
+  WVPASSEQ(recv(csock, &p, sizeof(p), MSG_DONTWAIT), -1);
+  WVPASSEQ(flush_packets(&s, ssock), 2);
+  WVPASSEQ(s.tx_batch.count, 0);
+  WVPASS(!read_incoming_packets(&c, csock, is_client, &npackets));
+  WVPASSEQ(npackets, 1);
+  WVPASSEQ(cSession.lat_rx_count, 1);
+  WVPASS(!read_incoming_packets(&c2, c2sock, is_client, &npackets));
+  WVPASSEQ(npackets, 1);
+  WVPASSEQ(c2Session.lat_rx_count, 1);
+
+  // A full batch is flushed before another packet is queued.
+  Session &sSession = s.session_map.begin()->second;
+  for (int i = 0; i < MAX_BATCH_PACKETS + 1; i++) {
+    prepare_tx_packet(&sSession);
+    queue_packet(&s, &sSession, ssock);
+  }
+  WVPASSEQ(s.tx_batch.count, 1);
+  WVPASSEQ(drain_socket(csock) + drain_socket(c2sock), MAX_BATCH_PACKETS);
+  WVPASSEQ(flush_packets(&s, ssock), 1);
+  WVPASSEQ(drain_socket(csock) + drain_socket(c2sock), 1);
+
+  close(ssock);
+  close(csock);
+  close(c2sock);
+  freeaddrinfo(res);
+}
+
 WVTEST_MAIN("Cookie Validation") {
   struct addrinfo hints, *res;
 
@@ -1010,3 +1123,285 @@ WVTEST_MAIN("sending packets when time rolls over 32 bits") {
   close(c2sock);
   freeaddrinfo(res);
 }
+
+static struct sockaddr_storage make_addr(int family, uint32_t host,
+                                         uint16_t port) {
+  struct sockaddr_storage ss;
+  memset(&ss, 0, sizeof(ss));
+  ss.ss_family = family;
+  if (family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    sin->sin_addr.s_addr = htonl(host);
+    sin->sin_port = htons(port);
+  } else {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+    memcpy(&sin6->sin6_addr.s6_addr[12], &host, sizeof(host));
+    sin6->sin6_port = htons(port);
+  }
+  return ss;
+}
+
+WVTEST_MAIN("SessionMap lookups") {
+  SessionMap m;
+  std::vector<Session *> sessions;
+  // Same host and port in different families, and many ports per host, to
+  // make sure the whole key is compared.
+  int failed_inserts = 0;
+  for (int i = 0; i < 2000; i++) {
+    int family = i % 2 ? AF_INET : AF_INET6;
+    struct sockaddr_storage addr = make_addr(family, i / 20, i / 2);
+    std::pair<SessionMap::iterator, bool> p = m.insert(
+        std::make_pair(addr, Session(i, 1000, addr, sizeof(addr))));
+    if (!p.second) failed_inserts++;
+    sessions.push_back(&p.first->second);
+  }
+  WVPASSEQ(failed_inserts, 0);
+  WVPASSEQ(m.size(), 2000);
+
+  int misses = 0;
+  for (int i = 0; i < 2000; i++) {
+    int family = i % 2 ? AF_INET : AF_INET6;
+    SessionMap::iterator it = m.find(make_addr(family, i / 20, i / 2));
+    if (it == m.end() || &it->second != sessions[i] ||
+        it->second.next_send != (uint64_t)i) {
+      misses++;
+    }
+  }
+  WVPASSEQ(misses, 0);
+  WVPASS(m.find(make_addr(AF_INET, 5000, 1)) == m.end());
+
+  // Inserting an existing key returns the original entry.
+  struct sockaddr_storage addr = make_addr(AF_INET, 0, 0);
+  std::pair<SessionMap::iterator, bool> p = m.insert(
+      std::make_pair(addr, Session(12345, 1000, addr, sizeof(addr))));
+  WVPASS(!p.second);
+  WVPASSEQ(p.first->second.next_send, 1);
+
+  // Erase every third entry, then make sure the rest are still reachable
+  // through the shifted probe chains.
+  size_t erased = 0;
+  for (int i = 0; i < 2000; i += 3) {
+    int family = i % 2 ? AF_INET : AF_INET6;
+    erased += m.erase(make_addr(family, i / 20, i / 2));
+  }
+  WVPASSEQ(erased, 667);
+  WVPASSEQ(m.size(), 2000 - 667);
+  misses = 0;
+  for (int i = 0; i < 2000; i++) {
+    int family = i % 2 ? AF_INET : AF_INET6;
+    SessionMap::iterator it = m.find(make_addr(family, i / 20, i / 2));
+    bool want = i % 3 != 0;
+    if ((it != m.end()) != want || (want && &it->second != sessions[i])) {
+      misses++;
+    }
+  }
+  WVPASSEQ(misses, 0);
+
+  size_t n = 0;
+  for (SessionMap::iterator it = m.begin(); it != m.end(); ++it) {
+    n++;
+  }
+  WVPASSEQ(n, m.size());
+}
+
+WVTEST_MAIN("SendWheel ordering") {
+  SendWheel w;
+  std::mt19937_64 rng(1);
+  std::map<uint32_t, uint64_t> expected;
+  uint64_t now = 4294000000ULL;  // just below a 32-bit wraparound
+
+  WVPASSEQ(w.NextTime(), 0);
+  // A mix of near and far deadlines, including ones far beyond the end of
+  // the wheel.
+  for (uint32_t i = 0; i < 1000; i++) {
+    uint64_t delay = rng() % (i % 10 == 0 ? 100000000000ULL : 5000000);
+    expected[i] = now + delay;
+    w.Schedule(i, now + delay);
+  }
+  // Rescheduling and cancelling don't leave stale entries behind.
+  for (uint32_t i = 0; i < 1000; i += 7) {
+    expected[i] = now + 1000 + i;
+    w.Schedule(i, now + 1000 + i);
+  }
+  for (uint32_t i = 3; i < 1000; i += 11) {
+    expected.erase(i);
+    w.Cancel(i);
+  }
+  WVPASSEQ(w.size(), expected.size());
+
+  int early = 0, late = 0, wrong_next = 0;
+  while (!expected.empty()) {
+    uint64_t want_next = UINT64_MAX;
+    for (std::map<uint32_t, uint64_t>::iterator it = expected.begin();
+         it != expected.end(); ++it) {
+      want_next = std::min(want_next, it->second);
+    }
+    if (w.NextTime() != want_next) wrong_next++;
+
+    // Jump ahead by a random amount, or straight to the next deadline.
+    now = rng() % 2 ? want_next : now + rng() % 3000000;
+    uint32_t index;
+    while (w.PopDue(now, &index)) {
+      if (expected[index] > now) early++;
+      expected.erase(index);
+    }
+    for (std::map<uint32_t, uint64_t>::iterator it = expected.begin();
+         it != expected.end(); ++it) {
+      if (it->second <= now) late++;
+    }
+  }
+  WVPASSEQ(wrong_next, 0);
+  WVPASSEQ(early, 0);
+  WVPASSEQ(late, 0);
+  WVPASSEQ(w.size(), 0);
+  WVPASSEQ(w.NextTime(), 0);
+}
+
+WVTEST_MAIN("Handshake rate limiting") {
+  HandshakeLimiter limiter;
+  limiter.SetRate(10, 5);
+  uint64_t now = 1000 * 1000;
+
+  // A burst is allowed, then the prefix must wait for its budget to refill.
+  struct sockaddr_storage a = make_addr(AF_INET, 0x0a000001, 1000);
+  int allowed = 0;
+  for (int i = 0; i < 20; i++) {
+    allowed += limiter.Allow(a, now);
+  }
+  WVPASSEQ(allowed, 5);
+
+  // Other hosts and ports in the same /24 share the budget...
+  WVFAIL(limiter.Allow(make_addr(AF_INET, 0x0a0000fe, 2000), now));
+  // ...but other prefixes have their own.
+  WVPASS(limiter.Allow(make_addr(AF_INET, 0x0a000101, 1000), now));
+
+  // IPv4 clients of a dual-stack socket show up as v4-mapped IPv6 addresses,
+  // and are grouped the same way.
+  struct sockaddr_storage mapped;
+  memset(&mapped, 0, sizeof(mapped));
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&mapped;
+  sin6->sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "::ffff:10.0.0.77", &sin6->sin6_addr);
+  WVFAIL(limiter.Allow(mapped, now));
+
+  // After 100ms one more handshake fits, and after a long pause the full
+  // burst is available again.
+  WVPASS(limiter.Allow(a, now + 100 * 1000));
+  WVFAIL(limiter.Allow(a, now + 100 * 1000));
+  allowed = 0;
+  for (int i = 0; i < 20; i++) {
+    allowed += limiter.Allow(a, now + 60 * 1000 * 1000);
+  }
+  WVPASSEQ(allowed, 5);
+}
+
+WVTEST_MAIN("Telemetry records") {
+  int fds[2];
+  WVPASS(!pipe(fds));
+  Telemetry telemetry(fds[1]);
+
+  uint64_t cbase = 400 * 1000;
+  uint64_t sbase = 600 * 1000;
+  uint32_t latency = 20 * 1000;
+  struct sockaddr_storage caddr = make_addr(AF_INET, 0x0a000001, 1000);
+  struct sockaddr_storage saddr = make_addr(AF_INET, 0x0a000002, 4948);
+  struct Session c(cbase, 100 * 1000, saddr, sizeof(saddr));
+  struct Session s(sbase, 100 * 1000, caddr, sizeof(caddr));
+  c.handshake_state = Session::ESTABLISHED;
+  s.handshake_state = Session::ESTABLISHED;
+  c.telemetry = &telemetry;
+
+  send_next_ack_packet(&c, cbase, &s, sbase, latency);
+  send_next_ack_packet(&s, sbase, &c, cbase, latency);
+  send_next_ack_packet(&c, cbase, &s, sbase, latency);
+
+  // Lose two server->client packets; the client notices at the next one.
+  s.next_send += 2 * s.usec_per_pkt;
+  s.next_tx_id += 2;
+  send_next_ack_packet(&s, sbase, &c, cbase, latency);
+  WVPASSEQ(c.num_lost, 2);
+
+  // Nothing is written until the batch is flushed.
+  telemetry.MaybeFlush(cbase, 1000 * 1000 * 1000);
+  WVPASS(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+  TelemetryRecord recs[8];
+  WVPASSEQ(read(fds[0], recs, sizeof(recs)), -1);
+
+  telemetry.Flush(cbase);
+  ssize_t len = read(fds[0], recs, sizeof(recs));
+  WVPASSEQ(len % TELEMETRY_RECORD_SIZE, 0);
+  int n = len / TELEMETRY_RECORD_SIZE;
+  WVPASS(n >= 2);
+  WVPASSEQ(recs[0].version, TELEMETRY_VERSION);
+  WVPASSEQ(recs[0].type, TELEMETRY_SYNC);
+
+  int losses = 0;
+  for (int i = 1; i < n; i++) {
+    WVPASSEQ(recs[i].family, AF_INET);
+    WVPASSEQ(recs[i].port, 4948);
+    if (recs[i].type == TELEMETRY_LOSS) {
+      losses++;
+      WVPASSEQ(recs[i].id, 4);
+      WVPASSEQ(recs[i].values[0], 2);
+      WVPASSEQ(recs[i].values[1], 2);
+    }
+  }
+  WVPASSEQ(losses, 1);
+  WVPASSEQ(telemetry.dropped(), 0);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+WVTEST_MAIN("Kernel transmit timestamps") {
+  TxTimestamps stamps;
+  int32_t lag;
+  WVFAIL(stamps.Find(0, 0, &lag));
+  stamps.Add(7, 1000, 25);
+  WVPASS(stamps.Find(7, 1000, &lag));
+  WVPASSEQ(lag, 25);
+  // The same id at a different time is a different packet.
+  WVFAIL(stamps.Find(7, 2000, &lag));
+
+#ifdef __linux__
+  int ssock, csock;
+  struct sockaddr_storage listenaddr;
+  socklen_t listenaddr_len = sizeof(listenaddr);
+  struct addrinfo *res;
+  if (!create_local_socketpair(&listenaddr, listenaddr_len, &csock, &ssock,
+                               &res)) {
+    return;
+  }
+  WVPASSEQ(enable_kernel_timestamps(csock), 0);
+
+  Sessions c;
+  c.tx_timestamps = new TxTimestamps();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  uint64_t now = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+  c.NewSession(now, 100 * 1000, &listenaddr, listenaddr_len);
+  Session &cSession = c.session_map.begin()->second;
+  WVPASS(cSession.tx_timestamps == c.tx_timestamps);
+  WVPASS(!send_waiting_packets(&c, csock, now, 0));
+
+  // The timestamp is queued as soon as the packet leaves, but give the kernel
+  // a moment anyway.
+  int got = 0;
+  for (int i = 0; i < 100 && !got; i++) {
+    got = read_tx_timestamps(&c, csock);
+    if (!got) usleep(1000);
+  }
+  WVPASSEQ(got, 1);
+  WVPASS(c.tx_timestamps->Find(ntohl(cSession.tx.id),
+                               ntohl(cSession.tx.txtime), &lag));
+  // It can't have left before it was scheduled, and it left right away.
+  WVPASS(lag >= 0);
+  WVPASS(lag < 1000 * 1000);
+
+  delete c.tx_timestamps;
+  c.tx_timestamps = NULL;
+  freeaddrinfo(res);
+  close(csock);
+  close(ssock);
+#endif
+}
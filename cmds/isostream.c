@@ -29,6 +29,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,18 +38,26 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #define MAGIC 0x424c4f50                  // magic number for Request packets
 #define SERVER_PORT 4947                  // port number to listen on
 #define BUFSIZE (1024*1024)               // maximum chunk size to read/write
 #define MIN_PERIODS_PER_SEC 10            // minimum chunks per sec to write
 #define DROPOUT_MIN_USEC  (100*1000)      // print any dropout longer than this
 #define CLOCK_RESET_USEC  (50*1000)       // ignore clock jumps more than this
-#define MAX_CHILDREN 8                    // limit to this many connections
-#define MAX_MBITS    1000                 // max speed per connection
+#define DEFAULT_CONNECTIONS 64            // default limit on connections
+#define MAX_CONNECTIONS 1024              // limit to this many connections
+#define MAX_MBITS    20000                // max speed per connection
+#define MAX_CHUNK    65536                // max bytes per period at low rates
+#define REQUEST_TIMEOUT_USEC (10*1000*1000) // drop clients that don't ask
+#define PACING_HEADROOM_PCT 200           // kernel pacing rate, % of goal
+#define DROP_BUCKETS (4*40)               // dropout histogram size
 
 #define _STR(n) #n
 #define STR(n) _STR(n)
@@ -65,13 +75,21 @@ struct Request {
 
 char buf[BUFSIZE];
 int want_to_die;
+int want_report;
 
 
+#ifndef UNIT_TESTS
 static void sighandler_die(int sig) {
   want_to_die = 1;
 }
 
 
+static void sighandler_report(int sig) {
+  want_report = 1;
+}
+#endif  /* UNIT_TESTS */
+
+
 // Returns the kernel monotonic timestamp in microseconds.
 // This function never returns the value 0; it returns 1 instead, so that
 // 0 can be used as a magic value.
@@ -99,6 +117,7 @@ static long long monotime(void) {
 #endif
 
 
+#ifndef UNIT_TESTS
 static void usage_and_die(char *argv0) {
   fprintf(stderr,
           "\n"
@@ -107,15 +126,18 @@ static void usage_and_die(char *argv0) {
           "\n"
           "Server specific:\n"
           "      -P <number>     limit to this many parallel connections\n"
+          "                      (default=%d)\n"
           "      -C <algo>       override TCP congestion control algorithm\n"
           "Client specific:\n"
           "      -b <Mbits/sec>  Mbits per second\n"
           "      -I <interface>  set source interface to specified interface\n"
           "      -s <number>     consider test sufficient after <number> seconds connected\n"
-          "      -t <number>     maximum time in seconds to run for\n",
-          argv0, argv0);
+          "      -t <number>     maximum time in seconds to run for\n"
+          "                      (SIGUSR1 prints the dropout report so far)\n",
+          argv0, argv0, DEFAULT_CONNECTIONS);
   exit(99);
 }
+#endif  /* UNIT_TESTS */
 
 
 // Render the given sockaddr as a string.  (Uses a static internal buffer
@@ -179,87 +201,460 @@ static int do_select(int sock, long long usec_timeout) {
 }
 
 
-void run_server(int conn, struct sockaddr_in6 *remoteaddr,
-                socklen_t remoteaddr_len) {
-  fprintf(stderr, "incoming connection from %s\n",
-          sockaddr_to_str((struct sockaddr *)remoteaddr));
-
+// Server-side state of one client connection.
+struct Flow {
+  int fd;
+  struct sockaddr_in6 remoteaddr;
   struct Request req;
-  ssize_t len = read(conn, &req, sizeof(req));
+  int req_len;                // bytes of req received so far
+  long long accept_time;
+  long megabits_per_sec;      // 0 until the request has arrived
+  long long chunk;            // don't bother writing less than this
+  long long start;            // time the schedule started
+  long long total;            // bytes sent so far
+  off_t offset;               // where the next write starts in the payload
+  int blocked;                // socket buffer was full on the last write
+
+  // Stalls: times when the socket wouldn't take data as fast as the schedule
+  // required, so the client must have fallen behind too.
+  long long stall_start, stall_depth;
+  long long stall_count, stall_maxlength, stall_maxdepth;
+};
+
+struct Flow flows[MAX_CONNECTIONS];
+int payload_fd = -1;
+
+
+// Creates a file holding the contents of buf, so that every flow can
+// sendfile() from the same page cache pages instead of copying buf into each
+// socket.  Returns -1 if that's not possible, in which case we write() buf.
+static int open_payload_file(void) {
+#ifdef __linux__
+  char path[] = "/tmp/isostream.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return -1;
+  }
+  unlink(path);
+  if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+    perror("write(payload)");
+    close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+
+// Asks the kernel to pace the flow's packets (TCP internal pacing, or the fq
+// qdisc), so each chunk we write goes out evenly spaced rather than as a
+// line-rate burst.  We still decide how many bytes go out when; the pacing
+// rate has some headroom so that it only smooths, and lets us catch up after
+// a stall.
+static void set_pacing_rate(struct Flow *f) {
+#ifdef SO_MAX_PACING_RATE
+  long long bytes_per_sec = f->megabits_per_sec * 1000000LL / 8
+      * PACING_HEADROOM_PCT / 100;
+  unsigned int rate = bytes_per_sec > 0xffffffffLL
+      ? 0xffffffff : bytes_per_sec;
+  if (setsockopt(f->fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                 &rate, sizeof(rate)) != 0) {
+    perror("setsockopt(SO_MAX_PACING_RATE)");
+  }
+#endif
+}
+
+
+static void flow_close(struct Flow *f, long long now) {
+  double secs = f->start ? (now - f->start) / 1e6 : 0;
+  fprintf(stderr, "client %s disconnected: %.1f MB in %.1fs (%.1f Mbps), "
+          "stalls=%lld/%.3fs/%.3fs\n",
+          sockaddr_to_str((struct sockaddr *)&f->remoteaddr),
+          f->total / 1e6, secs, secs ? f->total * 8 / secs / 1e6 : 0,
+          f->stall_count, f->stall_maxlength / 1e6,
+          f->stall_maxdepth / 1e6);
+  close(f->fd);
+  f->fd = -1;
+}
+
+
+// Reads (more of) the client's Request.  Returns -1 if the connection should
+// be dropped.
+static int flow_read_request(struct Flow *f, long long now) {
+  ssize_t len = read(f->fd, (char *)&f->req + f->req_len,
+                     sizeof(f->req) - f->req_len);
   if (len < 0) {
+    if (errno == EAGAIN || errno == EINTR) return 0;
     perror("read(req)");
-    return;
-  } else if (len < (int)sizeof(req)) {
+    return -1;
+  } else if (len == 0) {
     fprintf(stderr, "read(req): short read (got %d bytes, expected %d)\n",
-            (int)len, (int)sizeof(req));
-    return;
-  } else if (ntohl(req.magic) != MAGIC) {
+            f->req_len, (int)sizeof(f->req));
+    return -1;
+  }
+  f->req_len += len;
+  if (f->req_len < (int)sizeof(f->req)) {
+    return 0;
+  }
+  if (ntohl(f->req.magic) != MAGIC) {
     fprintf(stderr, "read(req): wrong magic (got %08X, expected %08X)\n",
-            (int)ntohl(req.magic), MAGIC);
-    return;
+            (int)ntohl(f->req.magic), MAGIC);
+    return -1;
   }
-  long megabits_per_sec = ntohl(req.megabits);
-  fprintf(stderr, "client requested %ld megabits/sec\n", megabits_per_sec);
-  if (megabits_per_sec < 0 || megabits_per_sec > MAX_MBITS) {
-    fprintf(stderr, "megabits/sec (%ld) must be > 0 and < %d, aborting.\n",
+  long megabits_per_sec = (int32_t)ntohl(f->req.megabits);
+  fprintf(stderr, "%s requested %ld megabits/sec\n",
+          sockaddr_to_str((struct sockaddr *)&f->remoteaddr),
+          megabits_per_sec);
+  if (megabits_per_sec <= 0 || megabits_per_sec > MAX_MBITS) {
+    fprintf(stderr, "megabits/sec (%ld) must be > 0 and <= %d, aborting.\n",
             megabits_per_sec, MAX_MBITS);
-    return;
+    return -1;
   }
-
-  if (shutdown(conn, SHUT_RD)) {
+  if (shutdown(f->fd, SHUT_RD)) {
     perror("shutdown(RD)");
-    return;
-  }
-
-  for (int i = 0; i < (int)(sizeof(buf)/sizeof(int)); i++) {
-    ((int *)buf)[i] = random();
+    return -1;
   }
+  f->megabits_per_sec = megabits_per_sec;
+  set_pacing_rate(f);
 
   // The recipient will be expecting its input to arrive in equal-spaced
   // intervals.  It's cheating to send a giant block and then nothing
   // for a long time, although the average rate would technically be
   // the same.  So we have both a time-based and byte-based limit
-  // on the amount of data in a single write.
-  long long total = 0;
-  long long bytes_per_period = megabits_per_sec * 1000000LL / 8
-      / MIN_PERIODS_PER_SEC;
-  if (bytes_per_period > 65536) bytes_per_period = 65536;
+  // on the amount of data in a single write.  At high rates, kernel pacing
+  // spreads each write out, so we can write more than that at a time.
+  f->chunk = megabits_per_sec * 1000000LL / 8 / MIN_PERIODS_PER_SEC;
+  if (f->chunk > MAX_CHUNK) f->chunk = MAX_CHUNK;
+  // Start the schedule one chunk in the past, so the first chunk goes out
+  // right away.
+  // Note on calculations: megabits/sec * microseconds = bits
+  f->start = now - f->chunk * 8 / megabits_per_sec;
+  return 0;
+}
+
+
+// Returns the time the flow next has a chunk due.
+static long long flow_next_due(struct Flow *f) {
+  return f->start + (f->total + f->chunk) * 8 / f->megabits_per_sec;
+}
+
+
+// Sends whatever the schedule says is due.  Returns -1 if the connection
+// should be dropped.
+static int flow_send(struct Flow *f, long long now) {
+  long long goal = (now - f->start) * f->megabits_per_sec / 8;
+  long long to_write = goal - f->total;
+  if (to_write < f->chunk) {
+    return 0;
+  }
+  if (to_write > (int)sizeof(buf)) {
+    to_write = sizeof(buf);
+  }
+  ssize_t wrote;
+  if (payload_fd >= 0) {
+#ifdef __linux__
+    if (to_write > (long long)sizeof(buf) - f->offset) {
+      to_write = sizeof(buf) - f->offset;
+    }
+    wrote = sendfile(f->fd, payload_fd, &f->offset, to_write);
+    if (f->offset >= (off_t)sizeof(buf)) f->offset = 0;
+#else
+    wrote = -1;
+#endif
+  } else {
+    wrote = write(f->fd, buf, to_write);
+  }
+  if (wrote < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("write");
+      return -1;
+    }
+    wrote = 0;
+  }
+  f->total += wrote;
+  f->blocked = wrote < to_write;
 
-  long long start = monotime();
+  // Track how far behind schedule the socket is holding us.
+  long long usec_behind = (goal - f->total) * 8 / f->megabits_per_sec;
+  if (!f->stall_start && usec_behind >= DROPOUT_MIN_USEC) {
+    f->stall_start = now;
+    f->stall_depth = 0;
+  } else if (f->stall_start && usec_behind * MIN_PERIODS_PER_SEC < 1000000) {
+    long long stall_length = now - f->stall_start;
+    f->stall_count++;
+    if (f->stall_maxlength < stall_length) f->stall_maxlength = stall_length;
+    if (f->stall_maxdepth < f->stall_depth) f->stall_maxdepth = f->stall_depth;
+    f->stall_start = 0;
+  }
+  if (f->stall_start && f->stall_depth < usec_behind) {
+    f->stall_depth = usec_behind;
+  }
+  return 0;
+}
+
+
+// Serves every client from a single process: sock is the listening socket.
+// Each flow's socket is non-blocking, and is only polled for writability
+// while its buffer is full; otherwise we wake up when the next flow has a
+// chunk due.
+void run_server(int sock, int max_flows, const char *cong_ctl) {
+  struct pollfd pfds[MAX_CONNECTIONS + 1];
+  int pfd_flow[MAX_CONNECTIONS + 1];
+  int nflows = 0;
+
+  for (int i = 0; i < (int)(sizeof(buf)/sizeof(int)); i++) {
+    ((int *)buf)[i] = random();
+  }
+  payload_fd = open_payload_file();
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    flows[i].fd = -1;
+  }
 
   while (!want_to_die) {
-    // Note on calculations: megabits/sec * microseconds = bits
     long long now = monotime();
-    long long goal = (now - start) * megabits_per_sec / 8;
-    long long to_write = goal - total;
-    if (to_write < bytes_per_period) {
-      long long delay_nsec = (bytes_per_period - to_write) * 8 * 1000 / megabits_per_sec;
-      struct timespec tx_delay = {
-        .tv_sec = delay_nsec / 1000000000LL,
-        .tv_nsec = delay_nsec % 1000000000LL,
-      };
-      if (tx_delay.tv_sec) {
-        fprintf(stderr, "Warning: client sleeping longer than 1 second.\n");
+    long long next_due = now + 1000000;
+    int npfds = 0;
+
+    if (nflows < max_flows) {
+      pfds[npfds].fd = sock;
+      pfds[npfds].events = POLLIN;
+      pfd_flow[npfds++] = -1;
+    }
+    for (int i = 0; i < max_flows; i++) {
+      struct Flow *f = &flows[i];
+      if (f->fd < 0) continue;
+      if (!f->megabits_per_sec) {
+        pfds[npfds].fd = f->fd;
+        pfds[npfds].events = POLLIN;
+        pfd_flow[npfds++] = i;
+        if (next_due > f->accept_time + REQUEST_TIMEOUT_USEC) {
+          next_due = f->accept_time + REQUEST_TIMEOUT_USEC;
+        }
+      } else if (f->blocked) {
+        pfds[npfds].fd = f->fd;
+        pfds[npfds].events = POLLOUT;
+        pfd_flow[npfds++] = i;
+      } else if (next_due > flow_next_due(f)) {
+        next_due = flow_next_due(f);
       }
-      if (nanosleep(&tx_delay, NULL)) {
-        perror("nanosleep");
-        break;
+    }
+
+    long long wait = next_due > now ? next_due - now : 0;
+#ifdef __linux__
+    // poll() only has millisecond resolution, which is coarse for fast flows.
+    struct timespec timeout = {
+      .tv_sec = wait / 1000000,
+      .tv_nsec = (wait % 1000000) * 1000,
+    };
+    int nfds = ppoll(pfds, npfds, &timeout, NULL);
+#else
+    int nfds = poll(pfds, npfds, (wait + 999) / 1000);
+#endif
+    if (nfds < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    now = monotime();
+
+    for (int p = 0; nfds > 0 && p < npfds; p++) {
+      if (!pfds[p].revents) continue;
+      if (pfd_flow[p] < 0) {
+        struct sockaddr_in6 remoteaddr;
+        socklen_t remoteaddr_len = sizeof(remoteaddr);
+        int conn = accept(sock, (struct sockaddr *)&remoteaddr,
+                          &remoteaddr_len);
+        if (conn < 0) {
+          perror("accept");
+          continue;
+        }
+        fprintf(stderr, "incoming connection from %s\n",
+                sockaddr_to_str((struct sockaddr *)&remoteaddr));
+        if (cong_ctl && set_cong_ctl(conn, cong_ctl) != 0) {
+          close(conn);
+          continue;
+        }
+        if (fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK) != 0) {
+          perror("fcntl(O_NONBLOCK)");
+          close(conn);
+          continue;
+        }
+        int i = 0;
+        while (flows[i].fd >= 0) i++;
+        struct Flow *f = &flows[i];
+        memset(f, 0, sizeof(*f));
+        f->fd = conn;
+        f->remoteaddr = remoteaddr;
+        f->accept_time = now;
+        nflows++;
+      } else {
+        struct Flow *f = &flows[pfd_flow[p]];
+        if (!f->megabits_per_sec) {
+          if (flow_read_request(f, now) < 0) {
+            flow_close(f, now);
+            nflows--;
+          }
+        } else {
+          f->blocked = 0;
+        }
       }
-      continue;
     }
-    if (to_write > (int)sizeof(buf)) {
-      to_write = sizeof(buf);
+
+    for (int i = 0; i < max_flows; i++) {
+      struct Flow *f = &flows[i];
+      if (f->fd < 0) continue;
+      int err = 0;
+      if (f->megabits_per_sec) {
+        if (!f->blocked) {
+          err = flow_send(f, now);
+        }
+      } else if (now - f->accept_time > REQUEST_TIMEOUT_USEC) {
+        fprintf(stderr, "%s: timed out waiting for request\n",
+                sockaddr_to_str((struct sockaddr *)&f->remoteaddr));
+        err = -1;
+      }
+      if (err < 0) {
+        flow_close(f, now);
+        nflows--;
+      }
     }
-    ssize_t wrote = write(conn, buf, to_write);
-    if (wrote < 0) {
-      perror("write");
-      break;
+  }
+
+  for (int i = 0; i < max_flows; i++) {
+    if (flows[i].fd >= 0) {
+      flow_close(&flows[i], monotime());
     }
-    total += wrote;
+  }
+  if (payload_fd >= 0) close(payload_fd);
+}
+
+
+// Dropouts, bucketed by how far behind schedule the stream was.  Buckets are
+// quarter powers of two: bucket 4*m+s covers [(4+s) << (m-2), (5+s) << (m-2))
+// usecs, so each is within 25% of its neighbours.  For each bucket we count
+// the dropouts whose deepest point fell in it, and the total time spent at
+// that depth, which is what decides how much buffer a player needs.
+struct DropHistogram {
+  struct {
+    long long events;
+    long long usecs;
+  } buckets[DROP_BUCKETS];
+  long long observed_usecs;   // total time measured, behind or not
+  long long last_time;
+  long long last_offset;
+  long long depth;            // deepest point of the current dropout, or 0
+};
+
+
+static int drop_bucket(long long usec) {
+  if (usec < 4) usec = 4;
+  int m = 63 - __builtin_clzll(usec);
+  int b = 4 * m + ((usec >> (m - 2)) & 3);
+  return b < DROP_BUCKETS ? b : DROP_BUCKETS - 1;
+}
+
+
+static long long drop_bucket_limit(int b) {
+  if (b < 8) return 4;  // drop_bucket() never uses these
+  return (long long)(4 + b % 4 + 1) << (b / 4 - 2);
+}
+
+
+// Adds dt usecs, spent moving steadily between depths from and to, to the
+// buckets in between.
+static void drop_histogram_spread(struct DropHistogram *h, long long from,
+                                  long long to, long long dt) {
+  if (from > to) {
+    long long tmp = from;
+    from = to;
+    to = tmp;
+  }
+  if (from == to) {
+    h->buckets[drop_bucket(to)].usecs += dt;
+    return;
+  }
+  for (long long d = from; d < to; ) {
+    int b = drop_bucket(d);
+    long long end = drop_bucket_limit(b) < to ? drop_bucket_limit(b) : to;
+    h->buckets[b].usecs += dt * (end - d) / (to - from);
+    d = end;
   }
 }
 
 
+// Records that the stream is usec_offset ahead of schedule (negative when
+// behind) at time now.  We only sample when data arrives, or once a second
+// when it doesn't, and while no data arrives we fall behind steadily, so the
+// time since the last sample is spread over the depths in between rather than
+// all being charged to the deepest one.
+static void drop_histogram_add(struct DropHistogram *h, long long now,
+                               long long usec_offset) {
+  if (h->last_time) {
+    long long dt = now - h->last_time;
+    long long from = -h->last_offset, to = -usec_offset;
+    h->observed_usecs += dt;
+    if (from > 0 || to > 0) {
+      // If we crossed the schedule, only part of dt was spent behind it.
+      if (from < 0) {
+        dt = dt * to / (to - from);
+        from = 0;
+      } else if (to < 0) {
+        dt = dt * from / (from - to);
+        to = 0;
+      }
+      drop_histogram_spread(h, from, to, dt);
+    }
+  }
+  h->last_time = now;
+  h->last_offset = usec_offset;
+  if (usec_offset < 0) {
+    if (h->depth < -usec_offset) h->depth = -usec_offset;
+  } else if (h->depth) {
+    h->buckets[drop_bucket(h->depth)].events++;
+    h->depth = 0;
+  }
+}
+
+
+// Returns the smallest playback buffer, in usecs, that would have stalled for
+// no more than (1 - reliability) of the observed time.  A player that starts
+// with a buffer of B usecs only stalls while the stream is more than B behind
+// schedule.
+static long long drop_histogram_buffer(const struct DropHistogram *h,
+                                       double reliability) {
+  double allowed = (1 - reliability) * h->observed_usecs;
+  long long stalled = 0;
+  for (int b = DROP_BUCKETS - 1; b >= 0; b--) {
+    stalled += h->buckets[b].usecs;
+    if (stalled > allowed) {
+      return drop_bucket_limit(b);
+    }
+  }
+  return 0;
+}
+
+
+static void print_drop_report(const struct DropHistogram *h,
+                              long megabits_per_sec) {
+  static const double levels[] = {0.99, 0.999, 0.9999};
+  printf("dropout report after %.3fs:\n", h->observed_usecs / 1e6);
+  for (int b = 0; b < DROP_BUCKETS; b++) {
+    if (!h->buckets[b].events) continue;
+    printf("  %lld dropouts up to %.3fs deep\n",
+           h->buckets[b].events, drop_bucket_limit(b) / 1e6);
+  }
+  for (int i = 0; i < (int)(sizeof(levels) / sizeof(levels[0])); i++) {
+    long long usecs = drop_histogram_buffer(h, levels[i]);
+    printf("  buffer for %g%% stall-free playback: %.3fs (%.3f MB)\n",
+           levels[i] * 100, usecs / 1e6,
+           usecs * megabits_per_sec / 8 / 1e6);
+  }
+  fflush(stdout);
+}
+
+
 int run_client(const char *remotename, const char *ifr_name,
                long megabits_per_sec, double sufficient) {
   int sock = -1, ret = 1, alive = 0;
@@ -284,6 +679,8 @@ int run_client(const char *remotename, const char *ifr_name,
     long long drop_maxlength;
   } stats;
   memset(&stats, 0, sizeof(stats));
+  struct DropHistogram hist;
+  memset(&hist, 0, sizeof(hist));
 
   long long prestart_time = 0, start_time = 0, stop_time = 0;
   long long last_wait_time = 0, last_print_time = 0, now = 0;
@@ -311,7 +708,7 @@ int run_client(const char *remotename, const char *ifr_name,
         // calculate how much buffer space would be needed for a
         // particular reliability level, given that dropouts
         // may overlap (a new one begins before we recovered from
-        // the last one).
+        // the last one).  DropHistogram does that calculation.
         //
         // (For our purposes, drop_depth is always negative and
         // drop_length is always positive.  Making depth negative
@@ -344,6 +741,15 @@ int run_client(const char *remotename, const char *ifr_name,
       }
       last_usec_offset = usec_offset;
 
+      // Unlike the dropout stats above, which simply report the raw offset,
+      // the histogram leaves out time we've already counted as disconnected,
+      // so a reconnection doesn't look like a dropout that never ends.
+      drop_histogram_add(&hist, now, usec_offset + stats.disconnect_usecs);
+      if (want_report) {
+        print_drop_report(&hist, megabits_per_sec);
+        want_report = 0;
+      }
+
       if (now - last_print_time >= 1000000) {
         printf("%11.3fs %ldMbps offset=%.3fs disconn=%lld/%.3fs "
                "drops=%lld/%.3fs/%.3fs\n",
@@ -494,15 +900,21 @@ reopen:
     }
     fprintf(stderr, "retrying connection...\n");
 
-    if (nanosleep(&second, NULL)) {
-      perror("nanosleep");
-      want_to_die = 1;
+    // A SIGUSR1 report interrupts the sleep; carry on with what's left of
+    // it.  SIGINT and SIGALRM set want_to_die, so stop sleeping for those.
+    struct timespec pause = second;
+    while (nanosleep(&pause, &pause) && !want_to_die) {
+      if (errno != EINTR) {
+        perror("nanosleep");
+        want_to_die = 1;
+      }
     }
     close(sock);
     prestart_time = 0;
     sock = -1;
   }
 
+  print_drop_report(&hist, megabits_per_sec);
   ret = 0;
 error:
   if (ai) freeaddrinfo(ai);
@@ -510,14 +922,14 @@ error:
 }
 
 
+#ifndef UNIT_TESTS
 int main(int argc, char **argv) {
-  struct sockaddr_in6 listenaddr, remoteaddr;
-  socklen_t remoteaddr_len;
+  struct sockaddr_in6 listenaddr;
   int sock = -1;
   int megabits_per_sec = 0;
   double sufficient = 0;
   int timeout = 0;
-  int max_children = MAX_CHILDREN;
+  int max_flows = DEFAULT_CONNECTIONS;
   const char *cong_ctl = NULL;
 
   int c;
@@ -527,7 +939,7 @@ int main(int argc, char **argv) {
     case 'b':
       megabits_per_sec = atoi(optarg);
       if (megabits_per_sec > MAX_MBITS || megabits_per_sec < 1) {
-        fprintf(stderr, "%s: megabits per second must be > 0 and < %d\n",
+        fprintf(stderr, "%s: megabits per second must be > 0 and <= %d\n",
                 argv[0], MAX_MBITS);
         return 99;
       }
@@ -536,10 +948,10 @@ int main(int argc, char **argv) {
       ifr_name = optarg;
       break;
     case 'P':
-      max_children = atoi(optarg);
-      if (max_children > MAX_CHILDREN || max_children < 1) {
-        fprintf(stderr, "%s: max connections must be >= 0 and < %d\n",
-                argv[0], MAX_CHILDREN);
+      max_flows = atoi(optarg);
+      if (max_flows > MAX_CONNECTIONS || max_flows < 1) {
+        fprintf(stderr, "%s: max connections must be > 0 and <= %d\n",
+                argv[0], MAX_CONNECTIONS);
         return 99;
       }
       break;
@@ -580,6 +992,10 @@ int main(int argc, char **argv) {
   };
   sigaction(SIGINT, &act, NULL);
   sigaction(SIGALRM, &act, NULL);
+  struct sigaction report_act = {
+    .sa_handler = sighandler_report,
+  };
+  sigaction(SIGUSR1, &report_act, NULL);
   signal(SIGPIPE, SIG_IGN);
 
   if (argc - optind == 0) {
@@ -613,60 +1029,14 @@ int main(int argc, char **argv) {
     if (cong_ctl && set_cong_ctl(sock, cong_ctl) != 0) {
       return 1;
     }
-    if (listen(sock, 1)) {
+    if (listen(sock, 16)) {
       perror("listen");
       return 1;
     }
     fprintf(stderr, "server listening at %s\n",
            sockaddr_to_str((struct sockaddr *)&listenaddr));
 
-    int numchildren = 0;
-    while (!want_to_die) {
-      int nfds;
-
-      if (numchildren < max_children) {
-        nfds = do_select(sock, numchildren ? 1000*1000 : -1);
-      } else {
-        if (waitpid(-1, NULL, 0) > 0) {
-          numchildren--;
-        }
-        nfds = 0;
-      }
-      while (waitpid(-1, NULL, WNOHANG) > 0) {
-        numchildren--;
-      }
-      if (nfds > 0) {
-        remoteaddr_len = sizeof(remoteaddr);
-        int conn = accept(sock, (struct sockaddr *)&remoteaddr,
-                          &remoteaddr_len);
-        if (conn < 0) {
-          perror("accept");
-          continue;
-        }
-        if (cong_ctl && set_cong_ctl(conn, cong_ctl) != 0) {
-          return 1;
-        }
-        pid_t pid = fork();
-        if (pid < 0) {
-          perror("fork");
-          if (nanosleep(&second, NULL)) {
-            perror("nanosleep");
-            exit(99);
-          }
-          close(conn);
-        } else if (pid > 0) {
-          // parent
-          close(conn);
-          numchildren++;
-        } else {
-          // child
-          close(sock);
-          run_server(conn, &remoteaddr, remoteaddr_len);
-          fprintf(stderr, "client disconnected.\n");
-          _exit(0);
-        }
-      }
-    }
+    run_server(sock, max_flows, cong_ctl);
   } else if (argc - optind == 1) {
     fprintf(stderr, "client mode.\n");
     if (cong_ctl) {
@@ -693,3 +1063,4 @@ int main(int argc, char **argv) {
   if (sock >= 0) close(sock);
   return 0;
 }
+#endif  /* UNIT_TESTS */
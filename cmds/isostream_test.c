@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Unit tests for isostream.c */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define UNIT_TESTS
+#include "isostream.c"
+
+
+void test_drop_bucket()
+{
+  assert(drop_bucket(0) == 8);
+  assert(drop_bucket(4) == 8);
+  assert(drop_bucket(5) == 9);
+  assert(drop_bucket(7) == 11);
+  assert(drop_bucket(8) == 12);
+  assert(drop_bucket(1LL << 50) == DROP_BUCKETS - 1);
+
+  /* Each bucket ends where the next one starts. */
+  for (int b = 8; b < DROP_BUCKETS - 1; b++) {
+    long long limit = drop_bucket_limit(b);
+    assert(drop_bucket(limit - 1) == b);
+    assert(drop_bucket(limit) == b + 1);
+  }
+}
+
+
+void test_drop_histogram_buffer()
+{
+  struct DropHistogram h;
+  long long usecs;
+
+  memset(&h, 0, sizeof(h));
+  assert(drop_histogram_buffer(&h, 0.999) == 0);
+
+  /* On schedule for 99s, then falling steadily behind to 1s deep, then
+   * caught up again. */
+  drop_histogram_add(&h, 1, 0);
+  drop_histogram_add(&h, 99000001, 0);
+  drop_histogram_add(&h, 100000001, -1000000);
+  drop_histogram_add(&h, 100000002, 1000);
+  assert(h.observed_usecs == 100000001);
+  assert(h.buckets[drop_bucket(1000000)].events == 1);
+  assert(h.depth == 0);
+
+  /* 1% of the time is allowed to stall, and it was never behind for
+   * longer than that. */
+  assert(drop_histogram_buffer(&h, 0.99) == 0);
+
+  /* 0.1% of the time is 0.1s, which was spent more than 0.9s behind. */
+  usecs = drop_histogram_buffer(&h, 0.999);
+  assert(usecs >= 900000);
+  assert(usecs <= 900000 * 5 / 4);
+
+  /* 0.01% is 0.01s, spent more than 0.99s behind. */
+  usecs = drop_histogram_buffer(&h, 0.9999);
+  assert(usecs >= 990000);
+  assert(usecs <= 990000 * 5 / 4);
+}
+
+
+int main(int argc, char** argv)
+{
+  test_drop_bucket();
+  test_drop_histogram_buffer();
+  exit(0);
+}
@@ -46,16 +46,31 @@ notify_text = ['']
 
 minissdpd_response = ['']
 keep_running = [True]
+# Paths which only answer once without a matching If-None-Match, so a
+# second run only sees the device if it revalidated its cached copy.
+served_once = set()
 
 
 class HttpHandler(BaseHTTPServer.BaseHTTPRequestHandler):
 
   def do_GET(self):  # pylint: disable=invalid-name
     """Respond to an HTTP GET for SSDP DeviceInfo."""
+    etag = '"%s"' % self.path
+    if self.headers.getheader('If-None-Match') == etag:
+      self.send_response(304)
+      self.send_header('ETag', etag)
+      self.end_headers()
+      return
+    if self.path.endswith('cached_device_xml'):
+      if self.path in served_once:
+        self.send_error(500)
+        return
+      served_once.add(self.path)
     self.send_response(200)
     self.send_header('Content-type', 'text/xml')
+    self.send_header('ETag', etag)
     self.end_headers()
-    if self.path.endswith('text_device_xml'):
+    if self.path.endswith(('text_device_xml', 'cached_device_xml')):
       self.wfile.write(text_device_xml)
     if self.path.endswith('email_address_xml'):
       self.wfile.write(email_address_xml)
@@ -104,6 +119,8 @@ def main():
     pathend = 'no_friendlyname_xml'
   if testnum == 4:
     pathend = 'ssdp_device_xml'
+  if testnum == 5:
+    pathend = 'cached_device_xml'
 
   h = ThreadingHTTPServer(('', 0), HttpHandler)
   sn = h.socket.getsockname()
@@ -29,6 +29,7 @@
 #include <asm/types.h>
 #include <ctype.h>
 #include <curl/curl.h>
+#include <errno.h>
 #include <getopt.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -42,6 +43,7 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <deque>
 #include <iostream>
 #include <set>
 #include <tr1/unordered_map>
@@ -66,23 +68,34 @@
 }
 
 #define SOCK_PATH "/var/run/minissdpd.sock"
+#define CACHE_PATH "/tmp/ssdptax.cache"
+
+/*
+ * Limits on concurrent device description fetches. Fetches beyond these
+ * wait in our own queue rather than curl's, so that their 1 second
+ * timeout only starts once they are actually on the wire.
+ */
+#define MAX_TOTAL_CONNECTIONS 32
+#define MAX_HOST_CONNECTIONS  2
 
 
 typedef struct ssdp_info {
   ssdp_info(): srv_type(), url(), friendlyName(), ipaddr(),
-    manufacturer(), model(), buffer(), failed(0) {}
+    manufacturer(), model(), etag(), buffer(), headers(NULL), failed(0) {}
   ssdp_info(const ssdp_info& s): srv_type(s.srv_type), url(s.url),
     friendlyName(s.friendlyName), ipaddr(s.ipaddr),
-    manufacturer(s.manufacturer), model(s.model),
-    buffer(s.buffer), failed(s.failed) {}
+    manufacturer(s.manufacturer), model(s.model), etag(s.etag),
+    buffer(s.buffer), headers(NULL), failed(s.failed) {}
   std::string srv_type;
   std::string url;
   std::string friendlyName;
   std::string ipaddr;
   std::string manufacturer;
   std::string model;
+  std::string etag;
 
   std::string buffer;
+  struct curl_slist *headers;
   int failed;
 } ssdp_info_t;
 
@@ -90,6 +103,37 @@ typedef struct ssdp_info {
 typedef std::tr1::unordered_map<std::string, ssdp_info_t*> ResponsesMap;
 
 
+/*
+ * Device descriptions from previous runs, keyed by URL. A cached entry
+ * is only reused after the device confirms its ETag with a 304.
+ */
+typedef struct cache_entry {
+  cache_entry(): etag(), friendlyName(), manufacturer(), model(),
+    confirmed(false) {}
+  std::string etag;
+  std::string friendlyName;
+  std::string manufacturer;
+  std::string model;
+  bool confirmed;
+} cache_entry_t;
+
+
+typedef std::tr1::unordered_map<std::string, cache_entry_t> CacheMap;
+
+
+typedef std::tr1::unordered_map<std::string, int> HostCountMap;
+
+
+typedef struct fetcher {
+  fetcher(): multi(NULL), cache(), pending(), per_host(), running(0) {}
+  CURLM *multi;
+  CacheMap cache;
+  std::deque<ssdp_info_t*> pending;
+  HostCountMap per_host;
+  int running;
+} fetcher_t;
+
+
 int ssdp_loop = 0;
 
 
@@ -541,69 +585,291 @@ size_t callback(const char *ptr, size_t size, size_t nmemb, void *userdata)
 }
 
 
+std::string trim(std::string s)
+{
+  size_t start = s.find_first_not_of(" \t\v\f\b\r\n");
+  if (std::string::npos != start && 0 != start) s = s.erase(0, start);
+
+  size_t end = s.find_last_not_of(" \t\v\f\b\r\n");
+  if (std::string::npos != end) s = s.substr(0, end + 1);
+
+  return s;
+}
+
+
+size_t header_callback(const char *ptr, size_t size, size_t nmemb,
+    void *userdata)
+{
+  ssdp_info_t *info = (ssdp_info_t *)userdata;
+  size_t len = size * nmemb;
+
+  if (len > 5 && strncasecmp(ptr, "etag:", 5) == 0) {
+    info->etag = trim(std::string(ptr + 5, len - 5));
+  }
+  return len;
+}
+
+
 /*
- * SSDP returned an endpoint URL, use curl to GET its contents.
+ * Returns true if the string can be stored in a tab-separated cache line.
  */
-void fetch_device_info(const std::string &url, ssdp_info_t *info)
+static bool cacheable(const std::string &s)
+{
+  return s.find_first_of("\t\r\n") == std::string::npos;
+}
+
+
+void load_cache(const char *path, CacheMap &cache)
+{
+  FILE *f;
+  char line[2048];
+
+  if (path == NULL || *path == '\0' || (f = fopen(path, "r")) == NULL) {
+    return;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *fields[5];
+    char *p, *saveptr;
+    int n = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    for (p = line; n < 5; p = NULL) {
+      fields[n] = strtok_r(p, "\t", &saveptr);
+      if (fields[n] == NULL) break;
+      n++;
+    }
+    if (n != 5) continue;
+
+    cache_entry_t &e = cache[fields[0]];
+    e.etag = fields[1];
+    e.friendlyName = fields[2];
+    e.manufacturer = fields[3];
+    e.model = fields[4];
+  }
+  fclose(f);
+}
+
+
+/*
+ * Write back only the entries which devices confirmed during this run,
+ * so the file never accumulates devices which have left the network.
+ * The temporary file gets a unique name from mkstemp, so a link planted
+ * in /tmp can't redirect the write and concurrent runs don't share it.
+ */
+void save_cache(const char *path, const CacheMap &cache)
+{
+  std::string tmppath;
+  FILE *f;
+  int fd;
+
+  if (path == NULL || *path == '\0') {
+    return;
+  }
+
+  tmppath = std::string(path) + ".XXXXXX";
+  if ((fd = mkstemp(&tmppath[0])) < 0) {
+    perror("mkstemp cache");
+    return;
+  }
+  if ((f = fdopen(fd, "w")) == NULL) {
+    perror("fdopen cache");
+    close(fd);
+    unlink(tmppath.c_str());
+    return;
+  }
+  for (CacheMap::const_iterator ii = cache.begin(); ii != cache.end(); ++ii) {
+    const cache_entry_t &e = ii->second;
+    if (!e.confirmed) continue;
+    /* strtok_r collapses empty fields, so store a placeholder. */
+    fprintf(f, "%s\t%s\t%s\t%s\t%s\n", ii->first.c_str(), e.etag.c_str(),
+        e.friendlyName.empty() ? "-" : e.friendlyName.c_str(),
+        e.manufacturer.empty() ? "-" : e.manufacturer.c_str(),
+        e.model.empty() ? "-" : e.model.c_str());
+  }
+  if (fclose(f) != 0 || rename(tmppath.c_str(), path) != 0) {
+    perror("write cache");
+    unlink(tmppath.c_str());
+  }
+}
+
+
+static std::string from_cache_field(const std::string &s)
+{
+  return (s == "-") ? std::string() : s;
+}
+
+
+/*
+ * Returns the host[:port] part of a URL.
+ */
+static std::string url_host(const std::string &url)
+{
+  size_t start = url.find("://");
+  size_t end;
+
+  start = (start == std::string::npos) ? 0 : start + 3;
+  end = url.find('/', start);
+  return url.substr(start, (end == std::string::npos) ? end : end - start);
+}
+
+
+/*
+ * Add a GET of the device description to the multi handle. The transfer
+ * completes in complete_fetches().
+ */
+static void start_fetch(fetcher_t *fetcher, ssdp_info_t *info)
 {
   CURL *curl = curl_easy_init();
-  char *ip;
+  CacheMap::const_iterator cached;
 
   if (!curl) {
     fprintf(stderr, "curl_easy_init failed\n");
+    info->failed = 1;
     return;
   }
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_URL, info->url.c_str());
   curl_easy_setopt(curl, CURLOPT_PATH_AS_IS, 1L);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &callback);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, info);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, info);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, info);
   curl_easy_setopt(curl, CURLOPT_USERAGENT, "ssdptaxonomy/1.0");
   curl_easy_setopt(curl, CURLOPT_TIMEOUT, 1L);
   curl_easy_setopt(curl, CURLOPT_FAILONERROR, true);
-  if (curl_easy_perform(curl) == CURLE_OK) {
-    extract_fields_from_buffer(info);
-  } else {
-    info->failed = 1;
+
+  cached = fetcher->cache.find(info->url);
+  if (cached != fetcher->cache.end()) {
+    std::string h = "If-None-Match: " + cached->second.etag;
+    info->headers = curl_slist_append(NULL, h.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, info->headers);
   }
-  if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip) == CURLE_OK) {
-    info->ipaddr = ip;
+
+  if (curl_multi_add_handle(fetcher->multi, curl) != CURLM_OK) {
+    fprintf(stderr, "curl_multi_add_handle failed\n");
+    info->failed = 1;
+    curl_slist_free_all(info->headers);
+    info->headers = NULL;
+    curl_easy_cleanup(curl);
+    return;
   }
+  fetcher->running++;
+  fetcher->per_host[url_host(info->url)]++;
+}
+
 
-  info->buffer.clear();
-  curl_easy_cleanup(curl);
+/*
+ * Start as many queued fetches as the connection limits allow.
+ */
+static void start_pending_fetches(fetcher_t *fetcher)
+{
+  std::deque<ssdp_info_t*>::iterator ii = fetcher->pending.begin();
+
+  while (ii != fetcher->pending.end() &&
+      fetcher->running < MAX_TOTAL_CONNECTIONS) {
+    ssdp_info_t *info = *ii;
+    if (fetcher->per_host[url_host(info->url)] < MAX_HOST_CONNECTIONS) {
+      ii = fetcher->pending.erase(ii);
+      start_fetch(fetcher, info);
+    } else {
+      ++ii;
+    }
+  }
 }
 
 
-std::string trim(std::string s)
+/*
+ * SSDP returned an endpoint URL, arrange to GET its contents.
+ */
+void queue_fetch(fetcher_t *fetcher, ssdp_info_t *info)
 {
-  size_t start = s.find_first_not_of(" \t\v\f\b\r\n");
-  if (std::string::npos != start && 0 != start) s = s.erase(0, start);
+  fetcher->pending.push_back(info);
+  start_pending_fetches(fetcher);
+}
 
-  size_t end = s.find_last_not_of(" \t\v\f\b\r\n");
-  if (std::string::npos != end) s = s.substr(0, end + 1);
 
-  return s;
+/*
+ * Reap transfers which have finished, filling in their ssdp_info_t.
+ */
+void complete_fetches(fetcher_t *fetcher)
+{
+  CURLMsg *msg;
+  int msgs_left;
+
+  while ((msg = curl_multi_info_read(fetcher->multi, &msgs_left)) != NULL) {
+    CURL *curl = msg->easy_handle;
+    ssdp_info_t *info = NULL;
+    long code = 0;
+    char *ip;
+
+    if (msg->msg != CURLMSG_DONE) continue;
+
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&info);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    if (msg->data.result != CURLE_OK) {
+      info->failed = 1;
+    } else if (code == 304 &&
+        fetcher->cache.find(info->url) != fetcher->cache.end()) {
+      cache_entry_t &e = fetcher->cache[info->url];
+      info->friendlyName = from_cache_field(e.friendlyName);
+      info->manufacturer = from_cache_field(e.manufacturer);
+      info->model = from_cache_field(e.model);
+      e.confirmed = true;
+    } else {
+      extract_fields_from_buffer(info);
+      if (!info->etag.empty() && cacheable(info->url) &&
+          cacheable(info->etag) && cacheable(info->friendlyName) &&
+          cacheable(info->manufacturer) && cacheable(info->model)) {
+        cache_entry_t &e = fetcher->cache[info->url];
+        e.etag = info->etag;
+        e.friendlyName = info->friendlyName;
+        e.manufacturer = info->manufacturer;
+        e.model = info->model;
+        e.confirmed = true;
+      }
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip) == CURLE_OK && ip) {
+      info->ipaddr = ip;
+    }
+
+    info->buffer.clear();
+    curl_multi_remove_handle(fetcher->multi, curl);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(info->headers);
+    info->headers = NULL;
+    fetcher->running--;
+    fetcher->per_host[url_host(info->url)]--;
+  }
+  start_pending_fetches(fetcher);
 }
 
 
-void parse_ssdp_response(int s, ResponsesMap &responses)
+/*
+ * Read one datagram without blocking. Returns false once the socket has
+ * been drained.
+ */
+bool parse_ssdp_response(int s, ResponsesMap &responses, fetcher_t *fetcher)
 {
-  ssdp_info_t *info = new ssdp_info_t;
+  ssdp_info_t *info;
   char buffer[4096];
   char *p, *saveptr, *strtok_pos;
   ssize_t pktlen;
 
   memset(buffer, 0, sizeof(buffer));
-  pktlen = recv(s, buffer, sizeof(buffer) - 1, 0);
+  pktlen = recv(s, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+  if (pktlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return false;
+  }
   if (pktlen < 0 || (size_t)pktlen >= sizeof(buffer)) {
     fprintf(stderr, "error receiving SSDP response, pktlen=%zd\n", pktlen);
-    delete info;
     /* not fatal, just return */
-    return;
+    return false;
   }
   buffer[pktlen] = '\0';
   strtok_pos = buffer;
 
+  info = new ssdp_info_t;
   while ((p = strtok_r(strtok_pos, "\r\n", &saveptr)) != NULL) {
     if (strlen(p) > 9 && strncasecmp(p, "location:", 9) == 0) {
       char urlbuf[512];
@@ -620,55 +886,110 @@ void parse_ssdp_response(int s, ResponsesMap &responses)
   }
 
   if (info->url.length() && responses.find(info->url) == responses.end()) {
-    fetch_device_info(info->url, info);
     responses[info->url] = info;
+    queue_fetch(fetcher, info);
   } else {
     delete info;
   }
+  return true;
 }
 
 
-/* Wait for SSDP NOTIFY messages to arrive. */
-#define TIMEOUT_SECS  5
-void listen_for_responses(int s4, int s6, ResponsesMap &responses)
+/*
+ * Run the multi handle until it needs to wait, then select() on its
+ * sockets plus any extra fds until one is readable or timeout_ms passes.
+ */
+static void service_fetches(fetcher_t *fetcher, fd_set *rfds, int maxfd,
+    long timeout_ms)
 {
   struct timeval tv;
+  fd_set wfds, efds;
+  int curl_maxfd = -1;
+  long curl_timeout = -1;
+  int still_running;
+
+  curl_multi_perform(fetcher->multi, &still_running);
+  complete_fetches(fetcher);
+
+  FD_ZERO(&wfds);
+  FD_ZERO(&efds);
+  if (fetcher->running > 0) {
+    curl_multi_fdset(fetcher->multi, rfds, &wfds, &efds, &curl_maxfd);
+    curl_multi_timeout(fetcher->multi, &curl_timeout);
+    if (curl_maxfd < 0 && (curl_timeout < 0 || curl_timeout > 100)) {
+      /* curl is busy with something it cannot give us an fd for,
+       * such as name resolution. Poll it again shortly. */
+      curl_timeout = 100;
+    }
+    if (curl_timeout >= 0 && curl_timeout < timeout_ms) {
+      timeout_ms = curl_timeout;
+    }
+    if (curl_maxfd > maxfd) {
+      maxfd = curl_maxfd;
+    }
+  }
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  if (select(maxfd + 1, rfds, &wfds, &efds, &tv) <= 0) {
+    FD_ZERO(rfds);
+  }
+
+  curl_multi_perform(fetcher->multi, &still_running);
+  complete_fetches(fetcher);
+}
+
+
+/*
+ * Wait for SSDP NOTIFY messages to arrive. Device descriptions are
+ * fetched concurrently, so a slow device does not hold up reading the
+ * responses of the others.
+ */
+#define TIMEOUT_SECS  5
+void listen_for_responses(int s4, int s6, ResponsesMap &responses,
+    fetcher_t *fetcher)
+{
   fd_set rfds;
   int maxfd = (s4 > s6) ? s4 : s6;
   time_t start = monotime();
+  time_t now;
 
-  memset(&tv, 0, sizeof(tv));
-  tv.tv_sec = TIMEOUT_SECS;
-  tv.tv_usec = 0;
-
-  FD_ZERO(&rfds);
-  FD_SET(s4, &rfds);
-  FD_SET(s6, &rfds);
+  while ((now = monotime()) - start < TIMEOUT_SECS) {
+    /* even on a network filled with SSDP packets,
+     * return after TIMEOUT_SECS. */
+    FD_ZERO(&rfds);
+    FD_SET(s4, &rfds);
+    FD_SET(s6, &rfds);
+    service_fetches(fetcher, &rfds, maxfd,
+        (TIMEOUT_SECS - (now - start)) * 1000L);
 
-  while (select(maxfd + 1, &rfds, NULL, NULL, &tv) > 0) {
-    time_t end = monotime();
     if (FD_ISSET(s4, &rfds)) {
-      parse_ssdp_response(s4, responses);
+      while (parse_ssdp_response(s4, responses, fetcher)) {}
     }
     if (FD_ISSET(s6, &rfds)) {
-      parse_ssdp_response(s6, responses);
+      while (parse_ssdp_response(s6, responses, fetcher)) {}
     }
+  }
+}
 
-    FD_ZERO(&rfds);
-    FD_SET(s4, &rfds);
-    FD_SET(s6, &rfds);
 
-    if ((end - start) > TIMEOUT_SECS) {
-      /* even on a network filled with SSDP packets,
-       * return after TIMEOUT_SECS. */
-      break;
-    }
+/* Let outstanding device description fetches finish. */
+void wait_for_fetches(fetcher_t *fetcher)
+{
+  fd_set rfds;
+
+  while (fetcher->running > 0 || !fetcher->pending.empty()) {
+    FD_ZERO(&rfds);
+    service_fetches(fetcher, &rfds, -1, 1000);
   }
 }
 
 
 void usage(char *progname) {
-  printf("usage: %s [-t /path/to/fifo] [-s search]\n", progname);
+  printf("usage: %s [-t /path/to/fifo] [-s search] [-c cachefile]\n",
+      progname);
+  printf("\t-c\tdevice description cache (default %s, \"\" to disable)\n",
+      CACHE_PATH);
   printf("\t-s\tserver type to search for (default ssdp:all)\n");
   printf("\t-t\ttest mode, use a fake path instead of minissdpd.\n");
   exit(1);
@@ -683,6 +1004,8 @@ int main(int argc, char **argv)
   int c, s4, s6;
   const char *sock_path = SOCK_PATH;
   const char *search = "ssdp:all";
+  const char *cache_path = CACHE_PATH;
+  fetcher_t fetcher;
 
   setlinebuf(stdout);
   alarm(30);
@@ -692,8 +1015,9 @@ int main(int argc, char **argv)
     exit(1);
   }
 
-  while ((c = getopt(argc, argv, "s:t:")) != -1) {
+  while ((c = getopt(argc, argv, "c:s:t:")) != -1) {
     switch(c) {
+      case 'c': cache_path = optarg; break;
       case 's': search = optarg; break;
       case 't':
         sock_path = optarg;
@@ -703,6 +1027,12 @@ int main(int argc, char **argv)
     }
   }
 
+  if ((fetcher.multi = curl_multi_init()) == NULL) {
+    fprintf(stderr, "curl_multi_init failed\n");
+    exit(1);
+  }
+  load_cache(cache_path, fetcher.cache);
+
   /* Request the list from MiniSSDPd */
   buffer = request_from_ssdpd(sock_path, 3, search);
   if (!buffer.empty()) {
@@ -713,8 +1043,8 @@ int main(int argc, char **argv)
 
       parse_minissdpd_response(buffer, info->url, info->srv_type);
       if (info->url.length() && responses.find(info->url) == responses.end()) {
-        fetch_device_info(info->url, info);
         responses[info->url] = info;
+        queue_fetch(&fetcher, info);
       } else {
         delete info;
       }
@@ -730,11 +1060,13 @@ int main(int argc, char **argv)
   send_ssdp_ip4_request(s4, search);
   s6 = get_ipv6_ssdp_socket();
   send_ssdp_ip6_request(s6, search);
-  listen_for_responses(s4, s6, responses);
+  listen_for_responses(s4, s6, responses, &fetcher);
   close(s4);
   s4 = -1;
   close(s6);
   s6 = -1;
+  wait_for_fetches(&fetcher);
+  save_cache(cache_path, fetcher.cache);
 
   /* Capture any new ARP table entries which appeared after sending
    * our own M-SEARCH. */
@@ -758,6 +1090,7 @@ int main(int argc, char **argv)
     std::cout << *ii << std::endl;
   }
 
+  curl_multi_cleanup(fetcher.multi);
   curl_global_cleanup();
   exit(0);
 }
@@ -104,6 +104,20 @@ WVPASSEQ "$(cat test1.$pid.tmp)" "dhcpv label Hewlett Packard Printer;HP LaserJe
 WVPASS $TAX -l label -v "mfg=Xerox;typ=MFP;mod=WorkCentre 3220;ser=ABC012345;loc=" >test1.$pid.tmp
 WVPASSEQ "$(cat test1.$pid.tmp)" "dhcpv label Xerox MFP;WorkCentre 3220"
 
+# Check batch mode gives the same answers, skipping lines with no match
+printf "aa AastraIPPhone55i\nbb Xbox 360\ncc no such vendor\ndd mfg=Xerox;typ=MFP;mod=WorkCentre 3220\n" >test2.$pid.tmp
+WVPASS $TAX -b <test2.$pid.tmp >test1.$pid.tmp
+WVPASSEQ "$(cat test1.$pid.tmp)" "dhcpv aa Aastra IP Phone;55i
+dhcpv bb Xbox;Xbox 360
+dhcpv dd Xerox MFP;WorkCentre 3220"
+WVFAIL $TAX -b -l label
+
+# Check batch mode doesn't split a long line into two lookups
+padding=$(printf 'x%.0s' $(seq 1020))
+printf "ee ${padding}ff mfg=Xerox;typ=MFP;mod=WorkCentre 3220\n" >test2.$pid.tmp
+WVPASS $TAX -b <test2.$pid.tmp >test1.$pid.tmp
+WVPASSEQ "$(cut -d' ' -f1-2 test1.$pid.tmp)" "dhcpv ee"
+
 # check invalid or missing arguments. -l and -v are required.
 WVFAIL $TAX
 WVFAIL $TAX -l label
@@ -9,3 +9,57 @@ WVSTART "isostream test"
 # verify that isostream ends when a timeout is set.
 TIMEOUT=1
 WVPASS alarm $(($TIMEOUT+1)) $IS -b 1 -t $TIMEOUT 127.0.0.1
+
+
+WVSTART "isostream server test"
+
+pid=$$
+LOG=server.$pid.tmp
+
+# prints the Mbps the server reported for the client that asked for $2.
+server_mbps()
+{
+  addr=$(sed -n "s/^\(.*\) requested $2 megabits\/sec$/\1/p" $1)
+  grep -F "client $addr disconnected:" $1 |
+    sed -n 's/.* (\([0-9.]*\) Mbps).*/\1/p'
+}
+
+# true if $1 is within 20% of $2.
+near()
+{
+  awk -v got="$1" -v want="$2" \
+    'BEGIN { exit !(got >= want * 0.8 && got <= want * 1.2) }'
+}
+
+$IS >$LOG 2>&1 &
+srvpid=$!
+sleep 0.5
+
+# two clients at different rates, served by the same process at once.
+alarm 10 $IS -b 8 -s 3 127.0.0.1 >client8.$pid.tmp 2>&1 &
+c8pid=$!
+alarm 10 $IS -b 4 -s 3 127.0.0.1 >client4.$pid.tmp 2>&1 &
+c4pid=$!
+WVPASS wait $c8pid
+WVPASS wait $c4pid
+
+for mbps in 8 4; do
+  OUT=client$mbps.$pid.tmp
+  # each second's report shows the requested rate, and the data never fell
+  # more than a few chunks behind schedule.
+  WVPASS [ "$(grep -c " ${mbps}Mbps offset=" $OUT)" -ge 2 ]
+  WVFAIL grep -q 'offset=-0*\.[1-9]\|offset=-[1-9]' $OUT
+done
+
+# the server notices each disconnect on its next write.
+for i in $(seq 20); do
+  [ "$(grep -c disconnected: $LOG)" -ge 2 ] && break
+  sleep 0.1
+done
+kill $srvpid
+wait $srvpid
+
+WVPASS near "$(server_mbps $LOG 8)" 8
+WVPASS near "$(server_mbps $LOG 4)" 4
+
+rm -f *.$pid.tmp
@@ -2,13 +2,29 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <netdb.h>
+#include <errno.h>
+#include <math.h>
 #include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__linux__) && !defined(UDP_SEGMENT)
+/* older headers lack UDP GSO, but the kernel may still have it */
+#define UDP_SEGMENT 103
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef SO_SNDBUFFORCE
+#define SO_SNDBUFFORCE SO_SNDBUF
+#define SO_RCVBUFFORCE SO_RCVBUF
+#endif
+
 #ifndef AI_NUMERICSERV
 /* some older linuxen lack this, so do without */
 #define AI_NUMERICSERV 0
@@ -25,6 +41,11 @@ void pe(char *s)
 
 #define MAGIC 0x31f71dc1
 
+#define BATCH 64          /* messages per sendmmsg()/recvmmsg() */
+#define GSO_SEGMENTS 64   /* max packets sent as one UDP GSO message */
+#define GSO_BYTES 65000   /* max bytes in one UDP GSO message */
+#define SOCKBUF (8 * 1024 * 1024)
+
 struct msg {
   u_int32_t magic;
   u_int32_t cmd;
@@ -35,6 +56,16 @@ struct msg {
   u_int32_t size;
 };
 
+/*
+ * Each packet of a burst starts with this.  Older clients only look at the
+ * msg part.
+ */
+struct reply {
+  struct msg m;           /* m.n is the packet's sequence number */
+  u_int32_t tx_hi;        /* sender's monotonic clock, in usec, when */
+  u_int32_t tx_lo;        /* the packet left (see send_batches()) */
+};
+
 void htonmsg(struct msg *m)
 {
 #define sw(x) x = htonl(x)
@@ -60,6 +91,166 @@ void ntohmsg(struct msg *m)
 char rbuf[64 * 1024];
 char tbuf[64 * 1024];
 
+/*
+ * Grows a socket buffer to SOCKBUF.  The privileged version isn't limited by
+ * the rmem_max/wmem_max sysctls, which are far too small for a line-rate
+ * burst.
+ */
+void set_sockbuf(int s, int opt, int force_opt, const char *name)
+{
+  int bufsize = SOCKBUF;
+  if (setsockopt(s, SOL_SOCKET, force_opt, &bufsize, sizeof bufsize) < 0 &&
+      setsockopt(s, SOL_SOCKET, opt, &bufsize, sizeof bufsize) < 0)
+    perror(name);
+}
+
+unsigned long long now_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+#ifdef __linux__
+struct reply hdrs[BATCH * GSO_SEGMENTS];
+struct iovec iovs[BATCH][2 * GSO_SEGMENTS];
+union {
+  char buf[CMSG_SPACE(sizeof(u_int16_t))];
+  struct cmsghdr align;
+} ctrls[BATCH];
+
+/*
+ * Sends packets first..n-1 of the burst described by rm, as fast as
+ * possible: up to BATCH messages per sendmmsg(), each of which is a
+ * UDP GSO message of up to GSO_SEGMENTS packets if gso is set.  Stops
+ * early if the kernel rejects a GSO message.  Returns the sequence
+ * number of the first packet not sent.
+ *
+ * A whole batch is handed over at once, but its packets still leave one
+ * after another, so each is stamped with the batch's start time plus its
+ * index times the per-packet time the previous batch took.  Once the send
+ * buffer fills, sendmmsg() only returns as fast as the link drains it, so
+ * that is our own serialization time and the receiver doesn't count it as
+ * queueing.  The first batch has nothing to go on and shares one stamp.
+ */
+u_int32_t send_batches(int s, struct sockaddr_in6 *rsa, socklen_t rsa_len,
+                       struct msg *rm, u_int32_t first, int gso)
+{
+  struct mmsghdr msgs[BATCH];
+  u_int32_t payload = rm->size - sizeof(struct reply);
+  u_int32_t segs = 1, seq = first;
+  double usec_per_pkt = 0;
+
+  if (gso) {
+    segs = GSO_BYTES / rm->size;
+    if (segs > GSO_SEGMENTS)
+      segs = GSO_SEGMENTS;
+  }
+
+  while (seq < rm->n) {
+    int nmsgs, i, r, done;
+    unsigned long long tx = now_usec();
+    u_int32_t batch_first = seq;
+
+    memset(msgs, 0, sizeof msgs);
+    for (nmsgs = 0; nmsgs < BATCH && seq < rm->n; nmsgs++) {
+      struct msghdr *mh = &msgs[nmsgs].msg_hdr;
+      u_int32_t k;
+
+      for (k = 0; k < segs && seq < rm->n; k++, seq++) {
+        struct reply *h = &hdrs[nmsgs * GSO_SEGMENTS + k];
+        unsigned long long ptx = tx + (seq - batch_first) * usec_per_pkt;
+        h->m.magic = htonl(MAGIC);
+        h->m.cmd = htonl(rm->cmd);
+        h->m.cookie = htonl(rm->cookie);
+        h->m.n = htonl(seq);
+        h->m.size = htonl(rm->size);
+        h->tx_hi = htonl(ptx >> 32);
+        h->tx_lo = htonl(ptx);
+        iovs[nmsgs][2 * k].iov_base = h;
+        iovs[nmsgs][2 * k].iov_len = sizeof *h;
+        iovs[nmsgs][2 * k + 1].iov_base = tbuf;
+        iovs[nmsgs][2 * k + 1].iov_len = payload;
+      }
+      mh->msg_name = rsa;
+      mh->msg_namelen = rsa_len;
+      mh->msg_iov = iovs[nmsgs];
+      mh->msg_iovlen = 2 * k;
+      if (k > 1) {
+        /* the kernel (or NIC) splits this into k packets of rm->size */
+        struct cmsghdr *cm;
+        mh->msg_control = ctrls[nmsgs].buf;
+        mh->msg_controllen = sizeof ctrls[nmsgs].buf;
+        cm = CMSG_FIRSTHDR(mh);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+        *(u_int16_t *) CMSG_DATA(cm) = rm->size;
+      }
+    }
+
+    for (done = 0; done < nmsgs; ) {
+      r = sendmmsg(s, msgs + done, nmsgs - done, 0);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == ENOBUFS || errno == EAGAIN) {
+          /* queue overflowed; that packet is lost, like on the wire */
+          done++;
+          continue;
+        }
+        if (segs > 1) {
+          perror("sendmmsg(UDP_SEGMENT)");
+          for (i = 0; i < done; i++)
+            batch_first += msgs[i].msg_hdr.msg_iovlen / 2;
+          return batch_first;
+        }
+        pe("sendmmsg");
+      }
+      done += r;
+    }
+    usec_per_pkt = (double) (now_usec() - tx) / (seq - batch_first);
+  }
+  return seq;
+}
+#endif
+
+void send_burst(int s, struct sockaddr_in6 *rsa, socklen_t rsa_len,
+                struct msg *rm)
+{
+#ifdef __linux__
+  u_int32_t seq = send_batches(s, rsa, rsa_len, rm, 0,
+                               rm->size * 2 <= GSO_BYTES);
+  if (seq < rm->n) {
+    fprintf(stderr, "UDP GSO failed, sending packets individually\n");
+    send_batches(s, rsa, rsa_len, rm, seq, 0);
+  }
+#else
+  struct reply *tm = (struct reply *) tbuf;
+  u_int32_t i;
+  int r;
+
+  memset(tbuf, 0x5a, sizeof tbuf);
+  tm->m.magic = MAGIC;
+  tm->m.cmd = rm->cmd;
+  tm->m.cookie = rm->cookie;
+  tm->m.n = 0;
+  tm->m.size = rm->size;
+  htonmsg(&tm->m);
+
+  for (i = 0; i < rm->n; i++) {
+    unsigned long long tx = now_usec();
+    tm->m.n = htonl(i);
+    tm->tx_hi = htonl(tx >> 32);
+    tm->tx_lo = htonl(tx);
+    r = sendto(s, tbuf, rm->size, 0, (struct sockaddr *) rsa, rsa_len);
+    if (r < 0) pe("sendto");
+    if (r < (int) rm->size)
+      fprintf(stderr, "short sendto (expected %d, got %d)\n", rm->size, r);
+  }
+#endif
+}
+
 void server(void)
 {
   int s, r;
@@ -68,6 +259,9 @@ void server(void)
   s = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
   if (s < 1) pe("socket");
 
+  /* let a whole burst queue up rather than dropping it in our own host */
+  set_sockbuf(s, SO_SNDBUF, SO_SNDBUFFORCE, "setsockopt(SO_SNDBUF)");
+
   sa.sin6_family = AF_INET6;
   sa.sin6_port = htons(PORT);
   sa.sin6_flowinfo = 0;
@@ -77,10 +271,10 @@ void server(void)
   r = bind(s, (struct sockaddr *) &sa, sizeof sa);
   if (r < 0) pe("bind");
 
+  memset(tbuf, 0x5a, sizeof tbuf);
+
   do {
     struct msg *rm = (struct msg *) rbuf;
-    struct msg *tm = (struct msg *) tbuf;
-    u_int32_t i;
     socklen_t rsa_len = sizeof rsa;
 
     r = recvfrom(s, rbuf, sizeof rbuf, 0, (struct sockaddr *) &rsa, &rsa_len);
@@ -98,9 +292,9 @@ void server(void)
       continue;
     }
 
-    if (rm->size < sizeof *rm) {
+    if (rm->size < sizeof(struct reply)) {
       fprintf(stderr, "adjusting size of reply messages up to minimum\n");
-      rm->size = sizeof *rm;
+      rm->size = sizeof(struct reply);
     }
 
     if (rm->size > sizeof tbuf) {
@@ -108,22 +302,7 @@ void server(void)
       rm->size = sizeof tbuf;
     }
 
-    memset(tbuf, 0x5a, sizeof tbuf);
-    tm->magic = MAGIC;
-    tm->cmd = rm->cmd;
-    tm->cookie = rm->cookie;
-    tm->n = 0;
-    tm->size = rm->size;
-
-    htonmsg(tm);
-
-    for  (i = 0; i < rm->n; i++) {
-      tm->n = htonl(i);
-      r = sendto(s, tbuf, rm->size, 0, (struct sockaddr *) &rsa, rsa_len);
-      if (r < 0) pe("sendto");
-      if (r < (int) rm->size)
-        fprintf(stderr, "short sendto (expected %d, got %d)\n", rm->size, r);
-    }
+    send_burst(s, &rsa, rsa_len, rm);
   } while (1);
 }
 
@@ -153,6 +332,147 @@ int sizetoi(char *p)
 }
 
 
+/* Client-side accounting for one burst. */
+struct stats {
+  u_int32_t n;
+  unsigned char *seen;        /* seen[i] is set once packet i arrives */
+  unsigned int unique;
+  unsigned int reordered;     /* arrived after a later packet */
+  unsigned int max_depth;     /* furthest behind the newest packet seen */
+  u_int32_t newest;
+  unsigned long long first_rx, last_rx;
+  double gap_sum, gap_sumsq;  /* inter-arrival gaps, in usec */
+  long long min_owd, max_owd; /* rx minus tx time, plus unknown clock offset */
+};
+
+/*
+ * Records the arrival of packet h at time rx_usec.  h->m must already be
+ * in host order and validated.  Returns 0 if it was a duplicate.
+ */
+int stats_add(struct stats *st, struct reply *h, unsigned long long rx_usec)
+{
+  u_int32_t seq = h->m.n;
+  long long owd = rx_usec -
+      (((unsigned long long) ntohl(h->tx_hi) << 32) | ntohl(h->tx_lo));
+
+  if (seq >= st->n || st->seen[seq])
+    return 0;
+  st->seen[seq] = 1;
+
+  if (st->unique == 0) {
+    st->first_rx = rx_usec;
+    st->min_owd = st->max_owd = owd;
+    st->newest = seq;
+  } else {
+    double gap = (double) rx_usec - st->last_rx;
+    st->gap_sum += gap;
+    st->gap_sumsq += gap * gap;
+    if (owd < st->min_owd) st->min_owd = owd;
+    if (owd > st->max_owd) st->max_owd = owd;
+    if (seq < st->newest) {
+      st->reordered++;
+      if (st->newest - seq > st->max_depth)
+        st->max_depth = st->newest - seq;
+    } else {
+      st->newest = seq;
+    }
+  }
+  st->last_rx = rx_usec;
+  st->unique++;
+  return 1;
+}
+
+void stats_print(struct stats *st, u_int32_t size)
+{
+  unsigned int tolerance = 0;
+  unsigned int lost = st->n - st->unique;
+
+  /* packets the path delivered back-to-back before it started dropping */
+  while (tolerance < st->n && st->seen[tolerance])
+    tolerance++;
+
+  printf("lost %u (%.2f%%) -- %u reordered, max depth %u -- "
+         "burst tolerance %u packets\n",
+         lost, st->n ? 100.0 * lost / st->n : 0,
+         st->reordered, st->max_depth, tolerance);
+
+  if (st->unique >= 2) {
+    double gaps = st->unique - 1;
+    double span = st->last_rx - st->first_rx;
+    double mean = st->gap_sum / gaps;
+    double var = st->gap_sumsq / gaps - mean * mean;
+    /* bottleneck rate, from how far apart it spread the packets */
+    double bytes_per_usec = span > 0 ? gaps * size / span : 0;
+    long long queued = st->max_owd - st->min_owd;
+
+    printf("arrival span %.3f ms -- gap mean %.1f us, stddev %.1f us -- "
+           "%.1f Mbps -- queueing %.3f ms (~%.0f bytes)\n",
+           span / 1000, mean, sqrt(var > 0 ? var : 0),
+           bytes_per_usec * 8, queued / 1000.0, queued * bytes_per_usec);
+  }
+}
+
+unsigned long long realtime_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Reads every packet already queued on s into bufs (BATCH buffers of
+ * bufsize bytes).  Stores each one's length and arrival time, and returns
+ * how many there were, or -1 on error.  On Linux the arrival times are
+ * the kernel's (SO_TIMESTAMPNS), so they aren't skewed by how long we took
+ * to get around to reading.
+ */
+int recv_batch(int s, char *bufs, size_t bufsize, int *lens,
+               unsigned long long *rx_usec)
+{
+#ifdef __linux__
+  struct mmsghdr msgs[BATCH];
+  struct iovec iov[BATCH];
+  union {
+    char buf[CMSG_SPACE(sizeof(struct timespec))];
+    struct cmsghdr align;
+  } ctrls[BATCH];
+  int i, r;
+
+  memset(msgs, 0, sizeof msgs);
+  for (i = 0; i < BATCH; i++) {
+    iov[i].iov_base = bufs + i * bufsize;
+    iov[i].iov_len = bufsize;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = ctrls[i].buf;
+    msgs[i].msg_hdr.msg_controllen = sizeof ctrls[i].buf;
+  }
+  r = recvmmsg(s, msgs, BATCH, MSG_DONTWAIT, NULL);
+  if (r < 0)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  for (i = 0; i < r; i++) {
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+    lens[i] = msgs[i].msg_len;
+    rx_usec[i] = 0;
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec *ts = (struct timespec *) CMSG_DATA(cm);
+      rx_usec[i] = ts->tv_sec * 1000000ULL + ts->tv_nsec / 1000;
+    }
+    if (!rx_usec[i])
+      rx_usec[i] = realtime_usec();
+  }
+  return r;
+#else
+  int r = recv(s, bufs, bufsize, 0);
+  if (r < 0)
+    return -1;
+  lens[0] = r;
+  rx_usec[0] = realtime_usec();
+  return 1;
+#endif
+}
+
+
 int main(int argc, char *argv[])
 {
   int error = 0;
@@ -167,7 +487,12 @@ int main(int argc, char *argv[])
     int s;
     ssize_t r;
     struct msg *tm = (struct msg *) tbuf;
-    struct msg *rm = (struct msg *) rbuf;
+    struct msg *rm;
+    struct stats st;
+    char *bufs;
+    size_t bufsize;
+    int lens[BATCH];
+    unsigned long long rx_usec[BATCH];
 
     struct addrinfo hints;
     struct addrinfo *result, *rp;
@@ -250,6 +575,16 @@ int main(int argc, char *argv[])
 
     freeaddrinfo(result);
 
+#ifdef SO_TIMESTAMPNS
+    {
+      int on = 1;
+      if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on) < 0)
+        perror("setsockopt(SO_TIMESTAMPNS)");
+    }
+#endif
+    /* a line-rate burst must fit here until we read it */
+    set_sockbuf(s, SO_RCVBUF, SO_RCVBUFFORCE, "setsockopt(SO_RCVBUF)");
+
     r = send(s, tm, sizeof *tm, 0);
     if (r < 0) {
       pe("send");
@@ -261,41 +596,58 @@ int main(int argc, char *argv[])
 
     ntohmsg(tm); /* swap some fields back so we can use them below */
 
+    memset(&st, 0, sizeof st);
+    st.n = tm->n;
+    st.seen = calloc(tm->n ? tm->n : 1, 1);
+    bufsize = tm->size > sizeof(struct reply) ? tm->size : sizeof(struct reply);
+    bufs = malloc(BATCH * bufsize);
+    if (!st.seen || !bufs) pe("malloc");
+
     do {
       struct pollfd ps = { .fd = s, .events = POLLIN };
 
       r = poll(&ps, 1, 500);
 
       if (ps.revents & POLLIN || ps.revents & POLLERR) {
-        r = recv(s, rbuf, sizeof rbuf, 0);
-        if (r < 0) {
+        int i, got = recv_batch(s, bufs, bufsize, lens, rx_usec);
+        if (got < 0) {
           perror("recv");
 	  error = 1;
 	  break;
         }
-        ntohmsg(rm);
+        for (i = 0; i < got; i++) {
+          struct reply *h = (struct reply *) (bufs + i * bufsize);
+          rm = &h->m;
+          if (lens[i] < (int) sizeof *rm) {
+            fprintf(stderr, "short packet\n");
+            continue;
+          }
+          ntohmsg(rm);
 #if 0
-        printf("recv: %d - %08x %08x %08x %08x %08x\n", r,
-               rm->magic, rm->cmd, rm->cookie, rm->n, rm->size);
-        fflush(stdout);
+          printf("recv: %d - %08x %08x %08x %08x %08x\n", lens[i],
+                 rm->magic, rm->cmd, rm->cookie, rm->n, rm->size);
+          fflush(stdout);
 #endif
 
-        if (rm->magic != MAGIC) {
-          fprintf(stderr, "wrong magic value\n");
-          continue;
-        }
-        if (rm->cookie != tm->cookie) {
-          fprintf(stderr, "wrong cookie value\n");
-          continue;
+          if (rm->magic != MAGIC) {
+            fprintf(stderr, "wrong magic value\n");
+            continue;
+          }
+          if (rm->cookie != tm->cookie) {
+            fprintf(stderr, "wrong cookie value\n");
+            continue;
+          }
+          if (lens[i] >= (int) sizeof *h)
+            stats_add(&st, h, rx_usec[i]);
+          if (count > 0 && rm->n < recent)
+            out_of_order++;
+          if (count > 0 && rm->n == recent)
+            adjacent_dups++;
+          if (adjacent_dups == 0 && out_of_order == 0 && rm->n == consecutive)
+            consecutive++;
+          count++;
+          recent = rm->n;
         }
-        if (count > 0 && rm->n < recent)
-          out_of_order++;
-        if (count > 0 && rm->n == recent)
-          adjacent_dups++;
-        if (adjacent_dups == 0 && out_of_order == 0 && rm->n == consecutive)
-          consecutive++;
-        count++;
-        recent = rm->n;
       }
       if (ps.revents & POLLHUP) {
         fprintf(stderr, "POLLHUP\n");
@@ -314,7 +666,10 @@ int main(int argc, char *argv[])
     if (count > 0 || error == 0) {
       printf("%d bytes -- received %d of %d -- %d consecutive %d ooo %d dups\n",
 	     tm->size, count, tm->n, consecutive, out_of_order, adjacent_dups);
+      stats_print(&st, tm->size);
     }
+    free(bufs);
+    free(st.seen);
     /*end of client */
   }
   return error;
@@ -41,6 +41,7 @@
 #include <netlink/netlink.h>
 #include <netlink/socket.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <sys/select.h>
@@ -51,8 +52,6 @@
 #include <unistd.h>
 
 #include <cinttypes>
-#include <string>
-#include <tr1/unordered_map>
 
 #ifndef UNIT_TESTS
 #define STATIONS_DIR "/tmp/stations"
@@ -62,6 +61,12 @@
 
 #define MAX_CLIENT_AGE_SECS  (4 * 60 * 60)
 
+/* How often to dump all stations for their counters, and how often to
+ * log a summary. Station arrivals are picked up in between from nl80211
+ * events. */
+#define DEFAULT_DUMP_SECS  10
+#define LOG_INTERVAL_SECS  (5 * 60)
+
 
 #ifndef UNIT_TESTS
 static time_t monotime(void) {
@@ -75,6 +80,48 @@ static time_t monotime(void) {
 #endif
 
 
+/*
+ * Time series of rate and signal samples, one column per field. Window
+ * reductions are plain loops over at most two contiguous uint8_t runs,
+ * which the compiler can vectorize. Holds one hour of samples at the
+ * default dump interval.
+ */
+#define SAMPLE_RING_SIZE 360
+
+enum sample_column {
+  SAMPLE_RX_HT_MCS,
+  SAMPLE_RX_VHT_MCS,
+  SAMPLE_RX_WIDTH,
+  SAMPLE_RX_HT_NSS,
+  SAMPLE_RX_VHT_NSS,
+  SAMPLE_RX_SHORT_GI,
+  SAMPLE_TX_HT_MCS,
+  SAMPLE_TX_VHT_MCS,
+  SAMPLE_TX_WIDTH,
+  SAMPLE_TX_HT_NSS,
+  SAMPLE_TX_VHT_NSS,
+  SAMPLE_TX_SHORT_GI,
+  SAMPLE_SIGNAL,  // dBm + SIGNAL_BIAS, so all columns are unsigned
+  NUM_SAMPLE_COLUMNS
+};
+
+#define SIGNAL_BIAS 128
+
+typedef struct sample_ring {
+  uint32_t time[SAMPLE_RING_SIZE];  // CLOCK_MONOTONIC
+  uint8_t col[NUM_SAMPLE_COLUMNS][SAMPLE_RING_SIZE];
+  uint16_t head;  // slot for the next sample
+  uint16_t count;
+} sample_ring_t;
+
+typedef struct sample_summary {
+  int n;
+  uint8_t min;
+  uint8_t max;
+  double mean;
+} sample_summary_t;
+
+
 typedef struct wifi_stats {
   uint64_t rx_drop64;
 
@@ -97,23 +144,7 @@ typedef struct wifi_stats {
   uint32_t tx_failed;
   uint32_t expected_mbps;
 
-#define MAX_SAMPLE_INDEX 150
-  int rx_sample_index;
-  uint8_t rx_ht_mcs_samples[MAX_SAMPLE_INDEX];
-  uint8_t rx_vht_mcs_samples[MAX_SAMPLE_INDEX];
-  uint8_t rx_width_samples[MAX_SAMPLE_INDEX];
-  uint8_t rx_ht_nss_samples[MAX_SAMPLE_INDEX];
-  uint8_t rx_vht_nss_samples[MAX_SAMPLE_INDEX];
-  uint8_t rx_short_gi_samples[MAX_SAMPLE_INDEX];
-  int8_t signal_samples[MAX_SAMPLE_INDEX];
-
-  int tx_sample_index;
-  uint8_t tx_ht_mcs_samples[MAX_SAMPLE_INDEX];
-  uint8_t tx_vht_mcs_samples[MAX_SAMPLE_INDEX];
-  uint8_t tx_width_samples[MAX_SAMPLE_INDEX];
-  uint8_t tx_ht_nss_samples[MAX_SAMPLE_INDEX];
-  uint8_t tx_vht_nss_samples[MAX_SAMPLE_INDEX];
-  uint8_t tx_short_gi_samples[MAX_SAMPLE_INDEX];
+  sample_ring_t samples;
 
   /*
    * Clients spend a lot of time mostly idle, where they
@@ -122,8 +153,8 @@ typedef struct wifi_stats {
    * if we report that MCS rate it gives a misleading
    * picture of what the client is capable of getting.
    *
-   * Instead, we choose the largest sample over the reporting
-   * interval. This is more likely to report a meaningful
+   * Instead, we choose the largest sample over the last
+   * LOG_INTERVAL_SECS. This is more likely to report a meaningful
    * MCS rate.
    */
   uint8_t rx_ht_mcs;
@@ -194,13 +225,35 @@ typedef struct client_state {
   time_t first_seen;  // CLOCK_MONOTONIC
   time_t last_seen;  // CLOCK_MONOTONIC
 
+  /* Hash of the JSON last written to STATIONS_DIR/macstr, 0 if none. */
+  uint64_t json_hash;
+
   wifi_stats_t s;
 } client_state_t;
 
 
-// Hash table of known Wifi clients.
-typedef std::tr1::unordered_map<std::string, client_state_t *> ClientMapType;
-ClientMapType clients;
+/*
+ * Hash table of known Wifi clients, keyed by MAC address packed into the
+ * low 48 bits of a uint64_t. Open addressing with linear probing; keys
+ * above 48 bits can never be a MAC address, so they mark empty and
+ * deleted slots.
+ */
+#define CLIENT_SLOT_EMPTY    (~0ULL)
+#define CLIENT_SLOT_DELETED  (~0ULL - 1)
+#define CLIENT_TABLE_MIN     64
+
+typedef struct client_slot {
+  uint64_t key;
+  client_state_t *state;
+} client_slot_t;
+
+typedef struct client_table {
+  client_slot_t *slots;
+  size_t capacity;  // always a power of two
+  size_t count;     // live entries
+  size_t used;      // live + deleted entries
+} client_table_t;
+client_table_t clients;
 
 
 /* Data about each wifi interface. */
@@ -231,6 +284,44 @@ typedef struct callback_data {
 static FILE *wifi_info_handle = NULL;
 
 
+/* Set by the netlink callbacks once a request has been fully answered. */
+static int nl_done = 0;
+
+
+/*
+ * Stations announced by NL80211_CMD_NEW_STATION events, waiting for a
+ * GET_STATION to fetch their details.
+ */
+#define MAX_PENDING_STATIONS 32
+typedef struct pending_station {
+  int ifindex;
+  uint8_t mac[ETH_ALEN];
+} pending_station_t;
+static pending_station_t pending_stations[MAX_PENDING_STATIONS];
+static int npending_stations = 0;
+
+/* Set when events were lost and a full station dump is needed. */
+static int need_station_dump = 0;
+
+/* Set when nl80211 reports interfaces coming or going. */
+static int interfaces_changed = 0;
+
+
+/*
+ * Optional single file holding every station, for readers which would
+ * rather not scan STATIONS_DIR. It is replaced by rename() so a reader
+ * can mmap() it and always see one complete generation.
+ */
+static const char *snapshot_file = NULL;
+static uint64_t snapshot_generation = 0;
+
+/* Set when any station file was written or removed. */
+static int stations_changed = 0;
+
+/* Largest JSON object we expect for one station. */
+#define MAX_STATION_JSON 4096
+
+
 static void ClearClientStateCounters(client_state_t *state)
 {
   char macstr[MAC_STR_LEN];
@@ -272,7 +363,7 @@ static int GetIfIndex(const char *ifname)
 }  /* GetIfIndex */
 
 
-static void ProcessNetlinkMessages(struct nl_sock *nlsk, int *done)
+static void ProcessNetlinkMessages(struct nl_sock *nlsk)
 {
   for (;;) {
     int s = nl_socket_get_fd(nlsk);
@@ -290,13 +381,27 @@ static void ProcessNetlinkMessages(struct nl_sock *nlsk, int *done)
       nl_recvmsgs_default(nlsk);
     }
 
-    if (*done) {
+    if (nl_done) {
       break;
     }
   }
 }
 
 
+static int FindInterface(int ifindex)
+{
+  int i;
+
+  for (i = 0; i < ninterfaces; ++i) {
+    if (interfaces[i].ifindex == ifindex) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
 static uint32_t GetBitrate(struct nlattr *attr)
 {
   int rate = 0;
@@ -385,9 +490,146 @@ static int HtMcsToNss(int rxmcs)
 }
 
 
+/*
+ * Appends a sample taken at time t and returns its slot. Fields missing
+ * from the new sample keep the value of the previous one.
+ */
+static int SampleAppend(sample_ring_t *r, time_t t)
+{
+  int n = r->head;
+  int prev = (n + SAMPLE_RING_SIZE - 1) % SAMPLE_RING_SIZE;
+  int c;
+
+  for (c = 0; c < NUM_SAMPLE_COLUMNS; ++c) {
+    r->col[c][n] = r->count ? r->col[c][prev] : 0;
+  }
+  if (r->count == 0) {
+    r->col[SAMPLE_SIGNAL][n] = SIGNAL_BIAS;
+  }
+  r->time[n] = t;
+
+  r->head = (n + 1) % SAMPLE_RING_SIZE;
+  if (r->count < SAMPLE_RING_SIZE) {
+    r->count++;
+  }
+
+  return n;
+}
+
+
+/* Slot of the i'th oldest sample. */
+static int SampleSlot(const sample_ring_t *r, int i)
+{
+  return (r->head + SAMPLE_RING_SIZE - r->count + i) % SAMPLE_RING_SIZE;
+}
+
+
+/*
+ * Finds the samples taken at or after since. Returns how many there are
+ * and sets *start to the slot of the oldest one.
+ */
+static int SampleWindow(const sample_ring_t *r, time_t since, int *start)
+{
+  int lo = 0, hi = r->count;
+
+  /* Samples are appended in time order, so binary search. */
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((time_t)r->time[SampleSlot(r, mid)] < since) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  *start = SampleSlot(r, lo);
+  return r->count - lo;
+}
+
+
+static void ReduceSamples(const uint8_t *v, int len,
+                          uint8_t *min, uint8_t *max, uint32_t *sum)
+{
+  uint8_t lo = *min, hi = *max;
+  uint32_t total = 0;
+  int i;
+
+  for (i = 0; i < len; ++i) {
+    lo = (v[i] < lo) ? v[i] : lo;
+    hi = (v[i] > hi) ? v[i] : hi;
+    total += v[i];
+  }
+
+  *min = lo;
+  *max = hi;
+  *sum += total;
+}
+
+
+/* min, max and mean of one column over the samples taken since. */
+static void SampleSummary(const sample_ring_t *r, int column, time_t since,
+                          sample_summary_t *summary)
+{
+  const uint8_t *v = r->col[column];
+  uint8_t min = 0xff, max = 0;
+  uint32_t sum = 0;
+  int start, n, first;
+
+  memset(summary, 0, sizeof(*summary));
+  if ((n = SampleWindow(r, since, &start)) == 0) {
+    return;
+  }
+
+  /* The window is at most two contiguous runs: to the end of the
+   * array, then wrapped around from the beginning. */
+  first = (start + n <= SAMPLE_RING_SIZE) ? n : SAMPLE_RING_SIZE - start;
+  ReduceSamples(v + start, first, &min, &max, &sum);
+  ReduceSamples(v, n - first, &min, &max, &sum);
+
+  summary->n = n;
+  summary->min = min;
+  summary->max = max;
+  summary->mean = (double)sum / n;
+}
+
+
+/* The pct'th percentile of one column over the samples taken since. */
+static uint8_t SamplePercentile(const sample_ring_t *r, int column,
+                                time_t since, int pct)
+{
+  const uint8_t *v = r->col[column];
+  uint16_t histogram[256];
+  int start, n, i, rank, seen;
+
+  if ((n = SampleWindow(r, since, &start)) == 0) {
+    return 0;
+  }
+
+  memset(histogram, 0, sizeof(histogram));
+  for (i = 0; i < n; ++i) {
+    histogram[v[(start + i) % SAMPLE_RING_SIZE]]++;
+  }
+
+  /* Nearest-rank: the smallest value with at least pct% of samples at
+   * or below it. */
+  rank = (pct * n + 99) / 100;
+  if (rank < 1) rank = 1;
+  for (i = 0, seen = 0; i < 256; ++i) {
+    seen += histogram[i];
+    if (seen >= rank) {
+      return i;
+    }
+  }
+
+  return 255;
+}
+
+
 static int ParseWifiStats(struct nlattr *sta_info, wifi_stats_t *stats)
 {
   struct nlattr *si[NL80211_STA_INFO_MAX + 1] = {0};
+  sample_ring_t *r = &stats->samples;
+  int n = -1;
   static struct nla_policy stats_policy[NL80211_STA_INFO_MAX + 1];
 
   memset(&stats_policy, 0, sizeof(stats_policy));
@@ -425,42 +667,36 @@ static int ParseWifiStats(struct nlattr *sta_info, wifi_stats_t *stats)
     }
   }
 
+  if (si[NL80211_STA_INFO_RX_BITRATE] || si[NL80211_STA_INFO_TX_BITRATE]) {
+    n = SampleAppend(r, monotime());
+  }
+
   if (si[NL80211_STA_INFO_RX_BITRATE]) {
     int rx_ht_mcs=0, rx_vht_mcs=0, rx_vht_nss=0, rx_width=0, rx_short_gi=0;
     int ht_nss;
-    int n = stats->rx_sample_index + 1;
-
-    if (n >= MAX_SAMPLE_INDEX) n = 0;
 
     stats->rx_bitrate = GetBitrate(si[NL80211_STA_INFO_RX_BITRATE]);
     GetMCS(si[NL80211_STA_INFO_RX_BITRATE], &rx_ht_mcs, &rx_vht_mcs,
         &rx_width, &rx_short_gi, &rx_vht_nss);
 
-    stats->rx_ht_mcs_samples[n] = rx_ht_mcs;
+    r->col[SAMPLE_RX_HT_MCS][n] = rx_ht_mcs;
     if (rx_ht_mcs > stats->rx_max_ht_mcs) stats->rx_max_ht_mcs = rx_ht_mcs;
 
     ht_nss = HtMcsToNss(rx_ht_mcs);
-    stats->rx_ht_nss_samples[n] = ht_nss;
+    r->col[SAMPLE_RX_HT_NSS][n] = ht_nss;
     if (ht_nss > stats->rx_max_ht_nss) stats->rx_max_ht_nss = ht_nss;
 
-    stats->rx_vht_mcs_samples[n] = rx_vht_mcs;
+    r->col[SAMPLE_RX_VHT_MCS][n] = rx_vht_mcs;
     if (rx_vht_mcs > stats->rx_max_vht_mcs) stats->rx_max_vht_mcs = rx_vht_mcs;
 
-    stats->rx_vht_nss_samples[n] = rx_vht_nss;
+    r->col[SAMPLE_RX_VHT_NSS][n] = rx_vht_nss;
     if (rx_vht_nss > stats->rx_max_vht_nss) stats->rx_max_vht_nss = rx_vht_nss;
 
-    stats->rx_short_gi_samples[n] = rx_short_gi;
+    r->col[SAMPLE_RX_SHORT_GI][n] = rx_short_gi;
     if (rx_short_gi) stats->ever_rx_short_gi = 1;
 
-    stats->rx_width_samples[n] = rx_width;
+    r->col[SAMPLE_RX_WIDTH][n] = rx_width;
     if (rx_width > stats->rx_max_width) stats->rx_max_width = rx_width;
-
-    if (si[NL80211_STA_INFO_SIGNAL]) {
-      int8_t signal = (int8_t)nla_get_u8(si[NL80211_STA_INFO_SIGNAL]);
-      stats->signal_samples[n] = signal;
-    }
-
-    stats->rx_sample_index = n;
   }
   if (si[NL80211_STA_INFO_RX_BYTES]) {
     uint32_t last_rx_bytes = stats->rx_bytes;
@@ -475,34 +711,29 @@ static int ParseWifiStats(struct nlattr *sta_info, wifi_stats_t *stats)
   if (si[NL80211_STA_INFO_TX_BITRATE]) {
     int tx_ht_mcs=0, tx_vht_mcs=0, tx_vht_nss=0, tx_width=0, tx_short_gi=0;
     int ht_nss;
-    int n = stats->tx_sample_index + 1;
-
-    if (n >= MAX_SAMPLE_INDEX) n = 0;
 
     stats->tx_bitrate = GetBitrate(si[NL80211_STA_INFO_TX_BITRATE]);
     GetMCS(si[NL80211_STA_INFO_TX_BITRATE], &tx_ht_mcs, &tx_vht_mcs,
         &tx_width, &tx_short_gi, &tx_vht_nss);
 
-    stats->tx_ht_mcs_samples[n] = tx_ht_mcs;
+    r->col[SAMPLE_TX_HT_MCS][n] = tx_ht_mcs;
     if (tx_ht_mcs > stats->tx_max_ht_mcs) stats->tx_max_ht_mcs = tx_ht_mcs;
 
     ht_nss = HtMcsToNss(tx_ht_mcs);
-    stats->tx_ht_nss_samples[n] = ht_nss;
+    r->col[SAMPLE_TX_HT_NSS][n] = ht_nss;
     if (ht_nss > stats->tx_max_ht_nss) stats->tx_max_ht_nss = ht_nss;
 
-    stats->tx_vht_mcs_samples[n] = tx_vht_mcs;
+    r->col[SAMPLE_TX_VHT_MCS][n] = tx_vht_mcs;
     if (tx_vht_mcs > stats->tx_max_vht_mcs) stats->tx_max_vht_mcs = tx_vht_mcs;
 
-    stats->tx_vht_nss_samples[n] = tx_vht_nss;
+    r->col[SAMPLE_TX_VHT_NSS][n] = tx_vht_nss;
     if (tx_vht_nss > stats->tx_max_vht_nss) stats->tx_max_vht_nss = tx_vht_nss;
 
-    stats->tx_short_gi_samples[n] = tx_short_gi;
+    r->col[SAMPLE_TX_SHORT_GI][n] = tx_short_gi;
     if (tx_short_gi) stats->ever_tx_short_gi = 1;
 
-    stats->tx_width_samples[n] = tx_width;
+    r->col[SAMPLE_TX_WIDTH][n] = tx_width;
     if (tx_width > stats->tx_max_width) stats->tx_max_width = tx_width;
-
-    stats->tx_sample_index = n;
   }
   if (si[NL80211_STA_INFO_TX_BYTES]) {
     uint32_t last_tx_bytes = stats->tx_bytes;
@@ -529,6 +760,9 @@ static int ParseWifiStats(struct nlattr *sta_info, wifi_stats_t *stats)
   }
   if (si[NL80211_STA_INFO_SIGNAL]) {
     stats->signal = (int8_t)nla_get_u8(si[NL80211_STA_INFO_SIGNAL]);
+    if (n >= 0) {
+      r->col[SAMPLE_SIGNAL][n] = stats->signal + SIGNAL_BIAS;
+    }
   }
   if (si[NL80211_STA_INFO_SIGNAL_AVG]) {
     stats->signal_avg = (int8_t)nla_get_u8(si[NL80211_STA_INFO_SIGNAL_AVG]);
@@ -596,9 +830,8 @@ static int BssInfoCallback(struct nl_msg *msg, void *arg)
   struct nlattr *nl[NL80211_ATTR_MAX + 1];
   struct nlattr *bi[NL80211_BSS_MAX + 1];
   struct genlmsghdr *gh = (struct genlmsghdr *)nlmsg_data(nlmsg_hdr(msg));
-  wifi_interface_t *wif = NULL;
-  uint32_t ifindex;
-  int i;
+  wifi_interface_t *wif;
+  int n;
   static struct nla_policy bss_policy[NL80211_BSS_MAX + 1];
 
   memset(&bss_policy, 0, sizeof(bss_policy));
@@ -619,16 +852,10 @@ static int BssInfoCallback(struct nl_msg *msg, void *arg)
     return NL_SKIP;
   }
 
-  ifindex = nla_get_u32(nl[NL80211_ATTR_IFINDEX]);
-  for (i = 0; i < ninterfaces; ++i) {
-    if (interfaces[i].ifindex == (int)ifindex) {
-      wif = &interfaces[i];
-      break;
-    }
-  }
-  if (wif == NULL) {
+  if ((n = FindInterface(nla_get_u32(nl[NL80211_ATTR_IFINDEX]))) < 0) {
     return NL_SKIP;
   }
+  wif = &interfaces[n];
 
   if (nla_parse_nested(bi, NL80211_BSS_MAX, nl[NL80211_ATTR_BSS],
         bss_policy)) {
@@ -659,9 +886,7 @@ static int InterfaceInfoCallback(struct nl_msg *msg, void *arg)
 {
   struct nlattr *si[NL80211_ATTR_MAX + 1];
   struct genlmsghdr *gh = (struct genlmsghdr *)nlmsg_data(nlmsg_hdr(msg));
-  wifi_interface_t *wif = NULL;
-  uint32_t ifindex;
-  int i;
+  int n;
 
   nla_parse(si, NL80211_ATTR_MAX, genlmsg_attrdata(gh, 0),
       genlmsg_attrlen(gh, 0), NULL);
@@ -670,20 +895,12 @@ static int InterfaceInfoCallback(struct nl_msg *msg, void *arg)
     return NL_SKIP;
   }
 
-  ifindex = nla_get_u32(si[NL80211_ATTR_IFINDEX]);
-  for (i = 0; i < ninterfaces; ++i) {
-    if (interfaces[i].ifindex == (int)ifindex) {
-      wif = &interfaces[i];
-      break;
-    }
-  }
-
-  if (wif == NULL) {
+  if ((n = FindInterface(nla_get_u32(si[NL80211_ATTR_IFINDEX]))) < 0) {
     return NL_SKIP;
   }
 
   if (si[NL80211_ATTR_STA_INFO]) {
-    ParseWifiStats(si[NL80211_ATTR_STA_INFO], &wif->s);
+    ParseWifiStats(si[NL80211_ATTR_STA_INFO], &interfaces[n].s);
   }
 
   return NL_OK;
@@ -699,6 +916,7 @@ static void HandleNLCommand(struct nl_sock *nlsk, int nl80211_id,
   int ifindex = n >= 0 ? interfaces[n].ifindex : -1;
   const char *ifname = n >= 0 ? interfaces[n].ifname : NULL;
 
+  nl_done = 0;
   if (nl_socket_modify_cb(nlsk, NL_CB_VALID, NL_CB_CUSTOM,
                           cb, (void *)ifname)) {
     fprintf(stderr, "nl_socket_modify_cb failed\n");
@@ -740,20 +958,45 @@ void RequestInterfaceList(struct nl_sock *nlsk, int nl80211_id)
 }
 
 
+/*
+ * Re-reads the list of wifi interfaces. Interfaces which are still
+ * present keep their stats, so sample windows span the refresh.
+ */
+void RefreshInterfaces(struct nl_sock *nlsk, int nl80211_id)
+{
+  static wifi_interface_t old[NINTERFACES];
+  int nold = ninterfaces;
+  int i, j;
+
+  memcpy(old, interfaces, sizeof(old));
+  ninterfaces = 0;
+  memset(interfaces, 0, sizeof(interfaces));
+  RequestInterfaceList(nlsk, nl80211_id);
+  ProcessNetlinkMessages(nlsk);
+
+  for (i = 0; i < ninterfaces; ++i) {
+    for (j = 0; j < nold; ++j) {
+      if (strcmp(interfaces[i].ifname, old[j].ifname) == 0) {
+        interfaces[i].s = old[j].s;
+        break;
+      }
+    }
+  }
+}
+
+
 void RequestInterfaceInfo(struct nl_sock *nlsk, int nl80211_id, int n)
 {
-  int done = 0;
   wifi_interface_t *wif = &interfaces[n];
 
   HandleNLCommand(nlsk, nl80211_id, n, NULL, BssInfoCallback,
                   NL80211_CMD_GET_SCAN, NLM_F_DUMP);
-  ProcessNetlinkMessages(nlsk, &done);
+  ProcessNetlinkMessages(nlsk);
 
   if (wif->is_client) {
-    done = 0;
     HandleNLCommand(nlsk, nl80211_id, n, wif->bssid, InterfaceInfoCallback,
                     NL80211_CMD_GET_STATION, 0);
-    ProcessNetlinkMessages(nlsk, &done);
+    ProcessNetlinkMessages(nlsk);
   }
 }
 
@@ -766,6 +1009,16 @@ int NlFinish(struct nl_msg *msg, void *arg)
 }
 
 
+/* A failed request (e.g. GET_STATION for a station which already left)
+ * is answered with an error instead of an ACK. */
+int NlError(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+  int *ret = (int *)arg;
+  *ret = 1;
+  return NL_STOP;
+}
+
+
 struct nl_sock *InitNetlinkSocket()
 {
   struct nl_sock *nlsk;
@@ -789,25 +1042,137 @@ struct nl_sock *InitNetlinkSocket()
 
 
 
-static client_state_t *FindClientState(const uint8_t mac[6])
+
+static uint64_t MacToKey(const uint8_t mac[ETH_ALEN])
+{
+  return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+         ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+         ((uint64_t)mac[4] << 8) | (uint64_t)mac[5];
+}
+
+
+static size_t ClientSlotIndex(uint64_t key, size_t capacity)
+{
+  uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+  return (size_t)(h ^ (h >> 32)) & (capacity - 1);
+}
+
+
+static void ClientTableResize(size_t capacity)
+{
+  client_slot_t *old = clients.slots;
+  size_t old_capacity = clients.capacity;
+  size_t i;
+
+  clients.slots = (client_slot_t *)malloc(capacity * sizeof(client_slot_t));
+  if (clients.slots == NULL) {
+    fprintf(stderr, "ClientTableResize: malloc failed\n");
+    exit(1);
+  }
+  for (i = 0; i < capacity; ++i) {
+    clients.slots[i].key = CLIENT_SLOT_EMPTY;
+    clients.slots[i].state = NULL;
+  }
+  clients.capacity = capacity;
+  clients.used = clients.count;
+
+  for (i = 0; i < old_capacity; ++i) {
+    if (old[i].key < CLIENT_SLOT_DELETED) {
+      size_t n = ClientSlotIndex(old[i].key, capacity);
+      while (clients.slots[n].key != CLIENT_SLOT_EMPTY) {
+        n = (n + 1) & (capacity - 1);
+      }
+      clients.slots[n] = old[i];
+    }
+  }
+  free(old);
+}
+
+
+/* Returns the slot holding key, or the free slot where it would go. */
+static client_slot_t *ClientTableLookup(uint64_t key)
 {
-  ClientMapType::iterator it;
+  client_slot_t *deleted = NULL;
+  size_t n;
+
+  if (clients.capacity == 0) {
+    ClientTableResize(CLIENT_TABLE_MIN);
+  }
+
+  n = ClientSlotIndex(key, clients.capacity);
+  for (;;) {
+    client_slot_t *slot = &clients.slots[n];
+    if (slot->key == key) {
+      return slot;
+    }
+    if (slot->key == CLIENT_SLOT_EMPTY) {
+      return deleted ? deleted : slot;
+    }
+    if (slot->key == CLIENT_SLOT_DELETED && deleted == NULL) {
+      deleted = slot;
+    }
+    n = (n + 1) & (clients.capacity - 1);
+  }
+}
+
+
+static void ClientTableErase(client_slot_t *slot)
+{
+  free(slot->state);
+  slot->key = CLIENT_SLOT_DELETED;
+  slot->state = NULL;
+  clients.count--;
+}
+
+
+static client_state_t *LookupClientState(const uint8_t mac[ETH_ALEN])
+{
+  uint64_t key = MacToKey(mac);
+  client_slot_t *slot = ClientTableLookup(key);
+
+  return (slot->key == key) ? slot->state : NULL;
+}
+
+
+static client_state_t *FindClientState(const uint8_t mac[ETH_ALEN])
+{
+  uint64_t key = MacToKey(mac);
+  client_slot_t *slot = ClientTableLookup(key);
   client_state_t *s;
-  char macstr[MAC_STR_LEN];
 
-  snprintf(macstr, sizeof(macstr), "%02x:%02x:%02x:%02x:%02x:%02x",
+  if (slot->key == key) {
+    return slot->state;
+  }
+
+  /* Keep at least a quarter of the slots empty so probes stay short. Only
+   * grow if live entries need the room; otherwise rehashing at the same
+   * size is enough to sweep out deleted slots. */
+  if (slot->key == CLIENT_SLOT_EMPTY &&
+      (clients.used + 1) * 4 > clients.capacity * 3) {
+    size_t capacity = clients.capacity;
+    if ((clients.count + 1) * 2 > capacity) {
+      capacity *= 2;
+    }
+    ClientTableResize(capacity);
+    slot = ClientTableLookup(key);
+  }
+
+  s = (client_state_t *)malloc(sizeof(*s));
+  if (s == NULL) {
+    fprintf(stderr, "FindClientState: malloc failed\n");
+    exit(1);
+  }
+  memset(s, 0, sizeof(*s));
+  snprintf(s->macstr, sizeof(s->macstr), "%02x:%02x:%02x:%02x:%02x:%02x",
       mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  s->first_seen = monotime();
 
-  /* Find any existing state for this STA, or allocate new. */
-  if ((it = clients.find(macstr)) == clients.end()) {
-    s = (client_state_t *)malloc(sizeof(*s));
-    memset(s, 0, sizeof(*s));
-    memcpy(s->macstr, macstr, sizeof(s->macstr));
-    s->first_seen = monotime();
-    clients[std::string(macstr)] = s;
-  } else {
-    s = it->second;
+  if (slot->key == CLIENT_SLOT_EMPTY) {
+    clients.used++;
   }
+  clients.count++;
+  slot->key = key;
+  slot->state = s;
 
   return s;
 }
@@ -863,6 +1228,92 @@ void RequestAssociatedDevices(struct nl_sock *nlsk,
 }  /* RequestAssociatedDevices */
 
 
+/*
+ * Handles nl80211 multicast events. New stations are queued for a
+ * GET_STATION rather than waiting for the next periodic dump.
+ */
+int StationEventCallback(struct nl_msg *msg, void *arg)
+{
+  struct genlmsghdr *gh = (struct genlmsghdr *)nlmsg_data(nlmsg_hdr(msg));
+  struct nlattr *tb[NL80211_ATTR_MAX + 1] = {0};
+  const uint8_t *mac;
+  client_state_t *state;
+  int ifindex;
+
+  if (gh->cmd == NL80211_CMD_NEW_INTERFACE ||
+      gh->cmd == NL80211_CMD_DEL_INTERFACE) {
+    interfaces_changed = 1;
+    return NL_SKIP;
+  }
+
+  if (gh->cmd != NL80211_CMD_NEW_STATION &&
+      gh->cmd != NL80211_CMD_DEL_STATION) {
+    return NL_SKIP;
+  }
+
+  if (nla_parse(tb, NL80211_ATTR_MAX,
+                genlmsg_attrdata(gh, 0), genlmsg_attrlen(gh, 0), NULL)) {
+    fprintf(stderr, "nla_parse failed.\n");
+    return NL_SKIP;
+  }
+
+  if (!tb[NL80211_ATTR_IFINDEX] || !tb[NL80211_ATTR_MAC]) {
+    return NL_SKIP;
+  }
+
+  ifindex = nla_get_u32(tb[NL80211_ATTR_IFINDEX]);
+  if (FindInterface(ifindex) < 0) {
+    interfaces_changed = 1;
+    return NL_SKIP;
+  }
+
+  mac = (const uint8_t *)nla_data(tb[NL80211_ATTR_MAC]);
+  if (gh->cmd == NL80211_CMD_NEW_STATION) {
+    if (npending_stations < MAX_PENDING_STATIONS) {
+      pending_station_t *p = &pending_stations[npending_stations++];
+      p->ifindex = ifindex;
+      memcpy(p->mac, mac, sizeof(p->mac));
+    } else {
+      need_station_dump = 1;
+    }
+  } else if ((state = LookupClientState(mac)) != NULL) {
+    state->last_seen = monotime();
+  }
+
+  return NL_OK;
+}  /* StationEventCallback */
+
+
+/* Subscribes to nl80211 station and interface add/remove events. */
+struct nl_sock *InitEventSocket(struct nl_sock *nlsk)
+{
+  static const char *groups[] = {"mlme", "config"};
+  struct nl_sock *evsk = InitNetlinkSocket();
+  size_t i;
+
+  nl_socket_disable_seq_check(evsk);
+  for (i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i) {
+    int grp = genl_ctrl_resolve_grp(nlsk, "nl80211", groups[i]);
+    if (grp < 0) {
+      fprintf(stderr, "genl_ctrl_resolve_grp %s failed\n", groups[i]);
+      exit(1);
+    }
+    if (nl_socket_add_membership(evsk, grp)) {
+      fprintf(stderr, "nl_socket_add_membership %s failed\n", groups[i]);
+      exit(1);
+    }
+  }
+
+  if (nl_socket_modify_cb(evsk, NL_CB_VALID, NL_CB_CUSTOM,
+                          StationEventCallback, NULL)) {
+    fprintf(stderr, "nl_socket_modify_cb failed\n");
+    exit(1);
+  }
+
+  return evsk;
+}  /* InitEventSocket */
+
+
 static void ClearClientCounters(client_state_t *state)
 {
   /* Kernel cleared its counters when client re-joined the WLAN,
@@ -884,6 +1335,7 @@ static int AgeOutClient(client_state_t *state)
     char filename[PATH_MAX];
     snprintf(filename, sizeof(filename), "%s/%s", STATIONS_DIR, state->macstr);
     unlink(filename);
+    stations_changed = 1;
     return 1;
   }
 
@@ -897,107 +1349,94 @@ static int AgeOutClient(client_state_t *state)
 }
 
 
-static void ConsolidateSamples(wifi_stats_t *stats)
+static uint8_t SampleMax(const sample_ring_t *r, int column, time_t since)
 {
-  int i;
-  uint8_t rx_ht_mcs=0, rx_vht_mcs=0, rx_width=0, rx_ht_nss=0;
-  uint8_t rx_vht_nss=0, rx_short_gi=0;
-  uint8_t tx_ht_mcs=0, tx_vht_mcs=0, tx_width=0, tx_ht_nss=0;
-  uint8_t tx_vht_nss=0, tx_short_gi=0;
-  double max_signal = -1000.0;
-  double min_signal = 0.0;
-  double sum_signal = 0.0;
-
-  for (i = 0; i < MAX_SAMPLE_INDEX; ++i) {
-    if (stats->rx_ht_mcs_samples[i] > rx_ht_mcs) {
-      rx_ht_mcs = stats->rx_ht_mcs_samples[i];
-    }
-    if (stats->rx_vht_mcs_samples[i] > rx_vht_mcs) {
-      rx_vht_mcs = stats->rx_vht_mcs_samples[i];
-    }
-    if (stats->rx_width_samples[i] > rx_width) {
-      rx_width = stats->rx_width_samples[i];
-    }
-    if (stats->rx_ht_nss_samples[i] > rx_ht_nss) {
-      rx_ht_nss = stats->rx_ht_nss_samples[i];
-    }
-    if (stats->rx_vht_nss_samples[i] > rx_vht_nss) {
-      rx_vht_nss = stats->rx_vht_nss_samples[i];
-    }
-    if (stats->rx_short_gi_samples[i] > rx_short_gi) {
-      rx_short_gi = stats->rx_short_gi_samples[i];
-    }
-
-    if (stats->signal_samples[i] > max_signal) {
-      max_signal = stats->signal_samples[i];
-    }
-    if (stats->signal_samples[i] < min_signal) {
-      min_signal = stats->signal_samples[i];
-    }
-    sum_signal += stats->signal_samples[i];
-
-    if (stats->tx_ht_mcs_samples[i] > tx_ht_mcs) {
-      tx_ht_mcs = stats->tx_ht_mcs_samples[i];
-    }
-    if (stats->tx_vht_mcs_samples[i] > tx_vht_mcs) {
-      tx_vht_mcs = stats->tx_vht_mcs_samples[i];
-    }
-    if (stats->tx_width_samples[i] > tx_width) {
-      tx_width = stats->tx_width_samples[i];
-    }
-    if (stats->tx_ht_nss_samples[i] > tx_ht_nss) {
-      tx_ht_nss = stats->tx_ht_nss_samples[i];
-    }
-    if (stats->tx_vht_nss_samples[i] > tx_vht_nss) {
-      tx_vht_nss = stats->tx_vht_nss_samples[i];
-    }
-    if (stats->tx_short_gi_samples[i] > tx_short_gi) {
-      tx_short_gi = stats->tx_short_gi_samples[i];
-    }
-  }
-
-  stats->rx_ht_mcs = rx_ht_mcs;
-  stats->rx_vht_mcs = rx_vht_mcs;
-  stats->rx_width = rx_width;
-  stats->rx_ht_nss = rx_ht_nss;
-  stats->rx_vht_nss = rx_vht_nss;
-  stats->rx_short_gi = rx_short_gi;
+  sample_summary_t summary;
 
-  stats->max_signal = max_signal;
-  stats->min_signal = min_signal;
-  stats->avg_signal = sum_signal / (double)MAX_SAMPLE_INDEX;
-
-  stats->tx_ht_mcs = tx_ht_mcs;
-  stats->tx_vht_mcs = tx_vht_mcs;
-  stats->tx_width = tx_width;
-  stats->tx_ht_nss = tx_ht_nss;
-  stats->tx_vht_nss = tx_vht_nss;
-  stats->tx_short_gi = tx_short_gi;
+  SampleSummary(r, column, since, &summary);
+  return summary.max;
 }
 
 
-static void ClientStateToJson(const client_state_t *state)
+/* Summarizes the samples over the last LOG_INTERVAL_SECS. */
+static void ConsolidateSamples(wifi_stats_t *stats)
 {
-  char tmpfile[PATH_MAX];
-  char filename[PATH_MAX];
-  time_t mono_now = monotime();
-  FILE *f;
+  const sample_ring_t *r = &stats->samples;
+  time_t since = monotime() - LOG_INTERVAL_SECS;
+  sample_summary_t summary;
+
+  stats->rx_ht_mcs = SampleMax(r, SAMPLE_RX_HT_MCS, since);
+  stats->rx_vht_mcs = SampleMax(r, SAMPLE_RX_VHT_MCS, since);
+  stats->rx_width = SampleMax(r, SAMPLE_RX_WIDTH, since);
+  stats->rx_ht_nss = SampleMax(r, SAMPLE_RX_HT_NSS, since);
+  stats->rx_vht_nss = SampleMax(r, SAMPLE_RX_VHT_NSS, since);
+  stats->rx_short_gi = SampleMax(r, SAMPLE_RX_SHORT_GI, since);
+
+  stats->tx_ht_mcs = SampleMax(r, SAMPLE_TX_HT_MCS, since);
+  stats->tx_vht_mcs = SampleMax(r, SAMPLE_TX_VHT_MCS, since);
+  stats->tx_width = SampleMax(r, SAMPLE_TX_WIDTH, since);
+  stats->tx_ht_nss = SampleMax(r, SAMPLE_TX_HT_NSS, since);
+  stats->tx_vht_nss = SampleMax(r, SAMPLE_TX_VHT_NSS, since);
+  stats->tx_short_gi = SampleMax(r, SAMPLE_TX_SHORT_GI, since);
+
+  SampleSummary(r, SAMPLE_SIGNAL, since, &summary);
+  if (summary.n) {
+    stats->max_signal = (double)summary.max - SIGNAL_BIAS;
+    stats->min_signal = (double)summary.min - SIGNAL_BIAS;
+    stats->avg_signal = summary.mean - SIGNAL_BIAS;
+  } else {
+    stats->max_signal = stats->min_signal = stats->avg_signal = 0.0;
+  }
+}
 
-  snprintf(tmpfile, sizeof(tmpfile), "%s/%s.new", STATIONS_DIR, state->macstr);
-  snprintf(filename, sizeof(filename), "%s/%s", STATIONS_DIR, state->macstr);
 
-  if ((f = fopen(tmpfile, "w+")) == NULL) {
-    char errbuf[80];
-    snprintf(errbuf, sizeof(errbuf), "fopen %s", tmpfile);
-    perror(errbuf);
-    return;
+/*
+ * Formats signal strength over the longer windows our RF analysis uses,
+ * as " rssi15m:min/mean/max/median rssi1h:...".
+ */
+static void FormatSignalWindows(const sample_ring_t *r, time_t mono_now,
+                                char *buf, size_t len)
+{
+  static const struct {
+    const char *name;
+    time_t secs;
+  } windows[] = {
+    {"15m", 15 * 60},
+    {"1h", 60 * 60},
+  };
+  size_t i, used = 0;
+
+  buf[0] = '\0';
+  for (i = 0; i < sizeof(windows) / sizeof(windows[0]) && used < len; ++i) {
+    time_t since = mono_now - windows[i].secs;
+    sample_summary_t summary;
+    int median;
+
+    SampleSummary(r, SAMPLE_SIGNAL, since, &summary);
+    if (summary.n == 0) {
+      continue;
+    }
+    median = SamplePercentile(r, SAMPLE_SIGNAL, since, 50);
+    used += snprintf(buf + used, len - used, " rssi%s:%d/%0.2f/%d/%d",
+        windows[i].name, summary.min - SIGNAL_BIAS,
+        summary.mean - SIGNAL_BIAS, summary.max - SIGNAL_BIAS,
+        median - SIGNAL_BIAS);
   }
+}
+
 
+/*
+ * Files are only rewritten when their JSON changes, so this leaves out
+ * inactive_msec, which grows on every dump for an idle client and would
+ * be stale anyway. "inactive since" carries the same information.
+ */
+static void PrintClientJson(FILE *f, const client_state_t *state,
+                            time_t mono_now)
+{
   fprintf(f, "{\n");
 
   fprintf(f, "  \"addr\": \"%s\",\n", state->macstr);
   fprintf(f, "  \"inactive since\": %.3f,\n", state->s.inactive_since);
-  fprintf(f, "  \"inactive msec\": %u,\n", state->s.inactive_msec);
 
   fprintf(f, "  \"active\": %s,\n",
       ((mono_now - state->last_seen) < 600) ? "true" : "false");
@@ -1054,6 +1493,68 @@ static void ClientStateToJson(const client_state_t *state)
 
   fprintf(f, "  \"ifname\": \"%s\"\n", state->ifname);
   fprintf(f, "}\n");
+}
+
+
+/* FNV-1a. */
+static uint64_t HashBytes(const char *buf, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    h ^= (uint8_t)buf[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+
+/* Writes STATIONS_DIR/macstr, unless it already holds the same JSON. */
+static void ClientStateToJson(client_state_t *state)
+{
+  char buf[MAX_STATION_JSON];
+  char tmpfile[PATH_MAX];
+  char filename[PATH_MAX];
+  uint64_t hash;
+  long len;
+  FILE *f;
+
+  if ((f = fmemopen(buf, sizeof(buf), "w")) == NULL) {
+    perror("fmemopen");
+    return;
+  }
+  PrintClientJson(f, state, monotime());
+  len = ftell(f);
+  fclose(f);
+  if (len <= 0 || len >= (long)sizeof(buf)) {
+    fprintf(stderr, "%s: JSON for %s does not fit in %zu bytes\n",
+        __FUNCTION__, state->macstr, sizeof(buf));
+    return;
+  }
+
+  hash = HashBytes(buf, len);
+  if (hash == state->json_hash) {
+    return;
+  }
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s/%s.new", STATIONS_DIR, state->macstr);
+  snprintf(filename, sizeof(filename), "%s/%s", STATIONS_DIR, state->macstr);
+
+  if ((f = fopen(tmpfile, "w+")) == NULL) {
+    char errbuf[PATH_MAX + 16];
+    snprintf(errbuf, sizeof(errbuf), "fopen %s", tmpfile);
+    perror(errbuf);
+    return;
+  }
+
+  if (fwrite(buf, 1, len, f) != (size_t)len) {
+    perror("fwrite");
+    fclose(f);
+    unlink(tmpfile);
+    return;
+  }
 
   fclose(f);
   if (rename(tmpfile, filename)) {
@@ -1061,12 +1562,18 @@ static void ClientStateToJson(const client_state_t *state)
     snprintf(errstr, sizeof(errstr), "%s: rename %s to %s",
         __FUNCTION__, tmpfile, filename);
     perror(errstr);
+    return;
   }
+
+  state->json_hash = hash;
+  stations_changed = 1;
 }
 
 
 static void ClientStateToLog(const client_state_t *state, time_t mono_now)
 {
+  char windows[96];
+
   if (!state->s.authorized || !state->s.authenticated) {
     /* Don't log about non-associated clients */
     return;
@@ -1077,6 +1584,7 @@ static void ClientStateToLog(const client_state_t *state, time_t mono_now)
     return;
   }
 
+  FormatSignalWindows(&state->s.samples, mono_now, windows, sizeof(windows));
   printf(
       "%s %s %ld %" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
       " %c,%hhd,%hhd,%u,%u,%u,%u,%u,%d"
@@ -1084,6 +1592,7 @@ static void ClientStateToLog(const client_state_t *state, time_t mono_now)
       " %u,%u,%u,%u,%u,%d"
       " %u,%u,%u,%u,%u,%d"
       " rssi:%0.2f/%0.2f/%0.2f"
+      "%s"
       "\n",
       state->macstr, state->ifname,
       ((mono_now - state->last_seen) + (state->s.inactive_msec / 1000)),
@@ -1113,21 +1622,23 @@ static void ClientStateToLog(const client_state_t *state, time_t mono_now)
       state->s.tx_max_vht_mcs, state->s.tx_max_vht_nss,
       state->s.tx_max_width, state->s.ever_tx_short_gi,
 
-      state->s.min_signal, state->s.avg_signal, state->s.max_signal);
+      state->s.min_signal, state->s.avg_signal, state->s.max_signal,
+      windows);
 }
 
 
 void ConsolidateAssociatedDevices()
 {
-  ClientMapType::iterator it = clients.begin();
+  size_t i;
 
-  while (it != clients.end()) {
-    client_state_t *state = it->second;
-    ConsolidateSamples(&state->s);
-    if (AgeOutClient(state)) {
-      clients.erase(it++);
-    } else {
-      ++it;
+  for (i = 0; i < clients.capacity; ++i) {
+    client_slot_t *slot = &clients.slots[i];
+    if (slot->key >= CLIENT_SLOT_DELETED) {
+      continue;
+    }
+    ConsolidateSamples(&slot->state->s);
+    if (AgeOutClient(slot->state)) {
+      ClientTableErase(slot);
     }
   }
 }
@@ -1136,32 +1647,123 @@ void ConsolidateAssociatedDevices()
 /* Walk through all Wifi clients, printing their info to JSON files. */
 void UpdateAssociatedDevices()
 {
-  ClientMapType::iterator it = clients.begin();
+  size_t i;
+
+  for (i = 0; i < clients.capacity; ++i) {
+    if (clients.slots[i].key < CLIENT_SLOT_DELETED) {
+      ClientStateToJson(clients.slots[i].state);
+    }
+  }
+}
+
+
+/*
+ * Writes every station into snapshot_file as one JSON object, tagged with
+ * a generation number which increases each time the contents change.
+ */
+void UpdateStationsSnapshot()
+{
+  char buf[MAX_STATION_JSON];
+  char tmpfile[PATH_MAX];
+  time_t mono_now = monotime();
+  const char *sep = "";
+  size_t i;
+  FILE *f;
+
+  if (snapshot_file == NULL || !stations_changed) {
+    return;
+  }
+  stations_changed = 0;
+
+  /* Seed from the wall clock so generations keep increasing across
+   * restarts. */
+  if (snapshot_generation == 0) {
+    snapshot_generation = (uint64_t)time(NULL) << 16;
+  }
+  snapshot_generation++;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.new", snapshot_file);
+  if ((f = fopen(tmpfile, "w+")) == NULL) {
+    char errbuf[PATH_MAX + 16];
+    snprintf(errbuf, sizeof(errbuf), "fopen %s", tmpfile);
+    perror(errbuf);
+    return;
+  }
+
+  /* Station objects are large; give stdio a buffer to match. */
+  setvbuf(f, buf, _IOFBF, sizeof(buf));
+
+  fprintf(f, "{\n");
+  fprintf(f, "\"generation\": %" PRIu64 ",\n", snapshot_generation);
+  fprintf(f, "\"stations\": [");
+  for (i = 0; i < clients.capacity; ++i) {
+    if (clients.slots[i].key >= CLIENT_SLOT_DELETED) {
+      continue;
+    }
+    fprintf(f, "%s\n", sep);
+    PrintClientJson(f, clients.slots[i].state, mono_now);
+    sep = ",";
+  }
+  fprintf(f, "]\n}\n");
+
+  if (fclose(f)) {
+    perror("fclose snapshot");
+    unlink(tmpfile);
+    return;
+  }
+  if (rename(tmpfile, snapshot_file)) {
+    fprintf(stderr, "%s: rename %s to %s: %s\n",
+        __FUNCTION__, tmpfile, snapshot_file, strerror(errno));
+  }
+}
+
+
+/* Fetch and write out stations queued by StationEventCallback. */
+void RequestPendingStations(struct nl_sock *nlsk, int nl80211_id)
+{
+  int i;
+
+  for (i = 0; i < npending_stations; ++i) {
+    pending_station_t *p = &pending_stations[i];
+    client_state_t *state;
+    int n;
+
+    if ((n = FindInterface(p->ifindex)) < 0) {
+      continue;
+    }
 
-  while (it != clients.end()) {
-    client_state_t *state = it->second;
-    ClientStateToJson(state);
-    ++it;
+    HandleNLCommand(nlsk, nl80211_id, n, p->mac, StationDumpCallback,
+                    NL80211_CMD_GET_STATION, 0);
+    ProcessNetlinkMessages(nlsk);
+
+    if ((state = LookupClientState(p->mac)) != NULL) {
+      ConsolidateSamples(&state->s);
+      ClientStateToJson(state);
+    }
   }
+  npending_stations = 0;
 }
 
 
 void LogAssociatedDevices()
 {
-  ClientMapType::iterator it = clients.begin();
   time_t mono_now = monotime();
+  size_t i;
 
-  while (it != clients.end()) {
-    client_state_t *state = it->second;
-    ClientStateToLog(state, mono_now);
-    ++it;
+  for (i = 0; i < clients.capacity; ++i) {
+    if (clients.slots[i].key < CLIENT_SLOT_DELETED) {
+      ClientStateToLog(clients.slots[i].state, mono_now);
+    }
   }
 }
 
 
 void LogInterfaces()
 {
+  time_t mono_now = monotime();
+  char windows[96];
   int i;
+
   for (i = 0; i < ninterfaces; ++i) {
     wifi_interface_t *wif = &interfaces[i];
 
@@ -1170,6 +1772,7 @@ void LogInterfaces()
     }
 
     ConsolidateSamples(&wif->s);
+    FormatSignalWindows(&wif->s.samples, mono_now, windows, sizeof(windows));
 
     printf(
         "C %s %d %" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
@@ -1178,6 +1781,7 @@ void LogInterfaces()
         " %u,%u,%u,%u,%u,%d"
         " %u,%u,%u,%u,%u,%d"
         " %0.2f %0.2f %0.2f"
+        "%s"
         "\n",
         wif->ifname, wif->freq,
 
@@ -1205,7 +1809,8 @@ void LogInterfaces()
         wif->s.tx_max_ht_mcs, wif->s.tx_max_ht_nss,
         wif->s.tx_max_vht_mcs, wif->s.tx_max_vht_nss,
         wif->s.tx_max_width, wif->s.ever_tx_short_gi,
-        wif->s.min_signal, wif->s.avg_signal, wif->s.max_signal);
+        wif->s.min_signal, wif->s.avg_signal, wif->s.max_signal,
+        windows);
   }
 }
 
@@ -1328,7 +1933,6 @@ void UpdateWifiShow(struct nl_sock *nlsk, int nl80211_id, int n)
   char filename[PATH_MAX];
   char autofile[PATH_MAX];
   const char *ifname = interfaces[n].ifname;
-  int done = 0;
   struct stat buffer;
   FILE *fptr;
 
@@ -1345,13 +1949,11 @@ void UpdateWifiShow(struct nl_sock *nlsk, int nl80211_id, int n)
   }
 
   fprintf(wifi_info_handle, "{\n");
-  done = 0;
   RequestWifiInfo(nlsk, nl80211_id, n);
-  ProcessNetlinkMessages(nlsk, &done);
+  ProcessNetlinkMessages(nlsk);
 
-  done = 0;
   RequestRegdomain(nlsk, nl80211_id);
-  ProcessNetlinkMessages(nlsk, &done);
+  ProcessNetlinkMessages(nlsk);
 
   snprintf(autofile, sizeof(autofile), "/tmp/autochan.%s", ifname);
   if (stat(autofile, &buffer) == 0) {
@@ -1403,12 +2005,69 @@ static void TouchUpdateFile()
 } /* TouchUpdateFile */
 
 
+/*
+ * Waits up to timeout seconds for nl80211 events. If the socket
+ * overflowed, events were dropped and the caller must dump all stations.
+ */
+static void WaitForStationEvents(struct nl_sock *evsk, time_t timeout)
+{
+  int s = nl_socket_get_fd(evsk);
+  fd_set rfds;
+  struct timeval tv;
+
+  memset(&tv, 0, sizeof(tv));
+  tv.tv_sec = (timeout > 0) ? timeout : 0;
+
+  FD_ZERO(&rfds);
+  FD_SET(s, &rfds);
+
+  if (select(s + 1, &rfds, NULL, NULL, &tv) <= 0) {
+    return;
+  }
+
+  if (nl_recvmsgs_default(evsk) == -NLE_NOMEM) {
+    need_station_dump = 1;
+  }
+}
+
+
+static void usage(const char *progname)
+{
+  fprintf(stderr, "usage: %s [-d dump_secs] [-s snapshot_file]\n", progname);
+  fprintf(stderr, "  -d  seconds between full station dumps (default %d)\n",
+          DEFAULT_DUMP_SECS);
+  fprintf(stderr, "  -s  also write all stations to a single JSON file\n");
+  exit(1);
+}
+
+
 int main(int argc, char **argv)
 {
-  int done = 0;
   int nl80211_id = -1;
+  int dump_secs = DEFAULT_DUMP_SECS;
   struct nl_sock *nlsk = NULL;
+  struct nl_sock *evsk = NULL;
   struct rlimit rlim;
+  time_t next_dump = 0;
+  time_t next_log;
+  int c;
+
+  while ((c = getopt(argc, argv, "d:s:")) != -1) {
+    switch (c) {
+      case 'd':
+        dump_secs = atoi(optarg);
+        if (dump_secs <= 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 's':
+        snapshot_file = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        break;
+    }
+  }
 
   memset(&rlim, 0, sizeof(rlim));
   if (getrlimit(RLIMIT_AS, &rlim)) {
@@ -1424,7 +2083,11 @@ int main(int argc, char **argv)
   setlinebuf(stdout);
 
   nlsk = InitNetlinkSocket();
-  if (nl_socket_modify_cb(nlsk, NL_CB_FINISH, NL_CB_CUSTOM, NlFinish, &done)) {
+  if (nl_socket_modify_cb(nlsk, NL_CB_FINISH, NL_CB_CUSTOM,
+                          NlFinish, &nl_done) ||
+      nl_socket_modify_cb(nlsk, NL_CB_ACK, NL_CB_CUSTOM,
+                          NlFinish, &nl_done) ||
+      nl_socket_modify_err_cb(nlsk, NL_CB_CUSTOM, NlError, &nl_done)) {
     fprintf(stderr, "nl_socket_modify_cb failed\n");
     exit(1);
   }
@@ -1432,38 +2095,56 @@ int main(int argc, char **argv)
     fprintf(stderr, "genl_ctrl_resolve failed\n");
     exit(1);
   }
+  evsk = InitEventSocket(nlsk);
+
+  interfaces_changed = 1;
+  next_log = monotime() + LOG_INTERVAL_SECS;
 
   while (1) {
-    int i, j;
-
-    /* Check if new interfaces have appeared */
-    ninterfaces = 0;
-    memset(interfaces, 0, sizeof(interfaces));
-    RequestInterfaceList(nlsk, nl80211_id);
-    ProcessNetlinkMessages(nlsk, &done);
-    for (i = 0; i < ninterfaces; ++i) {
-      UpdateWifiShow(nlsk, nl80211_id, i);
+    time_t mono_now;
+    int i;
+
+    if (interfaces_changed) {
+      /* Also drop pending stations, their ifindex may be stale. */
+      interfaces_changed = 0;
+      npending_stations = 0;
+      need_station_dump = 1;
+      RefreshInterfaces(nlsk, nl80211_id);
+      for (i = 0; i < ninterfaces; ++i) {
+        UpdateWifiShow(nlsk, nl80211_id, i);
+      }
     }
 
-    /* Accumulate MAX_SAMPLE_INDEX samples between calls to
-     * LogAssociatedDevices() */
-    for (i = 0; i < MAX_SAMPLE_INDEX; ++i) {
-      sleep(2);
-      for (j = 0; j < ninterfaces; ++j) {
-        done = 0;
-        RequestAssociatedDevices(nlsk, nl80211_id, j);
-        ProcessNetlinkMessages(nlsk, &done);
-        ConsolidateAssociatedDevices();
-        UpdateAssociatedDevices();
-
-        done = 0;
-        RequestInterfaceInfo(nlsk, nl80211_id, j);
-        ProcessNetlinkMessages(nlsk, &done);
+    mono_now = monotime();
+    if (need_station_dump || mono_now >= next_dump) {
+      need_station_dump = 0;
+      npending_stations = 0;
+      for (i = 0; i < ninterfaces; ++i) {
+        RequestAssociatedDevices(nlsk, nl80211_id, i);
+        ProcessNetlinkMessages(nlsk);
+        RequestInterfaceInfo(nlsk, nl80211_id, i);
       }
+      ConsolidateAssociatedDevices();
+      UpdateAssociatedDevices();
+      UpdateStationsSnapshot();
+      TouchUpdateFile();
+      next_dump = mono_now + dump_secs;
+    } else if (npending_stations) {
+      RequestPendingStations(nlsk, nl80211_id);
+      UpdateStationsSnapshot();
       TouchUpdateFile();
     }
-    LogAssociatedDevices();
-    LogInterfaces();
+
+    if (mono_now >= next_log) {
+      LogAssociatedDevices();
+      LogInterfaces();
+      next_log = mono_now + LOG_INTERVAL_SECS;
+
+      /* Events should keep the list current; re-check it anyway. */
+      interfaces_changed = 1;
+    }
+
+    WaitForStationEvents(evsk, next_dump - monotime());
   }
 
   exit(0);
@@ -83,7 +83,6 @@ void testFrequencyToChannel()
 static const char *expected_json = "{\n"
 "  \"addr\": \"00:11:22:33:44:55\",\n"
 "  \"inactive since\": 0.000,\n"
-"  \"inactive msec\": 0,\n"
 "  \"active\": false,\n"
 "  \"rx bitrate\": 4.7,\n"
 "  \"rx bytes\": 0,\n"
@@ -157,6 +156,81 @@ void testClientStateToJson()
 }
 
 
+void testClientStateToJsonUnchanged()
+{
+  client_state_t state;
+  char filename[PATH_MAX];
+
+  printf("Testing \"%s\" in %s:\n", __FUNCTION__, __FILE__);
+  memset(&state, 0, sizeof(client_state_t));
+  snprintf(state.macstr, sizeof(state.macstr), "00:11:22:33:44:66");
+  snprintf(filename, sizeof(filename), "%s/%s", STATIONS_DIR, state.macstr);
+
+  stations_changed = 0;
+  ClientStateToJson(&state);
+  TEST_ASSERT(stations_changed);
+  TEST_ASSERT(unlink(filename) == 0);
+
+  /* Nothing changed, so the file is not rewritten. */
+  stations_changed = 0;
+  state.s.inactive_msec = 12345;
+  ClientStateToJson(&state);
+  TEST_ASSERT(!stations_changed);
+  TEST_ASSERT(access(filename, F_OK) != 0);
+
+  state.s.rx_bytes = 1;
+  ClientStateToJson(&state);
+  TEST_ASSERT(stations_changed);
+  TEST_ASSERT(unlink(filename) == 0);
+  printf("! %s:%d\t%s\tok\n", __FILE__, __LINE__, __FUNCTION__);
+}
+
+
+void testStationsSnapshot()
+{
+  uint8_t mac[] = {0x00, 0x00, 0x02, 0x00, 0x00, 0x01};
+  char filename[PATH_MAX];
+  char *buf;
+  uint64_t generation;
+  int fd;
+
+  printf("Testing \"%s\" in %s:\n", __FUNCTION__, __FILE__);
+  snprintf(filename, sizeof(filename), "%s/snapshot", STATIONS_DIR);
+  snapshot_file = filename;
+  now = 1000;
+  FindClientState(mac)->last_seen = now;
+  mac[5] = 0x02;
+  FindClientState(mac)->last_seen = now;
+
+  stations_changed = 1;
+  UpdateStationsSnapshot();
+  generation = snapshot_generation;
+  TEST_ASSERT(generation != 0);
+
+  TEST_ASSERT((buf = (char *)malloc(SIZ)) != NULL);
+  memset(buf, 0, SIZ);
+  TEST_ASSERT((fd = open(filename, O_RDONLY)) >= 0);
+  TEST_ASSERT(read(fd, buf, SIZ) > 0);
+  close(fd);
+  TEST_ASSERT(strstr(buf, "\"00:00:02:00:00:01\"") != NULL);
+  TEST_ASSERT(strstr(buf, "\"00:00:02:00:00:02\"") != NULL);
+  free(buf);
+
+  /* No station changed, so no new generation. */
+  UpdateStationsSnapshot();
+  TEST_ASSERT(snapshot_generation == generation);
+
+  now = 1000 + MAX_CLIENT_AGE_SECS + 1;
+  ConsolidateAssociatedDevices();
+  UpdateStationsSnapshot();
+  TEST_ASSERT(snapshot_generation == generation + 1);
+
+  TEST_ASSERT(unlink(filename) == 0);
+  snapshot_file = NULL;
+  printf("! %s:%d\t%s\tok\n", __FILE__, __LINE__, __FUNCTION__);
+}
+
+
 void testAgeOutClients()
 {
   uint8_t mac[] = {0x00, 0x00, 0x01, 0x00, 0x00, 0x00};
@@ -170,15 +244,121 @@ void testAgeOutClients()
   mac[5] = 0x02;
   state = FindClientState(mac);
   state->last_seen = 10000;
-  TEST_ASSERT(clients.size() == 2);
+  TEST_ASSERT(clients.count == 2);
 
   now = 1000 + MAX_CLIENT_AGE_SECS + 1;
   ConsolidateAssociatedDevices();
-  TEST_ASSERT(clients.size() == 1);
+  TEST_ASSERT(clients.count == 1);
 
   now = 10000 + MAX_CLIENT_AGE_SECS + 1;
   ConsolidateAssociatedDevices();
-  TEST_ASSERT(clients.size() == 0);
+  TEST_ASSERT(clients.count == 0);
+  printf("! %s:%d\t%s\tok\n", __FILE__, __LINE__, __FUNCTION__);
+}
+
+
+void testClientTable()
+{
+  uint8_t mac[] = {0x00, 0x11, 0x22, 0x00, 0x00, 0x00};
+  client_state_t *state;
+  int i, found;
+
+  printf("Testing \"%s\" in %s:\n", __FUNCTION__, __FILE__);
+  now = 1000;
+  for (i = 0; i < 1000; ++i) {
+    mac[4] = i >> 8;
+    mac[5] = i & 0xff;
+    state = FindClientState(mac);
+    state->last_seen = (i & 1) ? 1000 : 10000;
+  }
+  TEST_ASSERT(clients.count == 1000);
+  TEST_ASSERT(clients.capacity >= 1000);
+
+  mac[4] = 0x01;
+  mac[5] = 0x02;
+  TEST_ASSERT(FindClientState(mac) == LookupClientState(mac));
+  TEST_ASSERT(strcmp(LookupClientState(mac)->macstr, "00:11:22:00:01:02") == 0);
+  TEST_ASSERT(clients.count == 1000);
+
+  /* Age out the odd half, leaving deleted slots behind. */
+  now = 1000 + MAX_CLIENT_AGE_SECS + 1;
+  ConsolidateAssociatedDevices();
+  TEST_ASSERT(clients.count == 500);
+
+  found = 0;
+  for (i = 0; i < 1000; ++i) {
+    mac[4] = i >> 8;
+    mac[5] = i & 0xff;
+    state = LookupClientState(mac);
+    if ((i & 1) == 0 && state != NULL) found++;
+    if ((i & 1) == 1 && state == NULL) found++;
+  }
+  TEST_ASSERT(found == 1000);
+
+  now = 10000 + MAX_CLIENT_AGE_SECS + 1;
+  ConsolidateAssociatedDevices();
+  TEST_ASSERT(clients.count == 0);
+  mac[5] = 0x02;
+  TEST_ASSERT(LookupClientState(mac) == NULL);
+  printf("! %s:%d\t%s\tok\n", __FILE__, __LINE__, __FUNCTION__);
+}
+
+
+void testSampleRing()
+{
+  wifi_stats_t stats;
+  sample_summary_t summary;
+  sample_ring_t *r = &stats.samples;
+  char windows[96];
+  int i, n;
+
+  printf("Testing \"%s\" in %s:\n", __FUNCTION__, __FILE__);
+  memset(&stats, 0, sizeof(stats));
+
+  /* Two hours of samples, one every 10 seconds: the ring wraps and
+   * keeps the most recent hour. Signal counts down -20 .. -89, MCS
+   * counts up 0 .. 9. */
+  for (i = 0; i < 720; ++i) {
+    n = SampleAppend(r, 10000 + i * 10);
+    r->col[SAMPLE_SIGNAL][n] = SIGNAL_BIAS - 20 - (i % 70);
+    r->col[SAMPLE_RX_VHT_MCS][n] = i % 10;
+  }
+  now = 10000 + 719 * 10;
+  TEST_ASSERT(r->count == SAMPLE_RING_SIZE);
+
+  SampleSummary(r, SAMPLE_SIGNAL, now - 3600, &summary);
+  TEST_ASSERT(summary.n == SAMPLE_RING_SIZE);
+
+  /* Last 5 minutes: i = 689 .. 719, signal -79 .. -89 then -20 .. -39. */
+  SampleSummary(r, SAMPLE_SIGNAL, now - LOG_INTERVAL_SECS, &summary);
+  TEST_ASSERT(summary.n == 31);
+  TEST_ASSERT(summary.max - SIGNAL_BIAS == -20);
+  TEST_ASSERT(summary.min - SIGNAL_BIAS == -89);
+
+  /* A window of one sample. */
+  SampleSummary(r, SAMPLE_SIGNAL, now, &summary);
+  TEST_ASSERT(summary.n == 1);
+  TEST_ASSERT(summary.min - SIGNAL_BIAS == -39);
+  TEST_ASSERT(summary.mean - SIGNAL_BIAS == -39.0);
+
+  /* Nothing in the future. */
+  SampleSummary(r, SAMPLE_SIGNAL, now + 1, &summary);
+  TEST_ASSERT(summary.n == 0);
+
+  /* Over 15 minutes, each MCS 0 .. 9 appears 9 times. */
+  TEST_ASSERT(SamplePercentile(r, SAMPLE_RX_VHT_MCS, now - 899, 50) == 4);
+  TEST_ASSERT(SamplePercentile(r, SAMPLE_RX_VHT_MCS, now - 899, 100) == 9);
+  TEST_ASSERT(SamplePercentile(r, SAMPLE_RX_VHT_MCS, now - 899, 1) == 0);
+
+  ConsolidateSamples(&stats);
+  TEST_ASSERT(stats.rx_vht_mcs == 9);
+  TEST_ASSERT(stats.rx_ht_mcs == 0);
+  TEST_ASSERT(stats.max_signal == -20.0);
+  TEST_ASSERT(stats.min_signal == -89.0);
+
+  FormatSignalWindows(r, now, windows, sizeof(windows));
+  TEST_ASSERT(strcmp(windows,
+      " rssi15m:-89/-49.38/-20/-45 rssi1h:-89/-53.94/-20/-54") == 0);
   printf("! %s:%d\t%s\tok\n", __FILE__, __LINE__, __FUNCTION__);
 }
 
@@ -194,7 +374,11 @@ int main(int argc, char** argv)
   testPrintSsidEscapedQuoteBackslash();
   testFrequencyToChannel();
   testClientStateToJson();
+  testClientStateToJsonUnchanged();
   testAgeOutClients();
+  testClientTable();
+  testStationsSnapshot();
+  testSampleRing();
 
   snprintf(filename, sizeof(filename), "%s/updated.new", STATIONS_DIR);
   unlink(filename);
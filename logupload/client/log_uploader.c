@@ -45,14 +45,13 @@ int logmark_once(const char* output_path, const char* version_path,
 char* parse_and_consume_log_data(struct log_parse_params* params) {
   unsigned long log_buffer_size = params->total_read;
   int wrote_start_marker = 0;
-  char *last_start_marker, *last_start_before_end_marker;
-  int check_for_markers = (params->last_log_counter == 0);
+  // These point into log_buffer, so they only cover the current batch.
+  char *last_start_marker = NULL, *last_start_before_end_marker = NULL;
   struct line_data parsed_line;
   memset(&parsed_line, 0, sizeof(parsed_line));
   ssize_t num_read;
-  if (check_for_markers)
-    last_start_marker = last_start_before_end_marker = NULL;
   params->total_read = 0;
+  params->buffer_full = 0;
 
   while (1) {
     // Make sure we have room in our main buffer for another line if we
@@ -61,6 +60,7 @@ char* parse_and_consume_log_data(struct log_parse_params* params) {
     // Use 2x so that we can also log data about missing entries if we
     // need to do that as well.
     if (params->total_read + 2*params->line_buffer_size >= log_buffer_size) {
+      params->buffer_full = 1;
       break;
     }
     if (!params->last_line_valid) {
@@ -152,26 +152,38 @@ char* parse_and_consume_log_data(struct log_parse_params* params) {
       }
       // If we don't have our tracking working then we need to look at the
       // markers in the log to avoid uploading tons of duplicate data.
-      // This should only happen after a reboot.
-      if (check_for_markers) {
-        if (strstr(parsed_line.text, LOG_MARKER_END) && last_start_marker) {
-          last_start_before_end_marker = last_start_marker;
+      // This should only happen after a reboot. The check stays on for
+      // every batch of the cycle, since the markers can be anywhere in it.
+      if (params->check_for_markers) {
+        if (strstr(parsed_line.text, LOG_MARKER_END) &&
+            params->start_marker) {
+          // If the start marker was in an earlier batch, only the caller
+          // can skip what came before it, using upload_from.
+          if (last_start_marker)
+            last_start_before_end_marker = last_start_marker;
+          params->upload_from = params->start_marker;
           last_start_marker = NULL;
+          params->start_marker = NULL;
         } else if (strstr(parsed_line.text, LOG_MARKER_START)) {
           last_start_marker = params->log_buffer + params->total_read;
+          params->start_marker = last_start_marker;
         }
       }
 
+      // The text is copied straight from the line buffer; the loop check
+      // above guarantees there is room for it.
       params->total_read += snprintf(params->log_buffer +
           params->total_read, log_buffer_size - params->total_read,
-          "<%d>[%5d.%06d] %s", parsed_line.level, time_sec, time_usec,
-          parsed_line.text);
+          "<%d>[%5d.%06d] ", parsed_line.level, time_sec, time_usec);
+      memcpy(params->log_buffer + params->total_read, parsed_line.text,
+          parsed_line.text_len);
+      params->total_read += parsed_line.text_len;
       params->last_log_counter = parsed_line.seq;
     }
   }
   params->log_buffer[params->total_read] = '\0';
 
-  if (check_for_markers && last_start_before_end_marker) {
+  if (last_start_before_end_marker) {
       // We have duplicate data from an upload (should have been before
       // a reboot which just occurred). Only upload what's been there
       // since the last start marker before the last end marker. We will
@@ -190,6 +202,8 @@ const char HARD[] = "BCDFGHJKLMNPQRSTVWXYZ" "AEIOU";
 const char *consensus_key_file = "/tmp/waveguide/consensus_key";
 #define CONSENSUS_KEY_LEN 16
 uint8_t consensus_key[CONSENSUS_KEY_LEN];
+// Bumped whenever consensus_key changes, invalidating cached anonids.
+static unsigned int consensus_key_generation;
 #define MAC_ADDR_LEN 17
 
 void default_consensus_key()
@@ -204,6 +218,7 @@ void default_consensus_key()
     }
     close(fd);
   }
+  consensus_key_generation++;
 }
 
 /* Read the waveguide consensus_key, if any */
@@ -214,10 +229,9 @@ static void get_consensus_key()
   struct stat statbuf;
   int fd;
 
-  if (stat(consensus_key_file, &statbuf)) {
-    if ((statbuf.st_ino == ino) && (statbuf.st_mtime == mtime)) {
-      return;
-    }
+  if (stat(consensus_key_file, &statbuf) ||
+      ((statbuf.st_ino == ino) && (statbuf.st_mtime == mtime))) {
+    return;
   }
 
   fd = open(consensus_key_file, O_RDONLY);
@@ -227,6 +241,7 @@ static void get_consensus_key()
       memcpy(consensus_key, new_key, sizeof(consensus_key));
       ino = statbuf.st_ino;
       mtime = statbuf.st_mtime;
+      consensus_key_generation++;
     }
     close(fd);
   }
@@ -272,7 +287,7 @@ static void get_binary_mac(const char *mac, uint8_t *out) {
   }
 }
 
-static const char *get_anonid_for_mac(const char *mac, char *out) {
+const char *get_anonid_for_mac(const char *mac, char *out) {
   unsigned char digest[EVP_MAX_MD_SIZE];
   unsigned int digest_len = sizeof(digest);
   uint8_t macbin[6];
@@ -289,11 +304,57 @@ static const char *get_anonid_for_mac(const char *mac, char *out) {
   return out;
 }
 
+/*
+ * A log burst usually mentions the same handful of stations over and
+ * over, so remember the most recent anonids rather than computing an
+ * HMAC for every occurrence.
+ */
+#define ANONID_CACHE_SIZE 32
+struct anonid_cache_entry {
+  uint64_t mac;
+  unsigned int generation;
+  unsigned int last_used;  // zero for an unused entry
+  char anonid[6];
+};
+static struct anonid_cache_entry anonid_cache[ANONID_CACHE_SIZE];
+static unsigned int anonid_cache_clock;
+
+static void get_cached_anonid_for_mac(const char *mac, char *out) {
+  struct anonid_cache_entry *e, *victim = &anonid_cache[0];
+  uint8_t macbin[6];
+  uint64_t key = 0;
+  int i;
+
+  get_binary_mac(mac, macbin);
+  for (i = 0; i < (int)sizeof(macbin); i++) {
+    key = (key << 8) | macbin[i];
+  }
+
+  for (i = 0; i < ANONID_CACHE_SIZE; i++) {
+    e = &anonid_cache[i];
+    if (e->last_used && e->mac == key &&
+        e->generation == consensus_key_generation) {
+      e->last_used = ++anonid_cache_clock;
+      memcpy(out, e->anonid, sizeof(e->anonid));
+      return;
+    }
+    if (e->last_used < victim->last_used) {
+      victim = e;
+    }
+  }
+
+  get_anonid_for_mac(mac, victim->anonid);
+  victim->mac = key;
+  victim->generation = consensus_key_generation;
+  victim->last_used = ++anonid_cache_clock;
+  memcpy(out, victim->anonid, sizeof(victim->anonid));
+}
+
 static ssize_t anonymize_mac_address(char *s, ssize_t len) {
   char anonid[6];
   ssize_t offset = MAC_ADDR_LEN - sizeof(anonid);
 
-  get_anonid_for_mac(s, anonid);
+  get_cached_anonid_for_mac(s, anonid);
   memcpy(s, anonid, sizeof(anonid));
   s += sizeof(anonid);
   len -= offset;
@@ -316,6 +377,60 @@ static int is_mac_addr(const char *s, char sep) {
   return 0;
 }
 
+static int is_mac_separator(char c) {
+  return c == ':' || c == '-' || c == '_';
+}
+
+#define ONES64 0x0101010101010101ULL
+#define HIGHS64 0x8080808080808080ULL
+
+/* Nonzero if any byte of w is ':', '-' or '_'. May report false positives
+ * for bytes following a real match, which callers recheck anyway. */
+static uint64_t has_mac_separator(uint64_t w) {
+  uint64_t colon = w ^ (ONES64 * ':');
+  uint64_t dash = w ^ (ONES64 * '-');
+  uint64_t underscore = w ^ (ONES64 * '_');
+  return (((colon - ONES64) & ~colon) |
+          ((dash - ONES64) & ~dash) |
+          ((underscore - ONES64) & ~underscore)) & HIGHS64;
+}
+
+/*
+ * Return the first position in [s, end) where a MAC address starts, or
+ * NULL. Every MAC address has a separator at offset 2, so this looks for
+ * separators eight bytes at a time and only checks the full pattern
+ * around the ones it finds.
+ */
+static char *find_mac_addr(char *s, const char *end) {
+  char *p, *last;
+
+  if (end - s < MAC_ADDR_LEN) {
+    return NULL;
+  }
+  p = s + 2;
+  last = (char *)end - MAC_ADDR_LEN + 2;  // separator of the last candidate
+  while (p <= last) {
+    int i, n = 8;
+    if (last - p >= 7) {
+      uint64_t w;
+      memcpy(&w, p, sizeof(w));
+      if (!has_mac_separator(w)) {
+        p += 8;
+        continue;
+      }
+    } else {
+      n = last - p + 1;
+    }
+    for (i = 0; i < n; i++) {
+      if (is_mac_separator(p[i]) && is_mac_addr(p + i - 2, p[i])) {
+        return p + i - 2;
+      }
+    }
+    p += n;
+  }
+  return NULL;
+}
+
 /*
  * search for text patterns which look like MAC addresses,
  * and anonymize them.
@@ -323,18 +438,21 @@ static int is_mac_addr(const char *s, char sep) {
  */
 unsigned long suppress_mac_addresses(char *line, ssize_t len) {
   char *s = line;
+  const char *end = line + len;
   unsigned long new_len = len;
   ssize_t reduce;
+  int have_key = 0;
 
-  while (len >= MAC_ADDR_LEN) {
-    if (is_mac_addr(s, ':') || is_mac_addr(s, '-') || is_mac_addr(s, '_')) {
-      reduce = anonymize_mac_address(s, len);
-      len -= reduce;
-      new_len -= reduce;
-    } else {
-      s += 1;
-      len -= 1;
+  while ((s = find_mac_addr(s, end)) != NULL) {
+    if (!have_key) {
+      // Pick up a new consensus key at most once per line.
+      get_consensus_key();
+      have_key = 1;
     }
+    // Scanning resumes at the anonid itself, as it always has.
+    reduce = anonymize_mac_address(s, end - s);
+    end -= reduce;
+    new_len -= reduce;
   }
 
   return new_len;
@@ -35,6 +35,15 @@ struct log_parse_params {
   char* line_buffer;
   int line_buffer_size;
   int last_line_valid;
+  int buffer_full;  // out: stopped early for lack of room in log_buffer
+  // Set by the caller at the start of each upload cycle, before the first
+  // batch, and left alone for the rest of the cycle's batches. The
+  // markers found are kept as pointers into log_buffer, so a caller which
+  // wants them to span batches has to read the batches back to back into
+  // one buffer, and clear both pointers before reusing it.
+  int check_for_markers;
+  char* start_marker;  // last start marker with no end marker after it yet
+  char* upload_from;   // out: last start marker followed by an end marker
 };
 
 // Returns a pointer to the start of the valid log data which will be
@@ -53,6 +62,10 @@ int logmark_once(const char* output_path, const char* version_path,
 // as anonids like ABCDEF.
 unsigned long suppress_mac_addresses(char *line, ssize_t len);
 
+// Compute the 6 character anonid for the MAC address at mac, which must
+// look like 00:11:22:33:44:55, into out. No caching; returns out.
+const char *get_anonid_for_mac(const char *mac, char *out);
+
 // initialize a random key for anonymization.
 void default_consensus_key();
 
@@ -24,10 +24,21 @@
 
 #define DEFAULT_SERVER "https://diag.cpe.gfsvc.com"
 #define COUNTER_MARKER_FILE "/tmp/loguploadcounter"
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
 #define LOGS_UPLOADED_MARKER_FILE "/tmp/logs-uploaded"
 #define DEFAULT_UPLOAD_TARGET "dmesg"
-#define MAX_LOG_SIZE 8*1024*1024  // max bytes to upload in one run
-#define LOG_BUF_EXTRA 65536       // extra bytes for extra compression slop
+// Logs are read and compressed in batches of this many bytes, and
+// uploaded whenever the compressed data reaches MAX_CHUNK_SIZE, so memory
+// use is bounded no matter how big the backlog is.
+#define LOG_BATCH_SIZE (256*1024)
+#define MAX_CHUNK_SIZE (1024*1024)
+// While looking for the markers after a reboot, batches are held back
+// until the markers show where the last upload got to, up to this many
+// bytes (the size of the single buffer used before batching).
+#define MAX_HELD_LOG_SIZE (8*1024*1024)
+// Room for the batch which takes a chunk past MAX_CHUNK_SIZE, even if it
+// doesn't compress at all, plus whatever zlib is still holding onto.
+#define CHUNK_BUF_EXTRA (LOG_BATCH_SIZE + LOG_BATCH_SIZE / 8 + 65536)
 #define DEV_KMSG_PATH "/dev/kmsg"
 #define NTP_SYNCED_PATH "/tmp/ntp.synced"
 #define VERSION_PATH "/etc/version"
@@ -162,6 +173,50 @@ static int parse_args(struct upload_config* config, int argc,
   return 0;
 }
 
+// Ends the compressed stream and uploads it. Returns 0 on success, or the
+// exit code to use on failure.
+static int upload_chunk(struct upload_config* config,
+    struct deflate_stream* ds, unsigned long raw_bytes) {
+  unsigned long compressed_size;
+  if (deflate_stream_finish(ds, &compressed_size) != Z_OK) {
+    fprintf(stderr, "fatal: deflate_stream_finish failed\n");
+    return 7;
+  }
+
+  fprintf(stderr, "uploading %lu bytes of logs.\n", raw_bytes);
+  struct ifaddrs* ifaddr;
+  if (getifaddrs(&ifaddr)) {
+    perror("getifaddrs");
+    return 5;
+  }
+
+  struct kvextractparams kvparams;
+  memset(&kvparams, 0, sizeof(kvparams));
+  kvparams.interfaces_to_check = interfaces_to_check;
+  kvparams.num_interfaces = num_interfaces;
+  kvparams.ifaddr = ifaddr;
+  kvparams.platform_path = PLATFORM_PATH;
+  kvparams.serial_path = SERIAL_PATH;
+  kvparams.name_info_resolver = getnameinfo_resolver;
+  kvparams.interface_to_mac = iface_to_mac;
+  kvparams.logtype = config->logtype;
+  struct kvpair* kvpairs = extract_kv_pairs(&kvparams);
+  freeifaddrs(ifaddr);
+  if (!kvpairs) {
+    fprintf(stderr, "failure extracting kv pairs, abort\n");
+    return 6;
+  }
+
+  int upload_res = upload_file(config->server, config->upload_target,
+        (char*) ds->out, compressed_size, kvpairs);
+  free_kv_pairs(kvpairs);
+  if (upload_res) {
+    fprintf(stderr, "upload_file failed\n");
+    return 8;
+  }
+  return 0;
+}
+
 static int pick_delay(struct upload_config* config) {
   // Randomize the sleep time to be near the specified amount, +/- 1/12th.
   // (1/12th is weird, but it means +/- 5 for 60 seconds, which is nice).
@@ -199,9 +254,12 @@ int main(int argc, char* const argv[]) {
   // Initialize the random number generator
   srandom(getpid() ^ time(NULL));
 
-  // Allocate this once and re-use it every time
-  char* log_buffer = (char*) malloc(MAX_LOG_SIZE + LOG_BUF_EXTRA);
-  if (!log_buffer) {
+  // Allocate these once and re-use them every time
+  char* log_buffer = (char*) malloc(LOG_BATCH_SIZE);
+  unsigned char* chunk_buffer = NULL;
+  if (!config.use_stdout)
+    chunk_buffer = (unsigned char*) malloc(MAX_CHUNK_SIZE + CHUNK_BUF_EXTRA);
+  if (!log_buffer || (!config.use_stdout && !chunk_buffer)) {
     fprintf(stderr, "Failed to allocate log_buffer!\n");
     return 98;
   }
@@ -221,9 +279,8 @@ int main(int argc, char* const argv[]) {
   // they use to read a line and then copy it to us, so it won't be any
   // bigger than this.
   char line_buffer[LOG_LINE_BUFFER_SIZE];
-  unsigned long total_read;
-  z_stream zstrm;
-  memset(&zstrm, 0, sizeof(zstrm));
+  struct deflate_stream dstream;
+  memset(&dstream, 0, sizeof(dstream));
 
   struct log_parse_params parse_params;
   memset(&parse_params, 0, sizeof(parse_params));
@@ -233,109 +290,168 @@ int main(int argc, char* const argv[]) {
   parse_params.dev_kmsg_path = DEV_KMSG_PATH;
   parse_params.version_path = VERSION_PATH;
   parse_params.ntp_synced_path = NTP_SYNCED_PATH;
-  // This'll set it to zero if it can't read the file, which is fine.
-  parse_params.last_log_counter = read_file_as_uint64(COUNTER_MARKER_FILE);
+  // The checkpoint is only usable if it came from this boot, since kmsg
+  // sequence numbers restart on reboot. Otherwise start from zero, which
+  // falls back to looking for our markers in the log. A checkpoint with
+  // no boot id was written by an older version during this boot.
+  struct checkpoint checkpoint;
+  char boot_id[sizeof(checkpoint.boot_id)];
+  read_boot_id(BOOT_ID_PATH, boot_id, sizeof(boot_id));
+  if (read_checkpoint(COUNTER_MARKER_FILE, &checkpoint) == 0 &&
+      (!checkpoint.boot_id[0] || !strcmp(checkpoint.boot_id, boot_id))) {
+    parse_params.last_log_counter = checkpoint.seq;
+  }
+  snprintf(checkpoint.boot_id, sizeof(checkpoint.boot_id), "%s", boot_id);
   parse_params.log_buffer = log_buffer;
   parse_params.line_buffer = line_buffer;
   parse_params.line_buffer_size = sizeof(line_buffer);
 
   while (1) {
-    char* log_data_to_use;
+    unsigned long run_bytes = 0;   // raw bytes read this cycle
+    unsigned long chunk_bytes = 0; // raw bytes in the current chunk
+    char* held_buffer = NULL;      // batches not yet past the markers
+    unsigned long held_bytes = 0;
+    int more = 1;
+
     if (config.use_stdin) {
-      // Read in all the data from stdin
-      int num_read;
-      total_read = num_read = 0;
       interrupted = 0;
       alarm(pick_delay(&config));
-      while ((num_read = read(STDIN_FILENO, log_buffer + total_read,
-              MAX_LOG_SIZE - total_read)) > 0 && !interrupted) {
-        total_read += num_read;
-      }
-      if (num_read < 0 && errno != EINTR) {
-        perror("stdin");
-        return 2;
-      }
-      if (num_read == 0 && total_read == 0) {
-        fprintf(stderr, "stdin: end of input. done.\n");
-        return 0;
-      }
-      log_data_to_use = log_buffer;
     } else {
       // Remove the marker file to indicate we've completed the upload process.
       remove(LOGS_UPLOADED_MARKER_FILE);
 
+      // Without a counter we fall back to the markers in the log to skip
+      // what was uploaded before a reboot, for every batch of this cycle.
+      parse_params.check_for_markers = (parse_params.last_log_counter == 0);
+      parse_params.start_marker = NULL;
+      parse_params.upload_from = NULL;
+      if (parse_params.check_for_markers) {
+        held_buffer = (char*) malloc(MAX_HELD_LOG_SIZE);
+        if (!held_buffer) {
+          fprintf(stderr, "Failed to allocate held_buffer!\n");
+          return 98;
+        }
+      }
+
       // Normal logs processing, write out the general marker data.
       // We only need to write this out if we're doing the first upload
       // otherwise it'll have been written right after we did the last one.
-      if (parse_params.last_log_counter == 0 &&
+      if (parse_params.check_for_markers &&
           logmark_once(DEV_KMSG_PATH, VERSION_PATH,
           NTP_SYNCED_PATH)) {
         fprintf(stderr, "failed to execute logmark-once properly\n");
         return 3;
       }
-
-      parse_params.total_read = MAX_LOG_SIZE;
-      log_data_to_use = parse_and_consume_log_data(&parse_params);
-      if (!log_data_to_use) {
-        fprintf(stderr, "failed with logs parsing, abort!\n");
-        return 4;
-      }
-      total_read = parse_params.total_read;
     }
 
-    // Now we've read all of the log data into our buffer, proceed
-    // with uploading or outputting it.
+    if (!config.use_stdout &&
+        deflate_stream_start(&dstream, chunk_buffer,
+          MAX_CHUNK_SIZE + CHUNK_BUF_EXTRA, ZLIB_COMPRESS_LEVEL) != Z_OK) {
+      fprintf(stderr, "fatal: deflate_stream_start failed\n");
+      return 7;
+    }
 
-    fprintf(stderr, "uploading %lu bytes of logs.\n", total_read);
-    if (config.use_stdout) {
-      // Just print the whole thing to stdout.  Note: might be binary.
-      fwrite(log_data_to_use, total_read, 1, stdout);
-    } else {
-      struct ifaddrs* ifaddr;
-      if (getifaddrs(&ifaddr)) {
-        perror("getifaddrs");
-        return 5;
+    while (more) {
+      char* log_data_to_use;
+      unsigned long total_read = 0;
+      if (config.use_stdin) {
+        // Read in the next batch of data from stdin
+        int num_read = 0;
+        while (total_read < LOG_BATCH_SIZE && !interrupted &&
+            (num_read = read(STDIN_FILENO, log_buffer + total_read,
+                LOG_BATCH_SIZE - total_read)) > 0) {
+          total_read += num_read;
+        }
+        if (num_read < 0 && errno != EINTR) {
+          perror("stdin");
+          return 2;
+        }
+        if (num_read == 0 && total_read == 0 && run_bytes == 0) {
+          fprintf(stderr, "stdin: end of input. done.\n");
+          return 0;
+        }
+        more = (total_read == LOG_BATCH_SIZE && !interrupted);
+        log_data_to_use = log_buffer;
+      } else {
+        // Held batches are read back to back so the markers found in one
+        // still point at the right place when a later one finishes.
+        parse_params.log_buffer =
+          held_buffer ? held_buffer + held_bytes : log_buffer;
+        parse_params.total_read = LOG_BATCH_SIZE;
+        log_data_to_use = parse_and_consume_log_data(&parse_params);
+        if (!log_data_to_use) {
+          fprintf(stderr, "failed with logs parsing, abort!\n");
+          return 4;
+        }
+        total_read = parse_params.total_read;
+        more = parse_params.buffer_full;
+        if (held_buffer) {
+          held_bytes = log_data_to_use + total_read - held_buffer;
+          if (more && held_bytes + LOG_BATCH_SIZE <= MAX_HELD_LOG_SIZE)
+            continue;
+          // Everything before the last start marker which was followed by
+          // an end marker went out before the reboot.
+          log_data_to_use = parse_params.upload_from ?
+            parse_params.upload_from : held_buffer;
+          total_read = held_buffer + held_bytes - log_data_to_use;
+          held_bytes = 0;
+          parse_params.start_marker = NULL;
+          parse_params.upload_from = NULL;
+        }
       }
+      run_bytes += total_read;
 
-      struct kvextractparams kvparams;
-      memset(&kvparams, 0, sizeof(kvparams));
-      kvparams.interfaces_to_check = interfaces_to_check;
-      kvparams.num_interfaces = num_interfaces;
-      kvparams.ifaddr = ifaddr;
-      kvparams.platform_path = PLATFORM_PATH;
-      kvparams.serial_path = SERIAL_PATH;
-      kvparams.name_info_resolver = getnameinfo_resolver;
-      kvparams.interface_to_mac = iface_to_mac;
-      kvparams.logtype = config.logtype;
-      struct kvpair* kvpairs = extract_kv_pairs(&kvparams);
-      freeifaddrs(ifaddr);
-      if (!kvpairs) {
-        fprintf(stderr, "failure extracting kv pairs, abort\n");
-        return 6;
+      if (config.use_stdout) {
+        // Just print it to stdout.  Note: might be binary.
+        fwrite(log_data_to_use, total_read, 1, stdout);
+        continue;
       }
 
-      // Adjust this if we moved the pointer.
-      unsigned long compressed_size = MAX_LOG_SIZE + LOG_BUF_EXTRA -
-        (log_data_to_use - log_buffer);
-      int comp_result = deflate_inplace(&zstrm, (unsigned char*)log_data_to_use,
-          total_read, &compressed_size);
-      if (comp_result != Z_OK) {
-        fprintf(stderr, "fatal: deflate_inplace failed\n");
-        return 7;
-      }
+      // Held data can be many batches long, so compress it a batch at a
+      // time to keep each chunk within chunk_buffer.
+      char* data_end = log_data_to_use + total_read;
+      do {
+        unsigned long len = data_end - log_data_to_use;
+        if (len > LOG_BATCH_SIZE)
+          len = LOG_BATCH_SIZE;
+        if (deflate_stream_write(&dstream, log_data_to_use, len) != Z_OK) {
+          fprintf(stderr, "fatal: deflate_stream_write failed\n");
+          return 7;
+        }
+        log_data_to_use += len;
+        chunk_bytes += len;
+        int more_data = more || log_data_to_use < data_end;
+        if (more_data && deflate_stream_used(&dstream) < MAX_CHUNK_SIZE) {
+          continue;
+        }
 
-      int upload_res = upload_file(config.server, config.upload_target,
-            log_data_to_use, compressed_size, kvpairs);
-      free_kv_pairs(kvpairs);
-      if (upload_res) {
-        fprintf(stderr, "upload_file failed\n");
-        return 8;
-      }
-      if (write_file_as_uint64(COUNTER_MARKER_FILE,
-            parse_params.last_log_counter)) {
-        fprintf(stderr, "unable to write out last log counter\n");
-        return 9;
-      }
+        int rv = upload_chunk(&config, &dstream, chunk_bytes);
+        if (rv)
+          return rv;
+        chunk_bytes = 0;
+        // Once all of this batch is out, everything parsed so far has been
+        // uploaded, so a restart can pick up from here.
+        if (log_data_to_use == data_end) {
+          checkpoint.seq = parse_params.last_log_counter;
+          if (write_checkpoint(COUNTER_MARKER_FILE, &checkpoint)) {
+            fprintf(stderr, "unable to write out last log counter\n");
+            return 9;
+          }
+        }
+        if (more_data &&
+            deflate_stream_start(&dstream, chunk_buffer,
+              MAX_CHUNK_SIZE + CHUNK_BUF_EXTRA, ZLIB_COMPRESS_LEVEL) != Z_OK) {
+          fprintf(stderr, "fatal: deflate_stream_start failed\n");
+          return 7;
+        }
+      } while (log_data_to_use < data_end);
+    }
+
+    free(held_buffer);
+
+    if (config.use_stdout) {
+      fprintf(stderr, "uploading %lu bytes of logs.\n", run_bytes);
+    } else {
       // Write the marker file to indicate we finished the upload.
       int marker_fd = open(LOGS_UPLOADED_MARKER_FILE, O_CREAT | O_WRONLY,
           RW_FILE_PERMISSIONS);
@@ -357,6 +473,7 @@ int main(int argc, char* const argv[]) {
       sleep(pick_delay(&config));
     }
   }
+  free(chunk_buffer);
   free(log_buffer);
   return 0;
 }
@@ -1,6 +1,8 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <time.h>
 #include "gtest/gtest.h"
 #include "log_uploader.h"
 #include "utils.h"
@@ -167,6 +169,7 @@ TEST(LogUploader, parse_logs_no_counter) {
   struct parser_progress* progress =
     (struct parser_progress*) params->user_data;
 
+  params->check_for_markers = 1;
   char* res_buffer = parse_and_consume_log_data(params);
 
   // The counter was at zero, so it should look for the first
@@ -283,6 +286,83 @@ TEST(LogUploader, parse_logs_with_missing_data) {
   free_log_parse_params(params);
 }
 
+struct log_data test_batch_data[] = {
+  { 1, 1000LL, 100LL, "-", "Uploaded before the reboot.", NULL },
+  { 4, 1001LL, 101LL, "-", "Also uploaded before.", NULL },
+  { 2, 1010LL, 102LL, "-", "Uploaded as well.", NULL },
+  { 2, 1020LL, 103LL, "-", LOG_MARKER_START, NULL },
+  { 3, 1030LL, 104LL, "-", "Logged during the upload.", NULL },
+  { 5, 1040LL, 105LL, "-", LOG_MARKER_END, NULL },
+  { 3, 1050LL, 106LL, "-", "Logged after the upload.", NULL },
+  { 4, 1060LL, 107LL, "-", LOG_MARKER_START, NULL },
+  { 6, 1070LL, 108LL, "-", "Logged during the next upload.", NULL },
+  { 6, 1080LL, 109LL, "-", "More of the next upload.", NULL },
+  { 5, 1090LL, 110LL, "-", LOG_MARKER_END, NULL },
+  { 9, 1100LL, 111LL, "-", "Newest data.", NULL }
+};
+int test_batch_data_size = sizeof(test_batch_data) / sizeof(struct log_data);
+
+// After a reboot the log is read in several batches, which are held back to
+// back in one buffer until the markers show what was already uploaded.
+TEST(LogUploader, parse_logs_no_counter_batches) {
+  struct log_parse_params* params = create_log_parse_params(test_batch_data,
+      test_batch_data_size);
+  struct parser_progress* progress =
+    (struct parser_progress*) params->user_data;
+  // Room for three of these lines per batch.
+  unsigned long batch_size = 2 * params->line_buffer_size + 100;
+  char* held_buffer = params->log_buffer;
+  unsigned long held_bytes = 0;
+  params->check_for_markers = 1;
+
+  // The first batch has no markers yet.
+  params->total_read = batch_size;
+  char* res_buffer = parse_and_consume_log_data(params);
+  EXPECT_EQ(1, params->buffer_full);
+  EXPECT_EQ(held_buffer, res_buffer);
+  EXPECT_TRUE(params->upload_from == NULL);
+  held_bytes = res_buffer + params->total_read - held_buffer;
+
+  // The second starts at a start marker followed by its end marker.
+  params->log_buffer = held_buffer + held_bytes;
+  params->total_read = batch_size;
+  res_buffer = parse_and_consume_log_data(params);
+  EXPECT_EQ(1, params->buffer_full);
+  EXPECT_EQ(params->log_buffer, res_buffer);
+  EXPECT_EQ(params->log_buffer, params->upload_from);
+  held_bytes = res_buffer + params->total_read - held_buffer;
+
+  // The third has the next start marker, whose end marker is in the last.
+  params->log_buffer = held_buffer + held_bytes;
+  params->total_read = batch_size;
+  res_buffer = parse_and_consume_log_data(params);
+  EXPECT_EQ(1, params->buffer_full);
+  EXPECT_TRUE(params->start_marker != NULL);
+  held_bytes = res_buffer + params->total_read - held_buffer;
+
+  // The last has room to read on to our own start marker.
+  params->log_buffer = held_buffer + held_bytes;
+  params->total_read = 2 * batch_size;
+  res_buffer = parse_and_consume_log_data(params);
+  EXPECT_EQ(0, params->buffer_full);
+  EXPECT_EQ(2, progress->eos_count);
+  EXPECT_EQ(progress->num_entries, progress->curr_entry);
+  EXPECT_EQ(111LL, params->last_log_counter);
+  EXPECT_EQ(1, params->check_for_markers);
+  held_bytes = res_buffer + params->total_read - held_buffer;
+
+  // Only the data from the last start marker before an end marker on goes
+  // out, none of what was uploaded before the reboot.
+  ASSERT_TRUE(params->upload_from != NULL);
+  EXPECT_TRUE(params->start_marker == NULL);
+  int len = held_buffer + held_bytes - params->upload_from;
+  EXPECT_EQ(len, verify_log_data(test_batch_data, params->upload_from, len,
+        7, 5));
+
+  params->log_buffer = held_buffer;
+  free_log_parse_params(params);
+}
+
 TEST(LogUploader, logmark_once_ntpsync) {
   setup_temp_files();
   write_to_file(test_version_path, "fakeversion");
@@ -342,3 +422,134 @@ TEST(LogUploader, anonymize_mac_addresses) {
 
   free_log_parse_params(params);
 }
+
+// The original byte-at-a-time scanner, kept as the reference for
+// suppress_mac_addresses.
+static int ref_is_mac_addr(const char *s, char sep) {
+  return (s[2] == sep) && (s[5] == sep) && (s[8] == sep) &&
+      (s[11] == sep) && (s[14] == sep) &&
+      isxdigit(s[0]) && isxdigit(s[1]) &&
+      isxdigit(s[3]) && isxdigit(s[4]) &&
+      isxdigit(s[6]) && isxdigit(s[7]) &&
+      isxdigit(s[9]) && isxdigit(s[10]) &&
+      isxdigit(s[12]) && isxdigit(s[13]) &&
+      isxdigit(s[15]) && isxdigit(s[16]);
+}
+
+static unsigned long ref_suppress_mac_addresses(char *line, ssize_t len) {
+  char *s = line;
+  unsigned long new_len = len;
+
+  while (len >= 17) {
+    if (ref_is_mac_addr(s, ':') || ref_is_mac_addr(s, '-') ||
+        ref_is_mac_addr(s, '_')) {
+      char anonid[6];
+      get_anonid_for_mac(s, anonid);
+      memcpy(s, anonid, sizeof(anonid));
+      memmove(s + 6, s + 17, len - 11);
+      len -= 11;
+      new_len -= 11;
+    } else {
+      s += 1;
+      len -= 1;
+    }
+  }
+  return new_len;
+}
+
+// Build a kernel-log-like line with a few MAC addresses, near misses and
+// separators in it, drawing from a small set of stations.
+static int make_mac_test_line(char *buf, int size) {
+  static const char *pieces[] = {
+    "wlan0: ", "STA ", "associated ", "aid=3 ", "rssi -61 ", "::", "--",
+    "__", "f8:8f:ca:00:00:01", "00-11-22-33-44-55", "aa_bb_cc_dd_ee_ff",
+    "f8:8f:ca:00:00:0", "f8:8f:ca:00:00:0g", "f8:8f-ca:00:00:01",
+    "12:34:56:78:9a:bc:de", "deauthenticated ", "reason 3 ", ":",
+  };
+  int n = 0;
+  int count = 1 + random() % 24;
+  while (count-- > 0) {
+    const char *p = pieces[random() % (sizeof(pieces) / sizeof(pieces[0]))];
+    int l = strlen(p);
+    if (n + l + 2 >= size) break;
+    memcpy(buf + n, p, l);
+    n += l;
+  }
+  buf[n++] = '\n';
+  buf[n] = '\0';
+  return n;
+}
+
+TEST(LogUploader, suppress_mac_addresses_matches_reference) {
+  char line[1024], expected[1024];
+  srandom(1234);
+  for (int i = 0; i < 20000; ++i) {
+    int len = make_mac_test_line(line, sizeof(line) - 16);
+    memcpy(expected, line, sizeof(line));
+    unsigned long expected_len = ref_suppress_mac_addresses(expected, len);
+    unsigned long new_len = suppress_mac_addresses(line, len);
+    ASSERT_EQ(expected_len, new_len);
+    ASSERT_EQ(0, memcmp(expected, line, new_len)) << expected;
+  }
+}
+
+TEST(LogUploader, suppress_mac_addresses_new_key) {
+  char line[64] = "sta f8:8f:ca:00:00:01 joined\n";
+  char line2[64];
+  strcpy(line2, line);
+  suppress_mac_addresses(line, strlen(line));
+  default_consensus_key();
+  suppress_mac_addresses(line2, strlen(line2));
+  // A cached anonid from the old key must not be reused.
+  char expected[7];
+  get_anonid_for_mac("f8:8f:ca:00:00:01", expected);
+  expected[6] = '\0';
+  EXPECT_EQ(0, strncmp(line2 + 4, expected, 6));
+  EXPECT_NE(0, strncmp(line + 4, line2 + 4, 6));
+}
+
+static double elapsed_secs(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Not a pass/fail check on speed, but reports throughput for both
+// implementations on the same data so regressions are easy to spot.
+TEST(LogUploader, suppress_mac_addresses_benchmark) {
+  const int num_lines = 2000;
+  const int rounds = 50;
+  static char lines[num_lines][256];
+  static int lens[num_lines];
+  char work[256];
+  struct timespec start;
+  unsigned long total = 0, ref_total = 0;
+  double new_secs, ref_secs;
+
+  srandom(5678);
+  for (int i = 0; i < num_lines; ++i) {
+    lens[i] = make_mac_test_line(lines[i], sizeof(lines[i]) - 16);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < rounds; ++r) {
+    for (int i = 0; i < num_lines; ++i) {
+      memcpy(work, lines[i], sizeof(work));
+      ref_total += ref_suppress_mac_addresses(work, lens[i]);
+    }
+  }
+  ref_secs = elapsed_secs(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < rounds; ++r) {
+    for (int i = 0; i < num_lines; ++i) {
+      memcpy(work, lines[i], sizeof(work));
+      total += suppress_mac_addresses(work, lens[i]);
+    }
+  }
+  new_secs = elapsed_secs(&start);
+
+  EXPECT_EQ(ref_total, total);
+  printf("suppress_mac_addresses: reference %.1f MB/s, new %.1f MB/s\n",
+      ref_total / ref_secs / 1e6, total / new_secs / 1e6);
+}
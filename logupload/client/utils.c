@@ -125,10 +125,78 @@ int parse_line_data(char* line, struct line_data* data) {
   data->seq = strtoull(comma_1 + 1, NULL, 10);
   data->ts_nsec = strtoull(comma_2 + 1, NULL, 10);
   data->text = semi + 1;
+  data->text_len = newline + 1 - data->text;
   *(newline + 1) = '\0'; // terminate the string after the newline
   return 0;
 }
 
+int read_boot_id(const char* path, char* buf, int len) {
+  if (read_file_as_string(path, buf, len) < 0) {
+    buf[0] = '\0';
+    return -1;
+  }
+  rstrip(buf);
+  return 0;
+}
+
+int read_checkpoint(const char* path, struct checkpoint* cp) {
+  char buf[128];
+  char* end;
+  memset(cp, 0, sizeof(*cp));
+  if (read_file_as_string(path, buf, sizeof(buf)) < 0) {
+    return -1;
+  }
+  char* space = strchr(buf, ' ');
+  char* num = buf;
+  if (space) {
+    if (space - buf >= (int)sizeof(cp->boot_id)) {
+      return -1;
+    }
+    memcpy(cp->boot_id, buf, space - buf);
+    num = space + 1;
+  }
+  errno = 0;
+  cp->seq = strtoull(num, &end, 10);
+  if (errno || end == num || (*end && !isspace(*end))) {
+    memset(cp, 0, sizeof(*cp));
+    return -1;
+  }
+  return 0;
+}
+
+int write_checkpoint(const char* path, const struct checkpoint* cp) {
+  char tmp_path[1024];
+  char data[128];
+  // A unique name from mkstemp, so a link planted at a predictable name
+  // can't redirect the write.
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >=
+      (int)sizeof(tmp_path)) {
+    fprintf(stderr, "checkpoint path too long: %s\n", path);
+    return -1;
+  }
+  int len = snprintf(data, sizeof(data), "%s %" PRIu64 "\n", cp->boot_id,
+      cp->seq);
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    perror(tmp_path);
+    return -1;
+  }
+  ssize_t num_written = write(fd, data, len);
+  if (num_written < len || fsync(fd) < 0) {
+    perror(tmp_path);
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+  close(fd);
+  if (rename(tmp_path, path) < 0) {
+    perror(path);
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
 int deflate_inplace(z_stream *strm, unsigned char* buf,
     unsigned long len, unsigned long *out_len) {
   int rv;
@@ -183,3 +251,48 @@ int deflate_inplace(z_stream *strm, unsigned char* buf,
   // Failure.
   return rv;
 }
+
+int deflate_stream_start(struct deflate_stream* ds, unsigned char* out,
+    unsigned long out_size, int level) {
+  deflateEnd(&ds->strm);
+  memset(&ds->strm, 0, sizeof(ds->strm));
+  ds->out = out;
+  ds->out_size = out_size;
+  int rv = deflateInit(&ds->strm, level);
+  if (rv != Z_OK)
+    return rv;
+  ds->strm.next_out = out;
+  ds->strm.avail_out = out_size;
+  return Z_OK;
+}
+
+int deflate_stream_write(struct deflate_stream* ds, const void* data,
+    unsigned long len) {
+  ds->strm.next_in = (unsigned char*) data;
+  ds->strm.avail_in = len;
+  while (ds->strm.avail_in) {
+    if (!ds->strm.avail_out)
+      return Z_BUF_ERROR;
+    int rv = deflate(&ds->strm, Z_NO_FLUSH);
+    if (rv != Z_OK)
+      return rv;
+  }
+  return Z_OK;
+}
+
+int deflate_stream_finish(struct deflate_stream* ds, unsigned long* out_len) {
+  int rv;
+  ds->strm.next_in = NULL;
+  ds->strm.avail_in = 0;
+  do {
+    rv = deflate(&ds->strm, Z_FINISH);
+  } while (rv == Z_OK && ds->strm.avail_out);
+  if (rv != Z_STREAM_END)
+    return (rv == Z_OK) ? Z_BUF_ERROR : rv;
+  *out_len = ds->strm.total_out;
+  return Z_OK;
+}
+
+unsigned long deflate_stream_used(const struct deflate_stream* ds) {
+  return ds->strm.total_out;
+}
@@ -18,6 +18,14 @@ struct line_data {
   uint64_t ts_nsec;
   uint64_t seq;
   char* text;
+  size_t text_len;  // including the trailing newline
+};
+
+// Where we got to uploading the kernel log. Sequence numbers restart on
+// every boot, so they're only meaningful together with the boot id.
+struct checkpoint {
+  char boot_id[64];
+  uint64_t seq;
 };
 
 // Reads a file and puts the contents into the passed in string, returns
@@ -42,6 +50,19 @@ void rstrip(char* string);
 // Returns 1 if the path exists, zero otherwise.
 int path_exists(const char* path);
 
+// Reads the kernel's boot id (from /proc/sys/kernel/random/boot_id) into
+// buf. Returns 0 on success, otherwise leaves buf empty and returns -1.
+int read_boot_id(const char* path, char* buf, int len);
+
+// Reads a checkpoint written by write_checkpoint. A file holding just a
+// counter, as older versions wrote, gives an empty boot_id. Returns 0 on
+// success, -1 and a zeroed checkpoint if the file is missing or invalid.
+int read_checkpoint(const char* path, struct checkpoint* cp);
+
+// Atomically replaces the checkpoint file, syncing it to disk first so a
+// crash leaves either the old or the new checkpoint. Returns 0 on success.
+int write_checkpoint(const char* path, const struct checkpoint* cp);
+
 // Parses a line of kernel log data into the struct.
 int parse_line_data(char* line, struct line_data* data);
 
@@ -55,6 +76,30 @@ int parse_line_data(char* line, struct line_data* data);
 int deflate_inplace(z_stream *strm, unsigned char* buf,
     unsigned long len, unsigned long *out_len);
 
+// Incremental compression into a fixed output buffer, so data can be
+// compressed as it is read rather than all at once.
+struct deflate_stream {
+  z_stream strm;
+  unsigned char* out;
+  unsigned long out_size;
+};
+
+// (Re)starts a zlib stream at the given level, writing into out. Returns
+// a zlib status code. ds must be zeroed before its first use.
+int deflate_stream_start(struct deflate_stream* ds, unsigned char* out,
+    unsigned long out_size, int level);
+
+// Compresses len more bytes of data. Returns Z_OK, or Z_BUF_ERROR if the
+// output buffer filled up before all the data was consumed.
+int deflate_stream_write(struct deflate_stream* ds, const void* data,
+    unsigned long len);
+
+// Ends the stream. On Z_OK, *out_len is the total compressed size.
+int deflate_stream_finish(struct deflate_stream* ds, unsigned long* out_len);
+
+// Number of compressed bytes produced so far.
+unsigned long deflate_stream_used(const struct deflate_stream* ds);
+
 #ifdef __cplusplus
 }
 #endif
@@ -82,6 +82,7 @@ TEST(Utils, parse_line_data_success) {
   char buf[128] = "5,16,200,-;This is my log message of love\n";
   EXPECT_EQ(0, parse_line_data(buf, &data));
   EXPECT_STREQ("This is my log message of love\n", data.text);
+  EXPECT_EQ(strlen(data.text), data.text_len);
   EXPECT_EQ(5, data.level);
   EXPECT_EQ(16, data.seq);
   EXPECT_EQ(200, data.ts_nsec);
@@ -90,11 +91,89 @@ TEST(Utils, parse_line_data_success) {
       "2,33,54321,-;This is my log message of tests suck\ndictjunk\n";
   EXPECT_EQ(0, parse_line_data(buf2, &data));
   EXPECT_STREQ("This is my log message of tests suck\n", data.text);
+  EXPECT_EQ(strlen(data.text), data.text_len);
   EXPECT_EQ(2, data.level);
   EXPECT_EQ(33, data.seq);
   EXPECT_EQ(54321, data.ts_nsec);
 }
 
+TEST(Utils, checkpoint_success) {
+  char tdir[32] = "utiltestXXXXXX";
+  EXPECT_TRUE(mkdtemp(tdir) != NULL);
+  char tfile[64];
+  snprintf(tfile, sizeof(tfile), "%s/%s", tdir, "checkpoint");
+  struct checkpoint cp, cp2;
+  memset(&cp, 0, sizeof(cp));
+  strcpy(cp.boot_id, "0b1d2a3c-4e5f-6789-abcd-ef0123456789");
+  cp.seq = 123456789012LL;
+  EXPECT_EQ(0, write_checkpoint(tfile, &cp));
+  EXPECT_EQ(0, read_checkpoint(tfile, &cp2));
+  EXPECT_STREQ(cp.boot_id, cp2.boot_id);
+  EXPECT_EQ(cp.seq, cp2.seq);
+
+  // Overwriting with a shorter value must not leave junk behind.
+  cp.seq = 7;
+  EXPECT_EQ(0, write_checkpoint(tfile, &cp));
+  EXPECT_EQ(0, read_checkpoint(tfile, &cp2));
+  EXPECT_EQ(7, cp2.seq);
+  remove(tfile);
+  rmdir(tdir);
+}
+
+TEST(Utils, checkpoint_ignores_planted_link) {
+  char tdir[32] = "utiltestXXXXXX";
+  EXPECT_TRUE(mkdtemp(tdir) != NULL);
+  char tfile[64], tlink[64], target[64];
+  snprintf(tfile, sizeof(tfile), "%s/%s", tdir, "checkpoint");
+  snprintf(tlink, sizeof(tlink), "%s/%s", tdir, "checkpoint.tmp");
+  snprintf(target, sizeof(target), "%s/%s", tdir, "target");
+  write_to_file(target, "untouched\n");
+  EXPECT_EQ(0, symlink("target", tlink));
+  struct checkpoint cp, cp2;
+  memset(&cp, 0, sizeof(cp));
+  cp.seq = 99;
+  EXPECT_EQ(0, write_checkpoint(tfile, &cp));
+  EXPECT_EQ(0, read_checkpoint(tfile, &cp2));
+  EXPECT_EQ(99, cp2.seq);
+  char buf[32];
+  EXPECT_EQ(10, read_file_as_string(target, buf, sizeof(buf)));
+  EXPECT_STREQ("untouched\n", buf);
+  remove(tlink);
+  remove(target);
+  remove(tfile);
+  rmdir(tdir);
+}
+
+TEST(Utils, checkpoint_old_format) {
+  char tdir[32] = "utiltestXXXXXX";
+  EXPECT_TRUE(mkdtemp(tdir) != NULL);
+  char tfile[64];
+  snprintf(tfile, sizeof(tfile), "%s/%s", tdir, "checkpoint");
+  EXPECT_EQ(0, write_file_as_uint64(tfile, 4242));
+  struct checkpoint cp;
+  EXPECT_EQ(0, read_checkpoint(tfile, &cp));
+  EXPECT_STREQ("", cp.boot_id);
+  EXPECT_EQ(4242, cp.seq);
+  remove(tfile);
+  rmdir(tdir);
+}
+
+TEST(Utils, checkpoint_failure) {
+  struct checkpoint cp;
+  EXPECT_EQ(-1, read_checkpoint("filedoesnotexist", &cp));
+  EXPECT_EQ(0, cp.seq);
+
+  char tdir[32] = "utiltestXXXXXX";
+  EXPECT_TRUE(mkdtemp(tdir) != NULL);
+  char tfile[64];
+  snprintf(tfile, sizeof(tfile), "%s/%s", tdir, "checkpoint");
+  write_to_file(tfile, "bootid notanumber\n");
+  EXPECT_EQ(-1, read_checkpoint(tfile, &cp));
+  EXPECT_EQ(0, cp.seq);
+  remove(tfile);
+  rmdir(tdir);
+}
+
 TEST(Utils, parse_line_data_failure) {
   struct line_data data;
   char buf[128] = "this is totally bad data";
@@ -159,3 +238,52 @@ TEST(Utils, deflate_in_place4_test) {
 TEST(Utils, deflate_in_place5_test) {
   zlib_test(256, 1, RANDBUF, 1);
 }
+
+TEST(Utils, deflate_stream_test) {
+  struct deflate_stream ds;
+  memset(&ds, 0, sizeof(ds));
+  unsigned char out[RANDBUF];
+  unsigned char data[RANDBUF];
+  for (unsigned int i = 0; i < sizeof(data); i++) {
+    data[i] = random() % 64;
+  }
+
+  // Feed it in pieces, and reuse the stream for a second round.
+  for (int round = 0; round < 2; round++) {
+    EXPECT_EQ(Z_OK, deflate_stream_start(&ds, out, sizeof(out), 1));
+    for (unsigned int i = 0; i < sizeof(data); i += 1000) {
+      unsigned long len = sizeof(data) - i < 1000 ? sizeof(data) - i : 1000;
+      EXPECT_EQ(Z_OK, deflate_stream_write(&ds, data + i, len));
+    }
+    unsigned long comp_size = 0;
+    EXPECT_EQ(Z_OK, deflate_stream_finish(&ds, &comp_size));
+    EXPECT_EQ(comp_size, deflate_stream_used(&ds));
+
+    unsigned char decompressed[RANDBUF];
+    unsigned long full_size = sizeof(decompressed);
+    EXPECT_EQ(Z_OK, uncompress(decompressed, &full_size, out, comp_size));
+    EXPECT_EQ(sizeof(data), full_size);
+    EXPECT_EQ(0, memcmp(decompressed, data, sizeof(data)));
+  }
+  deflateEnd(&ds.strm);
+}
+
+TEST(Utils, deflate_stream_overflow_test) {
+  struct deflate_stream ds;
+  memset(&ds, 0, sizeof(ds));
+  unsigned char out[1024];
+  unsigned char data[RANDBUF];
+  for (unsigned int i = 0; i < sizeof(data); i++) {
+    data[i] = random() % 256;
+  }
+  EXPECT_EQ(Z_OK, deflate_stream_start(&ds, out, sizeof(out), 1));
+  // zlib may buffer the input internally, so the overflow might only be
+  // noticed when finishing, but it must be noticed.
+  int rv = deflate_stream_write(&ds, data, sizeof(data));
+  if (rv == Z_OK) {
+    unsigned long comp_size = 0;
+    rv = deflate_stream_finish(&ds, &comp_size);
+  }
+  EXPECT_EQ(Z_BUF_ERROR, rv);
+  deflateEnd(&ds.strm);
+}
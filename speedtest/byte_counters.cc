@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "byte_counters.h"
+
+#include <new>
+#include <stdlib.h>
+
+namespace speedtest {
+
+void ByteCounters::FreeCounters::operator()(Counter *counters) const {
+  free(counters);
+}
+
+ByteCounters::ByteCounters(int num_streams)
+    : num_streams_(num_streams > 0 ? num_streams : 0) {
+  if (num_streams_ > 0) {
+    size_t size = num_streams_ * sizeof(Counter);
+    void *memory = nullptr;
+    if (posix_memalign(&memory, kCacheLineSize, size) != 0) {
+      // Unaligned counters may share cache lines, which costs some speed
+      // but still counts every byte.
+      memory = malloc(size);
+      if (!memory) {
+        throw std::bad_alloc();
+      }
+    }
+    Counter *counters = static_cast<Counter *>(memory);
+    for (int i = 0; i < num_streams_; ++i) {
+      new (&counters[i]) Counter;
+    }
+    counters_.reset(counters);
+  }
+  Reset();
+}
+
+void ByteCounters::Reset() {
+  for (int i = 0; i < num_streams_; ++i) {
+    counters_[i].bytes.store(0, std::memory_order_relaxed);
+  }
+}
+
+void ByteCounters::Add(int stream, long bytes) {
+  if (stream < 0 || stream >= num_streams_) {
+    return;
+  }
+  // Only one thread writes each counter so a plain load and store avoids
+  // the cost of a locked read-modify-write.
+  std::atomic_long &counter = counters_[stream].bytes;
+  counter.store(counter.load(std::memory_order_relaxed) + bytes,
+                std::memory_order_relaxed);
+}
+
+long ByteCounters::Total() const {
+  long total = 0;
+  for (int i = 0; i < num_streams_; ++i) {
+    total += counters_[i].bytes.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void ByteCounters::Sample(std::vector<long> *bytes) const {
+  if (!bytes) {
+    return;
+  }
+  bytes->resize(num_streams_);
+  for (int i = 0; i < num_streams_; ++i) {
+    (*bytes)[i] = counters_[i].bytes.load(std::memory_order_relaxed);
+  }
+}
+
+}  // namespace speedtest
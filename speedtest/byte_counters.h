@@ -0,0 +1,75 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPEEDTEST_BYTE_COUNTERS_H
+#define SPEEDTEST_BYTE_COUNTERS_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "utils.h"
+
+namespace speedtest {
+
+// Per-stream byte counters for concurrent transfers.
+//
+// Each stream has its own counter on its own cache line so streams never
+// contend with each other, and a stream's counter must only be written by
+// one thread at a time. Readers sample the counters without locking.
+class ByteCounters {
+ public:
+  explicit ByteCounters(int num_streams);
+
+  int num_streams() const { return num_streams_; }
+
+  // Set all counters to zero.
+  void Reset();
+
+  // Add bytes to one stream's counter.
+  void Add(int stream, long bytes);
+
+  // Sum of all streams.
+  long Total() const;
+
+  // Copy each stream's count into bytes, resizing it as needed.
+  // Caller retains ownership.
+  void Sample(std::vector<long> *bytes) const;
+
+ private:
+  static const int kCacheLineSize = 64;
+
+  struct alignas(kCacheLineSize) Counter {
+    std::atomic_long bytes;
+    char padding[kCacheLineSize - sizeof(std::atomic_long)];
+  };
+  static_assert(sizeof(Counter) == kCacheLineSize,
+                "each counter must fill exactly one cache line");
+
+  // Counters are allocated with posix_memalign since new[] doesn't honour
+  // over-aligned types before C++17, falling back to malloc if that fails.
+  struct FreeCounters {
+    void operator()(Counter *counters) const;
+  };
+
+  int num_streams_;
+  std::unique_ptr<Counter[], FreeCounters> counters_;
+
+  DISALLOW_COPY_AND_ASSIGN(ByteCounters);
+};
+
+}  // namespace speedtest
+
+#endif  // SPEEDTEST_BYTE_COUNTERS_H
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "byte_counters.h"
+
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace speedtest {
+namespace {
+
+TEST(ByteCountersTest, Empty_Ok) {
+  ByteCounters counters(0);
+  std::vector<long> bytes{1, 2, 3};
+  counters.Sample(&bytes);
+  EXPECT_EQ(0, counters.num_streams());
+  EXPECT_EQ(0, counters.Total());
+  EXPECT_TRUE(bytes.empty());
+}
+
+TEST(ByteCountersTest, Add_Ok) {
+  ByteCounters counters(3);
+  counters.Add(0, 100);
+  counters.Add(2, 50);
+  counters.Add(2, 25);
+  std::vector<long> bytes;
+  counters.Sample(&bytes);
+  EXPECT_EQ(175, counters.Total());
+  EXPECT_EQ(std::vector<long>({100, 0, 75}), bytes);
+}
+
+TEST(ByteCountersTest, AddOutOfRange_Ignored) {
+  ByteCounters counters(2);
+  counters.Add(-1, 100);
+  counters.Add(2, 100);
+  EXPECT_EQ(0, counters.Total());
+}
+
+TEST(ByteCountersTest, Reset_Ok) {
+  ByteCounters counters(2);
+  counters.Add(0, 100);
+  counters.Add(1, 100);
+  counters.Reset();
+  EXPECT_EQ(0, counters.Total());
+}
+
+}  // namespace
+}  // namespace speedtest
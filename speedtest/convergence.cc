@@ -0,0 +1,222 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "convergence.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace speedtest {
+namespace {
+
+// z score for a two sided 95% confidence interval
+const double kConfidenceZ = 1.96;
+
+// Slow start is considered over once an interval is less than this much
+// faster than the previous one.
+const double kSlowStartGrowth = 1.1;
+
+// The Theil-Sen window is never smaller than this.
+const size_t kMinWindowSize = 3;
+
+}  // namespace
+
+const char *StopRuleName(StopRule rule) {
+  switch (rule) {
+    case StopRule::MOVING_AVERAGE:
+      return "moving_average";
+    case StopRule::CONFIDENCE_INTERVAL:
+      return "confidence_interval";
+    case StopRule::THEIL_SEN:
+      return "theil_sen";
+  }
+  return "unknown";
+}
+
+bool ParseStopRule(const std::string &name, StopRule *rule) {
+  if (!rule) {
+    return false;
+  }
+  for (StopRule candidate : {StopRule::MOVING_AVERAGE,
+                             StopRule::CONFIDENCE_INTERVAL,
+                             StopRule::THEIL_SEN}) {
+    if (name == StopRuleName(candidate)) {
+      *rule = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+Convergence::Convergence(const ConvergenceOptions &options)
+    : options_(options),
+      window_size_(std::max(kMinWindowSize,
+                            static_cast<size_t>(
+                                std::max(0, options.max_intervals)))),
+      in_slow_start_(options.exclude_slow_start),
+      slow_start_intervals_(0),
+      last_megabits_(0.0),
+      num_samples_(0),
+      mean_(0.0),
+      m2_(0.0),
+      total_micros_(0),
+      total_bytes_(0),
+      window_micros_(0),
+      window_bytes_(0) {
+}
+
+void Convergence::AddInterval(long duration_micros, long bytes) {
+  if (duration_micros <= 0) {
+    return;
+  }
+  double megabits = ToMegabits(bytes, duration_micros);
+
+  if (in_slow_start_) {
+    bool growing = last_megabits_ <= 0 ||
+                   megabits >= last_megabits_ * kSlowStartGrowth;
+    // Give up on finding the end of the ramp after a full window.
+    if (growing && slow_start_intervals_ < static_cast<int>(window_size_)) {
+      last_megabits_ = megabits;
+      slow_start_intervals_++;
+      return;
+    }
+    in_slow_start_ = false;
+  }
+
+  num_samples_++;
+  double delta = megabits - mean_;
+  mean_ += delta / num_samples_;
+  m2_ += delta * (megabits - mean_);
+  total_micros_ += duration_micros;
+  total_bytes_ += bytes;
+
+  Interval interval = {duration_micros, bytes, megabits};
+  for (size_t i = 0; i < window_.size(); ++i) {
+    window_slopes_.Insert(Slope(window_[i], interval, window_.size() - i));
+  }
+  window_.push_back(interval);
+  window_micros_ += duration_micros;
+  window_bytes_ += bytes;
+  window_speeds_.Insert(megabits);
+  if (window_.size() > window_size_) {
+    const Interval &oldest = window_.front();
+    for (size_t j = 1; j < window_.size(); ++j) {
+      window_slopes_.Erase(Slope(oldest, window_[j], j));
+    }
+    window_micros_ -= oldest.duration_micros;
+    window_bytes_ -= oldest.bytes;
+    window_speeds_.Erase(oldest.megabits);
+    window_.pop_front();
+  }
+}
+
+bool Convergence::converged() const {
+  int min_samples = std::max(options_.min_intervals,
+                             static_cast<int>(kMinWindowSize) - 1);
+  if (num_samples_ < min_samples || speed_megabits() <= 0) {
+    return false;
+  }
+  switch (options_.rule) {
+    case StopRule::CONFIDENCE_INTERVAL:
+      return relative_confidence_interval() <= options_.max_variance;
+    case StopRule::THEIL_SEN:
+      return window_.size() >= kMinWindowSize &&
+             std::fabs(relative_slope()) <= options_.max_variance;
+    case StopRule::MOVING_AVERAGE:
+      break;
+  }
+  return false;
+}
+
+double Convergence::speed_megabits() const {
+  switch (options_.rule) {
+    case StopRule::THEIL_SEN:
+      return window_micros_ > 0
+             ? ToMegabits(window_bytes_, window_micros_)
+             : 0.0;
+    default:
+      return total_micros_ > 0
+             ? ToMegabits(total_bytes_, total_micros_)
+             : 0.0;
+  }
+}
+
+double Convergence::relative_confidence_interval() const {
+  if (num_samples_ < 2 || mean_ <= 0) {
+    return 1.0;
+  }
+  double stddev = std::sqrt(m2_ / (num_samples_ - 1));
+  return kConfidenceZ * stddev / std::sqrt(num_samples_) / mean_;
+}
+
+double Convergence::relative_slope() const {
+  if (window_.size() < 2) {
+    return 1.0;
+  }
+  double median_speed = window_speeds_.Median();
+  if (median_speed <= 0) {
+    return 1.0;
+  }
+  return window_slopes_.Median() * (window_.size() - 1) / median_speed;
+}
+
+double Convergence::Slope(const Interval &from, const Interval &to,
+                          size_t distance) {
+  return (to.megabits - from.megabits) / distance;
+}
+
+void Convergence::RunningMedian::Insert(double value) {
+  if (low_.empty() || value <= *low_.rbegin()) {
+    low_.insert(value);
+  } else {
+    high_.insert(value);
+  }
+  Rebalance();
+}
+
+void Convergence::RunningMedian::Erase(double value) {
+  auto it = low_.find(value);
+  if (it != low_.end()) {
+    low_.erase(it);
+  } else {
+    high_.erase(high_.find(value));
+  }
+  Rebalance();
+}
+
+double Convergence::RunningMedian::Median() const {
+  if (low_.empty()) {
+    return 0.0;
+  }
+  if (low_.size() > high_.size()) {
+    return *low_.rbegin();
+  }
+  return (*low_.rbegin() + *high_.begin()) / 2;
+}
+
+void Convergence::RunningMedian::Rebalance() {
+  while (low_.size() > high_.size() + 1) {
+    auto largest = std::prev(low_.end());
+    high_.insert(*largest);
+    low_.erase(largest);
+  }
+  while (high_.size() > low_.size()) {
+    low_.insert(*high_.begin());
+    high_.erase(high_.begin());
+  }
+}
+
+}  // namespace speedtest
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPEEDTEST_CONVERGENCE_H
+#define SPEEDTEST_CONVERGENCE_H
+
+#include <deque>
+#include <set>
+#include <string>
+#include "utils.h"
+
+namespace speedtest {
+
+// How a variable length transfer decides that its speed is stable.
+enum class StopRule {
+  // Stop when the short and long moving averages are close.
+  MOVING_AVERAGE,
+  // Stop when the 95% confidence interval of the mean interval speed is
+  // narrow relative to the mean.
+  CONFIDENCE_INTERVAL,
+  // Stop when the Theil-Sen slope of recent interval speeds is flat.
+  THEIL_SEN,
+};
+
+const char *StopRuleName(StopRule rule);
+
+// Parse a stop rule name as returned by StopRuleName.
+// Returns false if name is unknown or rule is null.
+bool ParseStopRule(const std::string &name, StopRule *rule);
+
+struct ConvergenceOptions {
+  StopRule rule = StopRule::MOVING_AVERAGE;
+  int min_intervals = 0;
+  int max_intervals = 0;
+  double max_variance = 0.0;
+  bool exclude_slow_start = false;
+};
+
+// Incremental speed estimator for the CONFIDENCE_INTERVAL and THEIL_SEN
+// stop rules. Samples are fed one interval at a time; the confidence
+// interval is maintained in O(1) per sample and the slope over a window of
+// at most max_intervals samples in O(max_intervals log max_intervals), so
+// checking for convergence never rescans the samples.
+//
+// Optionally the TCP slow start ramp is excluded: intervals are ignored
+// while each one is markedly faster than the one before.
+//
+// Not threadsafe.
+class Convergence {
+ public:
+  explicit Convergence(const ConvergenceOptions &options);
+
+  void AddInterval(long duration_micros, long bytes);
+
+  // Whether the estimate is stable according to the stop rule.
+  bool converged() const;
+
+  // Current speed estimate, 0 if there are no samples yet.
+  double speed_megabits() const;
+
+  // Number of intervals counted towards the estimate.
+  int num_samples() const { return num_samples_; }
+
+  // Number of intervals excluded as TCP slow start.
+  int slow_start_intervals() const { return slow_start_intervals_; }
+
+  // Relative half width of the 95% confidence interval of the mean.
+  double relative_confidence_interval() const;
+
+  // Theil-Sen slope over the window expressed as the relative change in
+  // speed across the whole window.
+  double relative_slope() const;
+
+ private:
+  struct Interval {
+    long duration_micros;
+    long bytes;
+    double megabits;
+  };
+
+  // Median of a multiset of values that can be added and removed.
+  class RunningMedian {
+   public:
+    void Insert(double value);
+    // value must have been inserted before
+    void Erase(double value);
+    // 0 if empty
+    double Median() const;
+
+   private:
+    void Rebalance();
+
+    // The lower half, with the extra value if the count is odd, and the
+    // upper half.
+    std::multiset<double> low_;
+    std::multiset<double> high_;
+  };
+
+  // Theil-Sen slope between two window entries distance apart.
+  static double Slope(const Interval &from, const Interval &to,
+                      size_t distance);
+
+  ConvergenceOptions options_;
+  size_t window_size_;
+
+  bool in_slow_start_;
+  int slow_start_intervals_;
+  double last_megabits_;
+
+  // Welford's running mean and variance of interval speeds
+  int num_samples_;
+  double mean_;
+  double m2_;
+  long total_micros_;
+  long total_bytes_;
+
+  std::deque<Interval> window_;
+  long window_micros_;
+  long window_bytes_;
+  RunningMedian window_speeds_;
+  RunningMedian window_slopes_;
+
+  DISALLOW_COPY_AND_ASSIGN(Convergence);
+};
+
+}  // namespace speedtest
+
+#endif  // SPEEDTEST_CONVERGENCE_H
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "convergence.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+
+namespace speedtest {
+namespace {
+
+const long kIntervalMicros = 100000;
+
+// Bytes per interval for a speed in megabits
+long BytesFor(double megabits) {
+  return static_cast<long>(megabits * kIntervalMicros / 8);
+}
+
+ConvergenceOptions MakeOptions(StopRule rule, double max_variance) {
+  ConvergenceOptions options;
+  options.rule = rule;
+  options.min_intervals = 4;
+  options.max_intervals = 8;
+  options.max_variance = max_variance;
+  return options;
+}
+
+void AddSpeeds(Convergence *convergence, std::vector<double> speeds) {
+  for (double megabits : speeds) {
+    convergence->AddInterval(kIntervalMicros, BytesFor(megabits));
+  }
+}
+
+double SortedMedian(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+// Theil-Sen relative slope of speeds, computed from scratch.
+double RecomputedSlope(const std::vector<double> &speeds) {
+  std::vector<double> slopes;
+  for (size_t i = 0; i < speeds.size(); ++i) {
+    for (size_t j = i + 1; j < speeds.size(); ++j) {
+      slopes.push_back((speeds[j] - speeds[i]) / (j - i));
+    }
+  }
+  return SortedMedian(slopes) * (speeds.size() - 1) / SortedMedian(speeds);
+}
+
+TEST(ConvergenceTest, StopRuleNames_RoundTrip) {
+  for (StopRule rule : {StopRule::MOVING_AVERAGE,
+                        StopRule::CONFIDENCE_INTERVAL,
+                        StopRule::THEIL_SEN}) {
+    StopRule parsed;
+    EXPECT_TRUE(ParseStopRule(StopRuleName(rule), &parsed));
+    EXPECT_EQ(rule, parsed);
+  }
+  StopRule parsed;
+  EXPECT_FALSE(ParseStopRule("bogus", &parsed));
+  EXPECT_FALSE(ParseStopRule("theil_sen", nullptr));
+}
+
+TEST(ConvergenceTest, DefaultRule_MovingAverage) {
+  // Same default as TransferOptions and Options.
+  ConvergenceOptions options;
+  EXPECT_EQ(StopRule::MOVING_AVERAGE, options.rule);
+}
+
+TEST(ConvergenceTest, Empty_NotConverged) {
+  Convergence convergence(MakeOptions(StopRule::CONFIDENCE_INTERVAL, 0.1));
+  EXPECT_FALSE(convergence.converged());
+  EXPECT_EQ(0.0, convergence.speed_megabits());
+}
+
+TEST(ConvergenceTest, ConfidenceInterval_Steady_Converged) {
+  Convergence convergence(MakeOptions(StopRule::CONFIDENCE_INTERVAL, 0.05));
+  AddSpeeds(&convergence, {100, 101, 99, 100});
+  EXPECT_TRUE(convergence.converged());
+  EXPECT_NEAR(100, convergence.speed_megabits(), 0.01);
+}
+
+TEST(ConvergenceTest, ConfidenceInterval_TooFewSamples_NotConverged) {
+  Convergence convergence(MakeOptions(StopRule::CONFIDENCE_INTERVAL, 0.05));
+  AddSpeeds(&convergence, {100, 100, 100});
+  EXPECT_FALSE(convergence.converged());
+}
+
+TEST(ConvergenceTest, ConfidenceInterval_Noisy_NotConverged) {
+  Convergence convergence(MakeOptions(StopRule::CONFIDENCE_INTERVAL, 0.05));
+  AddSpeeds(&convergence, {50, 150, 60, 140, 70});
+  EXPECT_FALSE(convergence.converged());
+}
+
+TEST(ConvergenceTest, TheilSen_Flat_Converged) {
+  Convergence convergence(MakeOptions(StopRule::THEIL_SEN, 0.05));
+  AddSpeeds(&convergence, {80, 120, 100, 100, 100, 100});
+  EXPECT_TRUE(convergence.converged());
+}
+
+TEST(ConvergenceTest, TheilSen_Rising_NotConverged) {
+  Convergence convergence(MakeOptions(StopRule::THEIL_SEN, 0.05));
+  AddSpeeds(&convergence, {100, 110, 120, 130, 140, 150});
+  EXPECT_FALSE(convergence.converged());
+  EXPECT_GT(convergence.relative_slope(), 0.05);
+}
+
+TEST(ConvergenceTest, TheilSen_SpeedUsesWindow) {
+  Convergence convergence(MakeOptions(StopRule::THEIL_SEN, 0.05));
+  AddSpeeds(&convergence, {10, 10, 100, 100, 100, 100, 100, 100, 100, 100});
+  EXPECT_NEAR(100, convergence.speed_megabits(), 0.01);
+}
+
+TEST(ConvergenceTest, TheilSen_SlidingWindow_MatchesRecomputed) {
+  ConvergenceOptions options = MakeOptions(StopRule::THEIL_SEN, 0.05);
+  options.max_intervals = 5;
+  Convergence convergence(options);
+  std::vector<double> speeds = {50, 90, 70, 70, 120, 80, 100, 60, 95, 105,
+                                100, 85, 100, 100};
+  for (size_t n = 1; n <= speeds.size(); ++n) {
+    convergence.AddInterval(kIntervalMicros, BytesFor(speeds[n - 1]));
+    if (n < 2) {
+      continue;
+    }
+    std::vector<double> window(speeds.begin() + (n > 5 ? n - 5 : 0),
+                               speeds.begin() + n);
+    EXPECT_NEAR(RecomputedSlope(window), convergence.relative_slope(), 1e-9);
+  }
+}
+
+TEST(ConvergenceTest, SlowStart_Excluded) {
+  ConvergenceOptions options = MakeOptions(StopRule::CONFIDENCE_INTERVAL, 0.05);
+  options.exclude_slow_start = true;
+  Convergence convergence(options);
+  AddSpeeds(&convergence, {0, 10, 30, 70, 100, 100, 99, 101, 100});
+  EXPECT_EQ(5, convergence.slow_start_intervals());
+  EXPECT_EQ(4, convergence.num_samples());
+  EXPECT_TRUE(convergence.converged());
+  EXPECT_NEAR(100, convergence.speed_megabits(), 0.01);
+}
+
+TEST(ConvergenceTest, SlowStart_Included) {
+  Convergence convergence(MakeOptions(StopRule::CONFIDENCE_INTERVAL, 0.05));
+  AddSpeeds(&convergence, {0, 10, 30, 70, 100, 100, 99, 101});
+  EXPECT_EQ(0, convergence.slow_start_intervals());
+  EXPECT_EQ(8, convergence.num_samples());
+  EXPECT_FALSE(convergence.converged());
+}
+
+}  // namespace
+}  // namespace speedtest
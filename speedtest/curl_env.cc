@@ -19,6 +19,7 @@
 #include <cstdlib>
 #include <iostream>
 #include "errors.h"
+#include "transfer_engine.h"
 
 namespace http {
 namespace {
@@ -55,9 +56,18 @@ CurlEnv::CurlEnv(const Options &options)
     std::cerr << "Curl initialization failed: " << ErrorString(status);
     std::exit(1);
   }
-  if (!options_.disable_dns_cache) {
+  if (!options_.disable_dns_cache || !options_.disable_connection_reuse) {
     share_ = curl_share_init();
-    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    if (!options_.disable_dns_cache) {
+      curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+    if (!options_.disable_connection_reuse) {
+      // Keeping connections and TLS sessions in the share rather than in
+      // each easy or multi handle lets them outlive the requests and
+      // TransferEngine that opened them.
+      curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+      curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
     curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
     curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &LockFn);
     curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &UnlockFn);
@@ -99,24 +109,53 @@ Request::Ptr CurlEnv::NewRequest(const Url &url) {
     set_max_connections_ = true;
   }
 
-  curl_easy_setopt(handle.get(), CURLOPT_SHARE, share_);
-  curl_easy_setopt(handle.get(), CURLOPT_NOSIGNAL, 1);
-  return std::unique_ptr<Request>(new Request(handle, url));
+  std::unique_ptr<Request> request(new Request(handle, url, share_));
+  if (options_.send_buffer_bytes > 0) {
+    request->set_send_buffer_bytes(options_.send_buffer_bytes);
+  }
+  return request;
+}
+
+void CurlEnv::Warm(const std::vector<Url> &urls, std::atomic_bool *cancel) {
+  if (options_.disable_connection_reuse || urls.empty()) {
+    return;
+  }
+
+  std::vector<Request::Ptr> requests;
+  for (const Url &url : urls) {
+    requests.emplace_back(NewRequest(url));
+  }
+
+  // Every request is started at once so none of them can reuse another's
+  // connection; each leaves one idle connection behind when it completes.
+  TransferEngine engine;
+  for (const Request::Ptr &request : requests) {
+    Request *warm = request.get();
+    bool started = false;
+    engine.AddStream([warm, started]() mutable -> CURL * {
+      if (started) {
+        return nullptr;
+      }
+      started = true;
+      return warm->PrepareGet();
+    });
+  }
+  engine.Run(cancel);
 }
 
 void CurlEnv::Lock(curl_lock_data lock_type) {
-  if (lock_type == CURL_LOCK_DATA_DNS) {
+  if (lock_type >= 0 && lock_type < CURL_LOCK_DATA_LAST) {
     // It is ill-advised to call lock directly but libcurl uses
     // separate lock/unlock functions.
-    dns_mutex_.lock();
+    share_mutexes_[lock_type].lock();
   }
 }
 
 void CurlEnv::Unlock(curl_lock_data lock_type) {
-  if (lock_type == CURL_LOCK_DATA_DNS) {
+  if (lock_type >= 0 && lock_type < CURL_LOCK_DATA_LAST) {
     // It is ill-advised to call lock directly but libcurl uses
-    // separate lock/unlock functiounknns.
-    dns_mutex_.unlock();
+    // separate lock/unlock functions.
+    share_mutexes_[lock_type].unlock();
   }
 }
 
@@ -17,9 +17,11 @@
 #ifndef HTTP_CURL_ENV_H
 #define HTTP_CURL_ENV_H
 
+#include <atomic>
 #include <curl/curl.h>
 #include <memory>
 #include <mutex>
+#include <vector>
 #include "request.h"
 #include "url.h"
 #include "utils.h"
@@ -33,7 +35,10 @@ class CurlEnv : public std::enable_shared_from_this<CurlEnv> {
   struct Options {
     int curl_options = CURL_GLOBAL_NOTHING;
     bool disable_dns_cache = false;
+    bool disable_connection_reuse = false;
     int max_connections = 0;
+    // Passed to Request::set_send_buffer_bytes() on every new request.
+    int send_buffer_bytes = 0;
   };
 
   static std::shared_ptr<CurlEnv> NewCurlEnv(const Options &options);
@@ -41,6 +46,12 @@ class CurlEnv : public std::enable_shared_from_this<CurlEnv> {
 
   Request::Ptr NewRequest(const Url &url);
 
+  // Connects to each URL concurrently, one connection per entry, and leaves
+  // the connections idle in the shared connection cache. Requests for the
+  // same host and port then pick them up instead of paying for DNS, TCP
+  // and TLS setup. Does nothing if connection reuse is disabled.
+  void Warm(const std::vector<Url> &urls, std::atomic_bool *cancel);
+
   void Lock(curl_lock_data lock_type);
   void Unlock(curl_lock_data lock_type);
 
@@ -53,7 +64,8 @@ class CurlEnv : public std::enable_shared_from_this<CurlEnv> {
   std::mutex curl_mutex_;
   bool set_max_connections_;
 
-  std::mutex dns_mutex_;
+  // one per kind of data in share_
+  std::mutex share_mutexes_[CURL_LOCK_DATA_LAST];
   CURLSH *share_;  // owned
 
   DISALLOW_COPY_AND_ASSIGN(CurlEnv);
@@ -18,7 +18,7 @@
 
 #include <string>
 #include <vector>
-#include <thread>
+#include "transfer_engine.h"
 
 namespace speedtest {
 
@@ -26,47 +26,63 @@ Download::Download(const Options &options)
     : options_(options),
       start_time_(0),
       end_time_(0),
-      bytes_transferred_(0) {
+      counters_(options.num_transfers) {
 }
 
 Download::Result Download::operator()(std::atomic_bool *cancel) {
   start_time_ = SystemTimeMicros();
-  bytes_transferred_ = 0;
+  counters_.Reset();
 
   if (!cancel) {
     end_time_ = SystemTimeMicros();
     return GetResult(Status(StatusCode::FAILED_PRECONDITION, "cancel is null"));
   }
 
-  std::vector<std::thread> threads;
+  // All streams run on this thread, driven by a single curl multi handle.
+  // The engine is declared after the requests so it releases their handles
+  // before they are cleaned up.
+  std::vector<http::Request::Ptr> downloads;
+  std::vector<long> downloaded(options_.num_transfers, 0);
+  http::TransferEngine engine;
+  if (!engine.ok()) {
+    end_time_ = SystemTimeMicros();
+    return GetResult(Status(StatusCode::INTERNAL,
+                            "failed to create transfer engine"));
+  }
   for (int i = 0; i < options_.num_transfers; ++i) {
-    threads.emplace_back([=]{
-      http::Request::Ptr download = options_.request_factory(i);
-      while (!*cancel) {
-        long downloaded = 0;
-        download->set_param("i", to_string(i));
-        download->set_param("size", to_string(options_.download_bytes));
-        download->set_param("time", to_string(SystemTimeMicros()));
-        download->set_progress_fn([&](curl_off_t,
-                                      curl_off_t dlnow,
-                                      curl_off_t,
-                                      curl_off_t) -> bool {
-          if (dlnow > downloaded) {
-            bytes_transferred_ += dlnow - downloaded;
-            downloaded = dlnow;
-          }
-          return *cancel;
-        });
-        download->Get();
+    downloads.emplace_back(options_.request_factory(i));
+    http::Request *download = downloads.back().get();
+    long *stream_downloaded = &downloaded[i];
+    bool started = false;
+    engine.AddStream([=]() mutable -> CURL * {
+      if (*cancel) {
+        return nullptr;
+      }
+      if (started) {
         download->Reset();
       }
+      started = true;
+      *stream_downloaded = 0;
+      download->set_param("i", to_string(i));
+      download->set_param("size", to_string(options_.download_bytes));
+      download->set_param("time", to_string(SystemTimeMicros()));
+      download->set_progress_fn([=](curl_off_t,
+                                    curl_off_t dlnow,
+                                    curl_off_t,
+                                    curl_off_t) -> bool {
+        if (dlnow > *stream_downloaded) {
+          counters_.Add(i, dlnow - *stream_downloaded);
+          *stream_downloaded = dlnow;
+        }
+        return *cancel;
+      });
+      return download->PrepareGet();
     });
   }
 
-  for (std::thread &thread : threads) {
-    if (thread.joinable()) {
-      thread.join();
-    }
+  if (!engine.Run(cancel)) {
+    end_time_ = SystemTimeMicros();
+    return GetResult(Status(StatusCode::INTERNAL, "transfer engine failed"));
   }
 
   end_time_ = SystemTimeMicros();
@@ -78,7 +94,7 @@ Download::Result Download::GetResult(Status status) const {
   result.start_time = start_time_;
   result.end_time = end_time_;
   result.status = status;
-  result.bytes_transferred = bytes_transferred_;
+  result.bytes_transferred = counters_.Total();
   return result;
 }
 
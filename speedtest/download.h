@@ -19,6 +19,7 @@
 
 #include <atomic>
 #include <functional>
+#include "byte_counters.h"
 #include "request.h"
 #include "status.h"
 #include "utils.h"
@@ -47,7 +48,8 @@ class Download {
 
   long start_time() const { return start_time_; }
   long end_time() const { return end_time_; }
-  long bytes_transferred() const { return bytes_transferred_; }
+  long bytes_transferred() const { return counters_.Total(); }
+  const ByteCounters &counters() const { return counters_; }
 
  private:
   Result GetResult(Status status) const;
@@ -55,7 +57,7 @@ class Download {
   Options options_;
   std::atomic_long start_time_;
   std::atomic_long end_time_;
-  std::atomic_long bytes_transferred_;
+  ByteCounters counters_;
 
   DISALLOW_COPY_AND_ASSIGN(Download);
 };
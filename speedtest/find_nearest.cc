@@ -16,8 +16,10 @@
 
 #include "find_nearest.h"
 
+#include <algorithm>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <mutex>
 #include <thread>
 
@@ -26,6 +28,17 @@ namespace {
 
 const long kDefaultPingTimeoutMillis = 500;
 
+// When racing, a region is dropped once its fastest warm ping is this much
+// slower than the current leader's. Only warm pings are compared, since the
+// first ping on a connection also pays for setting it up.
+const double kRaceMargin = 1.25;
+
+// Both the leader, before it wins, and a region, before it is dropped, must
+// have answered this many warm pings.
+const int kRaceMinPings = 3;
+
+const long kRaceCheckMillis = 10;
+
 }
 
 FindNearest::FindNearest(const Options &options)
@@ -51,29 +64,10 @@ FindNearest::Result FindNearest::operator()(std::atomic_bool *cancel) {
     return result;
   }
 
-  std::vector<std::thread> threads;
-  std::mutex mutex;
-  for (const Region &region : options_.regions) {
-    threads.emplace_back([&]{
-      Ping::Options ping_options;
-      ping_options.verbose = options_.verbose;
-      ping_options.request_factory = options_.request_factory;
-      ping_options.timeout_millis = options_.ping_timeout_millis > 0
-                                    ? options_.ping_timeout_millis
-                                    : kDefaultPingTimeoutMillis;
-      ping_options.num_concurrent_pings = 0;
-      ping_options.region = region;
-      Ping ping(ping_options);
-      Ping::Result ping_result = ping(cancel);
-      std::lock_guard<std::mutex> lock(mutex);
-      result.ping_results.push_back(ping_result);
-    });
-  }
-
-  for (std::thread &thread : threads) {
-    if (thread.joinable()) {
-      thread.join();
-    }
+  if (options_.race) {
+    RacePings(cancel, &result);
+  } else {
+    RunPings(cancel, &result);
   }
 
   const Ping::Result *fastest = nullptr;
@@ -99,4 +93,146 @@ FindNearest::Result FindNearest::operator()(std::atomic_bool *cancel) {
   return result;
 }
 
+void FindNearest::RunPings(std::atomic_bool *cancel, Result *result) {
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  for (const Region &region : options_.regions) {
+    threads.emplace_back([&]{
+      Ping ping(MakePingOptions(region));
+      Ping::Result ping_result = ping(cancel);
+      std::lock_guard<std::mutex> lock(mutex);
+      result->ping_results.push_back(ping_result);
+    });
+  }
+
+  for (std::thread &thread : threads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+}
+
+void FindNearest::RacePings(std::atomic_bool *cancel, Result *result) {
+  size_t num_regions = options_.regions.size();
+  std::vector<std::unique_ptr<Ping>> pings;
+  std::unique_ptr<std::atomic_bool[]> cancels(
+      new std::atomic_bool[num_regions]);
+  for (size_t i = 0; i < num_regions; ++i) {
+    Ping::Options ping_options = MakePingOptions(options_.regions[i]);
+    ping_options.dual_stack = true;
+    pings.emplace_back(new Ping(ping_options));
+    cancels[i] = false;
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::atomic_int running(num_regions);
+  for (size_t i = 0; i < num_regions; ++i) {
+    threads.emplace_back([&, i]{
+      Ping::Result ping_result = (*pings[i])(&cancels[i]);
+      std::lock_guard<std::mutex> lock(mutex);
+      result->ping_results.push_back(ping_result);
+      running--;
+    });
+  }
+
+  long timeout_micros = (options_.ping_timeout_millis > 0
+                         ? options_.ping_timeout_millis
+                         : kDefaultPingTimeoutMillis) * 1000;
+  long start_time = SystemTimeMicros();
+  while (running > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(kRaceCheckMillis));
+    if (*cancel) {
+      for (size_t i = 0; i < num_regions; ++i) {
+        cancels[i] = true;
+      }
+      continue;
+    }
+
+    // A region that hasn't answered anything within the ping timeout never
+    // will.
+    long elapsed = SystemTimeMicros() - start_time;
+    int leader = -1;
+    long leader_micros = std::numeric_limits<long>::max();
+    for (size_t i = 0; i < num_regions; ++i) {
+      if (cancels[i]) {
+        continue;
+      }
+      if (pings[i]->pings_received() == 0 && elapsed >= timeout_micros) {
+        if (options_.verbose) {
+          std::cout << "Dropping " << DescribeRegion(options_.regions[i])
+                    << " from find nearest, no answer\n";
+        }
+        cancels[i] = true;
+      } else if (pings[i]->warm_pings_received() > 0 &&
+                 pings[i]->min_warm_ping_micros() < leader_micros) {
+        leader = i;
+        leader_micros = pings[i]->min_warm_ping_micros();
+      }
+    }
+    if (leader < 0) {
+      continue;
+    }
+
+    // A region still on its first pings may yet turn out to be nearer, so
+    // it stays in the race until it has a few warm ones.
+    bool contested = false;
+    for (size_t i = 0; i < num_regions; ++i) {
+      if (static_cast<int>(i) == leader || cancels[i]) {
+        continue;
+      }
+      if (pings[i]->warm_pings_received() >= kRaceMinPings &&
+          pings[i]->min_warm_ping_micros() >= leader_micros * kRaceMargin) {
+        if (options_.verbose) {
+          std::cout << "Dropping " << DescribeRegion(options_.regions[i])
+                    << " from find nearest\n";
+        }
+        cancels[i] = true;
+      } else {
+        contested = true;
+      }
+    }
+    if (!contested && pings[leader]->warm_pings_received() >= kRaceMinPings) {
+      cancels[leader] = true;
+    }
+  }
+
+  for (std::thread &thread : threads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+}
+
+Ping::Options FindNearest::MakePingOptions(const Region &region) const {
+  Ping::Options ping_options;
+  ping_options.verbose = options_.verbose;
+  ping_options.request_factory = options_.request_factory;
+  ping_options.timeout_millis = options_.ping_timeout_millis > 0
+                                ? options_.ping_timeout_millis
+                                : kDefaultPingTimeoutMillis;
+  ping_options.num_concurrent_pings = 0;
+  ping_options.region = region;
+  return ping_options;
+}
+
+std::vector<Region> RankRegions(
+    const std::vector<Ping::Result> &ping_results) {
+  std::vector<const Ping::Result *> answered;
+  for (const Ping::Result &ping_result : ping_results) {
+    if (ping_result.received > 0) {
+      answered.push_back(&ping_result);
+    }
+  }
+  std::stable_sort(answered.begin(), answered.end(),
+                   [](const Ping::Result *a, const Ping::Result *b) {
+                     return a->min_ping_micros < b->min_ping_micros;
+                   });
+  std::vector<Region> regions;
+  for (const Ping::Result *ping_result : answered) {
+    regions.push_back(ping_result->region);
+  }
+  return regions;
+}
+
 }  // namespace speedtest
@@ -33,6 +33,10 @@ class FindNearest {
     http::Request::Factory request_factory;
     std::vector<Region> regions;
     long ping_timeout_millis;
+
+    // Race all regions over IPv4 and IPv6 and stop pinging regions as soon
+    // as they clearly can't be the nearest.
+    bool race = false;
   };
 
   struct Result {
@@ -52,6 +56,10 @@ class FindNearest {
   long end_time() const { return end_time_; }
 
  private:
+  void RunPings(std::atomic_bool *cancel, Result *result);
+  void RacePings(std::atomic_bool *cancel, Result *result);
+  Ping::Options MakePingOptions(const Region &region) const;
+
   Options options_;
   std::atomic_long start_time_;
   std::atomic_long end_time_;
@@ -59,6 +67,9 @@ class FindNearest {
   DISALLOW_COPY_AND_ASSIGN(FindNearest);
 };
 
+// Regions that answered pings ordered fastest first.
+std::vector<Region> RankRegions(const std::vector<Ping::Result> &ping_results);
+
 }  // namespace speedtest
 
 #endif // SPEEDTEST_FIND_NEAREST_H
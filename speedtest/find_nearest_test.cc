@@ -0,0 +1,71 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "find_nearest.h"
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <memory>
+#include "curl_env.h"
+#include "loopback_server.h"
+
+namespace speedtest {
+namespace {
+
+Region MakeRegion(const std::string &id, const LoopbackServer &server) {
+  Region region;
+  region.id = id;
+  region.name = id;
+  region.urls.push_back(server.url());
+  return region;
+}
+
+// The nearer region's first ping waits out a slow connection setup, long
+// after the farther region has answered, but its warm pings win.
+TEST(FindNearestTest, RaceIgnoresSlowFirstPing) {
+  LoopbackServer::Options near_options;
+  near_options.delay_millis = 10;
+  near_options.connect_delay_millis = 200;
+  LoopbackServer near(near_options);
+  ASSERT_TRUE(near.Start().ok());
+
+  LoopbackServer::Options far_options;
+  far_options.delay_millis = 60;
+  LoopbackServer far(far_options);
+  ASSERT_TRUE(far.Start().ok());
+
+  http::CurlEnv::Options curl_options;
+  std::shared_ptr<http::CurlEnv> env = http::CurlEnv::NewCurlEnv(curl_options);
+  FindNearest::Options options;
+  options.verbose = false;
+  options.request_factory = [&](const http::Url &url) {
+    return env->NewRequest(url);
+  };
+  options.regions.push_back(MakeRegion("far", far));
+  options.regions.push_back(MakeRegion("near", near));
+  options.ping_timeout_millis = 1000;
+  options.race = true;
+
+  FindNearest find_nearest(options);
+  std::atomic_bool cancel(false);
+  FindNearest::Result result = find_nearest(&cancel);
+  EXPECT_TRUE(result.status.ok());
+  EXPECT_EQ("near", result.selected_region.id);
+}
+
+}  // namespace
+}  // namespace speedtest
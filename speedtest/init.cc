@@ -16,6 +16,8 @@
 
 #include "init.h"
 
+#include <ctime>
+#include "region_cache.h"
 #include "timed_runner.h"
 
 namespace speedtest {
@@ -40,6 +42,19 @@ Init::Result Init::operator()(std::atomic_bool *cancel) {
     return result;
   }
 
+  std::string cache_prefix;
+  if (options_.global && !options_.region_cache_file.empty()) {
+    cache_prefix = GetNetworkPrefix(options_.global_url);
+    if (options_.verbose) {
+      std::cout << "Region cache prefix: "
+                << (cache_prefix.empty() ? "unknown" : cache_prefix) << "\n";
+    }
+    if (!cache_prefix.empty() && LoadFromRegionCache(cache_prefix, &result)) {
+      result.end_time = SystemTimeMicros();
+      return result;
+    }
+  }
+
   RegionOptions region_options;
   region_options.verbose = options_.verbose;
   region_options.request_factory = options_.request_factory;
@@ -73,6 +88,7 @@ Init::Result Init::operator()(std::atomic_bool *cancel) {
   find_options.request_factory = options_.request_factory;
   find_options.ping_timeout_millis = options_.ping_timeout_millis;
   find_options.regions = result.region_result.regions;
+  find_options.race = options_.race_find_nearest;
   FindNearest find_nearest(find_options);
   result.find_nearest_result = RunTimed(std::ref(find_nearest), cancel, 2000);
   if (!result.find_nearest_result.status.ok()) {
@@ -84,6 +100,9 @@ Init::Result Init::operator()(std::atomic_bool *cancel) {
     return result;
   }
   result.selected_region = result.find_nearest_result.selected_region;
+  if (!cache_prefix.empty()) {
+    SaveToRegionCache(cache_prefix, result);
+  }
 
   if (*cancel) {
     result.status = Status(StatusCode::ABORTED, "init aborted");
@@ -91,28 +110,77 @@ Init::Result Init::operator()(std::atomic_bool *cancel) {
     return result;
   }
 
+  LoadSelectedConfig(&result);
+  result.end_time = SystemTimeMicros();
+  return result;
+}
+
+bool Init::LoadFromRegionCache(const std::string &prefix, Result *result) {
+  std::vector<Region> ranked;
+  if (!LoadRegionCache(options_.region_cache_file, prefix,
+                       options_.region_cache_ttl_seconds, time(nullptr),
+                       &ranked)) {
+    if (options_.verbose) {
+      std::cout << "No cached regions for " << prefix << "\n";
+    }
+    return false;
+  }
+  result->selected_region = ranked.front();
+  if (options_.verbose) {
+    std::cout << "Using cached region "
+              << DescribeRegion(result->selected_region) << "\n";
+  }
+  LoadSelectedConfig(result);
+  if (!result->status.ok()) {
+    // The cached region may have gone away; fall back to discovery.
+    result->selected_region = Region();
+    result->config_result = ConfigResult();
+    return false;
+  }
+  result->region_cache_hit = true;
+  return true;
+}
+
+void Init::SaveToRegionCache(const std::string &prefix, const Result &result) {
+  std::vector<Region> ranked =
+      RankRegions(result.find_nearest_result.ping_results);
+  if (ranked.empty()) {
+    return;
+  }
+  Status status = SaveRegionCache(options_.region_cache_file, prefix,
+                                  options_.region_cache_ttl_seconds,
+                                  time(nullptr), ranked);
+  if (options_.verbose) {
+    if (status.ok()) {
+      std::cout << "Saved " << ranked.size() << " cached regions for "
+                << prefix << "\n";
+    } else {
+      std::cout << "Saving region cache failed: " << status.ToString() << "\n";
+    }
+  }
+}
+
+void Init::LoadSelectedConfig(Result *result) {
   ConfigOptions config_options;
   config_options.verbose = options_.verbose;
   config_options.request_factory = options_.request_factory;
-  config_options.region_url = result.selected_region.urls.front();
-  result.config_result = LoadConfig(config_options);
-  if (!result.config_result.status.ok()) {
-    result.status = result.config_result.status;
+  config_options.region_url = result->selected_region.urls.front();
+  result->config_result = LoadConfig(config_options);
+  if (!result->config_result.status.ok()) {
+    result->status = result->config_result.status;
     if (options_.verbose) {
-      std::cout << "Load config failed: " << result.status.ToString() << "\n";
+      std::cout << "Load config failed: " << result->status.ToString() << "\n";
     }
   } else {
-    result.status = Status::OK;
-    if (result.selected_region.id.empty()) {
-      result.selected_region.id = result.config_result.config.location_id;
+    result->status = Status::OK;
+    if (result->selected_region.id.empty()) {
+      result->selected_region.id = result->config_result.config.location_id;
     }
-    if (result.selected_region.name.empty()) {
-      result.selected_region.name = result.config_result.config.location_name;
+    if (result->selected_region.name.empty()) {
+      result->selected_region.name =
+          result->config_result.config.location_name;
     }
   }
-
-  result.end_time = SystemTimeMicros();
-  return result;
 }
 
 }  // namespace speedtest
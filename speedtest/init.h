@@ -18,6 +18,7 @@
 #define SPEEDTEST_INIT_H
 
 #include <atomic>
+#include <string>
 #include <vector>
 #include "config.h"
 #include "find_nearest.h"
@@ -38,6 +39,12 @@ class Init {
     http::Url global_url;
     std::vector<http::Url> regional_urls;
     long ping_timeout_millis;
+    bool race_find_nearest = false;
+
+    // If set, rankings of global regions are cached in this file and
+    // reused for region_cache_ttl_seconds.
+    std::string region_cache_file;
+    long region_cache_ttl_seconds = 0;
   };
 
   struct Result {
@@ -48,6 +55,7 @@ class Init {
     FindNearest::Result find_nearest_result;
     Region selected_region;
     ConfigResult config_result;
+    bool region_cache_hit = false;
   };
 
   explicit Init(const Options &options);
@@ -55,6 +63,10 @@ class Init {
   Result operator()(std::atomic_bool *cancel);
 
  private:
+  bool LoadFromRegionCache(const std::string &prefix, Result *result);
+  void SaveToRegionCache(const std::string &prefix, const Result &result);
+  void LoadSelectedConfig(Result *result);
+
   Options options_;
 
   DISALLOW_COPY_AND_ASSIGN(Init);
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace speedtest {
+
+LatencyHistogram::LatencyHistogram() {
+  Reset();
+}
+
+void LatencyHistogram::Record(long micros) {
+  micros = std::max(0L, std::min(micros, (1L << kMaxValueBits) - 1));
+  counts_[BucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+
+  long min = min_micros_.load(std::memory_order_relaxed);
+  while (micros < min &&
+         !min_micros_.compare_exchange_weak(min, micros,
+                                            std::memory_order_relaxed)) {
+  }
+  long max = max_micros_.load(std::memory_order_relaxed);
+  while (micros > max &&
+         !max_micros_.compare_exchange_weak(max, micros,
+                                            std::memory_order_relaxed)) {
+  }
+  // Publish the count last so a reader that sees it also sees the bucket.
+  count_.fetch_add(1, std::memory_order_release);
+}
+
+void LatencyHistogram::Reset() {
+  for (std::atomic_long &bucket : counts_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  min_micros_.store(std::numeric_limits<long>::max(),
+                    std::memory_order_relaxed);
+  max_micros_.store(0, std::memory_order_relaxed);
+  count_.store(0, std::memory_order_release);
+}
+
+long LatencyHistogram::ValueAtPercentile(double percentile) const {
+  long total = count_.load(std::memory_order_acquire);
+  if (total == 0) {
+    return 0;
+  }
+  percentile = std::max(0.0, std::min(percentile, 100.0));
+  long rank = std::max(1L, static_cast<long>(
+      std::ceil(percentile / 100.0 * total)));
+  long seen = 0;
+  for (int index = 0; index < kNumBuckets; ++index) {
+    seen += counts_[index].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(BucketHighestValue(index), max_micros());
+    }
+  }
+  return max_micros();
+}
+
+LatencySummary LatencyHistogram::Summarize() const {
+  LatencySummary summary;
+  summary.count = count();
+  if (summary.count > 0) {
+    summary.min_micros = min_micros();
+    summary.p50_micros = ValueAtPercentile(50);
+    summary.p90_micros = ValueAtPercentile(90);
+    summary.p99_micros = ValueAtPercentile(99);
+    summary.max_micros = max_micros();
+  }
+  return summary;
+}
+
+// static
+int LatencyHistogram::BucketIndex(long micros) {
+  const long kSubBuckets = 1L << kSubBucketBits;
+  if (micros < kSubBuckets) {
+    return micros;
+  }
+  int msb = 63 - __builtin_clzl(micros);
+  int shift = msb - (kSubBucketBits - 1);
+  long sub_bucket = micros >> shift;
+  return (shift << (kSubBucketBits - 1)) + sub_bucket;
+}
+
+// static
+long LatencyHistogram::BucketHighestValue(int index) {
+  const int kHalfSubBuckets = 1 << (kSubBucketBits - 1);
+  if (index < 2 * kHalfSubBuckets) {
+    return index;
+  }
+  int shift = index / kHalfSubBuckets - 1;
+  long sub_bucket = index % kHalfSubBuckets + kHalfSubBuckets;
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+}  // namespace speedtest
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPEEDTEST_LATENCY_HISTOGRAM_H
+#define SPEEDTEST_LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include "utils.h"
+
+namespace speedtest {
+
+struct LatencySummary {
+  long count = 0;
+  long min_micros = 0;
+  long p50_micros = 0;
+  long p90_micros = 0;
+  long p99_micros = 0;
+  long max_micros = 0;
+
+  // Pings that timed out or failed. They have no latency so they aren't
+  // part of the percentiles above.
+  long failed = 0;
+};
+
+// Log-linear latency histogram in the style of HdrHistogram.
+// Values below 128us are recorded exactly; above that each power of two is
+// split into 64 buckets, so any reported percentile is within 1.6% of the
+// recorded value. Values are clamped to 2^32us (about 71 minutes).
+//
+// Record() may be called concurrently from any number of threads without
+// locking. Readers see a consistent enough view for progress reporting and
+// an exact one once all writers have finished.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void Record(long micros);
+  void Reset();
+
+  long count() const { return count_; }
+
+  // Returns std::numeric_limits<long>::max() if nothing was recorded.
+  long min_micros() const { return min_micros_; }
+  long max_micros() const { return max_micros_; }
+
+  // Returns the highest value equivalent to the sample at the given
+  // percentile, capped at the maximum recorded value, or 0 if empty.
+  long ValueAtPercentile(double percentile) const;
+
+  LatencySummary Summarize() const;
+
+ private:
+  static const int kSubBucketBits = 7;
+  static const int kMaxValueBits = 32;
+  static const int kNumBuckets =
+      (kMaxValueBits - kSubBucketBits + 2) << (kSubBucketBits - 1);
+
+  static int BucketIndex(long micros);
+  static long BucketHighestValue(int index);
+
+  std::atomic_long counts_[kNumBuckets];
+  std::atomic_long count_;
+  std::atomic_long min_micros_;
+  std::atomic_long max_micros_;
+
+  DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+};
+
+}  // namespace speedtest
+
+#endif  // SPEEDTEST_LATENCY_HISTOGRAM_H
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "latency_histogram.h"
+
+#include <gtest/gtest.h>
+#include <limits>
+#include <thread>
+#include <vector>
+
+namespace speedtest {
+namespace {
+
+TEST(LatencyHistogramTest, Empty) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(0, histogram.count());
+  EXPECT_EQ(std::numeric_limits<long>::max(), histogram.min_micros());
+  EXPECT_EQ(0, histogram.ValueAtPercentile(50));
+  LatencySummary summary = histogram.Summarize();
+  EXPECT_EQ(0, summary.count);
+  EXPECT_EQ(0, summary.min_micros);
+  EXPECT_EQ(0, summary.max_micros);
+}
+
+TEST(LatencyHistogramTest, SmallValuesExact) {
+  LatencyHistogram histogram;
+  for (long i = 1; i <= 100; ++i) {
+    histogram.Record(i);
+  }
+  EXPECT_EQ(100, histogram.count());
+  EXPECT_EQ(1, histogram.min_micros());
+  EXPECT_EQ(100, histogram.max_micros());
+  EXPECT_EQ(50, histogram.ValueAtPercentile(50));
+  EXPECT_EQ(90, histogram.ValueAtPercentile(90));
+  EXPECT_EQ(99, histogram.ValueAtPercentile(99));
+  EXPECT_EQ(100, histogram.ValueAtPercentile(100));
+  EXPECT_EQ(1, histogram.ValueAtPercentile(0));
+}
+
+TEST(LatencyHistogramTest, LargeValuesWithinPrecision) {
+  LatencyHistogram histogram;
+  for (long i = 1; i <= 1000; ++i) {
+    histogram.Record(i * 1000);
+  }
+  LatencySummary summary = histogram.Summarize();
+  EXPECT_EQ(1000, summary.min_micros);
+  EXPECT_EQ(1000000, summary.max_micros);
+  EXPECT_NEAR(500000, summary.p50_micros, 500000 / 64);
+  EXPECT_NEAR(900000, summary.p90_micros, 900000 / 64);
+  EXPECT_NEAR(990000, summary.p99_micros, 990000 / 64);
+  EXPECT_GE(summary.p50_micros, 500000);
+  EXPECT_LE(summary.p99_micros, summary.max_micros);
+}
+
+TEST(LatencyHistogramTest, Clamped) {
+  LatencyHistogram histogram;
+  histogram.Record(-5);
+  histogram.Record(std::numeric_limits<long>::max());
+  EXPECT_EQ(0, histogram.min_micros());
+  EXPECT_EQ((1L << 32) - 1, histogram.max_micros());
+  EXPECT_EQ((1L << 32) - 1, histogram.ValueAtPercentile(100));
+}
+
+TEST(LatencyHistogramTest, Reset) {
+  LatencyHistogram histogram;
+  histogram.Record(1234);
+  histogram.Reset();
+  EXPECT_EQ(0, histogram.count());
+  histogram.Record(10);
+  EXPECT_EQ(10, histogram.ValueAtPercentile(99));
+}
+
+TEST(LatencyHistogramTest, ConcurrentRecord) {
+  const int kThreads = 4;
+  const int kSamples = 10000;
+  LatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&histogram, t]{
+      for (int i = 0; i < kSamples; ++i) {
+        histogram.Record(t * kSamples + i);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(kThreads * kSamples, histogram.count());
+  EXPECT_EQ(0, histogram.min_micros());
+  EXPECT_EQ(kThreads * kSamples - 1, histogram.max_micros());
+}
+
+}  // namespace
+}  // namespace speedtest
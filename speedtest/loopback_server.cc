@@ -0,0 +1,443 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loopback_server.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <errno.h>
+#include <jsoncpp/json/json.h>
+#include <jsoncpp/json/writer.h>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace speedtest {
+namespace {
+
+// Transfers are paced in chunks this size, so the limiter's granularity at
+// 100 Mbps is about 1.3 ms.
+const size_t kChunkBytes = 16 * 1024;
+
+const size_t kMaxHeaderBytes = 64 * 1024;
+
+// Socket buffers are kept small when shaping so the rate limiter, rather
+// than several megabytes of loopback buffering, decides what the client
+// sees. The receive side is smaller still: every upload stream parks a
+// full buffer here that the client has already counted as sent.
+const int kShapedBufferBytes = 128 * 1024;
+const int kShapedReceiveBufferBytes = 16 * 1024;
+
+long ThreadCpuMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+bool SendAll(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+std::string ToLower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+  return s;
+}
+
+}  // namespace
+
+RateLimiter::RateLimiter(double rate_mbps)
+    : micros_per_byte_(rate_mbps > 0 ? 8.0 / rate_mbps : 0),
+      next_free_(Clock::now()) {
+}
+
+void RateLimiter::Consume(long bytes) {
+  if (micros_per_byte_ <= 0) {
+    return;
+  }
+  Clock::time_point done;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Idle time isn't banked, so a quiet link doesn't allow a burst.
+    Clock::time_point start = std::max(Clock::now(), next_free_);
+    next_free_ = start + std::chrono::microseconds(
+        static_cast<long>(bytes * micros_per_byte_));
+    done = next_free_;
+  }
+  std::this_thread::sleep_until(done);
+}
+
+struct LoopbackServer::Request {
+  std::string method;
+  std::string path;
+  std::map<std::string, std::string> params;
+  long content_length = 0;
+  bool chunked = false;
+  bool expect_continue = false;
+  bool close = false;
+};
+
+LoopbackServer::LoopbackServer(const Options &options)
+    : options_(options),
+      download_limiter_(options.download_mbps),
+      upload_limiter_(options.upload_mbps),
+      listen_fd_(-1),
+      port_(0),
+      stopping_(false),
+      num_threads_(0),
+      cpu_micros_(0),
+      bytes_sent_(0),
+      bytes_received_(0) {
+}
+
+LoopbackServer::~LoopbackServer() {
+  Stop();
+}
+
+Status LoopbackServer::Start() {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    return Status(StatusCode::INTERNAL, "socket failed");
+  }
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (options_.download_mbps > 0 || options_.upload_mbps > 0) {
+    // Set before listen() so accepted sockets inherit them and the window
+    // scale is negotiated to match.
+    setsockopt(listen_fd_, SOL_SOCKET, SO_RCVBUF,
+               &kShapedReceiveBufferBytes, sizeof(kShapedBufferBytes));
+    setsockopt(listen_fd_, SOL_SOCKET, SO_SNDBUF,
+               &kShapedBufferBytes, sizeof(kShapedBufferBytes));
+  }
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addr_len = sizeof(addr);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(listen_fd_, SOMAXCONN) != 0 ||
+      getsockname(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr),
+                  &addr_len) != 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return Status(StatusCode::INTERNAL, "failed to listen on loopback");
+  }
+  port_ = ntohs(addr.sin_port);
+  accept_thread_ = std::thread([this]{ AcceptLoop(); });
+  return Status::OK;
+}
+
+void LoopbackServer::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || listen_fd_ < 0) {
+      return;
+    }
+    stopping_ = true;
+    // Wakes up accept() and every connection blocked in recv().
+    shutdown(listen_fd_, SHUT_RDWR);
+    for (int fd : connections_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+  if (accept_thread_.joinable()) {
+    accept_thread_.join();
+  }
+  close(listen_fd_);
+  listen_fd_ = -1;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]{ return num_threads_ == 0; });
+}
+
+http::Url LoopbackServer::url() const {
+  return http::Url("http://127.0.0.1:" + to_string(port_));
+}
+
+void LoopbackServer::AcceptLoop() {
+  while (true) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) {
+      close(fd);
+      return;
+    }
+    connections_.insert(fd);
+    num_threads_++;
+    std::thread([this, fd]{ ServeConnection(fd); }).detach();
+  }
+}
+
+void LoopbackServer::ServeConnection(int fd) {
+  long last_cpu_micros = ThreadCpuMicros();
+  std::string buffer;
+  Request request;
+  bool first = true;
+  while (ReadRequest(fd, &buffer, &request)) {
+    if (first && options_.connect_delay_millis > 0) {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(options_.connect_delay_millis));
+    }
+    first = false;
+    bool keep_going = HandleRequest(fd, request, &buffer) && !request.close;
+    AccountCpu(&last_cpu_micros);
+    if (!keep_going) {
+      break;
+    }
+  }
+  AccountCpu(&last_cpu_micros);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  connections_.erase(fd);
+  close(fd);
+  num_threads_--;
+  done_.notify_all();
+}
+
+bool LoopbackServer::ReadRequest(int fd,
+                                 std::string *buffer,
+                                 Request *request) {
+  size_t header_end;
+  while ((header_end = buffer->find("\r\n\r\n")) == std::string::npos) {
+    if (buffer->size() > kMaxHeaderBytes) {
+      return false;
+    }
+    char data[4096];
+    ssize_t received = recv(fd, data, sizeof(data), 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    buffer->append(data, received);
+  }
+  std::string header = buffer->substr(0, header_end);
+  buffer->erase(0, header_end + 4);
+
+  *request = Request();
+  size_t line_end = header.find("\r\n");
+  std::string request_line = header.substr(0, line_end);
+  size_t method_end = request_line.find(' ');
+  size_t target_end = request_line.find(' ', method_end + 1);
+  if (method_end == std::string::npos || target_end == std::string::npos) {
+    return false;
+  }
+  request->method = request_line.substr(0, method_end);
+  std::string target = request_line.substr(method_end + 1,
+                                           target_end - method_end - 1);
+  size_t query_start = target.find('?');
+  request->path = target.substr(0, query_start);
+  while (!request->path.empty() && request->path[1] == '/') {
+    // Region URLs sometimes produce "//config" style paths.
+    request->path.erase(0, 1);
+  }
+  if (query_start != std::string::npos) {
+    std::string query = target.substr(query_start + 1);
+    size_t pos = 0;
+    while (pos <= query.size()) {
+      size_t end = query.find('&', pos);
+      if (end == std::string::npos) {
+        end = query.size();
+      }
+      std::string pair = query.substr(pos, end - pos);
+      size_t equals = pair.find('=');
+      if (equals != std::string::npos) {
+        request->params[pair.substr(0, equals)] = pair.substr(equals + 1);
+      }
+      pos = end + 1;
+    }
+  }
+
+  while (line_end != std::string::npos) {
+    size_t start = line_end + 2;
+    line_end = header.find("\r\n", start);
+    std::string line = header.substr(start, line_end - start);
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = ToLower(line.substr(0, colon));
+    std::string value = line.substr(colon + 1);
+    Trim(&value);
+    if (name == "content-length") {
+      request->content_length = std::atol(value.c_str());
+    } else if (name == "transfer-encoding") {
+      request->chunked = ToLower(value) == "chunked";
+    } else if (name == "expect") {
+      request->expect_continue = ToLower(value) == "100-continue";
+    } else if (name == "connection") {
+      request->close = ToLower(value) == "close";
+    }
+  }
+  return true;
+}
+
+bool LoopbackServer::HandleRequest(int fd,
+                                   const Request &request,
+                                   std::string *buffer) {
+  if (request.chunked) {
+    const char kLengthRequired[] =
+        "HTTP/1.1 411 Length Required\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    SendAll(fd, kLengthRequired, sizeof(kLengthRequired) - 1);
+    return false;
+  }
+  if (request.expect_continue && request.content_length > 0) {
+    const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (!SendAll(fd, kContinue, sizeof(kContinue) - 1)) {
+      return false;
+    }
+  }
+  if (request.content_length > 0 &&
+      !ReadUpload(fd, request.content_length, buffer)) {
+    return false;
+  }
+
+  if (options_.delay_millis > 0) {
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(options_.delay_millis));
+  }
+
+  if (request.path == "/fiber/config" || request.path == "/config") {
+    return SendResponse(fd, ConfigJson());
+  }
+  if (request.path == "/download") {
+    long size = options_.config.download_bytes;
+    auto iter = request.params.find("size");
+    if (iter != request.params.end()) {
+      size = std::atol(iter->second.c_str());
+    }
+    return SendDownload(fd, size);
+  }
+  // /ping, /upload, /result and anything else just get an empty 200.
+  return SendResponse(fd, "");
+}
+
+bool LoopbackServer::SendResponse(int fd, const std::string &body) {
+  std::string response = "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: application/json\r\n"
+                         "Content-Length: " + to_string(body.size()) +
+                         "\r\n\r\n" + body;
+  return SendAll(fd, response.data(), response.size());
+}
+
+bool LoopbackServer::SendDownload(int fd, long size) {
+  static const char kZeroes[kChunkBytes] = {};
+  std::string header = "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Length: " + to_string(size) + "\r\n\r\n";
+  if (!SendAll(fd, header.data(), header.size())) {
+    return false;
+  }
+  while (size > 0) {
+    size_t len = std::min<long>(size, kChunkBytes);
+    download_limiter_.Consume(len);
+    if (!SendAll(fd, kZeroes, len)) {
+      return false;
+    }
+    bytes_sent_ += len;
+    size -= len;
+  }
+  return true;
+}
+
+bool LoopbackServer::ReadUpload(int fd, long size, std::string *buffer) {
+  // Part of the body may have arrived along with the headers.
+  long buffered = std::min<long>(size, buffer->size());
+  buffer->erase(0, buffered);
+  upload_limiter_.Consume(buffered);
+  bytes_received_ += buffered;
+  size -= buffered;
+
+  char data[kChunkBytes];
+  while (size > 0) {
+    ssize_t received = recv(fd, data, std::min<long>(size, sizeof(data)), 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    upload_limiter_.Consume(received);
+    bytes_received_ += received;
+    size -= received;
+  }
+  return true;
+}
+
+std::string LoopbackServer::ConfigJson() const {
+  const Config &config = options_.config;
+  Json::Value root;
+  root["downloadSize"] = static_cast<Json::Value::Int64>(config.download_bytes);
+  root["uploadSize"] = static_cast<Json::Value::Int64>(config.upload_bytes);
+  root["intervalSize"] =
+      static_cast<Json::Value::Int64>(config.interval_millis);
+  root["locationId"] = config.location_id;
+  root["locationName"] = config.location_name;
+  root["minTransferIntervals"] = config.min_transfer_intervals;
+  root["maxTransferIntervals"] = config.max_transfer_intervals;
+  root["minTransferRunTime"] =
+      static_cast<Json::Value::Int64>(config.min_transfer_runtime);
+  root["maxTransferRunTime"] =
+      static_cast<Json::Value::Int64>(config.max_transfer_runtime);
+  root["maxTransferVariance"] = config.max_transfer_variance;
+  root["numConcurrentUploads"] = config.num_uploads;
+  root["numConcurrentDownloads"] = config.num_downloads;
+  root["pingRunTime"] =
+      static_cast<Json::Value::Int64>(config.ping_runtime_millis);
+  root["pingTimeout"] =
+      static_cast<Json::Value::Int64>(config.ping_timeout_millis);
+  root["transferPortStart"] = port_;
+  root["transferPortEnd"] = port_;
+  root["averageType"] = config.average_type;
+  Json::FastWriter writer;
+  return writer.write(root);
+}
+
+void LoopbackServer::AccountCpu(long *last_micros) {
+  long now = ThreadCpuMicros();
+  cpu_micros_ += now - *last_micros;
+  *last_micros = now;
+}
+
+}  // namespace speedtest
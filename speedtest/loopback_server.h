@@ -0,0 +1,139 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPEEDTEST_LOOPBACK_SERVER_H
+#define SPEEDTEST_LOOPBACK_SERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include "config.h"
+#include "status.h"
+#include "url.h"
+#include "utils.h"
+
+namespace speedtest {
+
+// Paces a byte stream to a fixed rate, like a netem rate limit. All callers
+// share one bottleneck, so concurrent streams split the rate between them.
+// Threadsafe.
+class RateLimiter {
+ public:
+  // A rate of 0 disables pacing.
+  explicit RateLimiter(double rate_mbps);
+
+  // Blocks until the link has capacity for another bytes.
+  void Consume(long bytes);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  double micros_per_byte_;
+  std::mutex mutex_;
+  Clock::time_point next_free_;
+
+  DISALLOW_COPY_AND_ASSIGN(RateLimiter);
+};
+
+// A minimal HTTP/1.1 server on the loopback interface implementing the
+// speedtest service endpoints (/fiber/config, /ping, /download and
+// /upload) so the client can be benchmarked end to end without the real
+// service. Each connection is served by its own thread.
+class LoopbackServer {
+ public:
+  struct Options {
+    // Bottleneck rate in each direction. 0 means unlimited.
+    double download_mbps = 0;
+    double upload_mbps = 0;
+
+    // Added before every response, so a ping takes at least this long.
+    long delay_millis = 0;
+
+    // Added to the first response on each connection as well, standing in
+    // for the handshakes a real client pays for on a new connection.
+    long connect_delay_millis = 0;
+
+    // Served at /fiber/config. The transfer ports are replaced with the
+    // server's own port.
+    Config config;
+  };
+
+  explicit LoopbackServer(const Options &options);
+  virtual ~LoopbackServer();
+
+  // Binds to an ephemeral port on 127.0.0.1 and starts accepting.
+  Status Start();
+
+  // Closes the listening socket and every open connection and waits for
+  // the connection threads to exit.
+  void Stop();
+
+  int port() const { return port_; }
+  http::Url url() const;
+
+  // CPU time used by the server's threads, so that callers sharing the
+  // process can subtract it from their own usage.
+  long cpu_micros() const { return cpu_micros_; }
+
+  // Number of threads the server is currently running.
+  int num_threads() const { return num_threads_; }
+
+  long bytes_sent() const { return bytes_sent_; }
+  long bytes_received() const { return bytes_received_; }
+
+ private:
+  struct Request;
+
+  void AcceptLoop();
+  void ServeConnection(int fd);
+  bool ReadRequest(int fd, std::string *buffer, Request *request);
+  bool HandleRequest(int fd, const Request &request, std::string *buffer);
+  bool SendResponse(int fd, const std::string &body);
+  bool SendDownload(int fd, long size);
+  bool ReadUpload(int fd, long size, std::string *buffer);
+  std::string ConfigJson() const;
+
+  // Adds the calling thread's CPU time since *last_micros to cpu_micros_.
+  void AccountCpu(long *last_micros);
+
+  Options options_;
+  RateLimiter download_limiter_;
+  RateLimiter upload_limiter_;
+
+  int listen_fd_;
+  int port_;
+  std::thread accept_thread_;
+
+  std::mutex mutex_;
+  std::condition_variable done_;
+  std::set<int> connections_;
+  bool stopping_;
+
+  std::atomic_int num_threads_;
+  std::atomic_long cpu_micros_;
+  std::atomic_long bytes_sent_;
+  std::atomic_long bytes_received_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoopbackServer);
+};
+
+}  // namespace speedtest
+
+#endif  // SPEEDTEST_LOOPBACK_SERVER_H
@@ -27,6 +27,7 @@ namespace speedtest {
 namespace {
 
 const char* kDefaultHost = "any.speed.gfsvc.com";
+const long kDefaultRegionCacheTtlSeconds = 24 * 60 * 60;
 
 }  // namespace
 
@@ -78,6 +79,11 @@ const int kOptSkipUpload = 1004;
 const int kOptSkipPing = 1005;
 const int kOptNoReportResults = 1006;
 const int kOptServerId = 1007;
+const int kOptRaceFindNearest = 1008;
+const int kOptRegionCache = 1009;
+const int kOptRegionCacheTtl = 1010;
+const int kOptLoadedLatency = 1011;
+const int kOptDisableConnectionReuse = 1012;
 
 const int kOptMinTransferTime = 1100;
 const int kOptMaxTransferTime = 1101;
@@ -88,6 +94,8 @@ const int kOptIntervalMillis = 1105;
 const int kOptPingRuntime = 1106;
 const int kOptPingTimeout = 1107;
 const int kOptExponentialMovingAverage = 1108;
+const int kOptStopRule = 1109;
+const int kOptExcludeSlowStart = 1110;
 
 const char *kShortOpts = "hvg:a:d:s:t:u:p:";
 
@@ -97,6 +105,8 @@ struct option kLongOpts[] = {
     {"global_url", required_argument, nullptr, 'g'},
     {"user_agent", required_argument, nullptr, 'a'},
     {"disable_dns_cache", no_argument, nullptr, kOptDisableDnsCache},
+    {"disable_connection_reuse", no_argument, nullptr,
+        kOptDisableConnectionReuse},
     {"max_connections", required_argument, nullptr, kOptMaxConnections},
     {"progress_millis", required_argument, nullptr, 'p'},
     {"skip_download", no_argument, nullptr, kOptSkipDownload},
@@ -104,6 +114,10 @@ struct option kLongOpts[] = {
     {"skip_ping", no_argument, nullptr, kOptSkipPing},
     {"report_results", no_argument, nullptr, kOptReportResults},
     {"noreport_results", no_argument, nullptr, kOptNoReportResults},
+    {"race_find_nearest", no_argument, nullptr, kOptRaceFindNearest},
+    {"region_cache", required_argument, nullptr, kOptRegionCache},
+    {"region_cache_ttl", required_argument, nullptr, kOptRegionCacheTtl},
+    {"loaded_latency", no_argument, nullptr, kOptLoadedLatency},
 
     {"num_downloads", required_argument, nullptr, 'd'},
     {"download_size", required_argument, nullptr, 's'},
@@ -122,6 +136,8 @@ struct option kLongOpts[] = {
     {"ping_timeout", required_argument, nullptr, kOptPingTimeout},
     {"exponential_moving_average", no_argument, nullptr,
         kOptExponentialMovingAverage},
+    {"stop_rule", required_argument, nullptr, kOptStopRule},
+    {"exclude_slow_start", no_argument, nullptr, kOptExcludeSlowStart},
     {"serverid", required_argument, nullptr, kOptServerId},  // ignored
     {nullptr, 0, nullptr, 0},
 };
@@ -143,11 +159,17 @@ Usage: speedtest [options] [host ...]
  -a, --user_agent AGENT        User agent string for HTTP requests
  -p, --progress_millis NUM     Delay in milliseconds between updates
  --disable_dns_cache           Disable global DNS cache
+ --disable_connection_reuse    Open new connections for every test phase
  --max_connections NUM         Maximum number of parallel connections
  --skip_download               Skip the download test
  --skip_upload                 Skip the upload test
  --skip_ping                   Skip the ping test
  --[no]report_results          Whether to report Speedtest results to server
+ --race_find_nearest           Race regions over IPv4 and IPv6, dropping
+                               regions as soon as they can't be nearest
+ --region_cache FILE           Cache region rankings per network in FILE
+ --region_cache_ttl TIME       Region cache lifetime in seconds (default 1 day)
+ --loaded_latency              Measure latency while downloading and uploading
 
 These options override the speedtest config parameters:
  -d, --num_downloads NUM       Number of simultaneous downloads
@@ -163,6 +185,10 @@ These options override the speedtest config parameters:
  --ping_runtime TIME           Ping runtime in milliseconds
  --ping_timeout TIME           Ping timeout in milliseconds
  --exponential_moving_average  Use exponential instead of simple moving average
+ --stop_rule RULE              When to end a transfer: moving_average (default),
+                               confidence_interval or theil_sen
+ --exclude_slow_start          Ignore the TCP slow start ramp when estimating
+                               speed (confidence_interval and theil_sen only)
 )USAGE";
 
 }  // namespace
@@ -176,12 +202,19 @@ bool ParseOptions(int argc, char *argv[], Options *options) {
   options->user_agent = "";
   options->progress_millis = 0;
   options->disable_dns_cache = false;
+  options->disable_connection_reuse = false;
   options->max_connections = 0;
   options->exponential_moving_average = false;
+  options->stop_rule = StopRule::MOVING_AVERAGE;
+  options->exclude_slow_start = false;
   options->skip_download = false;
   options->skip_upload = false;
   options->skip_ping = false;
   options->report_results = true;
+  options->race_find_nearest = false;
+  options->region_cache_file = "";
+  options->region_cache_ttl_seconds = kDefaultRegionCacheTtlSeconds;
+  options->loaded_latency = false;
 
   options->num_downloads = 0;
   options->download_bytes = 0;
@@ -287,6 +320,9 @@ bool ParseOptions(int argc, char *argv[], Options *options) {
       case kOptDisableDnsCache:
         options->disable_dns_cache = true;
         break;
+      case kOptDisableConnectionReuse:
+        options->disable_connection_reuse = true;
+        break;
       case kOptMaxConnections: {
         long max_connections;
         char *endptr;
@@ -317,6 +353,30 @@ bool ParseOptions(int argc, char *argv[], Options *options) {
       case kOptNoReportResults:
         options->report_results = false;
         break;
+      case kOptRaceFindNearest:
+        options->race_find_nearest = true;
+        break;
+      case kOptRegionCache:
+        options->region_cache_file = optarg;
+        break;
+      case kOptRegionCacheTtl: {
+        long ttl;
+        char *endptr;
+        if (!ParseLong(optarg, &endptr, &ttl)) {
+          std::cerr << "Could not parse region cache TTL '" << optarg << "'\n";
+          return false;
+        }
+        if (ttl < 0) {
+          std::cerr << "Region cache TTL must be nonnegative, got "
+                    << optarg << "'\n";
+          return false;
+        }
+        options->region_cache_ttl_seconds = ttl;
+        break;
+      }
+      case kOptLoadedLatency:
+        options->loaded_latency = true;
+        break;
       case kOptMinTransferTime: {
         long transfer_time;
         char *endptr;
@@ -443,6 +503,15 @@ bool ParseOptions(int argc, char *argv[], Options *options) {
       case kOptExponentialMovingAverage:
         options->exponential_moving_average = true;
         break;
+      case kOptStopRule:
+        if (!ParseStopRule(optarg, &options->stop_rule)) {
+          std::cerr << "Unknown stop rule '" << optarg << "'\n";
+          return false;
+        }
+        break;
+      case kOptExcludeSlowStart:
+        options->exclude_slow_start = true;
+        break;
       case kOptServerId:
         // --serverid is accepted but ignored, for backwards compatibility.
         break;
@@ -486,6 +555,8 @@ void PrintOptions(std::ostream &out, const Options &options) {
       << "Progress interval: " << options.progress_millis << " ms\n"
       << "Disable DNS cache: "
       << (options.disable_dns_cache ? "true" : "false") << "\n"
+      << "Disable connection reuse: "
+      << (options.disable_connection_reuse ? "true" : "false") << "\n"
       << "Max connections: " << options.max_connections << "\n"
       << "Skip download: "
       << (options.skip_download ? "true" : "false") << "\n"
@@ -495,6 +566,12 @@ void PrintOptions(std::ostream &out, const Options &options) {
       << (options.skip_ping ? "true" : "false") << "\n"
       << "Report results: "
       << (options.report_results ? "true" : "false") << "\n"
+      << "Race find nearest: "
+      << (options.race_find_nearest ? "true" : "false") << "\n"
+      << "Region cache: " << options.region_cache_file << "\n"
+      << "Region cache TTL: " << options.region_cache_ttl_seconds << " s\n"
+      << "Loaded latency: "
+      << (options.loaded_latency ? "true" : "false") << "\n"
       << "Number of downloads: " << options.num_downloads << "\n"
       << "Download size: " << options.download_bytes << " bytes\n"
       << "Number of uploads: " << options.num_uploads << "\n"
@@ -509,6 +586,9 @@ void PrintOptions(std::ostream &out, const Options &options) {
       << "Ping timeout: " << options.ping_timeout_millis << " ms\n"
       << "Exponential moving average: "
       << (options.exponential_moving_average ? "true" : "false") << "\n"
+      << "Stop rule: " << StopRuleName(options.stop_rule) << "\n"
+      << "Exclude slow start: "
+      << (options.exclude_slow_start ? "true" : "false") << "\n"
       << "Hosts:\n";
   for (const http::Url &host : options.regional_urls) {
     out << "  " << host.url() << "\n";
@@ -20,6 +20,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include "convergence.h"
 #include "request.h"
 #include "url.h"
 
@@ -28,12 +29,14 @@ namespace speedtest {
 struct Options {
   bool verbose;
   http::Request::Factory request_factory;
+  http::Request::WarmFn warm_fn;
 
   bool usage = false;
   http::Url global_url;
   bool global = false;
   std::string user_agent;
   bool disable_dns_cache = false;
+  bool disable_connection_reuse = false;
   int max_connections = 0;
   int progress_millis = 0;
   bool skip_download = false;
@@ -55,6 +58,12 @@ struct Options {
   long ping_runtime_millis = 0;
   long ping_timeout_millis = 0;
   bool exponential_moving_average = false;
+  StopRule stop_rule = StopRule::MOVING_AVERAGE;
+  bool exclude_slow_start = false;
+  bool race_find_nearest = false;
+  std::string region_cache_file;
+  long region_cache_ttl_seconds = 0;
+  bool loaded_latency = false;
 
   std::vector<http::Url> regional_urls;
 };
@@ -88,12 +88,17 @@ TEST(OptionsTest, Empty_ValidDefault) {
   EXPECT_TRUE(options.global);
   EXPECT_EQ(http::Url("any.speed.gfsvc.com"), options.global_url);
   EXPECT_FALSE(options.disable_dns_cache);
+  EXPECT_FALSE(options.disable_connection_reuse);
   EXPECT_EQ(0, options.max_connections);
   EXPECT_EQ(0, options.progress_millis);
   EXPECT_FALSE(options.skip_download);
   EXPECT_FALSE(options.skip_upload);
   EXPECT_FALSE(options.skip_ping);
   EXPECT_TRUE(options.report_results);
+  EXPECT_FALSE(options.race_find_nearest);
+  EXPECT_EQ("", options.region_cache_file);
+  EXPECT_EQ(86400, options.region_cache_ttl_seconds);
+  EXPECT_FALSE(options.loaded_latency);
 
   EXPECT_EQ(0, options.num_downloads);
   EXPECT_EQ(0, options.download_bytes);
@@ -109,6 +114,8 @@ TEST(OptionsTest, Empty_ValidDefault) {
   EXPECT_EQ(0, options.ping_timeout_millis);
   EXPECT_THAT(options.regional_urls, testing::IsEmpty());
   EXPECT_FALSE(options.exponential_moving_average);
+  EXPECT_EQ(StopRule::MOVING_AVERAGE, options.stop_rule);
+  EXPECT_FALSE(options.exclude_slow_start);
 }
 
 TEST(OptionsTest, Usage_Valid) {
@@ -177,11 +184,16 @@ TEST(OptionsTest, LongOptions_Valid) {
                     "--user_agent", "CrOS",
                     "--progress_millis", "1000",
                     "--disable_dns_cache",
+                    "--disable_connection_reuse",
                     "--max_connections", "23",
                     "--noreport_results",
                     "--skip_download",
                     "--skip_upload",
                     "--skip_ping",
+                    "--race_find_nearest",
+                    "--region_cache", "/tmp/regions",
+                    "--region_cache_ttl", "3600",
+                    "--loaded_latency",
                     "--num_downloads", "16",
                     "--download_size", "5122",
                     "--num_uploads", "12",
@@ -195,6 +207,8 @@ TEST(OptionsTest, LongOptions_Valid) {
                     "--ping_runtime", "2500",
                     "--ping_timeout", "300",
                     "--exponential_moving_average",
+                    "--stop_rule", "theil_sen",
+                    "--exclude_slow_start",
                     "foo.speed.googlefiber.net",
                     "bar.speed.googlefiber.net"},
                     &options);
@@ -204,11 +218,16 @@ TEST(OptionsTest, LongOptions_Valid) {
   EXPECT_EQ("CrOS", options.user_agent);
   EXPECT_EQ(1000, options.progress_millis);
   EXPECT_TRUE(options.disable_dns_cache);
+  EXPECT_TRUE(options.disable_connection_reuse);
   EXPECT_EQ(23, options.max_connections);
   EXPECT_TRUE(options.skip_download);
   EXPECT_TRUE(options.skip_upload);
   EXPECT_TRUE(options.skip_ping);
   EXPECT_FALSE(options.report_results);
+  EXPECT_TRUE(options.race_find_nearest);
+  EXPECT_EQ("/tmp/regions", options.region_cache_file);
+  EXPECT_EQ(3600, options.region_cache_ttl_seconds);
+  EXPECT_TRUE(options.loaded_latency);
   EXPECT_EQ(16, options.num_downloads);
   EXPECT_EQ(5122, options.download_bytes);
   EXPECT_EQ(12, options.num_uploads);
@@ -223,10 +242,16 @@ TEST(OptionsTest, LongOptions_Valid) {
   EXPECT_EQ(2500, options.ping_runtime_millis);
   EXPECT_EQ(300, options.ping_timeout_millis);
   EXPECT_TRUE(options.exponential_moving_average);
+  EXPECT_EQ(StopRule::THEIL_SEN, options.stop_rule);
+  EXPECT_TRUE(options.exclude_slow_start);
   EXPECT_THAT(options.regional_urls, testing::UnorderedElementsAre(
       http::Url("foo.speed.googlefiber.net"),
       http::Url("bar.speed.googlefiber.net")));
 }
 
+TEST(OptionsTest, UnknownStopRule_Invalid) {
+  TestInvalidOptions({"--stop_rule", "fastest"});
+}
+
 }  // namespace
 }  // namespace speedtest
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "payload.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <sys/mman.h>
+
+namespace speedtest {
+
+std::shared_ptr<const Payload> Payload::NewPayload(size_t size) {
+  if (size == 0) {
+    return std::shared_ptr<const Payload>(new Payload(nullptr, 0));
+  }
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  std::random_device rd;
+  std::default_random_engine random_engine(rd());
+  std::uniform_int_distribution<int> uniform_dist(1, 255);
+  char *bytes = static_cast<char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    bytes[i] = static_cast<char>(uniform_dist(random_engine));
+  }
+
+  // Streams only ever read the block so catch any accidental writes.
+  mprotect(data, size, PROT_READ);
+  return std::shared_ptr<const Payload>(new Payload(bytes, size));
+}
+
+Payload::Payload(char *data, size_t size)
+    : data_(data),
+      size_(size) {
+}
+
+Payload::~Payload() {
+  if (data_) {
+    munmap(data_, size_);
+  }
+  data_ = nullptr;
+}
+
+http::Request::UploadFn Payload::MakeUploadFn(long total_bytes) const {
+  std::shared_ptr<const Payload> self(shared_from_this());
+  long sent = 0;
+  return [self, total_bytes, sent](char *buffer,
+                                   size_t size,
+                                   size_t *bytes_sent) mutable {
+    if (sent >= total_bytes || self->size() == 0) {
+      return http::Request::UploadStatus::DONE;
+    }
+    size_t offset = sent % self->size();
+    size_t len = std::min(size, self->size() - offset);
+    len = std::min(len, static_cast<size_t>(total_bytes - sent));
+    memcpy(buffer, self->data() + offset, len);
+    sent += len;
+    *bytes_sent = len;
+    return http::Request::UploadStatus::CONTINUE;
+  };
+}
+
+}  // namespace speedtest
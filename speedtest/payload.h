@@ -0,0 +1,57 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPEEDTEST_PAYLOAD_H
+#define SPEEDTEST_PAYLOAD_H
+
+#include <memory>
+#include "request.h"
+#include "utils.h"
+
+namespace speedtest {
+
+// A block of random upload data shared read-only by every upload stream.
+//
+// The block lives in a page-aligned private anonymous mapping which is
+// made read-only once filled. Streams send as many bytes as they like by
+// cycling through the block, so memory use doesn't depend on the upload
+// size or the number of streams.
+class Payload : public std::enable_shared_from_this<Payload> {
+ public:
+  // An empty payload maps nothing and uploads an empty body. Returns
+  // nullptr if the mapping can't be created.
+  static std::shared_ptr<const Payload> NewPayload(size_t size);
+  virtual ~Payload();
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Returns an upload function which sends total_bytes of data by reading
+  // through this block. The function keeps a reference to the payload.
+  http::Request::UploadFn MakeUploadFn(long total_bytes) const;
+
+ private:
+  Payload(char *data, size_t size);
+
+  char *data_;  // owned
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(Payload);
+};
+
+}  // namespace speedtest
+
+#endif  // SPEEDTEST_PAYLOAD_H
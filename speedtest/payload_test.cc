@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "payload.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+namespace speedtest {
+namespace {
+
+// Drains an upload function using a buffer of buffer_size bytes.
+std::string Drain(http::Request::UploadFn upload_fn, size_t buffer_size) {
+  std::string sent;
+  std::string buffer(buffer_size, '\0');
+  while (true) {
+    size_t bytes_sent = 0;
+    http::Request::UploadStatus status =
+        upload_fn(&buffer[0], buffer.size(), &bytes_sent);
+    if (status != http::Request::UploadStatus::CONTINUE) {
+      EXPECT_EQ(http::Request::UploadStatus::DONE, status);
+      break;
+    }
+    sent.append(buffer.data(), bytes_sent);
+  }
+  return sent;
+}
+
+TEST(PayloadTest, Empty_Ok) {
+  std::shared_ptr<const Payload> payload = Payload::NewPayload(0);
+  ASSERT_NE(nullptr, payload);
+  EXPECT_EQ(0, payload->size());
+  EXPECT_EQ("", Drain(payload->MakeUploadFn(0), 128));
+  EXPECT_EQ("", Drain(payload->MakeUploadFn(1000), 128));
+}
+
+TEST(PayloadTest, NonZeroData_Ok) {
+  std::shared_ptr<const Payload> payload = Payload::NewPayload(4096);
+  ASSERT_NE(nullptr, payload);
+  EXPECT_EQ(4096, payload->size());
+  for (size_t i = 0; i < payload->size(); ++i) {
+    ASSERT_NE('\0', payload->data()[i]);
+  }
+}
+
+TEST(PayloadTest, UploadFnSmallerThanPayload_Ok) {
+  std::shared_ptr<const Payload> payload = Payload::NewPayload(1000);
+  ASSERT_NE(nullptr, payload);
+  std::string sent = Drain(payload->MakeUploadFn(300), 128);
+  EXPECT_EQ(std::string(payload->data(), 300), sent);
+}
+
+TEST(PayloadTest, UploadFnWrapsPayload_Ok) {
+  std::shared_ptr<const Payload> payload = Payload::NewPayload(1000);
+  ASSERT_NE(nullptr, payload);
+  std::string block(payload->data(), payload->size());
+  std::string sent = Drain(payload->MakeUploadFn(2500), 384);
+  EXPECT_EQ(block + block + block.substr(0, 500), sent);
+}
+
+TEST(PayloadTest, UploadFnKeepsPayloadAlive_Ok) {
+  http::Request::UploadFn upload_fn;
+  {
+    std::shared_ptr<const Payload> payload = Payload::NewPayload(100);
+    ASSERT_NE(nullptr, payload);
+    upload_fn = payload->MakeUploadFn(150);
+  }
+  EXPECT_EQ(150, Drain(upload_fn, 64).size());
+}
+
+}  // namespace
+}  // namespace speedtest
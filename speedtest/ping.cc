@@ -18,8 +18,6 @@
 
 #include <curl/curl.h>
 #include <iostream>
-#include <limits>
-#include <mutex>
 #include <thread>
 #include <vector>
 #include "errors.h"
@@ -31,8 +29,7 @@ Ping::Ping(const Options &options)
     : options_(options),
       start_time_(0),
       end_time_(0),
-      pings_received_(0),
-      min_ping_micros_(std::numeric_limits<long>::max()) {
+      failed_(0) {
 }
 
 Ping::Result Ping::operator()(std::atomic_bool *cancel) {
@@ -55,17 +52,29 @@ Ping::Result Ping::operator()(std::atomic_bool *cancel) {
   }
 
   std::vector<std::thread> threads;
-  min_ping_micros_ = std::numeric_limits<long>::max();
-  pings_received_ = 0;
+  failed_ = 0;
+  histogram_.Reset();
+  warm_histogram_.Reset();
+  int num_urls = options_.region.urls.size();
   int num_pings = options_.num_concurrent_pings > 0
                   ? options_.num_concurrent_pings
-                  : options_.region.urls.size();
+                  : num_urls;
+  if (options_.dual_stack) {
+    num_pings *= 2;
+  }
   for (int index = 0; index < num_pings; ++index) {
-    threads.emplace_back([&]{
-      size_t url_index = index % options_.region.urls.size();
+    threads.emplace_back([=]{
+      size_t url_index = index % num_urls;
       http::Url url(options_.region.urls[url_index]);
       url.set_path("/ping");
+      long ip_resolve = CURL_IPRESOLVE_WHATEVER;
+      if (options_.dual_stack) {
+        ip_resolve = (index / num_urls) % 2 == 0
+                     ? CURL_IPRESOLVE_V4
+                     : CURL_IPRESOLVE_V6;
+      }
       http::Request::Ptr ping = options_.request_factory(url);
+      bool warm = false;
       while (!*cancel) {
         ping->add_param("i", to_string(index + 1));
         ping->add_param("time", to_string(SystemTimeMicros()));
@@ -73,20 +82,40 @@ Ping::Result Ping::operator()(std::atomic_bool *cancel) {
         if (options_.timeout_millis > 0) {
           ping->set_timeout_millis(options_.timeout_millis);
         }
+        ping->set_ip_resolve(ip_resolve);
+        // Abort an outstanding ping as soon as we're cancelled rather than
+        // waiting for it to time out.
+        ping->set_progress_fn([=](curl_off_t,
+                                  curl_off_t,
+                                  curl_off_t,
+                                  curl_off_t) -> bool {
+          return *cancel;
+        });
         long req_start = SystemTimeMicros();
         CURLcode curl_code = ping->Get();
         if (curl_code == CURLE_OK) {
-          long req_end = SystemTimeMicros();
-          long ping_time = req_end - req_start;
-          pings_received_++;
-          std::lock_guard<std::mutex> lock(mutex_);
-          min_ping_micros_ = std::min(min_ping_micros_, ping_time);
-        } else if (options_.verbose) {
-          std::cout << "Ping " << ping->url().url() << " failed: "
-                    << http::ErrorString(curl_code) << "\n";
+          long ping_micros = SystemTimeMicros() - req_start;
+          histogram_.Record(ping_micros);
+          if (warm) {
+            warm_histogram_.Record(ping_micros);
+          }
+          warm = true;
+        } else {
+          // The connection may not have survived the failure.
+          warm = false;
+          if (curl_code != CURLE_ABORTED_BY_CALLBACK) {
+            failed_++;
+            if (options_.verbose) {
+              std::cout << "Ping " << ping->url().url() << " failed: "
+                        << http::ErrorString(curl_code) << "\n";
+            }
+          }
         }
         ping->Reset();
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (options_.interval_millis > 0) {
+          std::this_thread::sleep_for(
+              std::chrono::milliseconds(options_.interval_millis));
+        }
       }
     });
   }
@@ -101,11 +130,6 @@ Ping::Result Ping::operator()(std::atomic_bool *cancel) {
   return GetResult(Status::OK);
 }
 
-long Ping::min_ping_micros() const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return min_ping_micros_;
-}
-
 Ping::Result Ping::GetResult(Status status) const {
   Ping::Result result;
   result.start_time = start_time_;
@@ -113,7 +137,9 @@ Ping::Result Ping::GetResult(Status status) const {
   result.status = status;
   result.region = options_.region;
   result.min_ping_micros = min_ping_micros();
-  result.received = pings_received_;
+  result.received = pings_received();
+  result.latency = histogram_.Summarize();
+  result.latency.failed = failed_;
   return result;
 }
 
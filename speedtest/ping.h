@@ -18,8 +18,8 @@
 #define SPEEDTEST_PING_H
 
 #include <atomic>
-#include <mutex>
 #include <string>
+#include "latency_histogram.h"
 #include "region.h"
 #include "request.h"
 #include "status.h"
@@ -35,6 +35,12 @@ class Ping {
     long timeout_millis;
     long num_concurrent_pings;
     Region region;
+
+    // Ping every URL over both IPv4 and IPv6.
+    bool dual_stack = false;
+
+    // Pause between successive pings on each connection.
+    long interval_millis = 100;
   };
 
   struct Result {
@@ -44,6 +50,7 @@ class Ping {
     Region region;
     long min_ping_micros;
     int received;
+    LatencySummary latency;
   };
 
   explicit Ping(const Options &options);
@@ -52,7 +59,17 @@ class Ping {
 
   long start_time() const { return start_time_; }
   long end_time() const { return end_time_; }
-  long min_ping_micros() const;
+  long min_ping_micros() const { return histogram_.min_micros(); }
+  int pings_received() const { return histogram_.count(); }
+
+  // Pings that timed out or failed, other than those aborted by cancel.
+  long pings_failed() const { return failed_; }
+
+  // Only pings sent on a connection that had already answered one, so
+  // they don't include DNS, TCP or TLS setup.
+  long min_warm_ping_micros() const { return warm_histogram_.min_micros(); }
+  int warm_pings_received() const { return warm_histogram_.count(); }
+  const LatencyHistogram &histogram() const { return histogram_; }
 
  private:
   Result GetResult(Status status) const;
@@ -60,10 +77,9 @@ class Ping {
   Options options_;
   std::atomic_long start_time_;
   std::atomic_long end_time_;
-  std::atomic_int pings_received_;
-
-  mutable std::mutex mutex_;
-  long min_ping_micros_;
+  std::atomic_long failed_;
+  LatencyHistogram histogram_;
+  LatencyHistogram warm_histogram_;
 
   DISALLOW_COPY_AND_ASSIGN(Ping);
 };
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ping.h"
+
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <memory>
+#include <thread>
+#include "curl_env.h"
+#include "loopback_server.h"
+
+namespace speedtest {
+namespace {
+
+// Pings that time out have no latency to record but must still be counted,
+// otherwise a stalled link looks like a fast one.
+TEST(PingTest, TimeoutsCounted) {
+  LoopbackServer::Options server_options;
+  server_options.delay_millis = 300;
+  LoopbackServer server(server_options);
+  ASSERT_TRUE(server.Start().ok());
+
+  http::CurlEnv::Options curl_options;
+  std::shared_ptr<http::CurlEnv> env = http::CurlEnv::NewCurlEnv(curl_options);
+  Ping::Options options;
+  options.verbose = false;
+  options.request_factory = [&](const http::Url &url) {
+    return env->NewRequest(url);
+  };
+  options.timeout_millis = 50;
+  options.num_concurrent_pings = 1;
+  options.region.id = "loopback";
+  options.region.urls.push_back(server.url());
+  options.interval_millis = 0;
+
+  Ping ping(options);
+  std::atomic_bool cancel(false);
+  Ping::Result result;
+  std::thread ping_thread([&]{
+    result = ping(&cancel);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  cancel = true;
+  ping_thread.join();
+
+  EXPECT_TRUE(result.status.ok());
+  EXPECT_EQ(0, result.latency.count);
+  EXPECT_GE(result.latency.failed, 2);
+}
+
+}  // namespace
+}  // namespace speedtest
@@ -0,0 +1,234 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "region_cache.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <jsoncpp/json/json.h>
+#include <jsoncpp/json/writer.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "utils.h"
+
+namespace speedtest {
+namespace {
+
+const int kIpv4PrefixBits = 24;
+const int kIpv6PrefixBits = 64;
+
+bool IsFresh(const Json::Value &entry, long ttl_seconds, long now) {
+  if (!entry.isObject() || !entry["timestamp"].isIntegral()) {
+    return false;
+  }
+  long age = now - entry["timestamp"].asInt64();
+  return age >= 0 && age < ttl_seconds;
+}
+
+std::string FormatPrefix(const struct sockaddr_storage &addr) {
+  char buf[INET6_ADDRSTRLEN];
+  if (addr.ss_family == AF_INET) {
+    struct in_addr in =
+        reinterpret_cast<const struct sockaddr_in *>(&addr)->sin_addr;
+    in.s_addr &= htonl(~0U << (32 - kIpv4PrefixBits));
+    if (!inet_ntop(AF_INET, &in, buf, sizeof(buf))) {
+      return "";
+    }
+    return std::string(buf) + "/" + to_string(kIpv4PrefixBits);
+  }
+  if (addr.ss_family == AF_INET6) {
+    struct in6_addr in6 =
+        reinterpret_cast<const struct sockaddr_in6 *>(&addr)->sin6_addr;
+    memset(in6.s6_addr + kIpv6PrefixBits / 8, 0, 16 - kIpv6PrefixBits / 8);
+    if (!inet_ntop(AF_INET6, &in6, buf, sizeof(buf))) {
+      return "";
+    }
+    return std::string(buf) + "/" + to_string(kIpv6PrefixBits);
+  }
+  return "";
+}
+
+}  // namespace
+
+std::string GetNetworkPrefix(const http::Url &url) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *res = nullptr;
+  std::string port = to_string(url.port() > 0 ? url.port() : 80);
+  if (getaddrinfo(url.host().c_str(), port.c_str(), &hints, &res) != 0) {
+    return "";
+  }
+
+  std::string prefix;
+  for (struct addrinfo *ai = res; ai && prefix.empty(); ai = ai->ai_next) {
+    // Connecting a UDP socket only selects a route and source address.
+    int fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      continue;
+    }
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        getsockname(fd, reinterpret_cast<struct sockaddr *>(&local),
+                    &local_len) == 0) {
+      prefix = FormatPrefix(local);
+    }
+    close(fd);
+  }
+  freeaddrinfo(res);
+  return prefix;
+}
+
+bool LoadRegionCache(const std::string &file,
+                     const std::string &prefix,
+                     long ttl_seconds,
+                     long now,
+                     std::vector<Region> *regions) {
+  std::ifstream in(file);
+  if (!in) {
+    return false;
+  }
+  std::string json((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  return ParseRegionCache(json, prefix, ttl_seconds, now, regions).ok();
+}
+
+Status SaveRegionCache(const std::string &file,
+                       const std::string &prefix,
+                       long ttl_seconds,
+                       long now,
+                       const std::vector<Region> &regions) {
+  std::string json;
+  {
+    std::ifstream in(file);
+    if (in) {
+      json.assign(std::istreambuf_iterator<char>(in),
+                  std::istreambuf_iterator<char>());
+    }
+  }
+  json = UpdateRegionCache(json, prefix, ttl_seconds, now, regions);
+
+  // Write to a temporary file and rename so readers never see a partial
+  // cache.
+  std::string tmp_file = file + ".new";
+  {
+    std::ofstream out(tmp_file, std::ios::trunc);
+    out << json;
+    if (!out) {
+      return Status(StatusCode::INTERNAL, "Failed to write region cache");
+    }
+  }
+  if (rename(tmp_file.c_str(), file.c_str()) != 0) {
+    unlink(tmp_file.c_str());
+    return Status(StatusCode::INTERNAL, "Failed to rename region cache");
+  }
+  return Status::OK;
+}
+
+Status ParseRegionCache(const std::string &json,
+                        const std::string &prefix,
+                        long ttl_seconds,
+                        long now,
+                        std::vector<Region> *regions) {
+  if (!regions) {
+    return Status(StatusCode::FAILED_PRECONDITION, "Regions is null");
+  }
+  if (prefix.empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "Prefix is empty");
+  }
+
+  Json::Reader reader;
+  Json::Value root;
+  if (!reader.parse(json, root, false) || !root.isObject()) {
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  "Failed to parse region cache JSON");
+  }
+  if (!root["entries"].isArray()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "no entries element found");
+  }
+  for (const Json::Value &entry : root["entries"]) {
+    if (!entry.isObject() || entry["prefix"].asString() != prefix) {
+      continue;
+    }
+    if (!IsFresh(entry, ttl_seconds, now)) {
+      return Status(StatusCode::UNAVAILABLE, "Region cache entry expired");
+    }
+    Json::Value regions_json;
+    regions_json["regions"] = entry["regions"];
+    std::vector<Region> cached;
+    Status status = ParseRegions(Json::FastWriter().write(regions_json),
+                                 &cached);
+    if (!status.ok()) {
+      return status;
+    }
+    if (cached.empty()) {
+      return Status(StatusCode::UNAVAILABLE, "Region cache entry empty");
+    }
+    *regions = cached;
+    return Status::OK;
+  }
+  return Status(StatusCode::UNAVAILABLE, "No region cache entry for prefix");
+}
+
+std::string UpdateRegionCache(const std::string &json,
+                              const std::string &prefix,
+                              long ttl_seconds,
+                              long now,
+                              const std::vector<Region> &regions) {
+  Json::Reader reader;
+  Json::Value old_root;
+  if (json.empty() || !reader.parse(json, old_root, false) ||
+      !old_root.isObject() || !old_root["entries"].isArray()) {
+    old_root = Json::Value(Json::objectValue);
+    old_root["entries"] = Json::Value(Json::arrayValue);
+  }
+
+  Json::Value root;
+  root["entries"] = Json::Value(Json::arrayValue);
+  for (const Json::Value &entry : old_root["entries"]) {
+    if (entry.isObject() && entry["prefix"].asString() != prefix &&
+        IsFresh(entry, ttl_seconds, now)) {
+      root["entries"].append(entry);
+    }
+  }
+
+  Json::Value entry;
+  entry["prefix"] = prefix;
+  entry["timestamp"] = static_cast<Json::Value::Int64>(now);
+  entry["regions"] = Json::Value(Json::arrayValue);
+  for (const Region &region : regions) {
+    Json::Value region_json;
+    region_json["id"] = region.id;
+    region_json["name"] = region.name;
+    region_json["url"] = Json::Value(Json::arrayValue);
+    for (const http::Url &url : region.urls) {
+      region_json["url"].append(url.url());
+    }
+    entry["regions"].append(region_json);
+  }
+  root["entries"].append(entry);
+  return Json::FastWriter().write(root);
+}
+
+}  // namespace speedtest
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPEEDTEST_REGION_CACHE_H
+#define SPEEDTEST_REGION_CACHE_H
+
+#include <string>
+#include <vector>
+#include "region.h"
+#include "status.h"
+#include "url.h"
+
+namespace speedtest {
+
+// Persistent cache of region rankings from previous find nearest runs so
+// that repeat runs from the same network can skip discovery.
+//
+// Entries are keyed by the network prefix of the local address used to
+// reach the speedtest service (see GetNetworkPrefix) and expire after a TTL.
+// The file holds a JSON document of the form:
+//
+// {"entries": [{"prefix": "192.0.2.0/24",
+//               "timestamp": 1476600000,
+//               "regions": [{"id": "...", "name": "...", "url": [...]}]}]}
+//
+// with each entry's regions ordered fastest first.
+
+// Returns the network prefix ("a.b.c.0/24" or the IPv6 /64) of the local
+// address the kernel would use to reach url's host, or an empty string if
+// it can't be determined. No packets are sent.
+std::string GetNetworkPrefix(const http::Url &url);
+
+// Loads the fresh ranking for prefix from file into regions.
+// Returns false if there is no entry younger than ttl_seconds at now.
+bool LoadRegionCache(const std::string &file,
+                     const std::string &prefix,
+                     long ttl_seconds,
+                     long now,
+                     std::vector<Region> *regions);
+
+// Stores the ranking for prefix in file, replacing any previous entry for
+// that prefix and dropping entries older than ttl_seconds.
+Status SaveRegionCache(const std::string &file,
+                       const std::string &prefix,
+                       long ttl_seconds,
+                       long now,
+                       const std::vector<Region> &regions);
+
+// Parses a region cache document and extracts the entry for prefix.
+Status ParseRegionCache(const std::string &json,
+                        const std::string &prefix,
+                        long ttl_seconds,
+                        long now,
+                        std::vector<Region> *regions);
+
+// Returns json updated with the ranking for prefix.
+// Invalid or empty input is treated as an empty cache.
+std::string UpdateRegionCache(const std::string &json,
+                              const std::string &prefix,
+                              long ttl_seconds,
+                              long now,
+                              const std::vector<Region> &regions);
+
+}  // namespace speedtest
+
+#endif  // SPEEDTEST_REGION_CACHE_H
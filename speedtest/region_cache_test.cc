@@ -0,0 +1,121 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "region_cache.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+namespace speedtest {
+namespace {
+
+const long kTtl = 3600;
+const long kNow = 1000000;
+
+std::vector<Region> MakeRegions() {
+  Region east;
+  east.id = "east";
+  east.name = "East";
+  east.urls.emplace_back("http://east.example.com");
+  Region west;
+  west.id = "west";
+  west.name = "West";
+  west.urls.emplace_back("http://west4.example.com");
+  west.urls.emplace_back("http://west6.example.com");
+  return {east, west};
+}
+
+TEST(RegionCacheTest, Parse_Invalid) {
+  std::vector<Region> regions;
+  EXPECT_FALSE(ParseRegionCache("", "10.0.0.0/24", kTtl, kNow, &regions).ok());
+  EXPECT_FALSE(ParseRegionCache("[]", "10.0.0.0/24", kTtl, kNow,
+                                &regions).ok());
+  EXPECT_FALSE(ParseRegionCache("{}", "10.0.0.0/24", kTtl, kNow,
+                                &regions).ok());
+  EXPECT_FALSE(ParseRegionCache("{\"entries\": []}", "10.0.0.0/24", kTtl,
+                                kNow, nullptr).ok());
+}
+
+TEST(RegionCacheTest, RoundTrip_Ok) {
+  std::string json = UpdateRegionCache("", "10.0.0.0/24", kTtl, kNow,
+                                       MakeRegions());
+  std::vector<Region> regions;
+  ASSERT_TRUE(ParseRegionCache(json, "10.0.0.0/24", kTtl, kNow + 10,
+                               &regions).ok());
+  ASSERT_EQ(2, regions.size());
+  EXPECT_EQ("east", regions[0].id);
+  EXPECT_EQ("East", regions[0].name);
+  EXPECT_EQ(http::Url("http://east.example.com"), regions[0].urls[0]);
+  EXPECT_EQ("west", regions[1].id);
+  ASSERT_EQ(2, regions[1].urls.size());
+  EXPECT_EQ(http::Url("http://west6.example.com"), regions[1].urls[1]);
+}
+
+TEST(RegionCacheTest, OtherPrefix_Miss) {
+  std::string json = UpdateRegionCache("", "10.0.0.0/24", kTtl, kNow,
+                                       MakeRegions());
+  std::vector<Region> regions;
+  EXPECT_FALSE(ParseRegionCache(json, "10.0.1.0/24", kTtl, kNow,
+                                &regions).ok());
+  EXPECT_TRUE(regions.empty());
+}
+
+TEST(RegionCacheTest, Expired_Miss) {
+  std::string json = UpdateRegionCache("", "10.0.0.0/24", kTtl, kNow,
+                                       MakeRegions());
+  std::vector<Region> regions;
+  EXPECT_FALSE(ParseRegionCache(json, "10.0.0.0/24", kTtl, kNow + kTtl,
+                                &regions).ok());
+  EXPECT_FALSE(ParseRegionCache(json, "10.0.0.0/24", kTtl, kNow - 1,
+                                &regions).ok());
+}
+
+TEST(RegionCacheTest, Update_ReplacesPrefixAndDropsExpired) {
+  std::vector<Region> regions = MakeRegions();
+  std::string json = UpdateRegionCache("", "10.0.0.0/24", kTtl, kNow,
+                                       regions);
+  json = UpdateRegionCache(json, "10.0.1.0/24", kTtl, kNow + 100, regions);
+  std::swap(regions[0], regions[1]);
+  json = UpdateRegionCache(json, "10.0.1.0/24", kTtl, kNow + kTtl, regions);
+
+  std::vector<Region> cached;
+  EXPECT_FALSE(ParseRegionCache(json, "10.0.0.0/24", kTtl * 2, kNow + kTtl,
+                                &cached).ok());
+  ASSERT_TRUE(ParseRegionCache(json, "10.0.1.0/24", kTtl, kNow + kTtl,
+                               &cached).ok());
+  ASSERT_EQ(2, cached.size());
+  EXPECT_EQ("west", cached[0].id);
+}
+
+TEST(RegionCacheTest, Update_ReplacesInvalidCache) {
+  std::vector<std::string> invalid = {"[]", "3", "\"x\"", "{\"entries\": 3}"};
+  for (const std::string &old_json : invalid) {
+    std::string json = UpdateRegionCache(old_json, "10.0.0.0/24", kTtl, kNow,
+                                         MakeRegions());
+    std::vector<Region> regions;
+    EXPECT_TRUE(ParseRegionCache(json, "10.0.0.0/24", kTtl, kNow,
+                                 &regions).ok()) << old_json;
+    EXPECT_EQ(2, regions.size());
+  }
+}
+
+TEST(RegionCacheTest, NetworkPrefix_Loopback) {
+  EXPECT_EQ("127.0.0.0/24", GetNetworkPrefix(http::Url("http://127.0.0.1")));
+}
+
+}  // namespace
+}  // namespace speedtest
@@ -19,6 +19,7 @@
 #include <assert.h>
 #include <cstdlib>
 #include <iostream>
+#include <sys/socket.h>
 
 #include "errors.h"
 
@@ -62,16 +63,27 @@ int ProgressCallback(void *clientp,
   return 0;
 }
 
+int SockoptCallback(void *clientp, curl_socket_t fd, curlsocktype purpose) {
+  const int *bytes = static_cast<const int *>(clientp);
+  if (purpose == CURLSOCKTYPE_IPCXN && *bytes > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, bytes, sizeof(*bytes));
+  }
+  return CURL_SOCKOPT_OK;
+}
+
 const int kDefaultQueryStringSize = 200;
 
 const Request::DownloadFn noop = [](void *, size_t) { };
 
 }  // namespace
 
-Request::Request(std::shared_ptr<CURL> handle, const Url &url)
+Request::Request(std::shared_ptr<CURL> handle, const Url &url, CURLSH *share)
     : handle_(handle),
       curl_headers_(nullptr),
+      share_(share),
+      send_buffer_bytes_(0),
       url_(url) {
+  ApplyDefaults();
 }
 
 Request::~Request() {
@@ -88,32 +100,70 @@ CURLcode Request::Get() {
 }
 
 CURLcode Request::Get(DownloadFn download_fn) {
+  PrepareGet(download_fn);
+  return Execute();
+}
+
+CURLcode Request::Post(UploadFn upload_fn) {
+  PreparePost(upload_fn);
+  return Execute();
+}
+
+CURLcode Request::Post(UploadFn upload_fn, curl_off_t data_len) {
+  PreparePost(upload_fn, data_len);
+  return Execute();
+}
+
+CURLcode Request::Post(const char *data, curl_off_t data_len) {
+  PreparePost(data, data_len);
+  return Execute();
+}
+
+CURL *Request::PrepareGet() {
+  return PrepareGet(noop);
+}
+
+CURL *Request::PrepareGet(DownloadFn download_fn) {
   CommonSetup();
-  if (download_fn) {
+  download_fn_ = download_fn;
+  if (download_fn_) {
     curl_easy_setopt(handle_.get(), CURLOPT_WRITEFUNCTION, &WriteCallback);
-    curl_easy_setopt(handle_.get(), CURLOPT_WRITEDATA, &download_fn);
+    curl_easy_setopt(handle_.get(), CURLOPT_WRITEDATA, &download_fn_);
   }
-  return Execute();
+  return handle_.get();
 }
 
-CURLcode Request::Post(UploadFn upload_fn) {
+CURL *Request::PreparePost(UploadFn upload_fn) {
+  return PreparePost(upload_fn, -1);
+}
+
+CURL *Request::PreparePost(UploadFn upload_fn, curl_off_t data_len) {
+  // Without a length the body has to be sent chunked.
+  if (data_len < 0) {
+    set_header("Transfer-Encoding", "chunked");
+  }
   CommonSetup();
-  curl_easy_setopt(handle_.get(), CURLOPT_UPLOAD, 1);
+  upload_fn_ = upload_fn;
+  curl_easy_setopt(handle_.get(), CURLOPT_POST, 1);
+  curl_easy_setopt(handle_.get(), CURLOPT_POSTFIELDSIZE_LARGE, data_len);
   curl_easy_setopt(handle_.get(), CURLOPT_READFUNCTION, &ReadCallback);
-  curl_easy_setopt(handle_.get(), CURLOPT_READDATA, &upload_fn);
-  return Execute();
+  curl_easy_setopt(handle_.get(), CURLOPT_READDATA, &upload_fn_);
+  return handle_.get();
 }
 
-CURLcode Request::Post(const char *data, curl_off_t data_len) {
+CURL *Request::PreparePost(const char *data, curl_off_t data_len) {
   CommonSetup();
   curl_easy_setopt(handle_.get(), CURLOPT_POSTFIELDSIZE_LARGE, data_len);
   curl_easy_setopt(handle_.get(), CURLOPT_POSTFIELDS, data);
-  return Execute();
+  return handle_.get();
 }
 
 void Request::Reset() {
   curl_easy_reset(handle_.get());
+  ApplyDefaults();
   clear_progress_fn();
+  download_fn_ = nullptr;
+  upload_fn_ = nullptr;
   clear_headers();
   clear_params();
   if (curl_headers_) {
@@ -162,6 +212,15 @@ void Request::set_timeout_millis(long millis) {
   curl_easy_setopt(handle_.get(), CURLOPT_TIMEOUT_MS, millis);
 }
 
+void Request::set_ip_resolve(long ip_resolve) {
+  curl_easy_setopt(handle_.get(), CURLOPT_IPRESOLVE, ip_resolve);
+}
+
+void Request::set_send_buffer_bytes(int bytes) {
+  send_buffer_bytes_ = bytes;
+  ApplyDefaults();
+}
+
 void Request::UpdateUrl() {
   std::string query_string;
   query_string.reserve(kDefaultQueryStringSize);
@@ -198,17 +257,30 @@ void Request::CommonSetup() {
                      &ProgressCallback);
     curl_easy_setopt(handle_.get(), CURLOPT_XFERINFODATA, &progress_fn_);
   }
+  if (curl_headers_) {
+    curl_slist_free_all(curl_headers_);
+    curl_headers_ = nullptr;
+  }
   if (!headers_.empty()) {
-    struct curl_slist *headers = nullptr;
     for (Headers::const_iterator iter = headers_.begin();
          iter != headers_.end();
          ++iter) {
       std::string header(iter->first);
       header.append(": ");
       header.append(iter->second);
-      headers = curl_slist_append(headers, header.c_str());
+      curl_headers_ = curl_slist_append(curl_headers_, header.c_str());
     }
-    curl_easy_setopt(handle_.get(), CURLOPT_HTTPHEADER, headers);
+  }
+  curl_easy_setopt(handle_.get(), CURLOPT_HTTPHEADER, curl_headers_);
+}
+
+void Request::ApplyDefaults() {
+  // curl_easy_reset() clears these along with everything else.
+  curl_easy_setopt(handle_.get(), CURLOPT_SHARE, share_);
+  curl_easy_setopt(handle_.get(), CURLOPT_NOSIGNAL, 1L);
+  if (send_buffer_bytes_ > 0) {
+    curl_easy_setopt(handle_.get(), CURLOPT_SOCKOPTFUNCTION, &SockoptCallback);
+    curl_easy_setopt(handle_.get(), CURLOPT_SOCKOPTDATA, &send_buffer_bytes_);
   }
 }
 
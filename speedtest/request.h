@@ -17,11 +17,13 @@
 #ifndef HTTP_REQUEST_H
 #define HTTP_REQUEST_H
 
+#include <atomic>
 #include <curl/curl.h>
 #include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 #include "url.h"
 #include "utils.h"
 
@@ -46,14 +48,32 @@ class Request {
   using Ptr = std::unique_ptr<Request>;
   using Factory = std::function<Ptr(const Url &)>;
 
-  Request(std::shared_ptr<CURL> handle, const Url &url);
+  // Opens connections to each URL ahead of time so requests made later
+  // through a Factory can reuse them. Blocks until done or cancelled.
+  using WarmFn = std::function<void(const std::vector<Url> &,
+                                    std::atomic_bool *)>;
+
+  // share is applied to the handle again on every Reset(). It may be null.
+  Request(std::shared_ptr<CURL> handle,
+          const Url &url,
+          CURLSH *share = nullptr);
   virtual ~Request();
 
   CURLcode Get();
   CURLcode Get(DownloadFn download_fn);
   CURLcode Post(UploadFn upload_fn);
+  CURLcode Post(UploadFn upload_fn, curl_off_t data_len);
   CURLcode Post(const char *data, curl_off_t data_len);
 
+  // Configure the handle for a transfer without performing it so that the
+  // caller can drive it, e.g. through a TransferEngine.
+  // Returns the easy handle, which remains owned by this request.
+  CURL *PrepareGet();
+  CURL *PrepareGet(DownloadFn download_fn);
+  CURL *PreparePost(UploadFn upload_fn);
+  CURL *PreparePost(UploadFn upload_fn, curl_off_t data_len);
+  CURL *PreparePost(const char *data, curl_off_t data_len);
+
   void Reset();
 
   const std::string &user_agent() const { return user_agent_; }
@@ -85,22 +105,36 @@ class Request {
   // Request timeout
   void set_timeout_millis(long millis);
 
+  // Restrict name resolution to one address family, e.g. CURL_IPRESOLVE_V6
+  void set_ip_resolve(long ip_resolve);
+
+  // Caps SO_SNDBUF on every connection this request opens, so a send
+  // returns once the bytes are close to the wire rather than when they
+  // have been copied into an autotuned buffer. 0 leaves the kernel
+  // default. Kept across Reset().
+  void set_send_buffer_bytes(int bytes);
+
   void UpdateUrl();
 
  private:
   void CommonSetup();
+  void ApplyDefaults();
 
   CURLcode Execute();
 
   // owned
   std::shared_ptr<CURL> handle_;
   struct curl_slist *curl_headers_;
+  CURLSH *share_;
+  int send_buffer_bytes_;
   Url url_;
 
   std::string user_agent_;
   Headers headers_;
   QueryStringParams params_;
   ProgressFn progress_fn_;
+  DownloadFn download_fn_;
+  UploadFn upload_fn_;
 
   DISALLOW_COPY_AND_ASSIGN(Request);
 };
@@ -27,6 +27,16 @@ void PopulateDuration(Json::Value &json, const T &t) {
   json["endMillis"] = static_cast<Json::Value::Int64>(t.end_time);
 }
 
+void PopulateLatency(Json::Value &json, const LatencySummary &latency) {
+  json["count"] = static_cast<Json::Value::Int64>(latency.count);
+  json["minMicros"] = static_cast<Json::Value::Int64>(latency.min_micros);
+  json["p50Micros"] = static_cast<Json::Value::Int64>(latency.p50_micros);
+  json["p90Micros"] = static_cast<Json::Value::Int64>(latency.p90_micros);
+  json["p99Micros"] = static_cast<Json::Value::Int64>(latency.p99_micros);
+  json["maxMicros"] = static_cast<Json::Value::Int64>(latency.max_micros);
+  json["failed"] = static_cast<Json::Value::Int64>(latency.failed);
+}
+
 }  // namespace
 
 void PopulateParameters(Json::Value &json, const Config &config) {
@@ -73,6 +83,7 @@ void PopulateFindNearest(Json::Value &json,
     if (ping_result.received > 0) {
       ping["minPingMillis"] =
           static_cast<Json::Value::Int64>(ping_result.min_ping_micros);
+      PopulateLatency(ping["latency"], ping_result.latency);
     }
     json["pingResults"].append(ping);
   }
@@ -86,6 +97,7 @@ void PopulateInitResult(Json::Value &json,
     PopulateFindNearest(json["findNearest"], init_result.find_nearest_result);
   }
   json["selectedRegion"] = init_result.selected_region.id;
+  json["regionCacheHit"] = init_result.region_cache_hit;
 }
 
 void PopulateTransfer(Json::Value &json,
@@ -104,6 +116,18 @@ void PopulateTransfer(Json::Value &json,
     bucket_json["offsetMillis"] = bucket.start_time / 1000.0d;
     json["buckets"].append(bucket_json);
   }
+  json["streamSpeedMbps"] = Json::Value(Json::arrayValue);
+  for (const std::vector<double> &stream : transfer_result.stream_megabits) {
+    Json::Value stream_json(Json::arrayValue);
+    for (double megabits : stream) {
+      stream_json.append(megabits);
+    }
+    json["streamSpeedMbps"].append(stream_json);
+  }
+  if (transfer_result.loaded_latency.count > 0 ||
+      transfer_result.loaded_latency.failed > 0) {
+    PopulateLatency(json["loadedLatency"], transfer_result.loaded_latency);
+  }
 }
 
 void PopulatePingResult(Json::Value &json, const Ping::Result &ping_result) {
@@ -113,6 +137,7 @@ void PopulatePingResult(Json::Value &json, const Ping::Result &ping_result) {
   if (ping_result.received > 0) {
     json["minPingMillis"] =
         static_cast<Json::Value::Int64>(ping_result.min_ping_micros);
+    PopulateLatency(json["latency"], ping_result.latency);
   }
 }
 
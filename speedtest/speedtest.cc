@@ -16,16 +16,44 @@
 
 #include "speedtest.h"
 
+#include <algorithm>
 #include <curl/curl.h>
 #include <jsoncpp/json/json.h>
 #include <jsoncpp/json/writer.h>
+#include <sstream>
+#include <thread>
 #include "download.h"
 #include "errors.h"
+#include "payload.h"
 #include "result.h"
 #include "timed_runner.h"
 #include "upload.h"
 
 namespace speedtest {
+namespace {
+
+// Upload streams cycle through a shared block of at most this size.
+const long kMaxPayloadBytes = 256 * 1024;
+
+// Pings under load are sent more often than idle pings to catch short
+// queueing spikes, and given long enough to survive a badly bloated buffer.
+const long kLoadedPingIntervalMillis = 20;
+const long kLoadedPingTimeoutMillis = 5000;
+
+std::string DescribeLatency(const LatencySummary &latency) {
+  std::stringstream ss;
+  ss << "p50 " << ToMillis(latency.p50_micros)
+     << " ms, p90 " << ToMillis(latency.p90_micros)
+     << " ms, p99 " << ToMillis(latency.p99_micros)
+     << " ms, max " << ToMillis(latency.max_micros) << " ms";
+  if (latency.failed > 0) {
+    ss << ", " << latency.failed << " of "
+       << latency.count + latency.failed << " pings failed";
+  }
+  return ss.str();
+}
+
+}  // namespace
 
 Speedtest::Speedtest(const Options &options): options_(options) {
 }
@@ -50,6 +78,9 @@ Speedtest::Result Speedtest::operator()(std::atomic_bool *cancel) {
   init_options.global_url = options_.global_url;
   init_options.ping_timeout_millis = options_.ping_timeout_millis;
   init_options.regional_urls = options_.regional_urls;
+  init_options.race_find_nearest = options_.race_find_nearest;
+  init_options.region_cache_file = options_.region_cache_file;
+  init_options.region_cache_ttl_seconds = options_.region_cache_ttl_seconds;
   Init init(init_options);
   result.init_result = init(cancel);
   if (!result.init_result.status.ok()) {
@@ -99,6 +130,12 @@ Speedtest::Result Speedtest::operator()(std::atomic_bool *cancel) {
     std::cout << "Download speed: "
               << round(result.download_result.speed_mbps, 2)
               << " Mbps\n";
+    if (result.download_result.loaded_latency.count > 0 ||
+        result.download_result.loaded_latency.failed > 0) {
+      std::cout << "Download latency: "
+                << DescribeLatency(result.download_result.loaded_latency)
+                << "\n";
+    }
   }
 
   if (*cancel) {
@@ -120,6 +157,12 @@ Speedtest::Result Speedtest::operator()(std::atomic_bool *cancel) {
     std::cout << "Upload speed: "
               << round(result.upload_result.speed_mbps, 2)
               << " Mbps\n";
+    if (result.upload_result.loaded_latency.count > 0 ||
+        result.upload_result.loaded_latency.failed > 0) {
+      std::cout << "Upload latency: "
+                << DescribeLatency(result.upload_result.loaded_latency)
+                << "\n";
+    }
   }
 
   if (*cancel) {
@@ -141,6 +184,10 @@ Speedtest::Result Speedtest::operator()(std::atomic_bool *cancel) {
     std::cout << "Ping time: "
               << ToMillis(result.ping_result.min_ping_micros)
               << " ms\n";
+    if (options_.loaded_latency && result.ping_result.latency.count > 0) {
+      std::cout << "Idle latency: "
+                << DescribeLatency(result.ping_result.latency) << "\n";
+    }
   }
 
   result.status = Status::OK;
@@ -181,6 +228,7 @@ TransferResult Speedtest::RunDownloadTest(std::atomic_bool *cancel) {
     std::cout << "Starting download test to "
               << DescribeRegion(selected_region_) << ")\n";
   }
+  WarmConnections(config_.num_downloads, cancel);
   Download::Options download_options;
   download_options.verbose = options_.verbose;
   download_options.num_transfers = config_.num_downloads;
@@ -200,6 +248,8 @@ TransferResult Speedtest::RunDownloadTest(std::atomic_bool *cancel) {
   transfer_options.interval_millis = config_.interval_millis;
   transfer_options.exponential_moving_average =
       config_.average_type == "EXPONENTIAL";
+  transfer_options.stop_rule = options_.stop_rule;
+  transfer_options.exclude_slow_start = options_.exclude_slow_start;
   if (options_.progress_millis > 0) {
     transfer_options.progress_millis = options_.progress_millis;
     transfer_options.progress_fn = [](Bucket bucket) {
@@ -212,7 +262,9 @@ TransferResult Speedtest::RunDownloadTest(std::atomic_bool *cancel) {
                 << round(speed_variance, 4) << ")\n";
     };
   }
-  return RunTransfer(std::ref(download), cancel, transfer_options);
+  return RunLoadedTransfer([&](std::atomic_bool *transfer_cancel) {
+    return RunTransfer(std::ref(download), transfer_cancel, transfer_options);
+  }, cancel);
 }
 
 TransferResult Speedtest::RunUploadTest(std::atomic_bool *cancel) {
@@ -223,7 +275,20 @@ TransferResult Speedtest::RunUploadTest(std::atomic_bool *cancel) {
   Upload::Options upload_options;
   upload_options.verbose = options_.verbose;
   upload_options.num_transfers = config_.num_uploads;
-  upload_options.payload = MakeRandomData(config_.upload_bytes);
+  upload_options.upload_bytes = config_.upload_bytes;
+  upload_options.payload = Payload::NewPayload(
+      std::min(config_.upload_bytes, kMaxPayloadBytes));
+  if (!upload_options.payload) {
+    TransferResult result;
+    result.start_time = SystemTimeMicros();
+    result.end_time = result.start_time;
+    result.speed_mbps = 0;
+    result.total_bytes = 0;
+    result.status = Status(StatusCode::RESOURCE_EXHAUSTED,
+                           "failed to map upload payload");
+    return result;
+  }
+  WarmConnections(config_.num_uploads, cancel);
   upload_options.request_factory = [this](int id) -> http::Request::Ptr{
     return MakeTransferRequest(id, "/upload");
   };
@@ -239,6 +304,8 @@ TransferResult Speedtest::RunUploadTest(std::atomic_bool *cancel) {
   transfer_options.interval_millis = config_.interval_millis;
   transfer_options.exponential_moving_average =
       config_.average_type == "EXPONENTIAL";
+  transfer_options.stop_rule = options_.stop_rule;
+  transfer_options.exclude_slow_start = options_.exclude_slow_start;
   if (options_.progress_millis > 0) {
     transfer_options.progress_millis = options_.progress_millis;
     transfer_options.progress_fn = [](Bucket bucket) {
@@ -251,20 +318,73 @@ TransferResult Speedtest::RunUploadTest(std::atomic_bool *cancel) {
                 << round(speed_variance, 4) << ")\n";
     };
   }
-  return RunTransfer(std::ref(upload), cancel, transfer_options);
+  return RunLoadedTransfer([&](std::atomic_bool *transfer_cancel) {
+    return RunTransfer(std::ref(upload), transfer_cancel, transfer_options);
+  }, cancel);
+}
+
+TransferResult Speedtest::RunLoadedTransfer(
+    std::function<TransferResult(std::atomic_bool *)> transfer_fn,
+    std::atomic_bool *cancel) {
+  if (!options_.loaded_latency) {
+    return transfer_fn(cancel);
+  }
+
+  Ping::Options ping_options = MakePingOptions();
+  ping_options.timeout_millis = kLoadedPingTimeoutMillis;
+  ping_options.interval_millis = kLoadedPingIntervalMillis;
+  Ping ping(ping_options);
+  std::atomic_bool ping_cancel(false);
+  Ping::Result ping_result;
+  std::thread ping_thread([&]{
+    ping_result = ping(&ping_cancel);
+  });
+
+  TransferResult result = transfer_fn(cancel);
+  ping_cancel = true;
+  ping_thread.join();
+  result.loaded_latency = ping_result.latency;
+  return result;
 }
 
 Ping::Result Speedtest::RunPingTest(std::atomic_bool *cancel) {
+  WarmConnections(0, cancel);
+  Ping ping(MakePingOptions());
+  return RunTimed(std::ref(ping), cancel, config_.ping_runtime_millis);
+}
+
+Ping::Options Speedtest::MakePingOptions() const {
   Ping::Options ping_options;
   ping_options.verbose = options_.verbose;
   ping_options.timeout_millis = config_.ping_timeout_millis;
   ping_options.region = selected_region_;
   ping_options.num_concurrent_pings = 0;
-  ping_options.request_factory = [&](const http::Url &url){
+  ping_options.request_factory = [this](const http::Url &url){
     return MakeRequest(url);
   };
-  Ping ping(ping_options);
-  return RunTimed(std::ref(ping), cancel, config_.ping_runtime_millis);
+  return ping_options;
+}
+
+void Speedtest::WarmConnections(int num_transfers, std::atomic_bool *cancel) {
+  if (!options_.warm_fn || options_.disable_connection_reuse) {
+    return;
+  }
+  std::vector<http::Url> urls;
+  for (int id = 0; id < num_transfers; ++id) {
+    urls.push_back(MakeTransferUrl(id, "/ping"));
+  }
+  if (num_transfers == 0 || options_.loaded_latency) {
+    for (http::Url url : selected_region_.urls) {
+      url.set_path("/ping");
+      urls.push_back(url);
+    }
+  }
+  long start_time = SystemTimeMicros();
+  options_.warm_fn(urls, cancel);
+  if (options_.verbose) {
+    std::cout << "Warmed " << urls.size() << " connections in "
+              << ToMillis(SystemTimeMicros() - start_time) << " ms\n";
+  }
 }
 
 void Speedtest::OverrideConfigWithOptions(Config *config,
@@ -327,6 +447,10 @@ http::Request::Ptr Speedtest::MakeBaseRequest(
 
 http::Request::Ptr Speedtest::MakeTransferRequest(
     int id, const std::string &path) const {
+  return MakeRequest(MakeTransferUrl(id, path));
+}
+
+http::Url Speedtest::MakeTransferUrl(int id, const std::string &path) const {
   http::Url url(selected_region_.urls.front().url());
   int port_start = config_.transfer_port_start;
   int port_end = config_.transfer_port_end;
@@ -335,7 +459,7 @@ http::Request::Ptr Speedtest::MakeTransferRequest(
     url.set_port(port_start + (id % num_ports));
   }
   url.set_path(path);
-  return MakeRequest(url);
+  return url;
 }
 
 }  // namespace speedtest
@@ -18,6 +18,7 @@
 #define SPEEDTEST_SPEEDTEST_H
 
 #include <atomic>
+#include <functional>
 #include <string>
 #include "config.h"
 #include "init.h"
@@ -59,11 +60,23 @@ class Speedtest {
   TransferResult RunUploadTest(std::atomic_bool *cancel);
   Ping::Result RunPingTest(std::atomic_bool *cancel);
 
+  // Runs a transfer test, pinging the selected region on separate
+  // connections for the duration if latency under load was requested.
+  TransferResult RunLoadedTransfer(
+      std::function<TransferResult(std::atomic_bool *)> transfer_fn,
+      std::atomic_bool *cancel);
+  Ping::Options MakePingOptions() const;
+
+  // Pre-connects the streams of the next phase, and the ping connections
+  // if they will be needed, so the phase doesn't measure handshakes.
+  void WarmConnections(int num_transfers, std::atomic_bool *cancel);
+
   void OverrideConfigWithOptions(Config *config, const Options &options);
 
   http::Request::Ptr MakeRequest(const http::Url &url) const;
   http::Request::Ptr MakeBaseRequest(int id, const std::string &path) const;
   http::Request::Ptr MakeTransferRequest(int id, const std::string &path) const;
+  http::Url MakeTransferUrl(int id, const std::string &path) const;
 
   Options options_;
   Config config_;
@@ -0,0 +1,371 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the full speedtest pipeline against an in-process loopback server
+// with a shaped bottleneck and reports how much CPU and how many threads
+// the client needed, and how close its measured speeds came to the rate
+// the server saw. Exits non-zero if either is off by more than the
+// tolerance.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+#include "curl_env.h"
+#include "loopback_server.h"
+#include "options.h"
+#include "request.h"
+#include "speedtest.h"
+#include "utils.h"
+
+namespace {
+
+const char *kUsage = R"USAGE(: [options]
+ -h, --help                    This help text
+ -v, --verbose                 Verbose output
+ -d, --num_downloads NUM       Number of simultaneous downloads (default 4)
+ -u, --num_uploads NUM         Number of simultaneous uploads (default 4)
+ --download_mbps RATE          Shaped download rate, 0 for unlimited (default 100)
+ --upload_mbps RATE            Shaped upload rate, 0 for unlimited (default 20)
+ --delay_millis TIME           Delay added to every response (default 10)
+ --transfer_runtime TIME       Maximum transfer time in milliseconds (default 5000)
+ --loaded_latency              Measure latency under load as well
+ --tolerance PERCENT           Maximum error against the server's rate (default 10)
+)USAGE";
+
+const int kOptDownloadMbps = 1000;
+const int kOptUploadMbps = 1001;
+const int kOptDelayMillis = 1002;
+const int kOptTransferRuntime = 1003;
+const int kOptLoadedLatency = 1004;
+const int kOptTolerance = 1005;
+
+const struct option kLongOpts[] = {
+    {"help", no_argument, nullptr, 'h'},
+    {"verbose", no_argument, nullptr, 'v'},
+    {"num_downloads", required_argument, nullptr, 'd'},
+    {"num_uploads", required_argument, nullptr, 'u'},
+    {"download_mbps", required_argument, nullptr, kOptDownloadMbps},
+    {"upload_mbps", required_argument, nullptr, kOptUploadMbps},
+    {"delay_millis", required_argument, nullptr, kOptDelayMillis},
+    {"transfer_runtime", required_argument, nullptr, kOptTransferRuntime},
+    {"loaded_latency", no_argument, nullptr, kOptLoadedLatency},
+    {"tolerance", required_argument, nullptr, kOptTolerance},
+    {nullptr, 0, nullptr, 0},
+};
+
+const long kThreadSampleMillis = 10;
+
+// Left to autotune, the client's loopback send buffer grows to several
+// megabytes and swallows whole upload bodies long before the server has
+// read them, so uploads are counted as sent far ahead of the bottleneck.
+const int kClientSendBufferBytes = 16 * 1024;
+
+struct BenchmarkOptions {
+  bool verbose = false;
+  int num_downloads = 4;
+  int num_uploads = 4;
+  double download_mbps = 100;
+  double upload_mbps = 20;
+  long delay_millis = 10;
+  long transfer_runtime_millis = 5000;
+  bool loaded_latency = false;
+  double tolerance_percent = 10;
+};
+
+// The server's byte counters at one point in time.
+struct ServerSample {
+  long time;
+  long bytes_sent;
+  long bytes_received;
+};
+
+bool ParseBenchmarkOptions(int argc, char *argv[], BenchmarkOptions *options) {
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hvd:u:", kLongOpts, nullptr)) != -1) {
+    char *endptr = nullptr;
+    switch (opt) {
+      case 'h':
+        return false;
+      case 'v':
+        options->verbose = true;
+        break;
+      case 'd':
+        options->num_downloads = std::strtol(optarg, &endptr, 10);
+        break;
+      case 'u':
+        options->num_uploads = std::strtol(optarg, &endptr, 10);
+        break;
+      case kOptDownloadMbps:
+        options->download_mbps = std::strtod(optarg, &endptr);
+        break;
+      case kOptUploadMbps:
+        options->upload_mbps = std::strtod(optarg, &endptr);
+        break;
+      case kOptDelayMillis:
+        options->delay_millis = std::strtol(optarg, &endptr, 10);
+        break;
+      case kOptTransferRuntime:
+        options->transfer_runtime_millis = std::strtol(optarg, &endptr, 10);
+        break;
+      case kOptLoadedLatency:
+        options->loaded_latency = true;
+        break;
+      case kOptTolerance:
+        options->tolerance_percent = std::strtod(optarg, &endptr);
+        break;
+      default:
+        return false;
+    }
+    if (endptr && (*endptr != '\0' || endptr == optarg)) {
+      std::cerr << "Invalid value '" << optarg << "'\n";
+      return false;
+    }
+  }
+  if (optind != argc || options->num_downloads <= 0 ||
+      options->num_uploads <= 0 || options->download_mbps < 0 ||
+      options->upload_mbps < 0 || options->delay_millis < 0 ||
+      options->transfer_runtime_millis <= 0 ||
+      options->tolerance_percent < 0) {
+    return false;
+  }
+  return true;
+}
+
+long ProcessCpuMicros() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int ProcessThreads() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 8, "Threads:") == 0) {
+      return std::atoi(line.c_str() + 8);
+    }
+  }
+  return 0;
+}
+
+// Interpolates one of the server's counters at time.
+double ServerBytesAt(const std::vector<ServerSample> &samples,
+                     long ServerSample::*bytes,
+                     long time) {
+  if (samples.empty()) {
+    return 0;
+  }
+  auto after = std::lower_bound(
+      samples.begin(), samples.end(), time,
+      [](const ServerSample &sample, long t) { return sample.time < t; });
+  if (after == samples.begin()) {
+    return (*after).*bytes;
+  }
+  if (after == samples.end()) {
+    return samples.back().*bytes;
+  }
+  const ServerSample &before = *(after - 1);
+  double fraction = static_cast<double>(time - before.time) /
+                    (after->time - before.time);
+  return before.*bytes + fraction * ((*after).*bytes - before.*bytes);
+}
+
+// Reports the client's speed against the rate the server actually moved
+// bytes at over the intervals the client averaged. Returns false if the
+// error is above the tolerance.
+bool ReportAccuracy(const std::string &name,
+                    const speedtest::TransferResult &result,
+                    int num_intervals,
+                    const std::vector<ServerSample> &samples,
+                    long ServerSample::*bytes,
+                    double shaped_mbps,
+                    double tolerance_percent) {
+  // Same window as GetSimpleAverage().
+  int end_index = result.buckets.size() - 1;
+  int start_index = std::max(0, end_index - num_intervals);
+  long start_time = result.start_time +
+                    result.buckets[start_index].start_time;
+  long end_time = result.start_time + result.buckets[end_index].start_time;
+  double server_bytes = ServerBytesAt(samples, bytes, end_time) -
+                        ServerBytesAt(samples, bytes, start_time);
+  long micros = end_time - start_time;
+  double server_mbps = micros > 0 ? server_bytes * 8 / micros : 0;
+  std::cout << name << ": " << speedtest::round(result.speed_mbps, 2)
+            << " Mbps (server " << speedtest::round(server_mbps, 2)
+            << " Mbps";
+  if (shaped_mbps > 0) {
+    std::cout << ", shaped " << speedtest::round(shaped_mbps, 2) << " Mbps";
+  }
+  if (server_mbps <= 0) {
+    std::cout << ")\n";
+    return false;
+  }
+  double error = (result.speed_mbps - server_mbps) / server_mbps * 100;
+  std::cout << ", error " << speedtest::round(error, 2) << "%)";
+  bool ok = std::fabs(error) <= tolerance_percent;
+  if (!ok) {
+    std::cout << " exceeds " << tolerance_percent << "% tolerance";
+  }
+  std::cout << "\n";
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  BenchmarkOptions benchmark;
+  if (!ParseBenchmarkOptions(argc, argv, &benchmark)) {
+    std::cerr << "Usage: " << argv[0] << kUsage;
+    std::exit(1);
+  }
+
+  speedtest::LoopbackServer::Options server_options;
+  server_options.download_mbps = benchmark.download_mbps;
+  server_options.upload_mbps = benchmark.upload_mbps;
+  server_options.delay_millis = benchmark.delay_millis;
+  speedtest::Config &config = server_options.config;
+  config.download_bytes = 10 * 1000 * 1000;
+  config.upload_bytes = 2 * 1000 * 1000;
+  config.interval_millis = 200;
+  config.location_id = "loopback";
+  config.location_name = "Loopback";
+  config.min_transfer_intervals = 5;
+  config.max_transfer_intervals = 10;
+  config.min_transfer_runtime = benchmark.transfer_runtime_millis / 2;
+  config.max_transfer_runtime = benchmark.transfer_runtime_millis;
+  config.max_transfer_variance = 0.1;
+  config.num_downloads = benchmark.num_downloads;
+  config.num_uploads = benchmark.num_uploads;
+  config.ping_runtime_millis = 1000;
+  config.ping_timeout_millis = 500 + benchmark.delay_millis;
+  config.average_type = "SIMPLE";
+  speedtest::LoopbackServer server(server_options);
+  speedtest::Status status = server.Start();
+  if (!status.ok()) {
+    std::cerr << status.ToString() << "\n";
+    std::exit(1);
+  }
+
+  http::CurlEnv::Options curl_options;
+  if (benchmark.upload_mbps > 0) {
+    curl_options.send_buffer_bytes = kClientSendBufferBytes;
+  }
+  std::shared_ptr<http::CurlEnv> curl_env =
+      http::CurlEnv::NewCurlEnv(curl_options);
+  speedtest::Options options;
+  options.verbose = benchmark.verbose;
+  options.request_factory = [&](const http::Url &url) -> http::Request::Ptr {
+    return curl_env->NewRequest(url);
+  };
+  options.warm_fn = [&](const std::vector<http::Url> &urls,
+                        std::atomic_bool *cancel) {
+    curl_env->Warm(urls, cancel);
+  };
+  options.user_agent = "speedtest_benchmark";
+  options.report_results = false;
+  options.loaded_latency = benchmark.loaded_latency;
+  options.regional_urls.push_back(server.url());
+
+  // The server's threads come and go with its connections, so they are
+  // subtracted from each sample along with the accept and sampler threads.
+  // The server's counters are sampled alongside so each transfer's window
+  // can be matched to the bytes the server saw in it.
+  std::atomic_bool done(false);
+  int peak_client_threads = 0;
+  std::vector<ServerSample> server_samples;
+  std::thread sampler([&]{
+    while (!done) {
+      int client_threads = ProcessThreads() - server.num_threads() - 2;
+      peak_client_threads = std::max(peak_client_threads, client_threads);
+      server_samples.push_back({speedtest::SystemTimeMicros(),
+                                server.bytes_sent(),
+                                server.bytes_received()});
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(kThreadSampleMillis));
+    }
+  });
+
+  long start_cpu = ProcessCpuMicros();
+  long start_server_cpu = server.cpu_micros();
+  long start_time = speedtest::SystemTimeMicros();
+  speedtest::Speedtest speed(options);
+  std::atomic_bool cancel(false);
+  speedtest::Speedtest::Result result = speed(&cancel);
+  long run_micros = speedtest::SystemTimeMicros() - start_time;
+  done = true;
+  sampler.join();
+
+  // Stopping the server first settles its CPU accounting for connections
+  // that were still open when the client finished.
+  server.Stop();
+  long client_cpu = ProcessCpuMicros() - start_cpu -
+                    (server.cpu_micros() - start_server_cpu);
+
+  if (!result.status.ok()) {
+    std::cerr << "Speedtest failed: " << result.status.ToString() << "\n";
+    std::exit(1);
+  }
+
+  long total_bytes = 0;
+  if (result.download_run) {
+    total_bytes += result.download_result.total_bytes;
+  }
+  if (result.upload_run) {
+    total_bytes += result.upload_result.total_bytes;
+  }
+  double megabits = total_bytes * 8 / 1e6;
+
+  std::cout << "\nBenchmark results\n";
+  bool accurate = true;
+  if (result.download_run) {
+    accurate &= ReportAccuracy("Download", result.download_result,
+                               config.max_transfer_intervals, server_samples, &ServerSample::bytes_sent,
+                               benchmark.download_mbps,
+                               benchmark.tolerance_percent);
+  }
+  if (result.upload_run) {
+    accurate &= ReportAccuracy("Upload", result.upload_result,
+                               config.max_transfer_intervals, server_samples, &ServerSample::bytes_received,
+                               benchmark.upload_mbps,
+                               benchmark.tolerance_percent);
+  }
+  std::cout << "Run time: " << speedtest::ToMillis(run_micros) << " ms\n"
+            << "Client CPU: " << speedtest::ToMillis(client_cpu) << " ms ("
+            << speedtest::round(100.0 * client_cpu / run_micros, 2)
+            << "% of one core)\n";
+  if (megabits > 0) {
+    std::cout << "CPU per megabit: "
+              << speedtest::round(client_cpu / megabits, 2)
+              << " us\n";
+  }
+  std::cout << "Peak client threads: " << peak_client_threads << "\n";
+  if (!accurate) {
+    std::cerr << "Measured speed is off by more than "
+              << benchmark.tolerance_percent << "%\n";
+    return 1;
+  }
+  return 0;
+}
@@ -20,6 +20,7 @@
 #include <iterator>
 #include <memory>
 #include <string>
+#include <vector>
 #include "curl_env.h"
 #include "options.h"
 #include "request.h"
@@ -68,12 +69,17 @@ int main(int argc, char *argv[]) {
   }
   http::CurlEnv::Options curl_options;
   curl_options.disable_dns_cache = options.disable_dns_cache;
+  curl_options.disable_connection_reuse = options.disable_connection_reuse;
   curl_options.max_connections = options.max_connections;
   std::shared_ptr<http::CurlEnv> curl_env =
       http::CurlEnv::NewCurlEnv(curl_options);
   options.request_factory = [&](const http::Url &url) -> http::Request::Ptr {
     return curl_env->NewRequest(url);
   };
+  options.warm_fn = [&](const std::vector<http::Url> &urls,
+                        std::atomic_bool *cancel) {
+    curl_env->Warm(urls, cancel);
+  };
   speedtest::Speedtest speed(options);
   std::atomic_bool cancel(false);
   speed(&cancel);
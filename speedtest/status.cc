@@ -31,6 +31,7 @@ std::string ErrorString(StatusCode status_code) {
     case StatusCode::FAILED_PRECONDITION: return "FAILED_PRECONDITION";
     case StatusCode::UNAVAILABLE: return "UNAVAILABLE";
     case StatusCode::UNKNOWN: return "UNKNOWN";
+    case StatusCode::RESOURCE_EXHAUSTED: return "RESOURCE_EXHAUSTED";
   }
   return std::string("Unknown status code ") + to_string(
       static_cast<std::underlying_type<StatusCode>::type>(status_code));
@@ -28,7 +28,8 @@ enum class StatusCode {
   INTERNAL = 3,
   FAILED_PRECONDITION = 4,
   UNAVAILABLE = 5,
-  UNKNOWN = 6
+  UNKNOWN = 6,
+  RESOURCE_EXHAUSTED = 7
 };
 
 std::string ErrorString(StatusCode status_code);
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "transfer_engine.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace http {
+namespace {
+
+const int kMaxEvents = 64;
+
+// Upper bound on how long we block so cancellation is noticed promptly.
+const long kMaxWaitMillis = 100;
+
+}  // namespace
+
+TransferEngine::TransferEngine()
+    : multi_(curl_multi_init()),
+      epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      timer_set_(false) {
+  if (multi_) {
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, &SocketCallback);
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, &TimerCallback);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+  }
+}
+
+TransferEngine::~TransferEngine() {
+  StopAll();
+  if (multi_) {
+    curl_multi_cleanup(multi_);
+    multi_ = nullptr;
+  }
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+    epoll_fd_ = -1;
+  }
+}
+
+bool TransferEngine::ok() const {
+  return multi_ != nullptr && epoll_fd_ >= 0;
+}
+
+void TransferEngine::AddStream(StartFn start_fn) {
+  streams_.emplace_back(start_fn);
+}
+
+bool TransferEngine::Run(std::atomic_bool *cancel) {
+  if (!ok() || !cancel) {
+    return false;
+  }
+
+  for (size_t index = 0; index < streams_.size(); ++index) {
+    StartStream(index);
+  }
+
+  bool success = true;
+  struct epoll_event events[kMaxEvents];
+  while (!*cancel && !active_.empty()) {
+    long wait_millis = kMaxWaitMillis;
+    if (timer_set_) {
+      // Round up so a timer less than a millisecond away doesn't turn into
+      // a zero timeout and spin; only a timer that is already due polls.
+      long remaining_micros =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              timer_deadline_ - Clock::now()).count();
+      long remaining_millis = remaining_micros > 0
+                              ? (remaining_micros + 999) / 1000
+                              : 0;
+      wait_millis = std::min(wait_millis, remaining_millis);
+    }
+
+    int num_events = epoll_wait(epoll_fd_, events, kMaxEvents, wait_millis);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "epoll_wait failed: " << errno << "\n";
+      success = false;
+      break;
+    }
+
+    for (int i = 0; i < num_events; ++i) {
+      int flags = 0;
+      if (events[i].events & EPOLLIN) {
+        flags |= CURL_CSELECT_IN;
+      }
+      if (events[i].events & EPOLLOUT) {
+        flags |= CURL_CSELECT_OUT;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        flags |= CURL_CSELECT_ERR;
+      }
+      if (!SocketAction(events[i].data.fd, flags)) {
+        success = false;
+      }
+    }
+
+    if (timer_set_ && Clock::now() >= timer_deadline_) {
+      timer_set_ = false;
+      if (!SocketAction(CURL_SOCKET_TIMEOUT, 0)) {
+        success = false;
+      }
+    }
+
+    if (!success) {
+      break;
+    }
+    ProcessCompleted();
+  }
+
+  StopAll();
+  return success;
+}
+
+int TransferEngine::SocketCallback(CURL *easy,
+                                   curl_socket_t socket,
+                                   int what,
+                                   void *userp,
+                                   void *socketp) {
+  TransferEngine *engine = static_cast<TransferEngine *>(userp);
+  engine->WatchSocket(socket, what);
+  return 0;
+}
+
+int TransferEngine::TimerCallback(CURLM *multi,
+                                  long timeout_millis,
+                                  void *userp) {
+  TransferEngine *engine = static_cast<TransferEngine *>(userp);
+  engine->SetTimer(timeout_millis);
+  return 0;
+}
+
+void TransferEngine::WatchSocket(curl_socket_t socket, int what) {
+  if (what == CURL_POLL_REMOVE) {
+    // The socket may already be closed, in which case the kernel has
+    // removed it from the epoll set for us.
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, socket, nullptr);
+    return;
+  }
+
+  struct epoll_event event = {};
+  event.data.fd = socket;
+  if (what & CURL_POLL_IN) {
+    event.events |= EPOLLIN;
+  }
+  if (what & CURL_POLL_OUT) {
+    event.events |= EPOLLOUT;
+  }
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, socket, &event) != 0 &&
+      errno == ENOENT) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, socket, &event);
+  }
+}
+
+void TransferEngine::SetTimer(long timeout_millis) {
+  if (timeout_millis < 0) {
+    timer_set_ = false;
+    return;
+  }
+  timer_set_ = true;
+  timer_deadline_ = Clock::now() + std::chrono::milliseconds(timeout_millis);
+}
+
+bool TransferEngine::SocketAction(curl_socket_t socket, int flags) {
+  int running = 0;
+  CURLMcode code = curl_multi_socket_action(multi_, socket, flags, &running);
+  if (code != CURLM_OK) {
+    std::cerr << "curl_multi_socket_action failed: "
+              << curl_multi_strerror(code) << "\n";
+    return false;
+  }
+  return true;
+}
+
+void TransferEngine::StartStream(size_t index) {
+  CURL *easy = streams_[index]();
+  if (!easy) {
+    return;
+  }
+  CURLMcode code = curl_multi_add_handle(multi_, easy);
+  if (code != CURLM_OK) {
+    std::cerr << "curl_multi_add_handle failed: "
+              << curl_multi_strerror(code) << "\n";
+    return;
+  }
+  active_[easy] = index;
+}
+
+void TransferEngine::ProcessCompleted() {
+  CURLMsg *msg;
+  int msgs_left;
+  while ((msg = curl_multi_info_read(multi_, &msgs_left))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    // msg is invalidated by removing the handle so copy what we need first
+    CURL *easy = msg->easy_handle;
+    curl_multi_remove_handle(multi_, easy);
+    auto iter = active_.find(easy);
+    if (iter == active_.end()) {
+      continue;
+    }
+    size_t index = iter->second;
+    active_.erase(iter);
+    StartStream(index);
+  }
+}
+
+void TransferEngine::StopAll() {
+  for (const auto &entry : active_) {
+    curl_multi_remove_handle(multi_, entry.first);
+  }
+  active_.clear();
+  timer_set_ = false;
+}
+
+}  // namespace http
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HTTP_TRANSFER_ENGINE_H
+#define HTTP_TRANSFER_ENGINE_H
+
+#include <atomic>
+#include <chrono>
+#include <curl/curl.h>
+#include <functional>
+#include <map>
+#include <vector>
+#include "utils.h"
+
+namespace http {
+
+// Runs many transfers concurrently on the calling thread using a curl multi
+// handle driven by epoll, rather than one thread per transfer.
+//
+// Each stream is described by a StartFn which prepares the next transfer
+// (see Request::PrepareGet and Request::PreparePost) and returns its easy
+// handle, or nullptr when the stream has nothing more to do. StartFn is
+// called once when Run() begins and again every time the stream's previous
+// transfer completes.
+//
+// Not threadsafe. All callbacks run on the thread that calls Run().
+class TransferEngine {
+ public:
+  using StartFn = std::function<CURL *()>;
+
+  TransferEngine();
+  virtual ~TransferEngine();
+
+  // Returns false if the multi handle or epoll instance couldn't be created.
+  bool ok() const;
+
+  void AddStream(StartFn start_fn);
+
+  // Runs all streams until they finish or cancel is set.
+  // Returns false on an unrecoverable multi or epoll error.
+  bool Run(std::atomic_bool *cancel);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static int SocketCallback(CURL *easy,
+                            curl_socket_t socket,
+                            int what,
+                            void *userp,
+                            void *socketp);
+  static int TimerCallback(CURLM *multi, long timeout_millis, void *userp);
+
+  void WatchSocket(curl_socket_t socket, int what);
+  void SetTimer(long timeout_millis);
+  bool SocketAction(curl_socket_t socket, int flags);
+  void StartStream(size_t index);
+  void ProcessCompleted();
+  void StopAll();
+
+  CURLM *multi_;  // owned
+  int epoll_fd_;  // owned
+  std::vector<StartFn> streams_;
+  std::map<CURL *, size_t> active_;
+  bool timer_set_;
+  Clock::time_point timer_deadline_;
+
+  DISALLOW_COPY_AND_ASSIGN(TransferEngine);
+};
+
+}  // namespace http
+
+#endif  // HTTP_TRANSFER_ENGINE_H
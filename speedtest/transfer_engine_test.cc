@@ -0,0 +1,144 @@
+/*
+ * Copyright 2016 Google Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "transfer_engine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "curl_env.h"
+#include "loopback_server.h"
+#include "request.h"
+
+namespace http {
+namespace {
+
+class TransferEngineTest : public testing::Test {
+ protected:
+  std::unique_ptr<speedtest::LoopbackServer> server;
+  std::shared_ptr<CurlEnv> env;
+
+  void StartServer(double download_mbps) {
+    speedtest::LoopbackServer::Options options;
+    options.download_mbps = download_mbps;
+    server.reset(new speedtest::LoopbackServer(options));
+    ASSERT_TRUE(server->Start().ok());
+    env = CurlEnv::NewCurlEnv({});
+  }
+
+  Request::Ptr NewDownload() {
+    Url url = server->url();
+    url.set_path("/download");
+    return env->NewRequest(url);
+  }
+};
+
+TEST_F(TransferEngineTest, ConcurrentStreams_AllComplete) {
+  StartServer(0);
+  const int kStreams = 2;
+  const int kTransfersPerStream = 3;
+  const long kBytes = 100 * 1000;
+
+  // The engine is declared after the requests so it releases their handles
+  // before they are cleaned up.
+  std::vector<Request::Ptr> downloads;
+  std::vector<int> started(kStreams, 0);
+  std::vector<long> received(kStreams, 0);
+  int in_flight = 0;
+  int max_in_flight = 0;
+  TransferEngine engine;
+  ASSERT_TRUE(engine.ok());
+  for (int i = 0; i < kStreams; ++i) {
+    downloads.emplace_back(NewDownload());
+    engine.AddStream([&, i]() -> CURL * {
+      if (started[i] > 0) {
+        // The previous transfer on this stream has completed.
+        in_flight--;
+        EXPECT_EQ(started[i] * kBytes, received[i]);
+      }
+      if (started[i] == kTransfersPerStream) {
+        return nullptr;
+      }
+      Request *download = downloads[i].get();
+      if (started[i] > 0) {
+        download->Reset();
+      }
+      started[i]++;
+      in_flight++;
+      max_in_flight = std::max(max_in_flight, in_flight);
+      download->set_param("size", speedtest::to_string(kBytes));
+      return download->PrepareGet([&, i](void *, size_t size) {
+        received[i] += size;
+      });
+    });
+  }
+
+  std::atomic_bool cancel(false);
+  EXPECT_TRUE(engine.Run(&cancel));
+  EXPECT_EQ(kStreams, max_in_flight);
+  EXPECT_EQ(0, in_flight);
+  for (int i = 0; i < kStreams; ++i) {
+    EXPECT_EQ(kTransfersPerStream, started[i]);
+    EXPECT_EQ(kTransfersPerStream * kBytes, received[i]);
+  }
+}
+
+TEST_F(TransferEngineTest, Cancel_StopsAllStreams) {
+  // 10 MB at 8 Mbps would take 10 seconds per stream.
+  StartServer(8);
+  const int kStreams = 2;
+  const long kBytes = 10 * 1000 * 1000;
+
+  std::vector<Request::Ptr> downloads;
+  std::vector<long> received(kStreams, 0);
+  std::vector<int> started(kStreams, 0);
+  TransferEngine engine;
+  ASSERT_TRUE(engine.ok());
+  for (int i = 0; i < kStreams; ++i) {
+    downloads.emplace_back(NewDownload());
+    engine.AddStream([&, i]() -> CURL * {
+      started[i]++;
+      downloads[i]->set_param("size", speedtest::to_string(kBytes));
+      return downloads[i]->PrepareGet([&, i](void *, size_t size) {
+        received[i] += size;
+      });
+    });
+  }
+
+  std::atomic_bool cancel(false);
+  std::thread canceller([&]{
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    cancel = true;
+  });
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(engine.Run(&cancel));
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  canceller.join();
+
+  EXPECT_LT(elapsed, std::chrono::seconds(2));
+  for (int i = 0; i < kStreams; ++i) {
+    EXPECT_EQ(1, started[i]);
+    EXPECT_GT(received[i], 0);
+    EXPECT_LT(received[i], kBytes);
+  }
+}
+
+}  // namespace
+}  // namespace http
@@ -23,6 +23,8 @@
 #include <mutex>
 #include <thread>
 #include <vector>
+#include "convergence.h"
+#include "latency_histogram.h"
 #include "status.h"
 #include "utils.h"
 
@@ -45,6 +47,8 @@ struct TransferOptions {
   int max_intervals = 0;
   double max_variance = 0.0;
   bool exponential_moving_average = false;
+  StopRule stop_rule = StopRule::MOVING_AVERAGE;
+  bool exclude_slow_start = false;
   std::function<void(const Bucket)> progress_fn;
 };
 
@@ -55,16 +59,25 @@ struct TransferResult {
   std::vector<Bucket> buckets;
   double speed_mbps;
   long total_bytes;
+
+  // Speed of each stream over each interval, indexed by stream then by
+  // bucket, so a stalled stream shows up as a run of zeroes.
+  std::vector<std::vector<double>> stream_megabits;
+
+  // Latency of pings sent on separate connections while the transfer ran.
+  // Empty unless latency under load was measured.
+  LatencySummary loaded_latency;
 };
 
 double GetShortEma(std::vector<Bucket> *buckets, int num_buckets);
 double GetLongEma(std::vector<Bucket> *buckets, int num_intervals);
 double GetSimpleAverage(std::vector<Bucket> *buckets, int num_intervals);
 
-// Run a variable length transfer test using two moving averages.
+// Run a variable length transfer test.
 // The test runs between min_runtime and max_runtime and otherwise
-// ends when the speed is "stable" meaning the two moving averages
-// are relatively close to one another.
+// ends when the speed is "stable" according to options.stop_rule. By
+// default that means the two moving averages are relatively close to
+// one another; the other rules are implemented by Convergence.
 template <typename F>
 TransferResult
 RunTransfer(F &&fn, std::atomic_bool *cancel, TransferOptions options) {
@@ -105,6 +118,17 @@ RunTransfer(F &&fn, std::atomic_bool *cancel, TransferOptions options) {
   long max_runtime_micros = options.max_runtime_millis * 1000;
   std::mutex mutex;
   std::thread updater([&] {
+    std::vector<long> stream_bytes;
+    std::vector<long> last_stream_bytes;
+    long last_sample_time = 0;
+    ConvergenceOptions convergence_options;
+    convergence_options.rule = options.stop_rule;
+    convergence_options.min_intervals = options.min_intervals;
+    convergence_options.max_intervals = options.max_intervals;
+    convergence_options.max_variance = options.max_variance;
+    convergence_options.exclude_slow_start = options.exclude_slow_start;
+    Convergence convergence(convergence_options);
+    bool converged = false;
     std::this_thread::sleep_for(
         std::chrono::milliseconds(options.interval_millis));
     while (!local_cancel) {
@@ -120,7 +144,21 @@ RunTransfer(F &&fn, std::atomic_bool *cancel, TransferOptions options) {
         result.buckets.emplace_back();
         Bucket &bucket = result.buckets.back();
         bucket.start_time = running_time;
-        bucket.total_bytes = fn.get().bytes_transferred();
+
+        // Sample every stream once and derive the total from the samples
+        // rather than from a shared counter.
+        fn.get().counters().Sample(&stream_bytes);
+        last_stream_bytes.resize(stream_bytes.size(), 0);
+        result.stream_megabits.resize(stream_bytes.size());
+        bucket.total_bytes = 0;
+        for (size_t i = 0; i < stream_bytes.size(); ++i) {
+          bucket.total_bytes += stream_bytes[i];
+          result.stream_megabits[i].push_back(
+              ToMegabits(stream_bytes[i] - last_stream_bytes[i],
+                         running_time - last_sample_time));
+        }
+        last_stream_bytes.swap(stream_bytes);
+        last_sample_time = running_time;
         result.total_bytes = bucket.total_bytes;
         if (options.exponential_moving_average) {
           bucket.short_megabits = GetShortEma(&result.buckets,
@@ -133,7 +171,15 @@ RunTransfer(F &&fn, std::atomic_bool *cancel, TransferOptions options) {
           bucket.long_megabits = GetSimpleAverage(&result.buckets,
                                                   options.max_intervals);
         }
-        result.speed_mbps = bucket.long_megabits;
+        if (options.stop_rule == StopRule::MOVING_AVERAGE) {
+          result.speed_mbps = bucket.long_megabits;
+        } else {
+          const Bucket &previous = result.buckets[result.buckets.size() - 2];
+          convergence.AddInterval(bucket.start_time - previous.start_time,
+                                  bucket.total_bytes - previous.total_bytes);
+          result.speed_mbps = convergence.speed_megabits();
+          converged = convergence.converged();
+        }
         last_bucket = result.buckets.back();
       }
 
@@ -141,7 +187,12 @@ RunTransfer(F &&fn, std::atomic_bool *cancel, TransferOptions options) {
         local_cancel = true;
         break;
       }
-      if (running_time > min_runtime_micros &&
+      if (running_time > min_runtime_micros && converged) {
+        local_cancel = true;
+        break;
+      }
+      if (options.stop_rule == StopRule::MOVING_AVERAGE &&
+          running_time > min_runtime_micros &&
           last_bucket.short_megabits > 0 &&
           last_bucket.long_megabits > 0) {
         double speed_variance = variance(last_bucket.short_megabits,
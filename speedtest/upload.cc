@@ -17,8 +17,8 @@
 #include "upload.h"
 
 #include <string>
-#include <thread>
 #include <vector>
+#include "transfer_engine.h"
 
 namespace speedtest {
 
@@ -26,53 +26,76 @@ Upload::Upload(const Options &options)
     : options_(options),
       start_time_(0),
       end_time_(0),
-      bytes_transferred_(0) {
+      counters_(options.num_transfers) {
 }
 
 Upload::Result Upload::operator()(std::atomic_bool *cancel) {
   start_time_ = SystemTimeMicros();
-  bytes_transferred_ = 0;
+  counters_.Reset();
 
   if (!cancel) {
     end_time_ = SystemTimeMicros();
     return GetResult(Status(StatusCode::FAILED_PRECONDITION, "cancel is null"));
   }
 
-  std::vector<std::thread> threads;
-  for (int i = 0; i < options_.num_transfers; ++i) {
-    threads.emplace_back([=]{
-      http::Request::Ptr upload = options_.request_factory(i);
-      while (!*cancel) {
-        long uploaded = 0;
-        upload->set_param("i", to_string(i));
-        upload->set_param("time", to_string(SystemTimeMicros()));
-        upload->set_progress_fn([&](curl_off_t,
-                                    curl_off_t,
-                                    curl_off_t,
-                                    curl_off_t ulnow) -> bool {
-          if (ulnow > uploaded) {
-            bytes_transferred_ += ulnow - uploaded;
-            uploaded = ulnow;
-          }
-          return *cancel;
-        });
-
-        // disable the Expect header as the server isn't expecting it (perhaps
-        // it should?). If the server isn't then libcurl waits for 1 second
-        // before sending the data anyway. So sending this header eliminated
-        // the 1 second delay.
-        upload->set_header("Expect", "");
+  if (!options_.payload) {
+    end_time_ = SystemTimeMicros();
+    return GetResult(Status(StatusCode::INVALID_ARGUMENT, "payload not set"));
+  }
 
-        upload->Post(options_.payload->c_str(), options_.payload->size());
+  // All streams run on this thread, driven by a single curl multi handle.
+  // The engine is declared after the requests so it releases their handles
+  // before they are cleaned up.
+  std::vector<http::Request::Ptr> uploads;
+  std::vector<long> uploaded(options_.num_transfers, 0);
+  http::TransferEngine engine;
+  if (!engine.ok()) {
+    end_time_ = SystemTimeMicros();
+    return GetResult(Status(StatusCode::INTERNAL,
+                            "failed to create transfer engine"));
+  }
+  for (int i = 0; i < options_.num_transfers; ++i) {
+    uploads.emplace_back(options_.request_factory(i));
+    http::Request *upload = uploads.back().get();
+    long *stream_uploaded = &uploaded[i];
+    bool started = false;
+    engine.AddStream([=]() mutable -> CURL * {
+      if (*cancel) {
+        return nullptr;
+      }
+      if (started) {
         upload->Reset();
       }
+      started = true;
+      *stream_uploaded = 0;
+      upload->set_param("i", to_string(i));
+      upload->set_param("time", to_string(SystemTimeMicros()));
+      upload->set_progress_fn([=](curl_off_t,
+                                  curl_off_t,
+                                  curl_off_t,
+                                  curl_off_t ulnow) -> bool {
+        if (ulnow > *stream_uploaded) {
+          counters_.Add(i, ulnow - *stream_uploaded);
+          *stream_uploaded = ulnow;
+        }
+        return *cancel;
+      });
+
+      // disable the Expect header as the server isn't expecting it (perhaps
+      // it should?). If the server isn't then libcurl waits for 1 second
+      // before sending the data anyway. So sending this header eliminated
+      // the 1 second delay.
+      upload->set_header("Expect", "");
+
+      return upload->PreparePost(
+          options_.payload->MakeUploadFn(options_.upload_bytes),
+          options_.upload_bytes);
     });
   }
 
-  for (std::thread &thread : threads) {
-    if (thread.joinable()) {
-      thread.join();
-    }
+  if (!engine.Run(cancel)) {
+    end_time_ = SystemTimeMicros();
+    return GetResult(Status(StatusCode::INTERNAL, "transfer engine failed"));
   }
 
   end_time_ = SystemTimeMicros();
@@ -84,7 +107,7 @@ Upload::Result Upload::GetResult(Status status) const {
   result.start_time = start_time_;
   result.end_time = end_time_;
   result.status = status;
-  result.bytes_transferred = bytes_transferred_;
+  result.bytes_transferred = counters_.Total();
   return result;
 }
 
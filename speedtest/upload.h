@@ -20,6 +20,8 @@
 #include <atomic>
 #include <functional>
 #include <memory>
+#include "byte_counters.h"
+#include "payload.h"
 #include "request.h"
 #include "status.h"
 #include "utils.h"
@@ -32,7 +34,8 @@ class Upload {
     bool verbose;
     std::function<http::Request::Ptr(int)> request_factory;
     int num_transfers;
-    std::shared_ptr<std::string> payload;
+    std::shared_ptr<const Payload> payload;
+    long upload_bytes;
   };
 
   struct Result {
@@ -48,7 +51,8 @@ class Upload {
 
   long start_time() const { return start_time_; }
   long end_time() const { return end_time_; }
-  long bytes_transferred() const { return bytes_transferred_; }
+  long bytes_transferred() const { return counters_.Total(); }
+  const ByteCounters &counters() const { return counters_; }
 
  private:
   Result GetResult(Status status) const;
@@ -56,7 +60,7 @@ class Upload {
   Options options_;
   std::atomic_long start_time_;
   std::atomic_long end_time_;
-  std::atomic_long bytes_transferred_;
+  ByteCounters counters_;
 
   DISALLOW_COPY_AND_ASSIGN(Upload);
 };
@@ -70,8 +70,6 @@ void RightTrim(std::string *s);
 // Caller retains ownership
 void Trim(std::string *s);
 
-std::shared_ptr<std::string> MakeRandomData(size_t size);
-
 }  // namespace speedtst
 
 #endif  // SPEEDTEST_UTILS_H